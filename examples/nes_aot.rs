@@ -0,0 +1,1029 @@
+//! NROM(Mapper0)のiNESファイルを事前にRustコードへ変換するAOTコンパイラ
+//!
+//! RESET/NMI/IRQベクタから到達できる命令を静的に辿り、基本ブロックごとに関数を生成します
+//! 生成したモジュールは`System`のバスと`Ppu`をそのまま使い、
+//! 翻訳していないアドレス(解決できなかった間接ジャンプ先、非公式命令、BRKなど)は`Cpu::step`で実行します
+//!
+//! usage: cargo run --release --example nes_aot -- <input.nes> <output.rs>
+extern crate rust_nes_emulator;
+
+use rust_nes_emulator::prelude::*;
+use std::collections::{BTreeMap, BTreeSet};
+use std::env;
+use std::fmt::Write;
+use std::fs;
+use std::process;
+
+/// PRG-ROMのサイズ
+const PRG_ROM_SIZE: usize = 0x10000 - PRG_ROM_SYSTEM_BASE_ADDR as usize;
+/// 1ブロックが消費するcycle数の上限。PPUの1line(CPU_CYCLE_PER_LINE)に収まる程度にする
+const AOT_MAX_BLOCK_CYCLES: u32 = 48;
+
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
+enum Mode {
+    Implied,
+    Accumulator,
+    Immediate,
+    Absolute,
+    ZeroPage,
+    ZeroPageX,
+    ZeroPageY,
+    AbsoluteX,
+    AbsoluteY,
+    Relative,
+    Indirect,
+    IndirectX,
+    IndirectY,
+}
+
+impl Mode {
+    /// opcodeを含めた命令長
+    fn len(self) -> u16 {
+        match self {
+            Mode::Implied | Mode::Accumulator => 1,
+            Mode::Absolute | Mode::AbsoluteX | Mode::AbsoluteY | Mode::Indirect => 3,
+            _ => 2,
+        }
+    }
+}
+
+/// 翻訳対象の命令。非公式命令は含めずインタプリタに任せます
+/// (`Cpu::step`のテーブルと同じAddressingModeにしておくこと)
+fn decode(code: u8) -> Option<(&'static str, Mode)> {
+    let inst = match code {
+        0x00 => ("BRK", Mode::Implied),
+        0x01 => ("ORA", Mode::IndirectX),
+        0x05 => ("ORA", Mode::ZeroPage),
+        0x06 => ("ASL", Mode::ZeroPage),
+        0x08 => ("PHP", Mode::Implied),
+        0x09 => ("ORA", Mode::Immediate),
+        0x0A => ("ASL", Mode::Accumulator),
+        0x0D => ("ORA", Mode::Absolute),
+        0x0E => ("ASL", Mode::Absolute),
+        0x10 => ("BPL", Mode::Relative),
+        0x11 => ("ORA", Mode::IndirectY),
+        0x15 => ("ORA", Mode::ZeroPageX),
+        0x16 => ("ASL", Mode::ZeroPageX),
+        0x18 => ("CLC", Mode::Implied),
+        0x19 => ("ORA", Mode::AbsoluteY),
+        0x1A => ("NOP", Mode::Implied),
+        0x1D => ("ORA", Mode::AbsoluteX),
+        0x1E => ("ASL", Mode::AbsoluteX),
+        0x20 => ("JSR", Mode::Absolute),
+        0x21 => ("AND", Mode::IndirectX),
+        0x24 => ("BIT", Mode::ZeroPage),
+        0x25 => ("AND", Mode::ZeroPage),
+        0x26 => ("ROL", Mode::ZeroPage),
+        0x28 => ("PLP", Mode::Implied),
+        0x29 => ("AND", Mode::Immediate),
+        0x2A => ("ROL", Mode::Accumulator),
+        0x2C => ("BIT", Mode::Absolute),
+        0x2D => ("AND", Mode::Absolute),
+        0x2E => ("ROL", Mode::Absolute),
+        0x30 => ("BMI", Mode::Relative),
+        0x31 => ("AND", Mode::IndirectY),
+        0x35 => ("AND", Mode::ZeroPageX),
+        0x36 => ("ROL", Mode::ZeroPageX),
+        0x38 => ("SEC", Mode::Implied),
+        0x39 => ("AND", Mode::AbsoluteY),
+        0x3A => ("NOP", Mode::Implied),
+        0x3D => ("AND", Mode::AbsoluteX),
+        0x3E => ("ROL", Mode::AbsoluteX),
+        0x40 => ("RTI", Mode::Implied),
+        0x41 => ("EOR", Mode::IndirectX),
+        0x45 => ("EOR", Mode::ZeroPage),
+        0x46 => ("LSR", Mode::ZeroPage),
+        0x48 => ("PHA", Mode::Implied),
+        0x49 => ("EOR", Mode::Immediate),
+        0x4A => ("LSR", Mode::Accumulator),
+        0x4C => ("JMP", Mode::Absolute),
+        0x4D => ("EOR", Mode::Absolute),
+        0x4E => ("LSR", Mode::Absolute),
+        0x50 => ("BVC", Mode::Relative),
+        0x51 => ("EOR", Mode::IndirectY),
+        0x55 => ("EOR", Mode::ZeroPageX),
+        0x56 => ("LSR", Mode::ZeroPageX),
+        0x58 => ("CLI", Mode::Implied),
+        0x59 => ("EOR", Mode::AbsoluteY),
+        0x5A => ("NOP", Mode::Implied),
+        0x5D => ("EOR", Mode::AbsoluteX),
+        0x5E => ("LSR", Mode::AbsoluteX),
+        0x60 => ("RTS", Mode::Implied),
+        0x61 => ("ADC", Mode::IndirectX),
+        0x65 => ("ADC", Mode::ZeroPage),
+        0x66 => ("ROR", Mode::ZeroPage),
+        0x68 => ("PLA", Mode::Implied),
+        0x69 => ("ADC", Mode::Immediate),
+        0x6A => ("ROR", Mode::Accumulator),
+        0x6C => ("JMP", Mode::Indirect),
+        0x6D => ("ADC", Mode::Absolute),
+        0x6E => ("ROR", Mode::Absolute),
+        0x70 => ("BVS", Mode::Relative),
+        0x71 => ("ADC", Mode::IndirectY),
+        0x75 => ("ADC", Mode::ZeroPageX),
+        0x76 => ("ROR", Mode::ZeroPageX),
+        0x78 => ("SEI", Mode::Implied),
+        0x79 => ("ADC", Mode::AbsoluteY),
+        0x7A => ("NOP", Mode::Implied),
+        0x7D => ("ADC", Mode::AbsoluteX),
+        0x7E => ("ROR", Mode::AbsoluteX),
+        0x81 => ("STA", Mode::IndirectX),
+        0x84 => ("STY", Mode::ZeroPage),
+        0x85 => ("STA", Mode::ZeroPage),
+        0x86 => ("STX", Mode::ZeroPage),
+        0x88 => ("DEY", Mode::Implied),
+        0x8A => ("TXA", Mode::Implied),
+        0x8C => ("STY", Mode::Absolute),
+        0x8D => ("STA", Mode::Absolute),
+        0x8E => ("STX", Mode::Absolute),
+        0x90 => ("BCC", Mode::Relative),
+        0x91 => ("STA", Mode::IndirectY),
+        0x94 => ("STY", Mode::ZeroPageX),
+        0x95 => ("STA", Mode::ZeroPageX),
+        0x96 => ("STX", Mode::ZeroPageY),
+        0x98 => ("TYA", Mode::Implied),
+        0x99 => ("STA", Mode::AbsoluteY),
+        0x9A => ("TXS", Mode::Implied),
+        0x9D => ("STA", Mode::AbsoluteX),
+        0xA0 => ("LDY", Mode::Immediate),
+        0xA1 => ("LDA", Mode::IndirectX),
+        0xA2 => ("LDX", Mode::Immediate),
+        0xA4 => ("LDY", Mode::ZeroPage),
+        0xA5 => ("LDA", Mode::ZeroPage),
+        0xA6 => ("LDX", Mode::ZeroPage),
+        0xA8 => ("TAY", Mode::Implied),
+        0xA9 => ("LDA", Mode::Immediate),
+        0xAA => ("TAX", Mode::Implied),
+        0xAC => ("LDY", Mode::Absolute),
+        0xAD => ("LDA", Mode::Absolute),
+        0xAE => ("LDX", Mode::Absolute),
+        0xB0 => ("BCS", Mode::Relative),
+        0xB1 => ("LDA", Mode::IndirectY),
+        0xB4 => ("LDY", Mode::ZeroPageX),
+        0xB5 => ("LDA", Mode::ZeroPageX),
+        0xB6 => ("LDX", Mode::ZeroPageY),
+        0xB8 => ("CLV", Mode::Implied),
+        0xB9 => ("LDA", Mode::AbsoluteY),
+        0xBA => ("TSX", Mode::Implied),
+        0xBC => ("LDY", Mode::AbsoluteX),
+        0xBD => ("LDA", Mode::AbsoluteX),
+        0xBE => ("LDX", Mode::AbsoluteY),
+        0xC0 => ("CPY", Mode::Immediate),
+        0xC1 => ("CMP", Mode::IndirectX),
+        0xC4 => ("CPY", Mode::ZeroPage),
+        0xC5 => ("CMP", Mode::ZeroPage),
+        0xC6 => ("DEC", Mode::ZeroPage),
+        0xC8 => ("INY", Mode::Implied),
+        0xC9 => ("CMP", Mode::Immediate),
+        0xCA => ("DEX", Mode::Implied),
+        0xCC => ("CPY", Mode::Absolute),
+        0xCD => ("CMP", Mode::Absolute),
+        0xCE => ("DEC", Mode::Absolute),
+        0xD0 => ("BNE", Mode::Relative),
+        0xD1 => ("CMP", Mode::IndirectY),
+        0xD5 => ("CMP", Mode::ZeroPageX),
+        0xD6 => ("DEC", Mode::ZeroPageX),
+        0xD8 => ("CLD", Mode::Implied),
+        0xD9 => ("CMP", Mode::AbsoluteY),
+        0xDA => ("NOP", Mode::Implied),
+        0xDD => ("CMP", Mode::AbsoluteX),
+        0xDE => ("DEC", Mode::AbsoluteX),
+        0xE0 => ("CPX", Mode::Immediate),
+        0xE1 => ("SBC", Mode::IndirectX),
+        0xE4 => ("CPX", Mode::ZeroPage),
+        0xE5 => ("SBC", Mode::ZeroPage),
+        0xE6 => ("INC", Mode::ZeroPage),
+        0xE8 => ("INX", Mode::Implied),
+        0xE9 => ("SBC", Mode::Immediate),
+        0xEA => ("NOP", Mode::Implied),
+        0xEB => ("SBC", Mode::Immediate),
+        0xEC => ("CPX", Mode::Absolute),
+        0xED => ("SBC", Mode::Absolute),
+        0xEE => ("INC", Mode::Absolute),
+        0xF0 => ("BEQ", Mode::Relative),
+        0xF1 => ("SBC", Mode::IndirectY),
+        0xF5 => ("SBC", Mode::ZeroPageX),
+        0xF6 => ("INC", Mode::ZeroPageX),
+        0xF8 => ("SED", Mode::Implied),
+        0xF9 => ("SBC", Mode::AbsoluteY),
+        0xFA => ("NOP", Mode::Implied),
+        0xFD => ("SBC", Mode::AbsoluteX),
+        0xFE => ("INC", Mode::AbsoluteX),
+        _ => return None,
+    };
+    Some(inst)
+}
+
+#[derive(Copy, Clone, Debug)]
+struct Inst {
+    addr: u16,
+    name: &'static str,
+    mode: Mode,
+    /// opcode直後のオペランド。1byteの場合は下位のみ
+    operand: u16,
+}
+
+impl Inst {
+    fn next(&self) -> u16 {
+        self.addr.wrapping_add(self.mode.len())
+    }
+    fn is_branch(&self) -> bool {
+        self.mode == Mode::Relative
+    }
+    fn branch_target(&self) -> u16 {
+        // 符号拡張して計算する
+        (i32::from(self.operand as u8 as i8) + i32::from(self.next())) as u16
+    }
+    /// pcを書き換える命令はブロックの終端になる
+    fn is_control(&self) -> bool {
+        self.is_branch()
+            || self.name == "JMP"
+            || self.name == "JSR"
+            || self.name == "RTS"
+            || self.name == "RTI"
+    }
+    /// I/Oレジスタにアクセスする可能性があるか。実行時にしかわからない場合もtrue
+    fn may_access_io(&self) -> bool {
+        if self.name == "JMP" || self.name == "JSR" {
+            return false;
+        }
+        // PPU, APU, PADのレジスタはアクセスするタイミングで結果が変わる
+        let overlaps_io = |begin: u32, end: u32| {
+            begin < u32::from(CASSETTE_BASE_ADDR) && end >= u32::from(PPU_REG_BASE_ADDR)
+        };
+        let base = u32::from(self.operand);
+        match self.mode {
+            Mode::Absolute => overlaps_io(base, base),
+            // 0x10000を超えた分は先頭に戻るので、念のためI/Oとみなす
+            Mode::AbsoluteX | Mode::AbsoluteY => {
+                base + 0xff > 0xffff || overlaps_io(base, base + 0xff)
+            }
+            Mode::IndirectX | Mode::IndirectY => true,
+            _ => false,
+        }
+    }
+    /// 分岐やページ跨ぎを含めた最大cycle数。`Cpu::step`と同じ数え方をします
+    fn max_cyc(&self) -> u32 {
+        let operand_cyc = match self.mode {
+            Mode::Implied => 0,
+            Mode::Accumulator | Mode::Immediate => 1,
+            Mode::ZeroPage => 2,
+            Mode::ZeroPageX | Mode::ZeroPageY | Mode::Absolute => 3,
+            Mode::AbsoluteX | Mode::AbsoluteY => 4,
+            Mode::Relative => 1 + self.branch_page_cyc(),
+            Mode::Indirect | Mode::IndirectX | Mode::IndirectY => 5,
+        };
+        match self.name {
+            "JMP" => operand_cyc,
+            "JSR" | "RTS" | "RTI" => 6,
+            "PHA" | "PHP" => 3,
+            "PLA" | "PLP" => 4,
+            "ASL" | "LSR" | "ROL" | "ROR" if self.mode == Mode::Accumulator => 2,
+            "ASL" | "LSR" | "ROL" | "ROR" | "INC" | "DEC" => 3 + operand_cyc,
+            "BIT" => 2 + operand_cyc,
+            _ if self.is_branch() => 1 + operand_cyc + 1,
+            _ if self.mode == Mode::Implied => 2,
+            _ => 1 + operand_cyc,
+        }
+    }
+    /// 分岐先がページを跨ぐ場合の追加cycle。分岐しない場合も加算される(インタプリタと同じ)
+    fn branch_page_cyc(&self) -> u32 {
+        if (self.branch_target() & 0xff00) != (self.next() & 0xff00) {
+            1
+        } else {
+            0
+        }
+    }
+}
+
+/// 到達可能な命令を辿った結果
+#[derive(Default)]
+struct Program {
+    insts: BTreeMap<u16, Inst>,
+    /// ブロックの先頭になりうるアドレス
+    leaders: BTreeSet<u16>,
+    /// 静的に解決したJMP(ind)の飛び先
+    indirect_targets: BTreeMap<u16, u16>,
+    /// 解決できなかったJMP(ind)のアドレス
+    unresolved_jumps: BTreeSet<u16>,
+    /// 翻訳できない命令のアドレス。インタプリタで実行します
+    fallbacks: BTreeSet<u16>,
+}
+
+impl Program {
+    /// `entries`から到達可能な命令を再帰下降で辿ります
+    fn analyze(prg: &[u8], entries: &[u16]) -> Program {
+        let read = |addr: u16| prg[usize::from(addr - PRG_ROM_SYSTEM_BASE_ADDR)];
+        let mut program = Program::default();
+        let mut pending: Vec<u16> = Vec::new();
+        for &entry in entries {
+            program.leaders.insert(entry);
+            pending.push(entry);
+        }
+        while let Some(start) = pending.pop() {
+            let mut addr = start;
+            while addr >= PRG_ROM_SYSTEM_BASE_ADDR
+                && !program.insts.contains_key(&addr)
+                && !program.fallbacks.contains(&addr)
+            {
+                let (name, mode) = match decode(read(addr)) {
+                    Some((name, mode))
+                        if name != "BRK" && u32::from(addr) + u32::from(mode.len()) <= 0x10000 =>
+                    {
+                        (name, mode)
+                    }
+                    // BRKは割り込み処理、非公式命令は種類が多いのでインタプリタに任せる
+                    _ => {
+                        program.fallbacks.insert(addr);
+                        break;
+                    }
+                };
+                let operand = match mode.len() {
+                    1 => 0,
+                    2 => u16::from(read(addr + 1)),
+                    _ => u16::from(read(addr + 1)) | (u16::from(read(addr + 2)) << 8),
+                };
+                let inst = Inst {
+                    addr,
+                    name,
+                    mode,
+                    operand,
+                };
+                program.insts.insert(addr, inst);
+
+                let mut targets: Vec<u16> = Vec::new();
+                let mut is_fallthrough = true;
+                if inst.is_branch() {
+                    targets.push(inst.branch_target());
+                    program.leaders.insert(inst.next());
+                } else {
+                    match name {
+                        "JMP" if mode == Mode::Absolute => {
+                            targets.push(operand);
+                            is_fallthrough = false;
+                        }
+                        "JMP" => {
+                            // ポインタがPRG-ROM上にあれば飛び先は変わらない
+                            // 上位byteはページを跨がずに読む(インタプリタと同じ)
+                            if operand >= PRG_ROM_SYSTEM_BASE_ADDR {
+                                let upper_addr =
+                                    (operand & 0xff00) | (operand.wrapping_add(1) & 0x00ff);
+                                let target =
+                                    u16::from(read(operand)) | (u16::from(read(upper_addr)) << 8);
+                                program.indirect_targets.insert(addr, target);
+                                targets.push(target);
+                            } else {
+                                program.unresolved_jumps.insert(addr);
+                            }
+                            is_fallthrough = false;
+                        }
+                        "JSR" => {
+                            // 戻り先はRTSの次に実行されるので先頭になる
+                            targets.push(operand);
+                            program.leaders.insert(inst.next());
+                        }
+                        "RTS" | "RTI" => is_fallthrough = false,
+                        _ => {}
+                    }
+                }
+                for target in targets {
+                    program.leaders.insert(target);
+                    pending.push(target);
+                }
+                if !is_fallthrough || inst.next() == 0 {
+                    break;
+                }
+                addr = inst.next();
+            }
+        }
+        program
+    }
+
+    /// 翻訳できる命令か
+    fn is_translatable(&self, inst: &Inst) -> bool {
+        !self.unresolved_jumps.contains(&inst.addr)
+    }
+}
+
+/// 生成したブロック
+struct Block {
+    start: u16,
+    max_cyc: u32,
+    num_of_insts: usize,
+    code: String,
+}
+
+/// 命令1つ分の生成コード
+struct Emitter {
+    code: String,
+    /// 加算するcycle数のうち静的にわかる分
+    cyc: u32,
+    /// 実行時に決まる追加cycleの変数名
+    dynamic_cyc: Option<&'static str>,
+}
+
+impl Emitter {
+    fn new() -> Emitter {
+        Emitter {
+            code: String::new(),
+            cyc: 0,
+            dynamic_cyc: None,
+        }
+    }
+    fn line(&mut self, s: &str) {
+        self.code.push_str("        ");
+        self.code.push_str(s);
+        self.code.push('\n');
+    }
+    /// オペランドのアドレスを`addr`に求めるコードを出力し、オペランドのcycle数を設定します
+    fn addr(&mut self, inst: &Inst) {
+        let op = inst.operand;
+        let (expr, cyc) = match inst.mode {
+            Mode::ZeroPage | Mode::Absolute => (
+                format!("0x{:04x}u16", op),
+                if inst.mode == Mode::ZeroPage { 2 } else { 3 },
+            ),
+            Mode::ZeroPageX => (format!("u16::from(0x{:02x}u8.wrapping_add(cpu.x))", op), 3),
+            Mode::ZeroPageY => (format!("u16::from(0x{:02x}u8.wrapping_add(cpu.y))", op), 3),
+            Mode::AbsoluteX | Mode::AbsoluteY => {
+                let reg = if inst.mode == Mode::AbsoluteX {
+                    "cpu.x"
+                } else {
+                    "cpu.y"
+                };
+                self.line(&format!(
+                    "let addr = 0x{:04x}u16.wrapping_add(u16::from({}));",
+                    op, reg
+                ));
+                self.line(&format!(
+                    "let page = page_cyc(addr, addr.wrapping_add(u16::from({})));",
+                    reg
+                ));
+                self.dynamic_cyc = Some("page");
+                return self.cyc += 3;
+            }
+            Mode::IndirectX => (
+                format!("read_zp_u16(system, 0x{:02x}u8.wrapping_add(cpu.x))", op),
+                5,
+            ),
+            Mode::IndirectY => {
+                self.line(&format!("let base = read_zp_u16(system, 0x{:02x});", op));
+                self.line("let addr = base.wrapping_add(u16::from(cpu.y));");
+                self.line("let page = page_cyc(base, addr);");
+                self.dynamic_cyc = Some("page");
+                return self.cyc += 4;
+            }
+            _ => unreachable!(),
+        };
+        self.line(&format!("let addr = {};", expr));
+        self.cyc += cyc;
+    }
+    /// オペランドの値を`arg`に読み出すコードを出力します
+    fn arg(&mut self, inst: &Inst) {
+        match inst.mode {
+            Mode::Immediate => {
+                self.line(&format!("let arg = 0x{:02x}u8;", inst.operand));
+                self.cyc += 1;
+            }
+            Mode::Accumulator => {
+                self.line("let arg = cpu.a;");
+                self.cyc += 1;
+            }
+            _ => {
+                self.addr(inst);
+                self.line("let arg = system.read_u8(addr, false);");
+            }
+        }
+    }
+    /// レジスタに結果を格納してN,Zを更新します
+    fn load(&mut self, reg: &str, value: &str) {
+        self.line(&format!("let result = {};", value));
+        self.line("update_nz(cpu, result);");
+        self.line(&format!("cpu.{} = result;", reg));
+    }
+    /// 命令を変換します。`Cpu::step`の各命令と同じ順序で読み書きすること
+    fn inst(&mut self, program: &Program, inst: &Inst) {
+        match inst.name {
+            "ADC" | "SBC" | "AND" | "EOR" | "ORA" | "CMP" | "CPX" | "CPY" | "LDA" | "LDX"
+            | "LDY" => {
+                self.arg(inst);
+                self.cyc += 1;
+                match inst.name {
+                    "ADC" => self.line("adc(cpu, arg);"),
+                    "SBC" => self.line("sbc(cpu, arg);"),
+                    "AND" => self.load("a", "cpu.a & arg"),
+                    "EOR" => self.load("a", "cpu.a ^ arg"),
+                    "ORA" => self.load("a", "cpu.a | arg"),
+                    "CMP" => self.line("compare(cpu, cpu.a, arg);"),
+                    "CPX" => self.line("compare(cpu, cpu.x, arg);"),
+                    "CPY" => self.line("compare(cpu, cpu.y, arg);"),
+                    "LDA" => self.load("a", "arg"),
+                    "LDX" => self.load("x", "arg"),
+                    _ => self.load("y", "arg"),
+                }
+            }
+            "ASL" | "LSR" | "ROL" | "ROR" => {
+                self.arg(inst);
+                let func = inst.name.to_lowercase();
+                if inst.mode == Mode::Accumulator {
+                    self.line(&format!("cpu.a = {}(cpu, arg);", func));
+                    self.cyc += 1;
+                } else {
+                    self.line(&format!("let result = {}(cpu, arg);", func));
+                    self.line("system.write_u8(addr, result, false);");
+                    self.cyc += 3;
+                }
+            }
+            "INC" | "DEC" => {
+                self.arg(inst);
+                let op = if inst.name == "INC" {
+                    "wrapping_add"
+                } else {
+                    "wrapping_sub"
+                };
+                self.line(&format!("let result = arg.{}(1);", op));
+                self.line("update_nz(cpu, result);");
+                self.line("system.write_u8(addr, result, false);");
+                self.cyc += 3;
+            }
+            "INX" => self.load("x", "cpu.x.wrapping_add(1)"),
+            "INY" => self.load("y", "cpu.y.wrapping_add(1)"),
+            "DEX" => self.load("x", "cpu.x.wrapping_sub(1)"),
+            "DEY" => self.load("y", "cpu.y.wrapping_sub(1)"),
+            "STA" | "STX" | "STY" => {
+                self.addr(inst);
+                let reg = &inst.name[2..].to_lowercase();
+                self.line(&format!("system.write_u8(addr, cpu.{}, false);", reg));
+                self.cyc += 1;
+            }
+            "SEC" => self.line("cpu.write_carry_flag(true);"),
+            "SED" => self.line("cpu.write_decimal_flag(true);"),
+            "SEI" => self.line("cpu.write_interrupt_flag(true);"),
+            "CLC" => self.line("cpu.write_carry_flag(false);"),
+            "CLD" => self.line("cpu.write_decimal_flag(false);"),
+            "CLI" => self.line("cpu.write_interrupt_flag(false);"),
+            "CLV" => self.line("cpu.write_overflow_flag(false);"),
+            "JMP" => {
+                let target = match inst.mode {
+                    Mode::Absolute => inst.operand,
+                    _ => program.indirect_targets[&inst.addr],
+                };
+                self.line(&format!("cpu.pc = 0x{:04x};", target));
+                self.cyc += inst.max_cyc();
+            }
+            "JSR" => {
+                let ret_addr = inst.addr + 2;
+                self.line(&format!("cpu.stack_push(system, 0x{:02x});", ret_addr >> 8));
+                self.line(&format!(
+                    "cpu.stack_push(system, 0x{:02x});",
+                    ret_addr & 0xff
+                ));
+                self.line(&format!("cpu.pc = 0x{:04x};", inst.operand));
+                self.cyc += 6;
+            }
+            "RTI" => {
+                self.line("cpu.p = cpu.stack_pop(system);");
+                self.line("let pc_lower = cpu.stack_pop(system);");
+                self.line("let pc_upper = cpu.stack_pop(system);");
+                self.line("cpu.pc = (u16::from(pc_upper) << 8) | u16::from(pc_lower);");
+                self.cyc += 6;
+            }
+            "RTS" => {
+                self.line("let pc_lower = cpu.stack_pop(system);");
+                self.line("let pc_upper = cpu.stack_pop(system);");
+                self.line("cpu.pc = ((u16::from(pc_upper) << 8) | u16::from(pc_lower)) + 1;");
+                self.cyc += 6;
+            }
+            "BCC" | "BCS" | "BEQ" | "BNE" | "BMI" | "BPL" | "BVC" | "BVS" => {
+                let flag = match &inst.name[1..] {
+                    "CC" | "CS" => "cpu.read_carry_flag()",
+                    "EQ" | "NE" => "cpu.read_zero_flag()",
+                    "MI" | "PL" => "cpu.read_negative_flag()",
+                    _ => "cpu.read_overflow_flag()",
+                };
+                let is_set = match inst.name {
+                    "BCS" | "BEQ" | "BMI" | "BVS" => "",
+                    _ => "!",
+                };
+                let not_taken_cyc = inst.max_cyc() - 1;
+                self.line(&format!("if {}{} {{", is_set, flag));
+                self.line(&format!("    cpu.pc = 0x{:04x};", inst.branch_target()));
+                self.line(&format!("    cyc += {};", not_taken_cyc + 1));
+                self.line("} else {");
+                self.line(&format!("    cpu.pc = 0x{:04x};", inst.next()));
+                self.line(&format!("    cyc += {};", not_taken_cyc));
+                self.line("}");
+            }
+            "PHA" => {
+                self.line("cpu.stack_push(system, cpu.a);");
+                self.cyc += 3;
+            }
+            "PHP" => {
+                self.line("cpu.stack_push(system, cpu.p);");
+                self.cyc += 3;
+            }
+            "PLA" => {
+                self.load("a", "cpu.stack_pop(system)");
+                self.cyc += 4;
+            }
+            "PLP" => {
+                self.line("cpu.p = cpu.stack_pop(system);");
+                self.cyc += 4;
+            }
+            "TAX" => self.load("x", "cpu.a"),
+            "TAY" => self.load("y", "cpu.a"),
+            "TSX" => self.load("x", "(cpu.sp & 0xff) as u8"),
+            "TXA" => self.load("a", "cpu.x"),
+            "TXS" => self.line("cpu.sp = u16::from(cpu.x) | 0x0100;"),
+            "TYA" => self.load("a", "cpu.y"),
+            "BIT" => {
+                self.addr(inst);
+                // 非破壊読み出し
+                self.line("let arg = system.read_u8(addr, true);");
+                self.line("bit(cpu, arg);");
+                self.cyc += 2;
+            }
+            "NOP" => {}
+            _ => unreachable!("{}", inst.name),
+        }
+        if inst.mode == Mode::Implied && inst.max_cyc() == 2 {
+            // INX, TAX, SECなどは2cycle固定
+            self.cyc += 2;
+        }
+    }
+}
+
+/// 命令の表記(コメント用)
+fn disassemble(inst: &Inst) -> String {
+    let op = inst.operand;
+    let operand = match inst.mode {
+        Mode::Implied => String::new(),
+        Mode::Accumulator => " A".to_string(),
+        Mode::Immediate => format!(" #${:02X}", op),
+        Mode::ZeroPage => format!(" ${:02X}", op),
+        Mode::ZeroPageX => format!(" ${:02X},X", op),
+        Mode::ZeroPageY => format!(" ${:02X},Y", op),
+        Mode::Absolute => format!(" ${:04X}", op),
+        Mode::AbsoluteX => format!(" ${:04X},X", op),
+        Mode::AbsoluteY => format!(" ${:04X},Y", op),
+        Mode::Relative => format!(" ${:04X}", inst.branch_target()),
+        Mode::Indirect => format!(" (${:04X})", op),
+        Mode::IndirectX => format!(" (${:02X},X)", op),
+        Mode::IndirectY => format!(" (${:02X}),Y", op),
+    };
+    format!("{}{}", inst.name, operand)
+}
+
+/// `start`から始まるブロックを生成します
+/// 命令の途中でブロックを分割した場合、続きの先頭を`new_leaders`に追加します
+fn generate_block(program: &Program, start: u16, new_leaders: &mut Vec<u16>) -> Option<Block> {
+    let mut code = String::new();
+    let mut max_cyc = 0;
+    let mut num_of_insts = 0;
+    let mut pc = start;
+    let mut is_terminated = false;
+    while let Some(inst) = program.insts.get(&pc) {
+        if !program.is_translatable(inst) || (num_of_insts > 0 && program.leaders.contains(&pc)) {
+            break;
+        }
+        if max_cyc + inst.max_cyc() > AOT_MAX_BLOCK_CYCLES {
+            new_leaders.push(pc);
+            break;
+        }
+        let mut emitter = Emitter::new();
+        emitter.inst(program, inst);
+        writeln!(code, "    // ${:04X}: {}", inst.addr, disassemble(inst)).unwrap();
+        code.push_str("    {\n");
+        code.push_str(&emitter.code);
+        match (emitter.cyc, emitter.dynamic_cyc) {
+            (0, None) => {}
+            (cyc, None) => writeln!(code, "        cyc += {};", cyc).unwrap(),
+            (cyc, Some(var)) => writeln!(code, "        cyc += {} + {};", cyc, var).unwrap(),
+        }
+        code.push_str("    }\n");
+        max_cyc += inst.max_cyc();
+        num_of_insts += 1;
+
+        if inst.is_control() {
+            is_terminated = true;
+            break;
+        }
+        pc = inst.next();
+        // I/Oへのアクセスはブロックの最後に置き、PPUを進めてから次の命令を実行させる
+        if inst.may_access_io() {
+            new_leaders.push(pc);
+            break;
+        }
+    }
+    if num_of_insts == 0 {
+        return None;
+    }
+    if !is_terminated {
+        writeln!(code, "    cpu.pc = 0x{:04x};", pc).unwrap();
+    }
+    Some(Block {
+        start,
+        max_cyc,
+        num_of_insts,
+        code,
+    })
+}
+
+/// 生成したコードが使う共通処理。`Cpu::step`と同じフラグ更新をします
+const RUNTIME: &str = r#"
+/// 読み込まれているROMがAOTコンパイルしたものと一致するか確認します
+pub fn is_compatible<S: CassetteStorage>(system: &mut System<S>) -> bool {
+    let mut hash = 0x811c_9dc5u32;
+    for addr in PRG_ROM_SYSTEM_BASE_ADDR..=0xffff {
+        hash = (hash ^ u32::from(system.read_u8(addr, true))).wrapping_mul(0x0100_0193);
+    }
+    hash == AOT_PRG_HASH
+}
+
+/// 翻訳済のブロックを実行するCpuEngine
+pub struct AotEngine;
+
+impl CpuEngine for AotEngine {
+    fn step<S: CassetteStorage>(
+        &mut self,
+        cpu: &mut Cpu,
+        system: &mut System<S>,
+        budget: usize,
+    ) -> u8 {
+        step(cpu, system, budget)
+    }
+}
+
+/// CPU/PPUを1frame分エミュレーションします
+pub fn emulate_frame<S: CassetteStorage>(
+    cpu: &mut Cpu,
+    system: &mut System<S>,
+    ppu: &mut Ppu,
+    fb: *mut u8,
+) {
+    AotEngine.emulate_frame(cpu, system, ppu, fb);
+}
+
+/// 1ブロックもしくは1命令実行します
+/// `budget` - ブロックが消費してよいcycle数。これ以上かかる可能性があるブロックはインタプリタで実行する
+/// ret: cycle数
+pub fn step<S: CassetteStorage>(cpu: &mut Cpu, system: &mut System<S>, budget: usize) -> u8 {
+    match run_block(cpu, system, budget) {
+        Some(cyc) => cyc,
+        None => cpu.step(system),
+    }
+}
+
+#[inline(always)]
+fn update_nz(cpu: &mut Cpu, result: u8) {
+    cpu.write_zero_flag(result == 0);
+    cpu.write_negative_flag((result & 0x80) == 0x80);
+}
+
+#[inline(always)]
+fn adc(cpu: &mut Cpu, arg: u8) {
+    let tmp = u16::from(cpu.a) + u16::from(arg) + (if cpu.read_carry_flag() { 1 } else { 0 });
+    let result = (tmp & 0xff) as u8;
+    cpu.write_carry_flag(tmp > 0x00ffu16);
+    update_nz(cpu, result);
+    cpu.write_overflow_flag(((cpu.a ^ result) & (arg ^ result) & 0x80) == 0x80);
+    cpu.a = result;
+}
+
+#[inline(always)]
+fn sbc(cpu: &mut Cpu, arg: u8) {
+    let (data1, is_carry1) = cpu.a.overflowing_sub(arg);
+    let (result, is_carry2) = data1.overflowing_sub(if cpu.read_carry_flag() { 0 } else { 1 });
+    cpu.write_carry_flag(!(is_carry1 || is_carry2));
+    update_nz(cpu, result);
+    cpu.write_overflow_flag(
+        (((cpu.a ^ arg) & 0x80) == 0x80) && (((cpu.a ^ result) & 0x80) == 0x80),
+    );
+    cpu.a = result;
+}
+
+#[inline(always)]
+fn compare(cpu: &mut Cpu, reg: u8, arg: u8) {
+    cpu.write_carry_flag(reg >= arg);
+    update_nz(cpu, reg.wrapping_sub(arg));
+}
+
+#[inline(always)]
+fn asl(cpu: &mut Cpu, arg: u8) -> u8 {
+    let result = arg.wrapping_shl(1);
+    cpu.write_carry_flag((arg & 0x80) == 0x80);
+    update_nz(cpu, result);
+    result
+}
+
+#[inline(always)]
+fn lsr(cpu: &mut Cpu, arg: u8) -> u8 {
+    let result = arg.wrapping_shr(1);
+    cpu.write_carry_flag((arg & 0x01) == 0x01);
+    update_nz(cpu, result);
+    result
+}
+
+#[inline(always)]
+fn rol(cpu: &mut Cpu, arg: u8) -> u8 {
+    let result = arg.wrapping_shl(1) | (if cpu.read_carry_flag() { 0x01 } else { 0x00 });
+    cpu.write_carry_flag((arg & 0x80) == 0x80);
+    update_nz(cpu, result);
+    result
+}
+
+#[inline(always)]
+fn ror(cpu: &mut Cpu, arg: u8) -> u8 {
+    let result = arg.wrapping_shr(1) | (if cpu.read_carry_flag() { 0x80 } else { 0x00 });
+    cpu.write_carry_flag((arg & 0x01) == 0x01);
+    update_nz(cpu, result);
+    result
+}
+
+#[inline(always)]
+fn bit(cpu: &mut Cpu, arg: u8) {
+    cpu.write_negative_flag((arg & 0x80) == 0x80);
+    cpu.write_zero_flag((cpu.a & arg) == 0x00);
+    cpu.write_overflow_flag((arg & 0x40) == 0x40);
+}
+
+/// ZeroPageから2byte読み出します。上位byteは0x00ffから0x0000に戻ります
+#[inline(always)]
+fn read_zp_u16<S: CassetteStorage>(system: &mut System<S>, ptr: u8) -> u16 {
+    let lower = u16::from(system.read_u8(u16::from(ptr), false));
+    let upper = u16::from(system.read_u8(u16::from(ptr.wrapping_add(1)), false));
+    lower | (upper << 8)
+}
+
+/// ページを跨いだ場合の追加cycle
+#[inline(always)]
+fn page_cyc(a: u16, b: u16) -> u8 {
+    if (a & 0xff00) != (b & 0xff00) {
+        1
+    } else {
+        0
+    }
+}
+"#;
+
+/// PRG-ROMのFNV-1aハッシュ。生成したコードの`is_compatible`と同じ計算をします
+fn prg_hash(prg: &[u8]) -> u32 {
+    prg.iter().fold(0x811c_9dc5u32, |hash, &data| {
+        (hash ^ u32::from(data)).wrapping_mul(0x0100_0193)
+    })
+}
+
+fn main() {
+    let args: Vec<String> = env::args().collect();
+    if args.len() != 3 {
+        eprintln!("usage: {} <input.nes> <output.rs>", args[0]);
+        process::exit(1);
+    }
+    let rom = fs::read(&args[1]).unwrap_or_else(|e| {
+        eprintln!("cannot read {}: {}", args[1], e);
+        process::exit(1);
+    });
+    let mut system: Box<System<NromStorage>> = Box::new(System::default());
+    let is_loaded = system
+        .cassette
+        .from_ines_binary(|addr| rom.get(addr).cloned().unwrap_or(0));
+    let is_nrom = match system.cassette.mapper {
+        Mapper::Nrom => true,
+        _ => false,
+    };
+    if !is_loaded || !is_nrom {
+        eprintln!("{} is not a NROM(Mapper0) iNES file", args[1]);
+        process::exit(1);
+    }
+    // 実際にバスから見える内容を使う(16KBのPRG-ROMはミラーされる)
+    let prg: Vec<u8> = (PRG_ROM_SYSTEM_BASE_ADDR..=0xffff)
+        .map(|addr| system.read_u8(addr, true))
+        .collect();
+    debug_assert!(prg.len() == PRG_ROM_SIZE);
+    let read_vector = |addr: u16| {
+        let index = usize::from(addr - PRG_ROM_SYSTEM_BASE_ADDR);
+        u16::from(prg[index]) | (u16::from(prg[index + 1]) << 8)
+    };
+    // NMI, RESET, IRQ
+    let entries = [
+        read_vector(0xfffa),
+        read_vector(0xfffc),
+        read_vector(0xfffe),
+    ];
+    let program = Program::analyze(&prg, &entries);
+
+    // 分割で増えた先頭も含めて、すべての先頭からブロックを作る
+    let mut blocks: BTreeMap<u16, Block> = BTreeMap::new();
+    let mut visited: BTreeSet<u16> = BTreeSet::new();
+    let mut pending: Vec<u16> = program.leaders.iter().cloned().collect();
+    while let Some(start) = pending.pop() {
+        if !visited.insert(start) {
+            continue;
+        }
+        let mut new_leaders = Vec::new();
+        if let Some(block) = generate_block(&program, start, &mut new_leaders) {
+            blocks.insert(start, block);
+        }
+        pending.extend(new_leaders);
+    }
+    let num_of_insts: usize = blocks.values().map(|b| b.num_of_insts).sum();
+
+    let mut out = String::new();
+    writeln!(out, "//! {} から生成したAOTコンパイル結果", args[1]).unwrap();
+    writeln!(
+        out,
+        "//! examples/nes_aot.rs が生成します。直接編集しないこと"
+    )
+    .unwrap();
+    writeln!(out, "#![allow(dead_code, unused_variables, clippy::all)]").unwrap();
+    writeln!(out).unwrap();
+    writeln!(out, "use rust_nes_emulator::prelude::*;").unwrap();
+    writeln!(out).unwrap();
+    writeln!(out, "/// 生成元のPRG-ROM(0x8000-0xffff)のFNV-1aハッシュ").unwrap();
+    writeln!(
+        out,
+        "pub const AOT_PRG_HASH: u32 = 0x{:08x};",
+        prg_hash(&prg)
+    )
+    .unwrap();
+    writeln!(out, "/// 翻訳済のブロック数").unwrap();
+    writeln!(
+        out,
+        "pub const AOT_NUM_OF_BLOCKS: usize = {};",
+        blocks.len()
+    )
+    .unwrap();
+    writeln!(out, "/// 翻訳済の命令数(ブロック間の重複を含む)").unwrap();
+    writeln!(out, "pub const AOT_NUM_OF_INSTS: usize = {};", num_of_insts).unwrap();
+    writeln!(
+        out,
+        "/// 静的に解決できず、インタプリタで実行する間接ジャンプの数"
+    )
+    .unwrap();
+    writeln!(
+        out,
+        "pub const AOT_NUM_OF_UNRESOLVED_JUMPS: usize = {};",
+        program.unresolved_jumps.len()
+    )
+    .unwrap();
+    out.push_str(RUNTIME);
+    writeln!(out).unwrap();
+    writeln!(out, "/// `cpu.pc`から始まる翻訳済のブロックを実行します").unwrap();
+    writeln!(
+        out,
+        "/// ret: cycle数。ブロックがない場合、`budget`以上かかる可能性がある場合はNone"
+    )
+    .unwrap();
+    writeln!(out, "fn run_block<S: CassetteStorage>(cpu: &mut Cpu, system: &mut System<S>, budget: usize) -> Option<u8> {{").unwrap();
+    writeln!(out, "    match cpu.pc {{").unwrap();
+    for block in blocks.values() {
+        writeln!(
+            out,
+            "        0x{:04x} if budget > {} => Some(block_{:04x}(cpu, system)),",
+            block.start, block.max_cyc, block.start
+        )
+        .unwrap();
+    }
+    writeln!(out, "        _ => None,").unwrap();
+    writeln!(out, "    }}").unwrap();
+    writeln!(out, "}}").unwrap();
+    for block in blocks.values() {
+        writeln!(out).unwrap();
+        writeln!(
+            out,
+            "/// ${:04X}: {}命令, 最大{}cycle",
+            block.start, block.num_of_insts, block.max_cyc
+        )
+        .unwrap();
+        writeln!(
+            out,
+            "fn block_{:04x}<S: CassetteStorage>(cpu: &mut Cpu, system: &mut System<S>) -> u8 {{",
+            block.start
+        )
+        .unwrap();
+        writeln!(out, "    let mut cyc: u8 = 0;").unwrap();
+        out.push_str(&block.code);
+        writeln!(out, "    cyc").unwrap();
+        writeln!(out, "}}").unwrap();
+    }
+    fs::write(&args[2], out).unwrap_or_else(|e| {
+        eprintln!("cannot write {}: {}", args[2], e);
+        process::exit(1);
+    });
+
+    println!(
+        "entries: NMI=${:04X} RESET=${:04X} IRQ=${:04X}",
+        entries[0], entries[1], entries[2]
+    );
+    println!("reachable instructions: {}", program.insts.len());
+    println!("blocks: {} ({} instructions)", blocks.len(), num_of_insts);
+    println!("interpreter fallbacks: {}", program.fallbacks.len());
+    println!(
+        "indirect jumps: {} resolved, {} unresolved",
+        program.indirect_targets.len(),
+        program.unresolved_jumps.len()
+    );
+    for addr in &program.unresolved_jumps {
+        println!("  unresolved JMP (ind) at ${:04X}", addr);
+    }
+}
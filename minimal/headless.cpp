@@ -0,0 +1,721 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/mman.h>
+
+#include "rust_nes_emulator.h"
+
+// Headless multi-instance runner
+// All instances live in one arena and share one read-only ROM image.
+// Build with STORAGE_PROFILE=profile-rom-in-place so that instances reference the ROM instead of copying it.
+
+static constexpr uint32_t ARENA_ALIGN = 64; // cache line
+
+static uint32_t alignUp(uint32_t size) {
+    return (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+// Per-instance work area, carved out of the arena
+struct Instance {
+    uint8_t* cpuBuf;
+    uint8_t* systemBuf;
+    uint8_t* ppuBuf;
+    uint8_t* fbBuf;         // nullptr if drawing is disabled
+    float* frameLatencyUs;  // [frames]
+};
+
+// Work-stealing pool over a fixed set of tasks
+// Each worker pops from the back of its own queue and steals from the front of others when it runs dry.
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(uint32_t numOfWorkers) : queues(numOfWorkers) {}
+
+    void push(uint32_t worker, uint32_t task) {
+        queues[worker].tasks.push_back(task);
+    }
+
+    // Runs until every queue is empty, returns number of stolen tasks
+    template<typename F>
+    uint32_t run(F func) {
+        std::atomic<uint32_t> stolen{0};
+        std::vector<std::thread> workers;
+        for (uint32_t id = 0; id < queues.size(); id++) {
+            workers.emplace_back([this, id, &func, &stolen]() {
+                uint32_t task;
+                for (;;) {
+                    if (popOwn(id, task)) {
+                        func(task);
+                    } else if (steal(id, task)) {
+                        stolen++;
+                        func(task);
+                    } else {
+                        // tasks are never added while running, so empty queues mean done
+                        break;
+                    }
+                }
+            });
+        }
+        for (auto& w : workers) {
+            w.join();
+        }
+        return stolen;
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<uint32_t> tasks;
+    };
+    std::vector<Queue> queues;
+
+    bool popOwn(uint32_t id, uint32_t& task) {
+        std::lock_guard<std::mutex> lock(queues[id].mutex);
+        if (queues[id].tasks.empty()) {
+            return false;
+        }
+        task = queues[id].tasks.back();
+        queues[id].tasks.pop_back();
+        return true;
+    }
+
+    bool steal(uint32_t id, uint32_t& task) {
+        for (uint32_t i = 1; i < queues.size(); i++) {
+            Queue& victim = queues[(id + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+static float percentile(std::vector<float>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0.0f;
+    }
+    const size_t index = std::min(sorted.size() - 1, static_cast<size_t>(p * (sorted.size() - 1) + 0.5));
+    return sorted[index];
+}
+
+int main(int argc, char* argv[])
+{
+    // parse command line args
+    if (argc < 2) {
+        std::cout << "headless [rom_path] [instances*] [frames*] [threads*] [draw*]" << std::endl
+                  << " - rom_path: .nes ROM file path (required) " << std::endl
+                  << " - instances: number of emulator instances. (default 64)" << std::endl
+                  << " - frames: frames to emulate per instance. (default 600)" << std::endl
+                  << " - threads: worker threads. If 0 is specified, use all hardware threads. (default 0)" << std::endl
+                  << " - draw: 1 to draw into a per-instance frame buffer, 0 to skip drawing. (default 0)" << std::endl;
+        return 0;
+    }
+    const char* romPath = argv[1];
+    const uint32_t numOfInstances = (argc > 2) ? std::stoi(argv[2]) : 64;
+    const uint32_t numOfFrames    = (argc > 3) ? std::stoi(argv[3]) : 600;
+    const uint32_t threadsArg     = (argc > 4) ? std::stoi(argv[4]) : 0;
+    const bool isDraw             = (argc > 5) ? (std::stoi(argv[5]) != 0) : false;
+    const uint32_t numOfThreads   = std::max(1u, (threadsArg > 0) ? threadsArg : std::thread::hardware_concurrency());
+
+    // Read rom (shared by all instances, never written)
+    std::ifstream ifs(romPath, std::ios::binary | std::ios::in);
+    if (!ifs) {
+        std::cout << "ERROR: Failed to read '" << romPath << "'" << std::endl;
+        return -1;
+    }
+    const std::vector<uint8_t> romBuf((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    ifs.close();
+    if (romBuf.empty()) {
+        std::cout << "ERROR: ROM size is zero" << std::endl;
+        return -1;
+    }
+    const bool isRomShared = (EmbeddedEmulator_GetStorageProfile() == StorageProfile::RomInPlace);
+    if (!isRomShared) {
+        std::cout << "WARN: ROM is copied into each instance. Build with STORAGE_PROFILE=profile-rom-in-place to share it" << std::endl;
+    }
+
+    // Allocate arena
+    // [cpu | system | ppu | fb] x instances, every block is cache line aligned so that instances never share a line
+    const uint32_t cpuStride    = alignUp(EmbeddedEmulator_GetCpuDataSize());
+    const uint32_t systemStride = alignUp(EmbeddedEmulator_GetSystemDataSize());
+    const uint32_t ppuStride    = alignUp(EmbeddedEmulator_GetPpuDataSize());
+    const uint32_t fbStride     = isDraw ? alignUp(EMBEDDED_EMULATOR_VISIBLE_SCREEN_WIDTH * EMBEDDED_EMULATOR_VISIBLE_SCREEN_HEIGHT * EMBEDDED_EMULATOR_NUM_OF_COLOR) : 0;
+    const uint32_t latencyStride = alignUp(numOfFrames * sizeof(float));
+    const size_t instanceStride = static_cast<size_t>(cpuStride) + systemStride + ppuStride + fbStride + latencyStride;
+    const size_t arenaSize = instanceStride * numOfInstances;
+    std::cout << "INFO: Allocate arena " << arenaSize << " bytes (" << instanceStride << " bytes x " << numOfInstances << ")" << std::endl
+              << " - ROM    : " << romBuf.size() << " bytes" << (isRomShared ? " (shared)" : " (copied)") << std::endl
+              << " - Threads: " << numOfThreads << std::endl;
+    uint8_t* arena = static_cast<uint8_t*>(std::aligned_alloc(ARENA_ALIGN, arenaSize));
+    if (arena == nullptr) {
+        std::cout << "ERROR: Failed to allocate arena" << std::endl;
+        return -1;
+    }
+
+    // Init instances
+    std::vector<Instance> instances(numOfInstances);
+    for (uint32_t i = 0; i < numOfInstances; i++) {
+        uint8_t* base = arena + instanceStride * i;
+        Instance& inst = instances[i];
+        inst.cpuBuf         = base;
+        inst.systemBuf      = base + cpuStride;
+        inst.ppuBuf         = base + cpuStride + systemStride;
+        inst.fbBuf          = isDraw ? (base + cpuStride + systemStride + ppuStride) : nullptr;
+        inst.frameLatencyUs = reinterpret_cast<float*>(base + cpuStride + systemStride + ppuStride + fbStride);
+
+        EmbeddedEmulator_InitCpu(inst.cpuBuf);
+        EmbeddedEmulator_InitSystem(inst.systemBuf);
+        EmbeddedEmulator_InitPpu(inst.ppuBuf);
+        EmbeddedEmulator_SetPpuDrawOption(inst.ppuBuf, EMBEDDED_EMULATOR_VISIBLE_SCREEN_WIDTH, EMBEDDED_EMULATOR_VISIBLE_SCREEN_HEIGHT, 0, 0, 1, DrawPioxelFormat::RGBA8888);
+    }
+
+    // Only the first instance loads the rom, the others are forked from it
+    if (!EmbeddedEmulator_LoadRom(instances[0].systemBuf, romBuf.data())) {
+        std::cout << "ERROR: failed to parse rom binary" << std::endl;
+        std::free(arena);
+        return -1;
+    }
+    EmbeddedEmulator_Reset(instances[0].cpuBuf, instances[0].systemBuf, instances[0].ppuBuf);
+    const EmbeddedEmulatorInstance origin = { instances[0].cpuBuf, instances[0].systemBuf, instances[0].ppuBuf, nullptr };
+    const auto cloneStart = std::chrono::steady_clock::now();
+    for (uint32_t i = 1; i < numOfInstances; i++) {
+        const EmbeddedEmulatorInstance fork = { instances[i].cpuBuf, instances[i].systemBuf, instances[i].ppuBuf, nullptr };
+        EmbeddedEmulator_Clone(&origin, &fork);
+    }
+    const double cloneUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - cloneStart).count();
+    std::cout << "INFO: Clone " << (cloneUs / std::max(1u, numOfInstances - 1)) << " us/instance" << std::endl;
+
+    // Schedule instances round-robin, idle workers steal the rest
+    WorkStealingPool pool(numOfThreads);
+    for (uint32_t i = 0; i < numOfInstances; i++) {
+        pool.push(i % numOfThreads, i);
+    }
+    std::cout << "INFO: Start emulation " << numOfFrames << " frames x " << numOfInstances << " instances" << std::endl;
+    const auto start = std::chrono::steady_clock::now();
+    const uint32_t stolen = pool.run([&](uint32_t index) {
+        Instance& inst = instances[index];
+        for (uint32_t frame = 0; frame < numOfFrames; frame++) {
+            const auto frameStart = std::chrono::steady_clock::now();
+            EmbeddedEmulator_EmulateFrame(inst.cpuBuf, inst.systemBuf, inst.ppuBuf, inst.fbBuf);
+            inst.frameLatencyUs[frame] = std::chrono::duration<float, std::micro>(std::chrono::steady_clock::now() - frameStart).count();
+        }
+    });
+    const double elapsedSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Report
+    std::vector<float> frameLatencies;
+    std::vector<float> instanceLatencies;
+    frameLatencies.reserve(static_cast<size_t>(numOfInstances) * numOfFrames);
+    for (const Instance& inst : instances) {
+        float sum = 0.0f;
+        for (uint32_t frame = 0; frame < numOfFrames; frame++) {
+            frameLatencies.push_back(inst.frameLatencyUs[frame]);
+            sum += inst.frameLatencyUs[frame];
+        }
+        instanceLatencies.push_back(sum / std::max(1u, numOfFrames));
+    }
+    std::sort(frameLatencies.begin(), frameLatencies.end());
+    std::sort(instanceLatencies.begin(), instanceLatencies.end());
+    const double totalFrames = static_cast<double>(numOfInstances) * numOfFrames;
+    std::cout << "INFO: Result" << std::endl
+              << " - Elapsed  : " << elapsedSec << " sec (" << stolen << " tasks stolen)" << std::endl
+              << " - Aggregate: " << (totalFrames / elapsedSec) << " frames/sec" << std::endl
+              << " - Frame    : p50 " << percentile(frameLatencies, 0.50) << " us, p90 " << percentile(frameLatencies, 0.90)
+              << " us, p99 " << percentile(frameLatencies, 0.99) << " us, max " << percentile(frameLatencies, 1.0) << " us" << std::endl
+              << " - Instance : p50 " << percentile(instanceLatencies, 0.50) << " us/frame, p99 " << percentile(instanceLatencies, 0.99)
+              << " us/frame, max " << percentile(instanceLatencies, 1.0) << " us/frame" << std::endl;
+
+    // Without input every instance must end up in the same state
+    const uint32_t stateSize = EmbeddedEmulator_GetSaveStateSize(instances[0].systemBuf);
+    std::vector<uint8_t> referenceState(stateSize);
+    std::vector<uint8_t> state(stateSize);
+    EmbeddedEmulator_SaveState(instances[0].cpuBuf, instances[0].systemBuf, instances[0].ppuBuf, nullptr, referenceState.data(), stateSize);
+    uint32_t numOfSynced = 0;
+    for (const Instance& inst : instances) {
+        EmbeddedEmulator_SaveState(inst.cpuBuf, inst.systemBuf, inst.ppuBuf, nullptr, state.data(), stateSize);
+        numOfSynced += (state == referenceState) ? 1 : 0;
+    }
+    std::cout << " - Sync     : " << numOfSynced << "/" << numOfInstances << " instances" << std::endl;
+
+    // Save state latency, loading the state just saved must not change what the next save writes
+    {
+        const Instance& inst = instances[0];
+        const uint32_t numOfTrials = 1000;
+        const auto saveStart = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < numOfTrials; i++) {
+            EmbeddedEmulator_SaveState(inst.cpuBuf, inst.systemBuf, inst.ppuBuf, nullptr, state.data(), stateSize);
+        }
+        const auto saveEnd = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < numOfTrials; i++) {
+            EmbeddedEmulator_LoadState(inst.cpuBuf, inst.systemBuf, inst.ppuBuf, nullptr, state.data(), stateSize);
+        }
+        const auto loadEnd = std::chrono::steady_clock::now();
+        EmbeddedEmulator_SaveState(inst.cpuBuf, inst.systemBuf, inst.ppuBuf, nullptr, state.data(), stateSize);
+        const double saveUs = std::chrono::duration<double, std::micro>(saveEnd - saveStart).count() / numOfTrials;
+        const double loadUs = std::chrono::duration<double, std::micro>(loadEnd - saveEnd).count() / numOfTrials;
+        std::cout << "INFO: Save state (" << stateSize << " bytes, version " << static_cast<uint32_t>(EMBEDDED_EMULATOR_SAVE_STATE_VERSION) << ")" << std::endl
+                  << " - Save     : " << saveUs << " us" << std::endl
+                  << " - Load     : " << loadUs << " us" << std::endl
+                  << " - Match    : " << ((state == referenceState) ? "ok" : "NG") << std::endl;
+    }
+
+    // Batch step (reinforcement learning style)
+    // Each worker owns a contiguous chunk of instances and steps it with one BatchStep call per step
+    constexpr uint32_t BATCH_FRAME_SKIP = 4;
+    constexpr uint32_t BATCH_MAX_EPISODE_FRAMES = 60 * 60;
+    constexpr uint32_t OBSERVATION_WIDTH = 84;
+    constexpr uint32_t OBSERVATION_HEIGHT = 84;
+    // L8 observation with max-pool needs the previous frame after the pooled one
+    constexpr size_t OBSERVATION_STRIDE = OBSERVATION_WIDTH * OBSERVATION_HEIGHT * 2;
+    const uint32_t numOfSteps = std::max(1u, numOfFrames / BATCH_FRAME_SKIP);
+    const uint32_t chunkSize = (numOfInstances + numOfThreads - 1) / numOfThreads;
+    std::vector<EmbeddedEmulatorInstance> handles(numOfInstances);
+    for (uint32_t i = 0; i < numOfInstances; i++) {
+        handles[i] = { instances[i].cpuBuf, instances[i].systemBuf, instances[i].ppuBuf, nullptr };
+        EmbeddedEmulator_SetPpuObservationOption(instances[i].ppuBuf, OBSERVATION_WIDTH, OBSERVATION_HEIGHT, ObservationSamplingMode::Area, true);
+    }
+    std::vector<uint8_t> buttons(numOfInstances, 0);
+    std::vector<uint8_t> dones(numOfInstances, 0);
+    std::vector<uint32_t> episodeFrames(numOfInstances, 0);
+    std::vector<uint8_t> ramTensor(static_cast<size_t>(numOfInstances) * EMBEDDED_EMULATOR_WRAM_SIZE);
+    std::vector<uint8_t> observationTensor(numOfInstances * OBSERVATION_STRIDE);
+    std::atomic<uint32_t> numOfDones{0};
+    WorkStealingPool batchPool(numOfThreads);
+    for (uint32_t chunk = 0; chunk * chunkSize < numOfInstances; chunk++) {
+        batchPool.push(chunk % numOfThreads, chunk);
+    }
+    const auto batchStart = std::chrono::steady_clock::now();
+    batchPool.run([&](uint32_t chunk) {
+        const uint32_t begin = chunk * chunkSize;
+        const uint32_t count = std::min(chunkSize, numOfInstances - begin);
+        uint32_t random = 0x12345678 + chunk;
+        for (uint32_t step = 0; step < numOfSteps; step++) {
+            // random actions (xorshift)
+            for (uint32_t i = begin; i < begin + count; i++) {
+                random ^= random << 13;
+                random ^= random >> 17;
+                random ^= random << 5;
+                buttons[i] = static_cast<uint8_t>(random);
+            }
+            EmbeddedEmulator_BatchStep(&handles[begin], count, &buttons[begin], BATCH_FRAME_SKIP,
+                                       BATCH_MAX_EPISODE_FRAMES, &episodeFrames[begin], nullptr, 0,
+                                       &dones[begin], &observationTensor[begin * OBSERVATION_STRIDE], OBSERVATION_STRIDE, &ramTensor[static_cast<size_t>(begin) * EMBEDDED_EMULATOR_WRAM_SIZE]);
+            for (uint32_t i = begin; i < begin + count; i++) {
+                numOfDones += dones[i];
+            }
+        }
+    });
+    const double batchElapsedSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - batchStart).count();
+    const double totalSteps = static_cast<double>(numOfInstances) * numOfSteps;
+    std::cout << "INFO: BatchStep (frame_skip " << BATCH_FRAME_SKIP << ", chunk " << chunkSize << " instances, "
+              << OBSERVATION_WIDTH << "x" << OBSERVATION_HEIGHT << " L8 area max-pool)" << std::endl
+              << " - Elapsed  : " << batchElapsedSec << " sec" << std::endl
+              << " - Aggregate: " << (totalSteps / batchElapsedSec) << " steps/sec, "
+              << (totalSteps * BATCH_FRAME_SKIP / batchElapsedSec) << " frames/sec" << std::endl
+              << " - Resets   : " << numOfDones << std::endl;
+
+    // Lockstep vs scalar
+    // Instances have diverged by the random actions above. Both runs start from the same snapshot and must end in the same state
+    const uint32_t numOfGroups = (numOfInstances + EMBEDDED_EMULATOR_LOCKSTEP_MAX_LANES - 1) / EMBEDDED_EMULATOR_LOCKSTEP_MAX_LANES;
+    std::vector<uint8_t> snapshots(static_cast<size_t>(numOfInstances) * stateSize);
+    std::vector<uint8_t> scalarStates(static_cast<size_t>(numOfInstances) * stateSize);
+    for (uint32_t i = 0; i < numOfInstances; i++) {
+        EmbeddedEmulator_SaveState(instances[i].cpuBuf, instances[i].systemBuf, instances[i].ppuBuf, nullptr, &snapshots[static_cast<size_t>(i) * stateSize], stateSize);
+    }
+    const auto runGroups = [&](auto stepGroup) {
+        WorkStealingPool groupPool(numOfThreads);
+        for (uint32_t group = 0; group < numOfGroups; group++) {
+            groupPool.push(group % numOfThreads, group);
+        }
+        const auto groupStart = std::chrono::steady_clock::now();
+        groupPool.run([&](uint32_t group) {
+            const uint32_t begin = group * EMBEDDED_EMULATOR_LOCKSTEP_MAX_LANES;
+            const uint32_t count = std::min(static_cast<uint32_t>(EMBEDDED_EMULATOR_LOCKSTEP_MAX_LANES), numOfInstances - begin);
+            for (uint32_t frame = 0; frame < numOfFrames; frame++) {
+                stepGroup(group, begin, count);
+            }
+        });
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - groupStart).count();
+    };
+    const double scalarElapsedSec = runGroups([&](uint32_t, uint32_t begin, uint32_t count) {
+        for (uint32_t i = begin; i < begin + count; i++) {
+            EmbeddedEmulator_EmulateFrame(instances[i].cpuBuf, instances[i].systemBuf, instances[i].ppuBuf, nullptr);
+        }
+    });
+    for (uint32_t i = 0; i < numOfInstances; i++) {
+        EmbeddedEmulator_SaveState(instances[i].cpuBuf, instances[i].systemBuf, instances[i].ppuBuf, nullptr, &scalarStates[static_cast<size_t>(i) * stateSize], stateSize);
+        EmbeddedEmulator_LoadState(instances[i].cpuBuf, instances[i].systemBuf, instances[i].ppuBuf, nullptr, &snapshots[static_cast<size_t>(i) * stateSize], stateSize);
+    }
+    const uint32_t lockstepStride = alignUp(EmbeddedEmulator_GetLockstepDataSize());
+    uint8_t* lockstepArena = static_cast<uint8_t*>(std::aligned_alloc(ARENA_ALIGN, static_cast<size_t>(lockstepStride) * numOfGroups));
+    for (uint32_t group = 0; group < numOfGroups; group++) {
+        EmbeddedEmulator_InitLockstep(lockstepArena + static_cast<size_t>(lockstepStride) * group);
+    }
+    const double lockstepElapsedSec = runGroups([&](uint32_t group, uint32_t begin, uint32_t count) {
+        EmbeddedEmulator_LockstepEmulateFrame(lockstepArena + static_cast<size_t>(lockstepStride) * group, &handles[begin], count, nullptr, 0);
+    });
+    uint64_t vectorLaneSteps = 0;
+    uint64_t scalarLaneSteps = 0;
+    uint64_t dispatches = 0;
+    for (uint32_t group = 0; group < numOfGroups; group++) {
+        uint64_t vector, scalar, dispatch;
+        EmbeddedEmulator_GetLockstepStats(lockstepArena + static_cast<size_t>(lockstepStride) * group, &vector, &scalar, &dispatch);
+        vectorLaneSteps += vector;
+        scalarLaneSteps += scalar;
+        dispatches += dispatch;
+    }
+    std::free(lockstepArena);
+    uint32_t numOfMatched = 0;
+    for (uint32_t i = 0; i < numOfInstances; i++) {
+        EmbeddedEmulator_SaveState(instances[i].cpuBuf, instances[i].systemBuf, instances[i].ppuBuf, nullptr, state.data(), stateSize);
+        numOfMatched += (std::memcmp(state.data(), &scalarStates[static_cast<size_t>(i) * stateSize], stateSize) == 0) ? 1 : 0;
+    }
+    const uint64_t laneSteps = std::max<uint64_t>(1, vectorLaneSteps + scalarLaneSteps);
+    std::cout << "INFO: Lockstep (" << numOfGroups << " groups x " << EMBEDDED_EMULATOR_LOCKSTEP_MAX_LANES << " lanes, no drawing)" << std::endl
+              << " - Scalar   : " << (totalFrames / scalarElapsedSec) << " frames/sec" << std::endl
+              << " - Lockstep : " << (totalFrames / lockstepElapsedSec) << " frames/sec (x" << (scalarElapsedSec / lockstepElapsedSec) << ")" << std::endl
+              << " - Vector   : " << (100.0 * vectorLaneSteps / laneSteps) << " % of instructions, "
+              << (static_cast<double>(laneSteps) / std::max<uint64_t>(1, dispatches)) << " lanes/dispatch" << std::endl
+              << " - Match    : " << numOfMatched << "/" << numOfInstances << " instances" << std::endl;
+
+    // JIT vs scalar (only when built with EXTRA_FEATURES=jit)
+    // ROM is identical across instances, so each group shares one translation cache
+    uint32_t numOfJitMatched = numOfInstances;
+    const uint32_t jitStride = alignUp(EmbeddedEmulator_GetJitDataSize());
+    if (jitStride > 0) {
+        constexpr size_t JIT_CODE_BUF_SIZE = 1024 * 1024;
+        uint8_t* jitArena = static_cast<uint8_t*>(std::aligned_alloc(ARENA_ALIGN, static_cast<size_t>(jitStride) * numOfGroups));
+        void* codeBuf = mmap(nullptr, JIT_CODE_BUF_SIZE * numOfGroups, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (jitArena == nullptr || codeBuf == MAP_FAILED) {
+            std::cout << "ERROR: Failed to allocate JIT buffers" << std::endl;
+            std::free(arena);
+            return -1;
+        }
+        for (const bool isTraceCompare : { false, true }) {
+            for (uint32_t group = 0; group < numOfGroups; group++) {
+                uint8_t* jit = jitArena + static_cast<size_t>(jitStride) * group;
+                EmbeddedEmulator_InitJit(jit, static_cast<uint8_t*>(codeBuf) + JIT_CODE_BUF_SIZE * group, JIT_CODE_BUF_SIZE);
+                EmbeddedEmulator_SetJitTraceCompare(jit, isTraceCompare);
+            }
+            for (uint32_t i = 0; i < numOfInstances; i++) {
+                EmbeddedEmulator_LoadState(instances[i].cpuBuf, instances[i].systemBuf, instances[i].ppuBuf, nullptr, &snapshots[static_cast<size_t>(i) * stateSize], stateSize);
+            }
+            const double jitElapsedSec = runGroups([&](uint32_t group, uint32_t begin, uint32_t count) {
+                uint8_t* jit = jitArena + static_cast<size_t>(jitStride) * group;
+                for (uint32_t i = begin; i < begin + count; i++) {
+                    EmbeddedEmulator_JitEmulateFrame(jit, instances[i].cpuBuf, instances[i].systemBuf, instances[i].ppuBuf, nullptr);
+                }
+            });
+            EmbeddedEmulatorJitStats total = {};
+            for (uint32_t group = 0; group < numOfGroups; group++) {
+                EmbeddedEmulatorJitStats stats;
+                EmbeddedEmulator_GetJitStats(jitArena + static_cast<size_t>(jitStride) * group, &stats);
+                total.compiled_blocks   += stats.compiled_blocks;
+                total.jit_insts         += stats.jit_insts;
+                total.interpreted_insts += stats.interpreted_insts;
+                total.trace_compared    += stats.trace_compared;
+                total.trace_mismatches  += stats.trace_mismatches;
+                if (total.first_mismatch_pc == 0) {
+                    total.first_mismatch_pc = stats.first_mismatch_pc;
+                }
+            }
+            uint32_t numOfMatchedRun = 0;
+            for (uint32_t i = 0; i < numOfInstances; i++) {
+                EmbeddedEmulator_SaveState(instances[i].cpuBuf, instances[i].systemBuf, instances[i].ppuBuf, nullptr, state.data(), stateSize);
+                numOfMatchedRun += (std::memcmp(state.data(), &scalarStates[static_cast<size_t>(i) * stateSize], stateSize) == 0) ? 1 : 0;
+            }
+            numOfJitMatched = std::min(numOfJitMatched, (total.trace_mismatches == 0) ? numOfMatchedRun : 0);
+            const uint64_t insts = std::max<uint64_t>(1, total.jit_insts + total.interpreted_insts);
+            std::cout << "INFO: JIT" << (isTraceCompare ? " (trace compare)" : "") << std::endl
+                      << " - JIT      : " << (totalFrames / jitElapsedSec) << " frames/sec (x" << (scalarElapsedSec / jitElapsedSec) << " vs scalar)" << std::endl
+                      << " - Blocks   : " << total.compiled_blocks << " compiled, " << (100.0 * total.jit_insts / insts) << " % of instructions translated" << std::endl;
+            if (isTraceCompare) {
+                std::cout << " - Trace    : " << total.trace_mismatches << " mismatches in " << total.trace_compared << " instructions";
+                if (total.trace_mismatches > 0) {
+                    std::cout << " (first at $" << std::hex << total.first_mismatch_pc << std::dec << ")";
+                }
+                std::cout << std::endl;
+            }
+            std::cout << " - Match    : " << numOfMatchedRun << "/" << numOfInstances << " instances" << std::endl;
+        }
+        munmap(codeBuf, JIT_CODE_BUF_SIZE * numOfGroups);
+        std::free(jitArena);
+    }
+
+    // Superinstruction fusion vs scalar
+    // Detected idioms depend only on the ROM, so each group shares one fusion table
+    const uint32_t fusionStride = alignUp(EmbeddedEmulator_GetFusionDataSize());
+    uint8_t* fusionArena = static_cast<uint8_t*>(std::aligned_alloc(ARENA_ALIGN, static_cast<size_t>(fusionStride) * numOfGroups));
+    for (uint32_t group = 0; group < numOfGroups; group++) {
+        EmbeddedEmulator_InitFusion(fusionArena + static_cast<size_t>(fusionStride) * group);
+    }
+    for (uint32_t i = 0; i < numOfInstances; i++) {
+        EmbeddedEmulator_LoadState(instances[i].cpuBuf, instances[i].systemBuf, instances[i].ppuBuf, nullptr, &snapshots[static_cast<size_t>(i) * stateSize], stateSize);
+    }
+    const double fusionElapsedSec = runGroups([&](uint32_t group, uint32_t begin, uint32_t count) {
+        uint8_t* fusion = fusionArena + static_cast<size_t>(fusionStride) * group;
+        for (uint32_t i = begin; i < begin + count; i++) {
+            EmbeddedEmulator_FusionEmulateFrame(fusion, instances[i].cpuBuf, instances[i].systemBuf, instances[i].ppuBuf, nullptr);
+        }
+    });
+    EmbeddedEmulatorFusionStats fusionTotal = {};
+    for (uint32_t group = 0; group < numOfGroups; group++) {
+        EmbeddedEmulatorFusionStats stats;
+        EmbeddedEmulator_GetFusionStats(fusionArena + static_cast<size_t>(fusionStride) * group, &stats);
+        fusionTotal.lda_zp_sta_abs        += stats.lda_zp_sta_abs;
+        fusionTotal.dex_bne               += stats.dex_bne;
+        fusionTotal.dey_bne               += stats.dey_bne;
+        fusionTotal.lda_abs_bpl           += stats.lda_abs_bpl;
+        fusionTotal.inc_zp_lda_zp         += stats.inc_zp_lda_zp;
+        fusionTotal.single_steps          += stats.single_steps;
+        fusionTotal.eliminated_dispatches += stats.eliminated_dispatches;
+    }
+    std::free(fusionArena);
+    uint32_t numOfFusionMatched = 0;
+    for (uint32_t i = 0; i < numOfInstances; i++) {
+        EmbeddedEmulator_SaveState(instances[i].cpuBuf, instances[i].systemBuf, instances[i].ppuBuf, nullptr, state.data(), stateSize);
+        numOfFusionMatched += (std::memcmp(state.data(), &scalarStates[static_cast<size_t>(i) * stateSize], stateSize) == 0) ? 1 : 0;
+    }
+    // Every fused pair is two instructions but one dispatch
+    const uint64_t fusionDispatches = fusionTotal.single_steps + fusionTotal.lda_zp_sta_abs + fusionTotal.dex_bne + fusionTotal.dey_bne
+                                    + fusionTotal.lda_abs_bpl + fusionTotal.inc_zp_lda_zp;
+    const uint64_t fusionInsts = std::max<uint64_t>(1, fusionDispatches + fusionTotal.eliminated_dispatches);
+    std::cout << "INFO: Superinstruction fusion" << std::endl
+              << " - Fusion   : " << (totalFrames / fusionElapsedSec) << " frames/sec (x" << (scalarElapsedSec / fusionElapsedSec) << " vs scalar)" << std::endl
+              << " - LDA zp; STA abs : " << fusionTotal.lda_zp_sta_abs << std::endl
+              << " - DEX; BNE        : " << fusionTotal.dex_bne << std::endl
+              << " - DEY; BNE        : " << fusionTotal.dey_bne << std::endl
+              << " - LDA abs; BPL    : " << fusionTotal.lda_abs_bpl << std::endl
+              << " - INC zp; LDA zp  : " << fusionTotal.inc_zp_lda_zp << std::endl
+              << " - Dispatch : " << fusionInsts << " -> " << fusionDispatches << " ("
+              << (100.0 * fusionTotal.eliminated_dispatches / fusionInsts) << " % eliminated)" << std::endl
+              << " - Match    : " << numOfFusionMatched << "/" << numOfInstances << " instances" << std::endl;
+
+    // Idle-loop skip vs scalar
+    // The watched loop and its register snapshot belong to one CPU, so every instance gets its own
+    const uint32_t idleStride = alignUp(EmbeddedEmulator_GetIdleSkipDataSize());
+    uint8_t* idleArena = static_cast<uint8_t*>(std::aligned_alloc(ARENA_ALIGN, static_cast<size_t>(idleStride) * numOfInstances));
+    for (uint32_t i = 0; i < numOfInstances; i++) {
+        EmbeddedEmulator_InitIdleSkip(idleArena + static_cast<size_t>(idleStride) * i);
+        EmbeddedEmulator_LoadState(instances[i].cpuBuf, instances[i].systemBuf, instances[i].ppuBuf, nullptr, &snapshots[static_cast<size_t>(i) * stateSize], stateSize);
+    }
+    const double idleElapsedSec = runGroups([&](uint32_t, uint32_t begin, uint32_t count) {
+        for (uint32_t i = begin; i < begin + count; i++) {
+            EmbeddedEmulator_IdleSkipEmulateFrame(idleArena + static_cast<size_t>(idleStride) * i, instances[i].cpuBuf, instances[i].systemBuf, instances[i].ppuBuf, nullptr);
+        }
+    });
+    EmbeddedEmulatorIdleSkipStats idleTotal = {};
+    uint32_t numOfIdleMatched = 0;
+    for (uint32_t i = 0; i < numOfInstances; i++) {
+        EmbeddedEmulatorIdleSkipStats stats;
+        EmbeddedEmulator_GetIdleSkipStats(idleArena + static_cast<size_t>(idleStride) * i, &stats);
+        idleTotal.executed_insts     += stats.executed_insts;
+        idleTotal.skipped_iterations += stats.skipped_iterations;
+        idleTotal.skipped_cycles     += stats.skipped_cycles;
+        EmbeddedEmulator_SaveState(instances[i].cpuBuf, instances[i].systemBuf, instances[i].ppuBuf, nullptr, state.data(), stateSize);
+        numOfIdleMatched += (std::memcmp(state.data(), &scalarStates[static_cast<size_t>(i) * stateSize], stateSize) == 0) ? 1 : 0;
+    }
+    std::free(idleArena);
+    std::cout << "INFO: Idle-loop skip" << std::endl
+              << " - Idle     : " << (totalFrames / idleElapsedSec) << " frames/sec (x" << (scalarElapsedSec / idleElapsedSec) << " vs scalar)" << std::endl
+              << " - Executed : " << idleTotal.executed_insts << " instructions" << std::endl
+              << " - Skipped  : " << idleTotal.skipped_iterations << " iterations, " << idleTotal.skipped_cycles << " cycles" << std::endl
+              << " - Match    : " << numOfIdleMatched << "/" << numOfInstances << " instances" << std::endl;
+
+    // AOT vs scalar (only when built with EXTRA_FEATURES=aot for this ROM, see "make aot")
+    uint32_t numOfAotMatched = numOfInstances;
+    if (EmbeddedEmulator_IsAotCompatible(instances[0].systemBuf)) {
+        for (uint32_t i = 0; i < numOfInstances; i++) {
+            EmbeddedEmulator_LoadState(instances[i].cpuBuf, instances[i].systemBuf, instances[i].ppuBuf, nullptr, &snapshots[static_cast<size_t>(i) * stateSize], stateSize);
+        }
+        const double aotElapsedSec = runGroups([&](uint32_t, uint32_t begin, uint32_t count) {
+            for (uint32_t i = begin; i < begin + count; i++) {
+                EmbeddedEmulator_AotEmulateFrame(instances[i].cpuBuf, instances[i].systemBuf, instances[i].ppuBuf, nullptr);
+            }
+        });
+        numOfAotMatched = 0;
+        for (uint32_t i = 0; i < numOfInstances; i++) {
+            EmbeddedEmulator_SaveState(instances[i].cpuBuf, instances[i].systemBuf, instances[i].ppuBuf, nullptr, state.data(), stateSize);
+            numOfAotMatched += (std::memcmp(state.data(), &scalarStates[static_cast<size_t>(i) * stateSize], stateSize) == 0) ? 1 : 0;
+        }
+        std::cout << "INFO: AOT" << std::endl
+                  << " - AOT      : " << (totalFrames / aotElapsedSec) << " frames/sec (x" << (scalarElapsedSec / aotElapsedSec) << " vs scalar)" << std::endl
+                  << " - Match    : " << numOfAotMatched << "/" << numOfInstances << " instances" << std::endl;
+    }
+
+    // Fixed-point APU mixer vs double-precision reference over every channel combination
+    const double mixerFullScale = 95.52 / (8128.0 / 30.0 + 100.0) + 163.67 / (24329.0 / 202.0 + 100.0);
+    double mixer16MaxError = 0.0;
+    double mixer32MaxError = 0.0;
+    const auto mixerStart = std::chrono::steady_clock::now();
+    for (uint32_t pulse1 = 0; pulse1 < 16; pulse1++) {
+        for (uint32_t pulse2 = 0; pulse2 < 16; pulse2++) {
+            for (uint32_t triangle = 0; triangle < 16; triangle++) {
+                for (uint32_t noise = 0; noise < 16; noise++) {
+                    for (uint32_t dmc = 0; dmc < 128; dmc++) {
+                        const uint32_t pulse = pulse1 + pulse2;
+                        const uint32_t tnd   = 3 * triangle + 2 * noise + dmc;
+                        const double pulseOut = (pulse == 0) ? 0.0 : 95.52 / (8128.0 / pulse + 100.0);
+                        const double tndOut   = (tnd == 0) ? 0.0 : 163.67 / (24329.0 / tnd + 100.0);
+                        const double expected = (pulseOut + tndOut) / mixerFullScale * EMBEDDED_EMULATOR_APU_MIXER_OUTPUT_MAX;
+                        const int16_t out16 = EmbeddedEmulator_MixApuOutput16(pulse1, pulse2, triangle, noise, dmc);
+                        const int32_t out32 = EmbeddedEmulator_MixApuOutput32(pulse1, pulse2, triangle, noise, dmc);
+                        mixer16MaxError = std::max(mixer16MaxError, std::abs(out16 - expected));
+                        mixer32MaxError = std::max(mixer32MaxError, std::abs(std::ldexp(out32, -static_cast<int>(EMBEDDED_EMULATOR_APU_MIXER_FRAC_BITS)) - expected));
+                    }
+                }
+            }
+        }
+    }
+    const double mixerElapsedSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - mixerStart).count();
+    // rounding to the nearest LSB, plus one rounding step per table for the 32-bit output
+    const bool isMixerMatched = (mixer16MaxError <= 0.5 + 1e-6) && (mixer32MaxError <= std::ldexp(1.0, -static_cast<int>(EMBEDDED_EMULATOR_APU_MIXER_FRAC_BITS)));
+    std::cout << "INFO: APU mixer (" << (16 * 16 * 16 * 16 * 128) << " combinations, " << mixerElapsedSec << " sec incl. reference)" << std::endl
+              << " - 16bit    : max error " << mixer16MaxError << " LSB" << std::endl
+              << " - 32bit    : max error " << mixer32MaxError << " LSB (16bit scale)" << std::endl
+              << " - Match    : " << (isMixerMatched ? "ok" : "NG") << std::endl;
+
+    // Polyphase resampler throughput, SIMD kernels must match the scalar fixed-point kernel bit for bit
+    const uint32_t resampleInputRate  = 1790000 / 37;
+    const uint32_t resampleOutputRate = 48000;
+    const size_t resampleInputLen = 1u << 20;
+    std::vector<int16_t> resampleInput(resampleInputLen);
+    for (size_t i = 0; i < resampleInputLen; i++) {
+        const double t = static_cast<double>(i) / resampleInputRate;
+        const double sweep = std::sin(2.0 * M_PI * (100.0 + 10000.0 * t / 20.0) * t);
+        const double square = ((i / 55) & 1) ? 0.25 : -0.25;
+        resampleInput[i] = static_cast<int16_t>(12000.0 * sweep + 8000.0 * square);
+    }
+    std::vector<uint64_t> resamplerBuf((EmbeddedEmulator_GetApuResamplerDataSize() + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+    std::vector<uint64_t> resampleRingBuf((EmbeddedEmulator_GetSampleRingDataSize() + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+    uint8_t* resampler    = reinterpret_cast<uint8_t*>(resamplerBuf.data());
+    uint8_t* resampleRing = reinterpret_cast<uint8_t*>(resampleRingBuf.data());
+    std::vector<int16_t> resampleScalarOutput;
+    bool isResamplerMatched = true;
+    std::cout << "INFO: APU resampler (" << resampleInputRate << " Hz -> " << resampleOutputRate << " Hz, " << resampleInputLen << " samples)" << std::endl;
+    const std::pair<ApuResamplerKernel, const char*> resamplerKernels[] = {
+        {ApuResamplerKernel::Scalar, "Scalar  "},
+        {ApuResamplerKernel::Sse2, "SSE2    "},
+        {ApuResamplerKernel::Avx2, "AVX2    "},
+    };
+    for (const auto& kernel : resamplerKernels) {
+        EmbeddedEmulator_InitApuResampler(resampler, resampleInputRate, resampleOutputRate);
+        if (!EmbeddedEmulator_SetApuResamplerKernel(resampler, kernel.first)) {
+            std::cout << " - " << kernel.second << " : not available" << std::endl;
+            continue;
+        }
+        EmbeddedEmulator_InitSampleRing(resampleRing);
+        std::vector<int16_t> output(resampleInputLen * 2);
+        size_t outputLen = 0;
+        const auto resampleStart = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < resampleInputLen; i += 1024) {
+            EmbeddedEmulator_ResampleApu(resampler, &resampleInput[i], std::min<size_t>(1024, resampleInputLen - i), resampleRing);
+            outputLen += EmbeddedEmulator_ReadSamples(resampleRing, &output[outputLen], output.size() - outputLen);
+        }
+        const double resampleUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - resampleStart).count();
+        output.resize(outputLen);
+        if (kernel.first == ApuResamplerKernel::Scalar) {
+            resampleScalarOutput = output;
+        }
+        const bool isMatched = (output == resampleScalarOutput);
+        isResamplerMatched = isResamplerMatched && isMatched;
+        std::cout << " - " << kernel.second << " : " << (outputLen / resampleUs) << " samples/us (" << outputLen << " output samples, "
+                  << (isMatched ? "match" : "MISMATCH") << ")" << std::endl;
+    }
+
+    // Per-channel taps, the mixed output must not change and every channel must stay sample aligned with it
+    const uint32_t tapSampleRate = 48000;
+    const ApuTapChannel tapChannels[EMBEDDED_EMULATOR_APU_CHANNEL_NUM] = {
+        ApuTapChannel::Pulse1, ApuTapChannel::Pulse2, ApuTapChannel::Triangle, ApuTapChannel::Noise, ApuTapChannel::Dmc,
+    };
+    const char* tapChannelNames[EMBEDDED_EMULATOR_APU_CHANNEL_NUM] = { "Pulse1  ", "Pulse2  ", "Triangle", "Noise   ", "DMC     " };
+    std::vector<uint64_t> tapApuBuf((EmbeddedEmulator_GetApuDataSize() + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+    std::vector<uint64_t> tapRingBuf((EmbeddedEmulator_GetSampleRingDataSize() + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+    std::vector<uint64_t> tapBuf((EmbeddedEmulator_GetApuChannelTapDataSize() + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+    uint8_t* tapApu  = reinterpret_cast<uint8_t*>(tapApuBuf.data());
+    uint8_t* tapRing = reinterpret_cast<uint8_t*>(tapRingBuf.data());
+    uint8_t* tap     = reinterpret_cast<uint8_t*>(tapBuf.data());
+    std::vector<int16_t> tapChunk(EMBEDDED_EMULATOR_SAMPLE_RING_SIZE);
+    std::vector<int16_t> mixedOutputs[2];
+    std::vector<int16_t> channelOutputs[EMBEDDED_EMULATOR_APU_CHANNEL_NUM];
+    double tapElapsedSec[2] = {};
+    for (uint32_t pass = 0; pass < 2; pass++) {
+        const bool isTapped = (pass == 1);
+        EmbeddedEmulator_LoadState(instances[0].cpuBuf, instances[0].systemBuf, instances[0].ppuBuf, nullptr, &snapshots[0], stateSize);
+        EmbeddedEmulator_InitApu(tapApu, tapSampleRate);
+        EmbeddedEmulator_InitSampleRing(tapRing);
+        if (isTapped) {
+            EmbeddedEmulator_InitApuChannelTap(tap, tapSampleRate);
+            EmbeddedEmulator_AttachApuChannelTap(tapApu, tap);
+        }
+        const auto tapStart = std::chrono::steady_clock::now();
+        for (uint32_t frame = 0; frame < numOfFrames; frame++) {
+            EmbeddedEmulator_ApuEmulateFrame(tapApu, tapRing, instances[0].cpuBuf, instances[0].systemBuf, instances[0].ppuBuf, nullptr);
+            const uintptr_t count = EmbeddedEmulator_ReadSamples(tapRing, tapChunk.data(), tapChunk.size());
+            mixedOutputs[pass].insert(mixedOutputs[pass].end(), tapChunk.begin(), tapChunk.begin() + count);
+            for (uint32_t ch = 0; isTapped && (ch < EMBEDDED_EMULATOR_APU_CHANNEL_NUM); ch++) {
+                const uintptr_t channelCount = EmbeddedEmulator_ReadApuChannelSamples(tap, tapChannels[ch], tapChunk.data(), tapChunk.size());
+                channelOutputs[ch].insert(channelOutputs[ch].end(), tapChunk.begin(), tapChunk.begin() + channelCount);
+            }
+        }
+        tapElapsedSec[pass] = std::chrono::duration<double>(std::chrono::steady_clock::now() - tapStart).count();
+    }
+    bool isTapMatched = (mixedOutputs[0] == mixedOutputs[1]);
+    std::cout << "INFO: APU channel taps (" << numOfFrames << " frames, " << mixedOutputs[1].size() << " samples)" << std::endl
+              << " - Untapped : " << (numOfFrames / tapElapsedSec[0]) << " frames/sec" << std::endl
+              << " - Tapped   : " << (numOfFrames / tapElapsedSec[1]) << " frames/sec (mixed output " << (isTapMatched ? "match" : "MISMATCH") << ")" << std::endl;
+    for (uint32_t ch = 0; ch < EMBEDDED_EMULATOR_APU_CHANNEL_NUM; ch++) {
+        int32_t peak = 0;
+        for (const int16_t sample : channelOutputs[ch]) {
+            peak = std::max(peak, std::abs(static_cast<int32_t>(sample)));
+        }
+        const bool isAligned = (channelOutputs[ch].size() == mixedOutputs[1].size());
+        isTapMatched = isTapMatched && isAligned;
+        std::cout << " - " << tapChannelNames[ch] << " : " << channelOutputs[ch].size() << " samples, peak " << peak
+                  << (isAligned ? "" : " (MISALIGNED)") << std::endl;
+    }
+
+    // APU save state, replaying from a state saved with the APU must land on the same state again
+    std::vector<uint8_t> apuMidState(stateSize);
+    std::vector<uint8_t> apuEndStates[2] = { std::vector<uint8_t>(stateSize), std::vector<uint8_t>(stateSize) };
+    EmbeddedEmulator_LoadState(instances[0].cpuBuf, instances[0].systemBuf, instances[0].ppuBuf, nullptr, &snapshots[0], stateSize);
+    EmbeddedEmulator_InitApu(tapApu, tapSampleRate);
+    EmbeddedEmulator_InitSampleRing(tapRing);
+    for (uint32_t pass = 0; pass < 2; pass++) {
+        if (pass == 0) {
+            for (uint32_t frame = 0; frame < numOfFrames / 2; frame++) {
+                EmbeddedEmulator_ApuEmulateFrame(tapApu, tapRing, instances[0].cpuBuf, instances[0].systemBuf, instances[0].ppuBuf, nullptr);
+                EmbeddedEmulator_ReadSamples(tapRing, tapChunk.data(), tapChunk.size());
+            }
+            EmbeddedEmulator_SaveState(instances[0].cpuBuf, instances[0].systemBuf, instances[0].ppuBuf, tapApu, apuMidState.data(), stateSize);
+        } else {
+            EmbeddedEmulator_LoadState(instances[0].cpuBuf, instances[0].systemBuf, instances[0].ppuBuf, tapApu, apuMidState.data(), stateSize);
+        }
+        for (uint32_t frame = numOfFrames / 2; frame < numOfFrames; frame++) {
+            EmbeddedEmulator_ApuEmulateFrame(tapApu, tapRing, instances[0].cpuBuf, instances[0].systemBuf, instances[0].ppuBuf, nullptr);
+            EmbeddedEmulator_ReadSamples(tapRing, tapChunk.data(), tapChunk.size());
+        }
+        EmbeddedEmulator_SaveState(instances[0].cpuBuf, instances[0].systemBuf, instances[0].ppuBuf, tapApu, apuEndStates[pass].data(), stateSize);
+    }
+    const bool isApuStateMatched = (apuEndStates[0] == apuEndStates[1]);
+    std::cout << "INFO: APU save state (" << (numOfFrames - numOfFrames / 2) << " frames after load, "
+              << (isApuStateMatched ? "match" : "MISMATCH") << ")" << std::endl;
+
+    std::free(arena);
+    return (isMixerMatched && isResamplerMatched && isTapMatched && isApuStateMatched && numOfSynced == numOfInstances && numOfMatched == numOfInstances && numOfJitMatched == numOfInstances && numOfFusionMatched == numOfInstances && numOfIdleMatched == numOfInstances && numOfAotMatched == numOfInstances) ? 0 : -1;
+}
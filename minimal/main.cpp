@@ -1,8 +1,14 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <fstream>
 #include <functional>
 #include <map>
+#include <string>
+#include <thread>
 #include <tuple>
+#include <vector>
 
 #include <cstdint>
 #include <cstdlib>
@@ -15,15 +21,24 @@ int main(int argc, char* argv[])
 {
     // parse command line args
     if (argc < 2) {
-        std::cout << "game [rom_path] [scale*] [fps*]" << std::endl
+        std::cout << "game [rom_path] [scale*] [fps*] [save_interval*] [run_ahead*] [apu_log_path*] [sync*]" << std::endl
                   << " - rom_path: .nes ROM file path (required) " << std::endl
                   << " - scale: screen scale. (default 2)" << std::endl
-                  << " - fps: frame per seconds. If 0 is specified, no control is given. (default 60)" << std::endl;
+                  << " - fps: frame per seconds. If 0 is specified, no control is given. (default 60)" << std::endl
+                  << " - save_interval: frames between battery-backed RAM flushes to '[rom_path].sav'. (default 60)" << std::endl
+                  << " - run_ahead: frames to run ahead to hide input lag. F2 changes it while playing. (default 0)" << std::endl
+                  << " - apu_log_path: file to dump the APU register log for offline rendering. '-' for none. (default none)" << std::endl
+                  << " - sync: 'video' paces frames with fps, 'audio' paces them with the audio output. (default video)" << std::endl;
         return 0;
     }
     const char* romPath = argv[1];
     const uint32_t scale = (argc > 2) ? std::stoi(argv[2]) : 2;
     const uint32_t fps  = (argc > 3) ? std::stoi(argv[3]) : 60;
+    const uint32_t saveInterval = (argc > 4) ? std::stoi(argv[4]) : 60;
+    const uint32_t maxRunAhead = 3;
+    uint32_t runAhead = (argc > 5) ? std::min<uint32_t>(std::stoi(argv[5]), maxRunAhead) : 0;
+    const char* apuLogPath = ((argc > 6) && (std::string(argv[6]) != "-")) ? argv[6] : nullptr;
+    const bool isAudioSync = (argc > 7) && (std::string(argv[7]) == "audio");
 
     const uint32_t offsetX = 0;
     const uint32_t offsetY = 0;
@@ -36,17 +51,31 @@ int main(int argc, char* argv[])
     const uint32_t cpuDataSize    = EmbeddedEmulator_GetCpuDataSize();
     const uint32_t systemDataSize = EmbeddedEmulator_GetSystemDataSize();
     const uint32_t ppuDataSize    = EmbeddedEmulator_GetPpuDataSize();
+    const uint32_t rewindDataSize = EmbeddedEmulator_GetRewindDataSize();
+    const uint32_t rewindHistorySize = 8 * 1024 * 1024;
+    const uint32_t apuDataSize    = EmbeddedEmulator_GetApuDataSize();
+    const uint32_t ringDataSize   = EmbeddedEmulator_GetSampleRingDataSize();
+    const uint32_t logDataSize    = EmbeddedEmulator_GetApuLogRingDataSize();
     std::cout << "INFO: Allocate buffer" << std::endl
               << " - FB     : " << fbDataSize << " bytes" << std::endl
               << " - Cpu    : " << cpuDataSize << " bytes" << std::endl
               << " - System : " << systemDataSize << " bytes" << std::endl
-              << " - Ppu    : " << ppuDataSize << " bytes" << std::endl;
+              << " - Ppu    : " << ppuDataSize << " bytes" << std::endl
+              << " - Rewind : " << rewindDataSize << " + " << rewindHistorySize << " bytes" << std::endl
+              << " - Apu    : " << apuDataSize << " x 2 + " << logDataSize << " + " << ringDataSize << " bytes" << std::endl;
 
-    uint8_t* workBuf   = new uint8_t[fbDataSize + cpuDataSize + systemDataSize + ppuDataSize];
+    uint8_t* workBuf   = new uint8_t[fbDataSize + cpuDataSize + systemDataSize + ppuDataSize + rewindDataSize];
     uint8_t* fbBuf     = &workBuf[0];
     uint8_t* cpuBuf    = &workBuf[fbDataSize];
     uint8_t* systemBuf = &workBuf[fbDataSize + cpuDataSize];
     uint8_t* ppuBuf    = &workBuf[fbDataSize + cpuDataSize + systemDataSize];
+    uint8_t* rewindBuf = &workBuf[fbDataSize + cpuDataSize + systemDataSize + ppuDataSize];
+    uint8_t* rewindHistoryBuf = new uint8_t[rewindHistorySize];
+    // The rings and the render APU are shared with the audio thread, so they are kept apart from the packed workarea
+    uint8_t* apuBuf       = new uint8_t[apuDataSize];
+    uint8_t* renderApuBuf = new uint8_t[apuDataSize];
+    uint8_t* logBuf       = new uint8_t[logDataSize];
+    uint8_t* ringBuf      = new uint8_t[ringDataSize];
 
     // Emulator initialize
     std::cout << "INFO: Init emulator" << std::endl;
@@ -54,12 +83,22 @@ int main(int argc, char* argv[])
     EmbeddedEmulator_InitSystem(systemBuf);
     EmbeddedEmulator_InitPpu(ppuBuf);
     EmbeddedEmulator_SetPpuDrawOption(ppuBuf, screenWidth, screenHeight, offsetX, offsetY, scale, DrawPioxelFormat::RGBA8888);
+    const uint32_t sampleRate = 48000;
+    EmbeddedEmulator_InitApu(apuBuf, sampleRate);
+    EmbeddedEmulator_InitApu(renderApuBuf, sampleRate);
+    EmbeddedEmulator_InitApuLogRing(logBuf);
+    EmbeddedEmulator_InitSampleRing(ringBuf);
 
     // Open rom file
     std::cout << "INFO: Load rom binary '" << romPath << "'" << std::endl;
     std::ifstream ifs(romPath, std::ios::binary | std::ios::in);
     if (!ifs) {
         std::cout << "ERROR: Failed to read '" << romPath << "'" << std::endl;
+        delete[] ringBuf;
+        delete[] logBuf;
+        delete[] renderApuBuf;
+        delete[] apuBuf;
+        delete[] rewindHistoryBuf;
         delete[] workBuf;
         return -1;
     }
@@ -70,6 +109,11 @@ int main(int argc, char* argv[])
     if (!romSize) {
         std::cout << "ERROR: ROM size is zero" << std::endl;
         ifs.close();
+        delete[] ringBuf;
+        delete[] logBuf;
+        delete[] renderApuBuf;
+        delete[] apuBuf;
+        delete[] rewindHistoryBuf;
         delete[] workBuf;
         return -1;
     }
@@ -86,21 +130,179 @@ int main(int argc, char* argv[])
     if (!isLoad) {
         std::cout << "ERROR: failed to parse rom binary" << std::endl;
         delete[] romBuf;
+        delete[] ringBuf;
+        delete[] logBuf;
+        delete[] renderApuBuf;
+        delete[] apuBuf;
+        delete[] rewindHistoryBuf;
         delete[] workBuf;
         return -1;
     }
 
+    // Battery-backed RAM
+    // Restore the previous save, then only write back the pages the game has modified
+    const std::string savePath = std::string(romPath) + ".sav";
+    const uint32_t saveRamSize = EmbeddedEmulator_GetSaveRamSize(systemBuf);
+    std::fstream saveFile;
+    if (saveRamSize > 0) {
+        std::ifstream savIfs(savePath, std::ios::binary | std::ios::in);
+        if (savIfs) {
+            std::cout << "INFO: Restore save RAM '" << savePath << "'" << std::endl;
+            uint8_t* saveBuf = new uint8_t[saveRamSize]();
+            savIfs.read((char*)saveBuf, saveRamSize);
+            EmbeddedEmulator_RestoreSaveRam(systemBuf, saveBuf, savIfs.gcount());
+            savIfs.close();
+            delete[] saveBuf;
+        } else {
+            // Create the whole image once so that pages can be overwritten in place
+            std::cout << "INFO: Create save RAM '" << savePath << "'" << std::endl;
+            std::ofstream savOfs(savePath, std::ios::binary | std::ios::out);
+            uint8_t pageBuf[EMBEDDED_EMULATOR_SAVE_RAM_PAGE_SIZE];
+            for (uint32_t page = 0; page < saveRamSize / EMBEDDED_EMULATOR_SAVE_RAM_PAGE_SIZE; page++) {
+                EmbeddedEmulator_ReadSaveRamPage(systemBuf, page, pageBuf);
+                savOfs.write((const char*)pageBuf, sizeof(pageBuf));
+            }
+            savOfs.close();
+        }
+        saveFile.open(savePath, std::ios::binary | std::ios::in | std::ios::out);
+    }
+    const auto flushSaveRam = [&]() {
+        const uint32_t dirtyPages = EmbeddedEmulator_TakeSaveRamDirtyPages(systemBuf);
+        if (!saveFile || (dirtyPages == 0)) {
+            return;
+        }
+        uint8_t pageBuf[EMBEDDED_EMULATOR_SAVE_RAM_PAGE_SIZE];
+        for (uint32_t page = 0; page < EMBEDDED_EMULATOR_SAVE_RAM_NUM_OF_PAGES; page++) {
+            if ((dirtyPages & (1u << page)) == 0) {
+                continue;
+            }
+            EmbeddedEmulator_ReadSaveRamPage(systemBuf, page, pageBuf);
+            saveFile.seekp(page * EMBEDDED_EMULATOR_SAVE_RAM_PAGE_SIZE);
+            saveFile.write((const char*)pageBuf, sizeof(pageBuf));
+        }
+        saveFile.flush();
+    };
+
     // Reset
     std::cout << "INFO: Reset" << std::endl;
     EmbeddedEmulator_Reset(cpuBuf, systemBuf, ppuBuf);
 
+    // Save state
+    // F5: save to '[rom_path].state', F9: load from it
+    const std::string statePath = std::string(romPath) + ".state";
+    const uint32_t stateSize = EmbeddedEmulator_GetSaveStateSize(systemBuf);
+    std::vector<uint8_t> stateBuf(stateSize);
+    std::cout << "INFO: Save state " << stateSize << " bytes (version " << static_cast<uint32_t>(EMBEDDED_EMULATOR_SAVE_STATE_VERSION) << ")" << std::endl;
+
+    // Rewind
+    // Hold BACKSPACE to rewind. A snapshot is captured every frame with a keyframe every second
+    if (!EmbeddedEmulator_InitRewind(rewindBuf, systemBuf, rewindHistoryBuf, rewindHistorySize, 1, 60)) {
+        std::cout << "WARN: Failed to init rewind" << std::endl;
+    }
+    double captureSec = 0.0;
+    uint32_t captureCount = 0;
+
+    // Run-ahead
+    // The real frame is emulated without drawing, then the frame [run_ahead] frames later is drawn and discarded
+    // The discarded frames still run the emulation-side APU so that frame/DMC IRQs and $4015 follow the real timeline,
+    // their accesses go to a throwaway log and the APU comes back with the state
+    std::vector<uint8_t> runAheadBuf(stateSize);
+    std::vector<uint8_t> runAheadLogBuf(logDataSize);
+    double runAheadMs = 0.0;
+
     // Screen Initialize
     std::cout << "INFO: Init window" << std::endl;
     InitWindow(screenWidth, screenHeight, "rust-nes-emulator-embedded");
-    if (fps > 0) {
+    if ((fps > 0) && !isAudioSync) {
         SetTargetFPS(fps);
     }
 
+    // Audio
+    // The APU output is streamed in chunks, and underruns are padded with silence
+    // The stream holds 2 chunks. Audio sync refills it while waiting for the frame, so the chunk is kept small
+    // to leave room for the sample ring within the latency budget. Otherwise it is refilled only once per frame
+    const uint32_t audioChunkSamples = isAudioSync ? 256 : 1024;
+    InitAudioDevice();
+    SetAudioStreamBufferSizeDefault(audioChunkSamples);
+    AudioStream audioStream = InitAudioStream(sampleRate, 16, 1);
+    PlayAudioStream(audioStream);
+    std::vector<int16_t> audioChunk(audioChunkSamples);
+    uint32_t underrunCount = 0;
+    uint64_t underrunSamples = 0;
+    const auto pumpAudio = [&]() {
+        while (IsAudioStreamProcessed(audioStream)) {
+            const uintptr_t count = EmbeddedEmulator_ReadSamples(ringBuf, audioChunk.data(), audioChunk.size());
+            if (count < audioChunk.size()) {
+                underrunCount++;
+                underrunSamples += audioChunk.size() - count;
+                std::fill(audioChunk.begin() + count, audioChunk.end(), 0);
+            }
+            UpdateAudioStream(audioStream, audioChunk.data(), audioChunk.size());
+        }
+    };
+
+    // Audio sync
+    // The audio device clock drives the emulation. The buffered samples are kept around the target by
+    // a small change of the resampling ratio, and the frame pacing only steps in when the buffer leaves the band
+    // Latency is counted from a sample being written to the ring until it leaves the stream buffers
+    const double framePeriodSec = static_cast<double>(EmbeddedEmulator_GetCpuCyclePerFrame()) / EmbeddedEmulator_GetCpuFreq();
+    const uint32_t frameSamples = static_cast<uint32_t>(sampleRate * framePeriodSec + 0.5);
+    const uint32_t streamSamples = 2 * audioChunkSamples;
+    const double maxLatencyMs = 40.0;
+    // Buffered samples before a frame is emulated. The frame adds frameSamples on top of it
+    const uint32_t maxBufferedSamples = static_cast<uint32_t>(sampleRate * maxLatencyMs / 1000.0) - streamSamples - frameSamples - 1;
+    // A chunk has to be ready when the stream asks, plus a margin for the audio thread to render the last frame
+    const uint32_t minBufferedSamples = audioChunkSamples + audioChunkSamples / 2;
+    const uint32_t targetBufferedSamples = (minBufferedSamples + maxBufferedSamples) / 2;
+    // The error is corrected in about 2 seconds, and the pitch change is kept below 0.5 %
+    const int32_t maxRateAdjustPpm = 5000;
+    const double rateAdjustPpmPerSample = 1e6 / (sampleRate * 2.0);
+    std::atomic<int32_t> rateAdjustPpm { 0 };
+    // Frames pushed to the APU log, and frames the audio thread has rendered into the sample ring
+    uint64_t emittedFrames = 0;
+    std::atomic<uint64_t> renderedFrames { 0 };
+    const auto bufferedSamples = [&]() {
+        return EmbeddedEmulator_GetSampleRingLength(ringBuf) + (emittedFrames - renderedFrames) * frameSamples;
+    };
+    auto frameDeadline = std::chrono::steady_clock::now();
+    double latencySumMs = 0.0;
+    double latencyMaxMs = 0.0;
+    double latencyTotalMaxMs = 0.0;
+    uint32_t latencyCount = 0;
+    uint32_t syncWaitFrames = 0;
+    uint32_t syncCatchUpFrames = 0;
+    if (isAudioSync) {
+        std::cout << "INFO: Audio sync" << std::endl
+                  << " - Buffer : " << minBufferedSamples << " ~ " << maxBufferedSamples << " samples (target " << targetBufferedSamples << ")" << std::endl
+                  << " - Stream : " << streamSamples << " samples" << std::endl
+                  << " - Frame  : " << frameSamples << " samples" << std::endl;
+    }
+
+    // Audio thread
+    // The emulation only records APU register accesses, this thread renders them into the sample ring
+    std::ofstream apuLogFile;
+    if (apuLogPath != nullptr) {
+        apuLogFile.open(apuLogPath, std::ios::binary);
+        std::cout << "INFO: Dump APU log to " << apuLogPath << std::endl;
+    }
+    std::atomic<bool> isAudioRunning { true };
+    bool isApuLogOverflowed = false;
+    std::thread audioThread([&]() {
+        std::vector<uint8_t> logChunk(EMBEDDED_EMULATOR_APU_LOG_RING_SIZE * EMBEDDED_EMULATOR_APU_LOG_ENTRY_BYTES);
+        while (isAudioRunning) {
+            const uintptr_t bytes = EmbeddedEmulator_ReadApuLog(logBuf, logChunk.data(), logChunk.size());
+            if (bytes == 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+            if (apuLogFile.is_open()) {
+                apuLogFile.write(reinterpret_cast<const char*>(logChunk.data()), bytes);
+            }
+            EmbeddedEmulator_SetApuRateAdjust(renderApuBuf, rateAdjustPpm);
+            renderedFrames += EmbeddedEmulator_RenderApuLog(renderApuBuf, logChunk.data(), bytes, ringBuf);
+        }
+    });
+
     // FrameBuffer Image
     Image fbImg = { fbBuf, static_cast<int>(screenWidth), static_cast<int>(screenHeight), 1, UNCOMPRESSED_R8G8B8A8 };
     Texture2D fbTexture = LoadTextureFromImage(fbImg);
@@ -119,9 +321,8 @@ int main(int argc, char* argv[])
 
     // Main game loop
     // Since there are keystrokes, the main thread should be the CPU thread.
-    const uint32_t cyclePerFrame = EmbeddedEmulator_GetCpuCyclePerFrame();
     std::cout << "INFO: Start emulation" << std::endl;
-    while (!WindowShouldClose())
+    for (uint32_t frameCount = 1; !WindowShouldClose(); frameCount++)
     {
         // Input
         for (const auto& [key, value]: keyMaps) {
@@ -135,19 +336,117 @@ int main(int argc, char* argv[])
         if (IsKeyReleased(KEY_R)) {
             std::cout << "INFO: Reset" << std::endl;
             EmbeddedEmulator_Reset(cpuBuf, systemBuf, ppuBuf);
+            // The audio thread's APU is reset through the log at the next frame
+            EmbeddedEmulator_InitApu(apuBuf, sampleRate);
+        }
+        if (IsKeyReleased(KEY_F5)) {
+            const uintptr_t writeSize = EmbeddedEmulator_SaveState(cpuBuf, systemBuf, ppuBuf, apuBuf, stateBuf.data(), stateBuf.size());
+            std::ofstream stateOfs(statePath, std::ios::binary | std::ios::out);
+            stateOfs.write((const char*)stateBuf.data(), writeSize);
+            std::cout << "INFO: Save state '" << statePath << "' " << writeSize << " bytes" << std::endl;
+        }
+        if (IsKeyReleased(KEY_F9)) {
+            std::ifstream stateIfs(statePath, std::ios::binary | std::ios::in);
+            stateIfs.read((char*)stateBuf.data(), stateBuf.size());
+            if (EmbeddedEmulator_LoadState(cpuBuf, systemBuf, ppuBuf, apuBuf, stateBuf.data(), stateIfs.gcount())) {
+                std::cout << "INFO: Load state '" << statePath << "'" << std::endl;
+            } else {
+                std::cout << "WARN: Failed to load state '" << statePath << "'" << std::endl;
+            }
+        }
+        if (IsKeyReleased(KEY_F2)) {
+            runAhead = (runAhead + 1) % (maxRunAhead + 1);
+            std::cout << "INFO: Run-ahead " << runAhead << " frames" << std::endl;
+        }
+
+        // Rewind 2 frames and emulate 1 frame to redraw the screen
+        const bool isRewinding = IsKeyDown(KEY_BACKSPACE);
+        if (isRewinding) {
+            EmbeddedEmulator_Rewind(rewindBuf, cpuBuf, systemBuf, ppuBuf, apuBuf, 2);
         }
 
-        // Emulate cpu/ppu
-        for(uint32_t cycleSum = 0; cycleSum < cyclePerFrame; ) {
-            // emulate cpu
-            const uint32_t cyc = EmbeddedEmulator_EmulateCpu(cpuBuf, systemBuf);
-            cycleSum += cyc;
-            // emulate ppu
-            const CpuInterrupt irq = EmbeddedEmulator_EmulatePpu(ppuBuf, systemBuf, fbBuf, cyc);
-            // Interrupt from ppu
-            if (irq != CpuInterrupt::NONE) {
-                EmbeddedEmulator_InterruptCpu(cpuBuf, systemBuf, irq);
+        // Pace the frame with the audio output
+        if (isAudioSync) {
+            pumpAudio();
+            bool isCaughtUp = false;
+            bool isWaited = false;
+            while (true) {
+                const uint64_t buffered = bufferedSamples();
+                if (buffered < minBufferedSamples) {
+                    // About to run dry, emulate right away
+                    isCaughtUp = true;
+                    break;
+                }
+                const bool isEarly = std::chrono::steady_clock::now() < frameDeadline;
+                if (!isEarly && (buffered <= maxBufferedSamples)) {
+                    break;
+                }
+                // Past the deadline but too much latency, hold the frame back until the device catches up
+                isWaited = isWaited || !isEarly;
+                std::this_thread::sleep_for(std::chrono::microseconds(500));
+                pumpAudio();
+            }
+            // Restart the pacing from here when the buffer has left the band
+            if (isCaughtUp || isWaited) {
+                syncCatchUpFrames += isCaughtUp ? 1 : 0;
+                syncWaitFrames += isWaited ? 1 : 0;
+                frameDeadline = std::chrono::steady_clock::now();
+            }
+            frameDeadline += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(framePeriodSec));
+
+            const uint64_t buffered = bufferedSamples();
+            const double ppm = (static_cast<double>(buffered) - targetBufferedSamples) * rateAdjustPpmPerSample;
+            rateAdjustPpm = std::clamp(static_cast<int32_t>(ppm), -maxRateAdjustPpm, maxRateAdjustPpm);
+            const double latencyMs = (buffered + frameSamples + streamSamples) * 1000.0 / sampleRate;
+            latencySumMs += latencyMs;
+            latencyMaxMs = std::max(latencyMaxMs, latencyMs);
+            latencyTotalMaxMs = std::max(latencyTotalMaxMs, latencyMs);
+            latencyCount++;
+        }
+
+        // Emulate cpu/ppu/apu
+        // Only the real frame records APU accesses
+        // A dropped access desyncs the rendering APU, which only happens if the audio thread stalls for many frames
+        const bool isApuLogKept = EmbeddedEmulator_ApuLogEmulateFrame(apuBuf, logBuf, cpuBuf, systemBuf, ppuBuf, (runAhead == 0) ? fbBuf : nullptr);
+        if (!isApuLogKept && !isApuLogOverflowed) {
+            std::cout << "WARN: APU log overflowed, audio may be out of sync" << std::endl;
+            isApuLogOverflowed = true;
+        }
+        if (runAhead > 0) {
+            // Snapshot the real frame, draw the future frame, then go back
+            const double runAheadStart = GetTime();
+            EmbeddedEmulator_SaveState(cpuBuf, systemBuf, ppuBuf, apuBuf, runAheadBuf.data(), runAheadBuf.size());
+            for (uint32_t i = 0; i < runAhead; i++) {
+                EmbeddedEmulator_InitApuLogRing(runAheadLogBuf.data());
+                EmbeddedEmulator_ApuLogEmulateFrame(apuBuf, runAheadLogBuf.data(), cpuBuf, systemBuf, ppuBuf, (i == runAhead - 1) ? fbBuf : nullptr);
             }
+            EmbeddedEmulator_LoadState(cpuBuf, systemBuf, ppuBuf, apuBuf, runAheadBuf.data(), runAheadBuf.size());
+            runAheadMs = (GetTime() - runAheadStart) * 1000.0;
+        }
+
+        emittedFrames++;
+
+        // Audio
+        pumpAudio();
+        if (isAudioSync && (latencyCount >= 300)) {
+            std::cout << "INFO: Audio sync latency " << (latencySumMs / latencyCount) << " ms (max " << latencyMaxMs << " ms), "
+                      << "underrun " << underrunCount << ", rate adjust " << rateAdjustPpm << " ppm, "
+                      << "wait " << syncWaitFrames << ", catch up " << syncCatchUpFrames << " frames" << std::endl;
+            latencySumMs = 0.0;
+            latencyMaxMs = 0.0;
+            latencyCount = 0;
+        }
+
+        // Record history for rewind
+        const double captureStart = GetTime();
+        if (EmbeddedEmulator_CaptureRewind(rewindBuf, cpuBuf, systemBuf, ppuBuf, apuBuf)) {
+            captureSec += GetTime() - captureStart;
+            captureCount++;
+        }
+
+        // Write back battery-backed RAM
+        if ((saveInterval > 0) && ((frameCount % saveInterval) == 0)) {
+            flushSaveRam();
         }
 
         // Draw
@@ -161,15 +460,46 @@ int main(int argc, char* argv[])
             DrawTextureEx(fbTexture, Vector2{ 0, 0 }, 0, 1, WHITE);
 
             DrawFPS(10, 10);
+            if (isRewinding) {
+                DrawText(TextFormat("REWIND %u", EmbeddedEmulator_GetRewindFrames(rewindBuf)), 10, 30, 20, YELLOW);
+            }
+            if (runAhead > 0) {
+                DrawText(TextFormat("RUN-AHEAD %u: %.2f ms", runAhead, runAheadMs), 10, 50, 20, GREEN);
+            }
+            if (isAudioSync) {
+                DrawText(TextFormat("AUDIO %.1f ms %+d ppm", (bufferedSamples() + streamSamples) * 1000.0 / sampleRate, rateAdjustPpm.load()), 10, 70, 20, SKYBLUE);
+            }
         }
         EndDrawing();
     }
 
     // Finalize
     std::cout << "INFO: Finalize" << std::endl;
+    if (captureCount > 0) {
+        std::cout << "INFO: Rewind capture " << (captureSec * 1e6 / captureCount) << " us/frame" << std::endl;
+    }
+    isAudioRunning = false;
+    audioThread.join();
+    apuLogFile.close();
+    std::cout << "INFO: APU log dropped " << EmbeddedEmulator_GetApuLogDropped(logBuf) << " accesses, "
+              << "sample ring dropped " << EmbeddedEmulator_GetSampleRingDropped(ringBuf) << " samples" << std::endl
+              << "INFO: Audio underrun " << underrunCount << " times, " << underrunSamples << " samples" << std::endl;
+    if (isAudioSync) {
+        std::cout << "INFO: Audio sync max latency " << latencyTotalMaxMs << " ms, "
+                  << "wait " << syncWaitFrames << ", catch up " << syncCatchUpFrames << " frames" << std::endl;
+    }
+    flushSaveRam();
+    saveFile.close();
     UnloadTexture(fbTexture);
+    CloseAudioStream(audioStream);
+    CloseAudioDevice();
     CloseWindow();
     delete[] romBuf;
+    delete[] ringBuf;
+    delete[] logBuf;
+    delete[] renderApuBuf;
+    delete[] apuBuf;
+    delete[] rewindHistoryBuf;
     delete[] workBuf;
 
     std::cout << "INFO: Exit" << std::endl;
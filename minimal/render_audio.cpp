@@ -0,0 +1,255 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+#include <cstdlib>
+
+#include "rust_nes_emulator.h"
+
+// Headless audio renderer (no raylib, no pixel rendering)
+// Runs a .nes ROM, an NSF, or an APU log dumped by the game (apu_log_path) as fast as possible
+// and writes the APU output to a 16bit mono WAV file
+
+enum class InputKind {
+    Rom,
+    Nsf,
+    ApuLog,
+};
+
+static InputKind detectInputKind(const std::vector<uint8_t>& buf)
+{
+    if ((buf.size() >= 4) && (std::memcmp(buf.data(), "NES\x1a", 4) == 0)) {
+        return InputKind::Rom;
+    }
+    if ((buf.size() >= 5) && (std::memcmp(buf.data(), "NESM\x1a", 5) == 0)) {
+        return InputKind::Nsf;
+    }
+    return InputKind::ApuLog;
+}
+
+static void writeLe(std::ofstream& ofs, uint32_t value, uint32_t bytes)
+{
+    for (uint32_t i = 0; i < bytes; i++) {
+        ofs.put(static_cast<char>((value >> (8 * i)) & 0xff));
+    }
+}
+
+static bool writeWav(const char* path, const std::vector<int16_t>& samples, uint32_t sampleRate)
+{
+    std::ofstream ofs(path, std::ios::binary | std::ios::out);
+    if (!ofs) {
+        return false;
+    }
+    const uint32_t dataBytes = static_cast<uint32_t>(samples.size() * sizeof(int16_t));
+    ofs.write("RIFF", 4);
+    writeLe(ofs, 36 + dataBytes, 4);
+    ofs.write("WAVE", 4);
+    ofs.write("fmt ", 4);
+    writeLe(ofs, 16, 4);             // fmt chunk size
+    writeLe(ofs, 1, 2);              // PCM
+    writeLe(ofs, 1, 2);              // mono
+    writeLe(ofs, sampleRate, 4);
+    writeLe(ofs, sampleRate * 2, 4); // byte rate
+    writeLe(ofs, 2, 2);              // block align
+    writeLe(ofs, 16, 2);             // bits per sample
+    ofs.write("data", 4);
+    writeLe(ofs, dataBytes, 4);
+    for (const int16_t sample: samples) {
+        writeLe(ofs, static_cast<uint16_t>(sample), 2);
+    }
+    return static_cast<bool>(ofs);
+}
+
+// FNV-1a over the samples, to compare renders without keeping the WAV files
+static uint64_t fingerprint(const std::vector<int16_t>& samples)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (const int16_t sample: samples) {
+        for (uint32_t i = 0; i < 2; i++) {
+            hash ^= (static_cast<uint16_t>(sample) >> (8 * i)) & 0xff;
+            hash *= 0x100000001b3ull;
+        }
+    }
+    return hash;
+}
+
+int main(int argc, char* argv[])
+{
+    // parse command line args
+    if (argc < 3) {
+        std::cout << "render_audio [input_path] [wav_path] [seconds*] [song*] [sample_rate*] [stem_prefix*]" << std::endl
+                  << " - input_path: .nes ROM, .nsf, or APU log dumped by the game (required)" << std::endl
+                  << " - wav_path: output 16bit mono WAV file path (required)" << std::endl
+                  << " - seconds: length to render. APU logs stop at the end of the log. (default 60)" << std::endl
+                  << " - song: NSF song number. If 0 is specified, use the starting song. (default 0)" << std::endl
+                  << " - sample_rate: output sampling rate. (default 48000)" << std::endl
+                  << " - stem_prefix: if specified, also write each channel to [stem_prefix]_[channel].wav (default none)" << std::endl;
+        return 0;
+    }
+    const char* inputPath  = argv[1];
+    const char* wavPath    = argv[2];
+    const double seconds   = (argc > 3) ? std::stod(argv[3]) : 60.0;
+    const uint32_t songArg = (argc > 4) ? std::stoi(argv[4]) : 0;
+    const uint32_t sampleRate = (argc > 5) ? std::stoi(argv[5]) : 48000;
+    const char* stemPrefix    = (argc > 6) ? argv[6] : nullptr;
+
+    // Read input
+    std::ifstream ifs(inputPath, std::ios::binary | std::ios::in);
+    if (!ifs) {
+        std::cout << "ERROR: Failed to read '" << inputPath << "'" << std::endl;
+        return -1;
+    }
+    const std::vector<uint8_t> inputBuf((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    ifs.close();
+    if (inputBuf.empty()) {
+        std::cout << "ERROR: Input size is zero" << std::endl;
+        return -1;
+    }
+    const InputKind inputKind = detectInputKind(inputBuf);
+
+    // Allocate workarea
+    std::vector<uint8_t> cpuBuf(EmbeddedEmulator_GetCpuDataSize());
+    std::vector<uint8_t> systemBuf(EmbeddedEmulator_GetSystemDataSize());
+    std::vector<uint8_t> ppuBuf(EmbeddedEmulator_GetPpuDataSize());
+    std::vector<uint8_t> idleBuf(EmbeddedEmulator_GetIdleSkipDataSize());
+    std::vector<uint8_t> nsfBuf(EmbeddedEmulator_GetNsfDataSize());
+    std::vector<uint8_t> apuBuf(EmbeddedEmulator_GetApuDataSize());
+    std::vector<uint8_t> ringBuf(EmbeddedEmulator_GetSampleRingDataSize());
+    std::vector<uint8_t> tapBuf(EmbeddedEmulator_GetApuChannelTapDataSize());
+    EmbeddedEmulator_InitCpu(cpuBuf.data());
+    EmbeddedEmulator_InitSystem(systemBuf.data());
+    EmbeddedEmulator_InitPpu(ppuBuf.data());
+    EmbeddedEmulator_InitSampleRing(ringBuf.data());
+    if (!EmbeddedEmulator_InitApu(apuBuf.data(), sampleRate)) {
+        std::cout << "ERROR: Unsupported sample rate " << sampleRate << " Hz" << std::endl;
+        return -1;
+    }
+    // Channel taps are written in the same synthesis pass, attach before anything is synthesized to stay sample aligned
+    if (stemPrefix != nullptr) {
+        EmbeddedEmulator_InitApuChannelTap(tapBuf.data(), sampleRate);
+        EmbeddedEmulator_AttachApuChannelTap(apuBuf.data(), tapBuf.data());
+    }
+
+    // Prepare the input
+    const uint64_t maxSamples = static_cast<uint64_t>(seconds * sampleRate);
+    std::vector<int16_t> samples;
+    samples.reserve(maxSamples + EMBEDDED_EMULATOR_SAMPLE_RING_SIZE);
+    std::vector<int16_t> chunk(EMBEDDED_EMULATOR_SAMPLE_RING_SIZE);
+    const ApuTapChannel stemChannels[EMBEDDED_EMULATOR_APU_CHANNEL_NUM] = {
+        ApuTapChannel::Pulse1, ApuTapChannel::Pulse2, ApuTapChannel::Triangle, ApuTapChannel::Noise, ApuTapChannel::Dmc,
+    };
+    const char* stemNames[EMBEDDED_EMULATOR_APU_CHANNEL_NUM] = { "pulse1", "pulse2", "triangle", "noise", "dmc" };
+    std::vector<int16_t> stems[EMBEDDED_EMULATOR_APU_CHANNEL_NUM];
+    const auto drainRing = [&]() {
+        const uintptr_t count = EmbeddedEmulator_ReadSamples(ringBuf.data(), chunk.data(), chunk.size());
+        samples.insert(samples.end(), chunk.begin(), chunk.begin() + count);
+        for (uint32_t ch = 0; (stemPrefix != nullptr) && (ch < EMBEDDED_EMULATOR_APU_CHANNEL_NUM); ch++) {
+            const uintptr_t stemCount = EmbeddedEmulator_ReadApuChannelSamples(tapBuf.data(), stemChannels[ch], chunk.data(), chunk.size());
+            stems[ch].insert(stems[ch].end(), chunk.begin(), chunk.begin() + stemCount);
+        }
+    };
+    switch (inputKind) {
+    case InputKind::Rom:
+        std::cout << "INFO: Render ROM '" << inputPath << "'" << std::endl;
+        if (!EmbeddedEmulator_LoadRom(systemBuf.data(), inputBuf.data())) {
+            std::cout << "ERROR: failed to parse rom binary" << std::endl;
+            return -1;
+        }
+        EmbeddedEmulator_Reset(cpuBuf.data(), systemBuf.data(), ppuBuf.data());
+        EmbeddedEmulator_InitIdleSkip(idleBuf.data());
+        break;
+    case InputKind::Nsf: {
+        if (!EmbeddedEmulator_LoadNsf(nsfBuf.data(), systemBuf.data(), inputBuf.data(), inputBuf.size())) {
+            std::cout << "ERROR: failed to parse nsf binary (bank switching is not supported)" << std::endl;
+            return -1;
+        }
+        const uint32_t totalSongs = EmbeddedEmulator_GetNsfTotalSongs(nsfBuf.data());
+        const uint32_t song = (songArg > 0) ? songArg : EmbeddedEmulator_GetNsfStartingSong(nsfBuf.data());
+        std::cout << "INFO: Render NSF '" << inputPath << "' song " << song << "/" << totalSongs << std::endl;
+        if (!EmbeddedEmulator_InitNsfSong(nsfBuf.data(), apuBuf.data(), ringBuf.data(), cpuBuf.data(), systemBuf.data(), song)) {
+            std::cout << "ERROR: song " << song << " is out of range" << std::endl;
+            return -1;
+        }
+        drainRing();
+        break;
+    }
+    case InputKind::ApuLog:
+        std::cout << "INFO: Render APU log '" << inputPath << "' "
+                  << (inputBuf.size() / EMBEDDED_EMULATOR_APU_LOG_ENTRY_BYTES) << " accesses" << std::endl;
+        break;
+    }
+
+    // Render
+    // Drain the ring every frame, one frame is far shorter than the ring
+    const auto renderStart = std::chrono::steady_clock::now();
+    uint64_t numOfFrames = 0;
+    uintptr_t logPos = 0;
+    while (samples.size() < maxSamples) {
+        if (inputKind == InputKind::Rom) {
+            // The no-render path, only CPU/PPU timing and the APU are emulated. Idle loops are fast-forwarded
+            EmbeddedEmulator_IdleSkipApuEmulateFrame(idleBuf.data(), apuBuf.data(), ringBuf.data(), cpuBuf.data(), systemBuf.data(), ppuBuf.data(), nullptr);
+        } else if (inputKind == InputKind::Nsf) {
+            EmbeddedEmulator_NsfEmulateFrame(nsfBuf.data(), apuBuf.data(), ringBuf.data(), cpuBuf.data(), systemBuf.data());
+        } else {
+            // Replay up to the next frame boundary
+            if (logPos + EMBEDDED_EMULATOR_APU_LOG_ENTRY_BYTES > inputBuf.size()) {
+                break;
+            }
+            while ((logPos + EMBEDDED_EMULATOR_APU_LOG_ENTRY_BYTES <= inputBuf.size())
+                && (EmbeddedEmulator_RenderApuLog(apuBuf.data(), &inputBuf[logPos], EMBEDDED_EMULATOR_APU_LOG_ENTRY_BYTES, ringBuf.data()) == 0)) {
+                logPos += EMBEDDED_EMULATOR_APU_LOG_ENTRY_BYTES;
+            }
+            logPos += EMBEDDED_EMULATOR_APU_LOG_ENTRY_BYTES;
+        }
+        drainRing();
+        numOfFrames++;
+    }
+    const double renderSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - renderStart).count();
+    samples.resize(std::min<uint64_t>(samples.size(), maxSamples));
+
+    // Write
+    if (!writeWav(wavPath, samples, sampleRate)) {
+        std::cout << "ERROR: Failed to write '" << wavPath << "'" << std::endl;
+        return -1;
+    }
+    for (uint32_t ch = 0; (stemPrefix != nullptr) && (ch < EMBEDDED_EMULATOR_APU_CHANNEL_NUM); ch++) {
+        stems[ch].resize(std::min<uint64_t>(stems[ch].size(), maxSamples));
+        const std::string stemPath = std::string(stemPrefix) + "_" + stemNames[ch] + ".wav";
+        if (!writeWav(stemPath.c_str(), stems[ch], sampleRate)) {
+            std::cout << "ERROR: Failed to write '" << stemPath << "'" << std::endl;
+            return -1;
+        }
+    }
+    const double audioSec = static_cast<double>(samples.size()) / sampleRate;
+    int32_t peak = 0;
+    for (const int16_t sample: samples) {
+        peak = std::max(peak, std::abs(static_cast<int32_t>(sample)));
+    }
+    std::cout << "INFO: Result" << std::endl
+              << " - Output  : '" << wavPath << "' " << samples.size() << " samples (" << audioSec << " sec, " << sampleRate << " Hz)" << std::endl
+              << " - Frames  : " << numOfFrames << std::endl
+              << " - Elapsed : " << renderSec << " sec" << std::endl
+              << " - Speed   : " << (samples.size() / renderSec) << " samples/sec (" << (audioSec / renderSec) << "x realtime)" << std::endl
+              << " - Peak    : " << peak << std::endl
+              << " - Hash    : " << std::hex << fingerprint(samples) << std::dec << std::endl;
+    if (inputKind == InputKind::Rom) {
+        EmbeddedEmulatorIdleSkipStats idleStats;
+        EmbeddedEmulator_GetIdleSkipStats(idleBuf.data(), &idleStats);
+        const double totalCycles = static_cast<double>(numOfFrames) * EmbeddedEmulator_GetCpuCyclePerFrame();
+        std::cout << " - Idle    : " << (100.0 * idleStats.skipped_cycles / std::max(1.0, totalCycles)) << " % of cycles skipped" << std::endl;
+    }
+    for (uint32_t ch = 0; (stemPrefix != nullptr) && (ch < EMBEDDED_EMULATOR_APU_CHANNEL_NUM); ch++) {
+        int32_t stemPeak = 0;
+        for (const int16_t sample: stems[ch]) {
+            stemPeak = std::max(stemPeak, std::abs(static_cast<int32_t>(sample)));
+        }
+        std::cout << " - Stem    : '" << stemPrefix << "_" << stemNames[ch] << ".wav' " << stems[ch].size() << " samples, peak " << stemPeak << std::endl;
+    }
+    std::cout << "INFO: Exit" << std::endl;
+    return 0;
+}
@@ -18,10 +18,33 @@ pub extern "C" fn rust_eh_personality() {}
 extern crate rust_nes_emulator;
 use rust_nes_emulator::prelude::*;
 
+/// `make aot`でexamples/nes_aot.rsが生成したAOTコンパイル結果
+#[cfg(feature = "aot")]
+#[path = "aot_generated.rs"]
+mod aot_generated;
+
 pub const EMBEDDED_EMULATOR_NUM_OF_COLOR: usize = 4;
 pub const EMBEDDED_EMULATOR_VISIBLE_SCREEN_WIDTH: usize = 256;
 pub const EMBEDDED_EMULATOR_VISIBLE_SCREEN_HEIGHT: usize = 240;
 
+pub const EMBEDDED_EMULATOR_WRAM_SIZE: usize = 2048;
+
+pub const EMBEDDED_EMULATOR_LOCKSTEP_MAX_LANES: usize = 16;
+
+pub const EMBEDDED_EMULATOR_SAVE_RAM_PAGE_SIZE: usize = 256;
+pub const EMBEDDED_EMULATOR_SAVE_RAM_NUM_OF_PAGES: u32 = 32;
+
+pub const EMBEDDED_EMULATOR_SAVE_STATE_VERSION: u8 = 5;
+
+pub const EMBEDDED_EMULATOR_SAMPLE_RING_SIZE: usize = 4096;
+pub const EMBEDDED_EMULATOR_APU_MAX_SAMPLE_RATE: u32 = 96000;
+pub const EMBEDDED_EMULATOR_APU_LOG_RING_SIZE: usize = 32768;
+pub const EMBEDDED_EMULATOR_APU_LOG_ENTRY_BYTES: usize = 6;
+pub const EMBEDDED_EMULATOR_APU_MIXER_OUTPUT_MAX: i16 = 32767;
+pub const EMBEDDED_EMULATOR_APU_MIXER_FRAC_BITS: u32 = 16;
+pub const EMBEDDED_EMULATOR_APU_MAX_RATE_ADJUST_PPM: i32 = 50000;
+pub const EMBEDDED_EMULATOR_APU_CHANNEL_NUM: usize = 5;
+
 pub const EMBEDDED_EMULATOR_PLAYER_0: u32 = 0;
 pub const EMBEDDED_EMULATOR_PLAYER_1: u32 = 1;
 
@@ -54,6 +77,16 @@ pub enum CpuInterrupt {
     NONE,
 }
 
+#[repr(u8)]
+pub enum StorageProfile {
+    /// NROM専用 PRG-ROM/CHR-ROMをSystem内に展開する
+    Nrom,
+    /// Mapper対応を見込んだ大容量構成
+    Mapper,
+    /// ROMをコピーせずLoadRomに渡したバッファを参照する
+    RomInPlace,
+}
+
 #[repr(u8)]
 pub enum DrawPioxelFormat {
     RGBA8888,
@@ -61,6 +94,86 @@ pub enum DrawPioxelFormat {
     ARGB8888,
 }
 
+#[repr(u8)]
+pub enum ObservationSamplingMode {
+    /// 出力pixelの左上に相当するdotを使う
+    Nearest,
+    /// 出力pixelに含まれるdotを平均する
+    Area,
+}
+
+#[repr(u8)]
+pub enum ApuResamplerKernel {
+    /// 固定小数点の整数演算のみ
+    Scalar,
+    /// x86-64のSSE2
+    Sse2,
+    /// x86-64のAVX2
+    Avx2,
+}
+
+#[repr(u8)]
+pub enum ApuTapChannel {
+    Pulse1,
+    Pulse2,
+    Triangle,
+    Noise,
+    Dmc,
+}
+
+impl ApuTapChannel {
+    fn to_channel(self) -> ApuChannel {
+        match self {
+            ApuTapChannel::Pulse1 => ApuChannel::Pulse1,
+            ApuTapChannel::Pulse2 => ApuChannel::Pulse2,
+            ApuTapChannel::Triangle => ApuChannel::Triangle,
+            ApuTapChannel::Noise => ApuChannel::Noise,
+            ApuTapChannel::Dmc => ApuChannel::Dmc,
+        }
+    }
+}
+
+/// BatchStepに渡すエミュレータ1台分の領域
+/// 各領域はInitCpu/InitSystem/InitPpuで初期化済みのものを指定してください
+#[repr(C)]
+pub struct EmbeddedEmulatorInstance {
+    pub cpu: *mut u8,
+    pub system: *mut u8,
+    pub ppu: *mut u8,
+    /// $4015の値とIRQのために状態を追うAPU。InitApuで初期化済みのもの。nullならAPUを使わない
+    pub apu: *mut u8,
+}
+
+/// ビルド時に選択したStorage Profile
+/// features: profile-nrom(default), profile-mapper, profile-rom-in-place のいずれか1つ
+#[cfg(any(
+    all(feature = "profile-nrom", feature = "profile-mapper"),
+    all(feature = "profile-nrom", feature = "profile-rom-in-place"),
+    all(feature = "profile-mapper", feature = "profile-rom-in-place"),
+))]
+compile_error!("Enable only one of profile-nrom, profile-mapper and profile-rom-in-place (use --no-default-features)");
+#[cfg(not(any(
+    feature = "profile-nrom",
+    feature = "profile-mapper",
+    feature = "profile-rom-in-place",
+)))]
+compile_error!("Enable one of profile-nrom, profile-mapper and profile-rom-in-place");
+
+#[cfg(feature = "profile-rom-in-place")]
+type EmulatorStorage = RomInPlaceStorage;
+#[cfg(all(feature = "profile-mapper", not(feature = "profile-rom-in-place")))]
+type EmulatorStorage = MapperStorage;
+#[cfg(not(any(feature = "profile-mapper", feature = "profile-rom-in-place")))]
+type EmulatorStorage = NromStorage;
+type EmulatorSystem = System<EmulatorStorage>;
+
+#[cfg(feature = "profile-rom-in-place")]
+const EMULATOR_STORAGE_PROFILE: StorageProfile = StorageProfile::RomInPlace;
+#[cfg(all(feature = "profile-mapper", not(feature = "profile-rom-in-place")))]
+const EMULATOR_STORAGE_PROFILE: StorageProfile = StorageProfile::Mapper;
+#[cfg(not(any(feature = "profile-mapper", feature = "profile-rom-in-place")))]
+const EMULATOR_STORAGE_PROFILE: StorageProfile = StorageProfile::Nrom;
+
 /// 配列への参照を任意の型への参照に変換します
 /// `raw_ref` - 参照先。 ARM向けを考慮すると、4byte alignした位置に配置されていることが望ましい
 unsafe fn convert_ref<T>(raw_ref: &mut u8) -> &mut T {
@@ -74,6 +187,12 @@ unsafe fn init_struct_ref<T: Default>(raw_ref: &mut u8) {
     *data_ref = T::default();
 }
 
+/// CPUのクロック周波数を返します
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_GetCpuFreq() -> u32 {
+    CPU_FREQ
+}
+
 /// 画面全体を描画するのに必要なCPU Cylceを返します
 #[no_mangle]
 pub unsafe extern "C" fn EmbeddedEmulator_GetCpuCyclePerFrame() -> usize {
@@ -86,6 +205,12 @@ pub unsafe extern "C" fn EmbeddedEmulator_GetCpuCyclePerLine() -> usize {
     CPU_CYCLE_PER_LINE
 }
 
+/// ビルド時に選択したStorage Profileを返します
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_GetStorageProfile() -> StorageProfile {
+    EMULATOR_STORAGE_PROFILE
+}
+
 /// Cpuのデータ構造に必要なサイズを返します
 #[no_mangle]
 pub unsafe extern "C" fn EmbeddedEmulator_GetCpuDataSize() -> usize {
@@ -93,9 +218,10 @@ pub unsafe extern "C" fn EmbeddedEmulator_GetCpuDataSize() -> usize {
 }
 
 /// SubSystemのデータ構造に必要なサイズを返します
+/// Storage Profileによってサイズが変わります
 #[no_mangle]
 pub unsafe extern "C" fn EmbeddedEmulator_GetSystemDataSize() -> usize {
-    mem::size_of::<System>()
+    mem::size_of::<EmulatorSystem>()
 }
 
 /// Ppuのデータ構造に必要なサイズを返します
@@ -104,6 +230,81 @@ pub unsafe extern "C" fn EmbeddedEmulator_GetPpuDataSize() -> usize {
     mem::size_of::<Ppu>()
 }
 
+/// APUのデータ構造に必要なサイズを返します
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_GetApuDataSize() -> usize {
+    mem::size_of::<Apu>()
+}
+
+/// APUの出力を受け渡すリングバッファに必要なサイズを返します
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_GetSampleRingDataSize() -> usize {
+    mem::size_of::<SampleRing>()
+}
+
+/// APUレジスタへのアクセスの記録を受け渡すリングバッファに必要なサイズを返します
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_GetApuLogRingDataSize() -> usize {
+    mem::size_of::<ApuLogRing>()
+}
+
+/// サンプリング周波数変換に必要なサイズを返します
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_GetApuResamplerDataSize() -> usize {
+    mem::size_of::<Resampler>()
+}
+
+/// APUのチャンネルごとの出力に必要なサイズを返します
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_GetApuChannelTapDataSize() -> usize {
+    mem::size_of::<ApuChannelTap>()
+}
+
+/// NSFの再生に必要なサイズを返します
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_GetNsfDataSize() -> usize {
+    mem::size_of::<Nsf>()
+}
+
+/// Rewindの管理データ構造に必要なサイズを返します
+/// 履歴自体はInitRewindに渡すバッファに置かれます
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_GetRewindDataSize() -> usize {
+    mem::size_of::<Rewind>()
+}
+
+/// Lockstep実行の管理データ構造に必要なサイズを返します
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_GetLockstepDataSize() -> usize {
+    mem::size_of::<LockstepCpu>()
+}
+
+/// 命令融合の管理データ構造に必要なサイズを返します
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_GetFusionDataSize() -> usize {
+    mem::size_of::<Fusion>()
+}
+
+/// 待ちループ早送りの管理データ構造に必要なサイズを返します
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_GetIdleSkipDataSize() -> usize {
+    mem::size_of::<IdleSkip>()
+}
+
+/// JITの管理データ構造に必要なサイズを返します
+/// 翻訳したコードはInitJitに渡すバッファに置かれます。jit featureを有効にしていない場合は0
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_GetJitDataSize() -> usize {
+    #[cfg(all(feature = "jit", target_arch = "x86_64"))]
+    {
+        mem::size_of::<Jit>()
+    }
+    #[cfg(not(all(feature = "jit", target_arch = "x86_64")))]
+    {
+        0
+    }
+}
+
 /// Cpuの構造体を初期化します
 #[no_mangle]
 pub unsafe extern "C" fn EmbeddedEmulator_InitCpu(raw_ref: &mut u8) {
@@ -113,7 +314,7 @@ pub unsafe extern "C" fn EmbeddedEmulator_InitCpu(raw_ref: &mut u8) {
 /// Systemの構造体を初期化します
 #[no_mangle]
 pub unsafe extern "C" fn EmbeddedEmulator_InitSystem(raw_ref: &mut u8) {
-    init_struct_ref::<System>(raw_ref);
+    init_struct_ref::<EmulatorSystem>(raw_ref);
 }
 
 /// Ppuの構造体を初期化します
@@ -122,6 +323,59 @@ pub unsafe extern "C" fn EmbeddedEmulator_InitPpu(raw_ref: &mut u8) {
     init_struct_ref::<Ppu>(raw_ref);
 }
 
+/// APUを初期化します
+/// `sample_rate` - 出力のサンプリング周波数。 1 ~ EMBEDDED_EMULATOR_APU_MAX_SAMPLE_RATE
+/// ret: 対応していないサンプリング周波数ならfalse
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_InitApu(raw_ref: &mut u8, sample_rate: u32) -> bool {
+    init_struct_ref::<Apu>(raw_ref);
+    convert_ref::<Apu>(raw_ref).init(sample_rate)
+}
+
+/// APUの出力を受け渡すリングバッファを初期化します
+/// 16bit signed monoのサンプルが入ります
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_InitSampleRing(raw_ref: &mut u8) {
+    init_struct_ref::<SampleRing>(raw_ref);
+}
+
+/// APUのチャンネルごとの出力を初期化します。チャンネルごとに16bit signed monoのリングバッファを持ちます
+/// `sample_rate` - 取り付けるAPUのInitApuと同じ値
+/// ret: 対応していないサンプリング周波数ならfalse
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_InitApuChannelTap(
+    raw_ref: &mut u8,
+    sample_rate: u32,
+) -> bool {
+    init_struct_ref::<ApuChannelTap>(raw_ref);
+    convert_ref::<ApuChannelTap>(raw_ref).init(sample_rate)
+}
+
+/// APUレジスタへのアクセスの記録を受け渡すリングバッファを初期化します
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_InitApuLogRing(raw_ref: &mut u8) {
+    init_struct_ref::<ApuLogRing>(raw_ref);
+}
+
+/// サンプリング周波数変換を初期化します。APUは内部に持っているので、それ以外のサンプルを変換する場合に使います
+/// `input_rate`, `output_rate` - 変換前後のサンプリング周波数。入力は出力の1.125倍以下
+/// ret: 対応していない組み合わせならfalse
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_InitApuResampler(
+    raw_ref: &mut u8,
+    input_rate: u32,
+    output_rate: u32,
+) -> bool {
+    init_struct_ref::<Resampler>(raw_ref);
+    convert_ref::<Resampler>(raw_ref).init(input_rate, output_rate)
+}
+
+/// Lockstep実行の管理データ構造を初期化します
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_InitLockstep(raw_ref: &mut u8) {
+    init_struct_ref::<LockstepCpu>(raw_ref);
+}
+
 /// Ppuの描画設定を更新します
 #[no_mangle]
 pub unsafe extern "C" fn EmbeddedEmulator_SetPpuDrawOption(
@@ -147,6 +401,27 @@ pub unsafe extern "C" fn EmbeddedEmulator_SetPpuDrawOption(
     (*ppu_ref).draw_option.pixel_format = pixel_format;
 }
 
+/// Ppuの観測出力設定を更新します
+/// 有効な間はSetPpuDrawOptionの代わりに、縮小したL8(1pixel 1byte, width*height byte)の画像をFrame Bufferに書き出します
+/// `width`, `height` - 出力サイズ。256x240以下のみ対応です。0を指定すると観測出力を無効にします
+/// `is_max_pool` - 直前のframeとのmax-poolを出力します。Frame Bufferの後半に直前のframeを保持するので、width*height*2 byte必要です
+/// 戻り値: サイズが範囲外の場合は何も変更せずfalse
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_SetPpuObservationOption(
+    raw_ppu_ref: &mut u8,
+    width: u32,
+    height: u32,
+    sampling: ObservationSamplingMode,
+    is_max_pool: bool,
+) -> bool {
+    let ppu_ref = convert_ref::<Ppu>(raw_ppu_ref);
+    let sampling = match sampling {
+        ObservationSamplingMode::Nearest => ObservationSampling::Nearest,
+        ObservationSamplingMode::Area => ObservationSampling::Area,
+    };
+    (*ppu_ref).set_observation_option(width, height, sampling, is_max_pool)
+}
+
 /// CPUに特定の割り込みを送信します
 #[no_mangle]
 pub unsafe extern "C" fn EmbeddedEmulator_InterruptCpu(
@@ -155,7 +430,7 @@ pub unsafe extern "C" fn EmbeddedEmulator_InterruptCpu(
     interrupt: CpuInterrupt,
 ) {
     let cpu_ref = convert_ref::<Cpu>(raw_cpu_ref);
-    let system_ref = convert_ref::<System>(raw_system_ref);
+    let system_ref = convert_ref::<EmulatorSystem>(raw_system_ref);
     let irq = match interrupt {
         CpuInterrupt::NMI => Interrupt::NMI,
         CpuInterrupt::RESET => Interrupt::RESET,
@@ -175,7 +450,7 @@ pub unsafe extern "C" fn EmbeddedEmulator_Reset(
     raw_ppu_ref: &mut u8,
 ) {
     let cpu_ref = convert_ref::<Cpu>(raw_cpu_ref);
-    let system_ref = convert_ref::<System>(raw_system_ref);
+    let system_ref = convert_ref::<EmulatorSystem>(raw_system_ref);
     let ppu_ref = convert_ref::<Ppu>(raw_ppu_ref);
     (*cpu_ref).reset();
     (*system_ref).reset();
@@ -185,15 +460,83 @@ pub unsafe extern "C" fn EmbeddedEmulator_Reset(
 
 /// ROMを読み込みます
 /// 成功した場合はtrueが返ります。実行中のエミュレートは中止して、Resetをかけてください
+/// ROM-in-placeのProfileでは`rom_ref`を参照し続けるので、エミュレーション中は解放しないでください
 #[no_mangle]
 pub unsafe extern "C" fn EmbeddedEmulator_LoadRom(
     raw_system_ref: &mut u8,
     rom_ref: *const u8,
 ) -> bool {
-    let system_ref = convert_ref::<System>(raw_system_ref);
-    (*system_ref)
-        .cassette
-        .from_ines_binary(|addr: usize| *rom_ref.offset(addr as isize))
+    let system_ref = convert_ref::<EmulatorSystem>(raw_system_ref);
+    (*system_ref).cassette.from_ines_ptr(rom_ref)
+}
+
+/// NSFファイルを読み込みます。データはカセットのPRG-ROMに配置します
+/// Bank切り替えを使うNSFと、ROM-in-placeのProfileには対応しません
+/// 成功した場合はtrueが返ります。続けてInitNsfSongで曲を選んでください
+/// `nsf_ptr` - [len] NSFファイル
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_LoadNsf(
+    raw_nsf_ref: &mut u8,
+    raw_system_ref: &mut u8,
+    nsf_ptr: *const u8,
+    len: usize,
+) -> bool {
+    init_struct_ref::<Nsf>(raw_nsf_ref);
+    let nsf_ref = convert_ref::<Nsf>(raw_nsf_ref);
+    let system_ref = convert_ref::<EmulatorSystem>(raw_system_ref);
+    let src = core::slice::from_raw_parts(nsf_ptr, len);
+    nsf_ref.load(system_ref, |addr: usize| src[addr], len)
+}
+
+/// LoadNsfで読み込んだNSFの曲数を返します
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_GetNsfTotalSongs(raw_nsf_ref: &mut u8) -> u8 {
+    convert_ref::<Nsf>(raw_nsf_ref).total_songs
+}
+
+/// LoadNsfで読み込んだNSFの最初に再生する曲を返します。1始まり
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_GetNsfStartingSong(raw_nsf_ref: &mut u8) -> u8 {
+    convert_ref::<Nsf>(raw_nsf_ref).starting_song
+}
+
+/// NSFの曲の再生を始めます。RAMとAPUのレジスタを初期化して、曲のINITを呼び出します
+/// PPUは使わないので不要です
+/// `song` - 1 ~ GetNsfTotalSongs
+/// ret: 曲番号が範囲外ならfalse
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_InitNsfSong(
+    raw_nsf_ref: &mut u8,
+    raw_apu_ref: &mut u8,
+    raw_ring_ptr: *const u8,
+    raw_cpu_ref: &mut u8,
+    raw_system_ref: &mut u8,
+    song: u8,
+) -> bool {
+    let nsf_ref = convert_ref::<Nsf>(raw_nsf_ref);
+    let apu_ref = convert_ref::<Apu>(raw_apu_ref);
+    let ring_ref = &*(raw_ring_ptr as *const SampleRing);
+    let cpu_ref = convert_ref::<Cpu>(raw_cpu_ref);
+    let system_ref = convert_ref::<EmulatorSystem>(raw_system_ref);
+    nsf_ref.init_song(apu_ref, ring_ref, cpu_ref, system_ref, song)
+}
+
+/// NSFの曲のPLAYを1回呼び出し、次の呼び出しまでAPUを進めて、出力をリングバッファに書き出します
+/// 画面は描画しません。1回あたりの長さはNSFが指定した呼び出し間隔(通常は1/60秒)です
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_NsfEmulateFrame(
+    raw_nsf_ref: &mut u8,
+    raw_apu_ref: &mut u8,
+    raw_ring_ptr: *const u8,
+    raw_cpu_ref: &mut u8,
+    raw_system_ref: &mut u8,
+) {
+    let nsf_ref = convert_ref::<Nsf>(raw_nsf_ref);
+    let apu_ref = convert_ref::<Apu>(raw_apu_ref);
+    let ring_ref = &*(raw_ring_ptr as *const SampleRing);
+    let cpu_ref = convert_ref::<Cpu>(raw_cpu_ref);
+    let system_ref = convert_ref::<EmulatorSystem>(raw_system_ref);
+    nsf_ref.emulate_frame(apu_ref, ring_ref, cpu_ref, system_ref);
 }
 
 /// CPUを1stepエミュレーションします
@@ -203,7 +546,7 @@ pub unsafe extern "C" fn EmbeddedEmulator_EmulateCpu(
     raw_system_ref: &mut u8,
 ) -> u8 {
     let cpu_ref = convert_ref::<Cpu>(raw_cpu_ref);
-    let system_ref = convert_ref::<System>(raw_system_ref);
+    let system_ref = convert_ref::<EmulatorSystem>(raw_system_ref);
 
     (*cpu_ref).step(&mut (*system_ref))
 }
@@ -218,7 +561,7 @@ pub unsafe extern "C" fn EmbeddedEmulator_EmulatePpu(
     cpu_cycle: usize,
 ) -> CpuInterrupt {
     let ppu_ref = convert_ref::<Ppu>(raw_ppu_ref);
-    let system_ref = convert_ref::<System>(raw_system_ref);
+    let system_ref = convert_ref::<EmulatorSystem>(raw_system_ref);
 
     match (*ppu_ref).step(cpu_cycle, &mut (*system_ref), fb_ptr) {
         Some(Interrupt::NMI) => CpuInterrupt::NMI,
@@ -229,6 +572,777 @@ pub unsafe extern "C" fn EmbeddedEmulator_EmulatePpu(
     }
 }
 
+/// APUの時刻を進めます。EmulateCpuの後に、その命令のCPU Cycle数を渡して呼び出してください
+/// 合成は記録したレジスタへのアクセスを反映する必要があるときにまとめて行い、出力は一定間隔でリングバッファに書き出されます
+/// 戻り値: DMCのDMAでCPUが止まったサイクル数。EmulatePpuには命令のCPU Cycle数にこの分を加えて渡してください
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_EmulateApu(
+    raw_apu_ref: &mut u8,
+    raw_system_ref: &mut u8,
+    raw_ring_ptr: *const u8,
+    cpu_cycle: u8,
+) -> u8 {
+    let apu_ref = convert_ref::<Apu>(raw_apu_ref);
+    let system_ref = convert_ref::<EmulatorSystem>(raw_system_ref);
+    let ring_ref = &*(raw_ring_ptr as *const SampleRing);
+    apu_ref.step(system_ref, ring_ref, cpu_cycle)
+}
+
+/// CPU/PPUを1frame分(EmbeddedEmulator_GetCpuCyclePerFrame)エミュレーションします
+/// 1命令ごとにEmulateCpu/EmulatePpu/InterruptCpuを呼ぶのと同じ動作です
+/// APUは進めないので、Frame IRQ/DMC IRQは発生せず$4015の値も変わりません
+/// `fb_ptr` - nullを渡すと描画を省略します。Run-aheadなど画面を使わないframeで使ってください
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_EmulateFrame(
+    raw_cpu_ref: &mut u8,
+    raw_system_ref: &mut u8,
+    raw_ppu_ref: &mut u8,
+    fb_ptr: *mut u8,
+) {
+    let cpu_ref = convert_ref::<Cpu>(raw_cpu_ref);
+    let system_ref = convert_ref::<EmulatorSystem>(raw_system_ref);
+    let ppu_ref = convert_ref::<Ppu>(raw_ppu_ref);
+    Interpreter.emulate_frame(cpu_ref, system_ref, ppu_ref, fb_ptr);
+}
+
+/// CPU/PPU/APUを1frame分エミュレーションします
+/// 1命令ごとにEmulateCpu/EmulatePpu/EmulateApu/InterruptCpuを呼ぶのと同じ動作です
+/// Run-aheadなど後で巻き戻すframeは、音が重複しないようにApuLogEmulateFrameで捨てるためのリングバッファに記録し、
+/// APUごとSaveState/LoadStateで戻してください
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_ApuEmulateFrame(
+    raw_apu_ref: &mut u8,
+    raw_ring_ptr: *const u8,
+    raw_cpu_ref: &mut u8,
+    raw_system_ref: &mut u8,
+    raw_ppu_ref: &mut u8,
+    fb_ptr: *mut u8,
+) {
+    let apu_ref = convert_ref::<Apu>(raw_apu_ref);
+    let ring_ref = &*(raw_ring_ptr as *const SampleRing);
+    let cpu_ref = convert_ref::<Cpu>(raw_cpu_ref);
+    let system_ref = convert_ref::<EmulatorSystem>(raw_system_ref);
+    let ppu_ref = convert_ref::<Ppu>(raw_ppu_ref);
+    Interpreter.emulate_apu_frame(apu_ref, ring_ref, cpu_ref, system_ref, ppu_ref, fb_ptr);
+}
+
+/// APUを現在の時刻まで合成して、溜まっている出力をリングバッファに書き出します
+/// 通常は一定間隔で書き出されるので、サンプルを読み出す直前や一時停止の前などに呼んでください
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_FlushApu(
+    raw_apu_ref: &mut u8,
+    raw_system_ref: &mut u8,
+    raw_ring_ptr: *const u8,
+) {
+    let apu_ref = convert_ref::<Apu>(raw_apu_ref);
+    let system_ref = convert_ref::<EmulatorSystem>(raw_system_ref);
+    let ring_ref = &*(raw_ring_ptr as *const SampleRing);
+    apu_ref.flush(system_ref, ring_ref);
+}
+
+/// リングバッファからサンプルを読み出します
+/// エミュレーションと別のスレッド(オーディオコールバックなど)から呼び出せます。読み出し側は1スレッドにしてください
+/// `dst_ptr` - [len] 16bit signed mono
+/// ret: 読み出したサンプル数
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_ReadSamples(
+    raw_ring_ptr: *const u8,
+    dst_ptr: *mut i16,
+    len: usize,
+) -> usize {
+    let ring_ref = &*(raw_ring_ptr as *const SampleRing);
+    let dst = core::slice::from_raw_parts_mut(dst_ptr, len);
+    ring_ref.pop(dst)
+}
+
+/// リングバッファから読み出せるサンプル数を返します
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_GetSampleRingLength(raw_ring_ptr: *const u8) -> usize {
+    let ring_ref = &*(raw_ring_ptr as *const SampleRing);
+    ring_ref.len()
+}
+
+/// リングバッファの空きが足りずに捨てたサンプル数の累計を返します
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_GetSampleRingDropped(raw_ring_ptr: *const u8) -> usize {
+    let ring_ref = &*(raw_ring_ptr as *const SampleRing);
+    ring_ref.dropped()
+}
+
+/// CPU/PPUを1frame分エミュレーションし、APUレジスタへのアクセスを時刻と一緒にリングバッファに記録します
+/// APUは$4015の値に関わる状態だけを追い、波形は合成しません。合成は別スレッドでRenderApuLogに任せてください
+/// リングバッファは1frame分の記録が必ず収まる大きさなので、frameごとにReadApuLogで読み出していれば記録は捨てられません
+/// InitApu, LoadState, Rewindで状態を差し替えた後の最初のframeでは、合成側のAPUを同じ状態に合わせる記録も書き出します
+/// `raw_apu_ref` - 状態を追うためのAPU。RenderApuLogに渡すものとは別に用意してください
+/// ret: リングバッファの空きが足りずに記録を捨てた場合はfalse。捨てた分だけ合成側のAPUの状態がずれます
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_ApuLogEmulateFrame(
+    raw_apu_ref: &mut u8,
+    raw_log_ptr: *const u8,
+    raw_cpu_ref: &mut u8,
+    raw_system_ref: &mut u8,
+    raw_ppu_ref: &mut u8,
+    fb_ptr: *mut u8,
+) -> bool {
+    let apu_ref = convert_ref::<Apu>(raw_apu_ref);
+    let log_ref = &*(raw_log_ptr as *const ApuLogRing);
+    let cpu_ref = convert_ref::<Cpu>(raw_cpu_ref);
+    let system_ref = convert_ref::<EmulatorSystem>(raw_system_ref);
+    let ppu_ref = convert_ref::<Ppu>(raw_ppu_ref);
+    let dropped = log_ref.dropped();
+    Interpreter.emulate_apu_frame(apu_ref, log_ref, cpu_ref, system_ref, ppu_ref, fb_ptr);
+    // frameの区切りを書き出す
+    apu_ref.flush(system_ref, log_ref);
+    log_ref.dropped() == dropped
+}
+
+/// リングバッファからAPUレジスタへのアクセスの記録を読み出します
+/// エミュレーションと別のスレッドから呼び出せます。読み出し側は1スレッドにしてください
+/// 1アクセスはEMBEDDED_EMULATOR_APU_LOG_ENTRY_BYTES byteで、そのままファイルに書き出してオフラインの合成に使えます
+/// `dst_ptr` - [len]
+/// ret: 読み出したbyte数。EMBEDDED_EMULATOR_APU_LOG_ENTRY_BYTESの倍数
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_ReadApuLog(
+    raw_log_ptr: *const u8,
+    dst_ptr: *mut u8,
+    len: usize,
+) -> usize {
+    let log_ref = &*(raw_log_ptr as *const ApuLogRing);
+    let dst = core::slice::from_raw_parts_mut(dst_ptr, len);
+    let mut accesses = [ApuRegAccess::default(); 64];
+    let mut pos = 0;
+    while pos + APU_LOG_ENTRY_BYTES <= dst.len() {
+        let max_count = core::cmp::min(accesses.len(), (dst.len() - pos) / APU_LOG_ENTRY_BYTES);
+        let count = log_ref.pop(&mut accesses[..max_count]);
+        for access in accesses[..count].iter() {
+            dst[pos..(pos + APU_LOG_ENTRY_BYTES)].copy_from_slice(&access.to_bytes());
+            pos = pos + APU_LOG_ENTRY_BYTES;
+        }
+        if count < max_count {
+            break;
+        }
+    }
+    pos
+}
+
+/// ReadApuLogで読み出した記録から波形を合成して、サンプルのリングバッファに書き出します
+/// ファイルに書き出した記録をオフラインで合成する場合にも使えます
+/// エミュレーション側のリセットやSave Stateの読み込みも記録から反映するので、合成側のAPUを作り直す必要はありません
+/// `raw_apu_ref` - 合成に使うAPU。ApuLogEmulateFrameに渡すものとは別に用意してください
+/// `src_ptr` - [len] 端数のbyteは無視します
+/// ret: 合成したframe数
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_RenderApuLog(
+    raw_apu_ref: &mut u8,
+    src_ptr: *const u8,
+    len: usize,
+    raw_ring_ptr: *const u8,
+) -> usize {
+    let apu_ref = convert_ref::<Apu>(raw_apu_ref);
+    let src = core::slice::from_raw_parts(src_ptr, len);
+    let ring_ref = &*(raw_ring_ptr as *const SampleRing);
+    let mut num_of_frames = 0;
+    for bytes in src.chunks_exact(APU_LOG_ENTRY_BYTES) {
+        let access = ApuRegAccess::from_bytes(bytes);
+        if access.offset == APU_LOG_FRAME_END {
+            num_of_frames = num_of_frames + 1;
+        }
+        apu_ref.replay(access, ring_ref);
+    }
+    num_of_frames
+}
+
+/// APUにチャンネルごとの出力を取り付けます。以降は出力をリングバッファに書き出すすべての関数で、
+/// ミキサーの出力と同じ合成の中で各チャンネルを単独で鳴らした出力も書き出します。取り付けなければ合成の処理は増えません
+/// InitApuの直後に取り付けてください。取り付けるまでに合成した分だけ、ミキサーの出力とサンプルの位置がずれます
+/// `raw_tap_ptr` - InitApuChannelTapで初期化したもの。取り外すまで解放しないでください。nullなら取り外します
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_AttachApuChannelTap(
+    raw_apu_ref: &mut u8,
+    raw_tap_ptr: *const u8,
+) {
+    let apu_ref = convert_ref::<Apu>(raw_apu_ref);
+    apu_ref.attach_channel_tap(raw_tap_ptr as *const ApuChannelTap);
+}
+
+/// チャンネルのリングバッファからサンプルを読み出します
+/// ReadSamplesと同様に、エミュレーションと別のスレッドから呼び出せます。読み出し側はチャンネルごとに1スレッドにしてください
+/// `dst_ptr` - [len] 16bit signed mono
+/// ret: 読み出したサンプル数
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_ReadApuChannelSamples(
+    raw_tap_ptr: *const u8,
+    channel: ApuTapChannel,
+    dst_ptr: *mut i16,
+    len: usize,
+) -> usize {
+    let tap_ref = &*(raw_tap_ptr as *const ApuChannelTap);
+    let dst = core::slice::from_raw_parts_mut(dst_ptr, len);
+    tap_ref.ring(channel.to_channel()).pop(dst)
+}
+
+/// チャンネルのリングバッファから読み出せるサンプル数を返します
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_GetApuChannelSampleLength(
+    raw_tap_ptr: *const u8,
+    channel: ApuTapChannel,
+) -> usize {
+    let tap_ref = &*(raw_tap_ptr as *const ApuChannelTap);
+    tap_ref.ring(channel.to_channel()).len()
+}
+
+/// APUの出力のサンプリング周波数を設定値からずらします。エミュレーションの速さとオーディオ出力の時計のずれを吸収するのに使います
+/// 正の値ほど1frameあたりのサンプル数が減ります。変換比は出力サンプルごとに滑らかに変わります
+/// `ppm` - ±EMBEDDED_EMULATOR_APU_MAX_RATE_ADJUST_PPMに制限します
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_SetApuRateAdjust(raw_apu_ref: &mut u8, ppm: i32) {
+    let apu_ref = convert_ref::<Apu>(raw_apu_ref);
+    apu_ref.set_rate_adjust(ppm);
+}
+
+/// サンプリング周波数変換の積和の実装を選びます。初期化時には使える中で最も速いものが選ばれています
+/// ret: 実行中のCPUで使えなければ何もせずfalse
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_SetApuResamplerKernel(
+    raw_resampler_ref: &mut u8,
+    kernel: ApuResamplerKernel,
+) -> bool {
+    let resampler_ref = convert_ref::<Resampler>(raw_resampler_ref);
+    let kernel = match kernel {
+        ApuResamplerKernel::Scalar => ResamplerKernel::Scalar,
+        ApuResamplerKernel::Sse2 => ResamplerKernel::Sse2,
+        ApuResamplerKernel::Avx2 => ResamplerKernel::Avx2,
+    };
+    resampler_ref.set_kernel(kernel)
+}
+
+/// サンプルのサンプリング周波数を変換して、サンプルのリングバッファに書き出します
+/// `src_ptr` - [len] 16bit signed monoのサンプル
+/// `raw_ring_ptr` - InitSampleRingで初期化したリングバッファ
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_ResampleApu(
+    raw_resampler_ref: &mut u8,
+    src_ptr: *const i16,
+    len: usize,
+    raw_ring_ptr: *const u8,
+) {
+    let resampler_ref = convert_ref::<Resampler>(raw_resampler_ref);
+    let ring_ref = &*(raw_ring_ptr as *const SampleRing);
+    let src = core::slice::from_raw_parts(src_ptr, len);
+    resampler_ref.process(src, ring_ref);
+}
+
+/// APUレジスタへのアクセスのリングバッファの空きが足りずに捨てたアクセス数の累計を返します
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_GetApuLogDropped(raw_log_ptr: *const u8) -> usize {
+    let log_ref = &*(raw_log_ptr as *const ApuLogRing);
+    log_ref.dropped()
+}
+
+/// 各チャンネルの出力を非線形ミキサーで混ぜた値を返します。全チャンネルが最大のときEMBEDDED_EMULATOR_APU_MIXER_OUTPUT_MAX
+/// 固定小数点のテーブル引きで計算します。APUが合成に使っている値と同じです
+/// `pulse1`, `pulse2`, `triangle`, `noise` - 0 ~ 15。上位bitは無視します
+/// `dmc` - 0 ~ 127。上位bitは無視します
+#[no_mangle]
+pub extern "C" fn EmbeddedEmulator_MixApuOutput16(
+    pulse1: u8,
+    pulse2: u8,
+    triangle: u8,
+    noise: u8,
+    dmc: u8,
+) -> i16 {
+    mix::<i16>(
+        pulse1 & 0x0f,
+        pulse2 & 0x0f,
+        triangle & 0x0f,
+        noise & 0x0f,
+        dmc & 0x7f,
+    )
+}
+
+/// MixApuOutput16の32bit版です。16bitの出力をEMBEDDED_EMULATOR_APU_MIXER_FRAC_BITSだけ左にシフトした値で、丸める前の小数部を含みます
+#[no_mangle]
+pub extern "C" fn EmbeddedEmulator_MixApuOutput32(
+    pulse1: u8,
+    pulse2: u8,
+    triangle: u8,
+    noise: u8,
+    dmc: u8,
+) -> i32 {
+    mix::<i32>(
+        pulse1 & 0x0f,
+        pulse2 & 0x0f,
+        triangle & 0x0f,
+        noise & 0x0f,
+        dmc & 0x7f,
+    )
+}
+
+/// 複数のエミュレータをまとめて進めます。強化学習などで多数の環境を並べて動かす用途向けです
+/// 各インスタンスに`buttons`を入力して`frame_skip`frame進め、最後のframeの観測を書き出します
+/// 領域の確保やコピーは観測の書き出し以外行いません
+/// 重ならない範囲のインスタンス配列であれば、複数スレッドから同時に呼び出せます
+/// `instances_ptr` - `num_of_instances`個のインスタンス
+/// `buttons_ptr` - [num_of_instances] 1Pの入力。bit0から A, B, Select, Start, Up, Down, Left, Right。nullなら入力を変更しない
+/// `frame_skip` - 1回の呼び出しで進めるframe数。0は1とみなします
+/// `max_episode_frames` - このframe数に達したインスタンスをリセットします。0ならリセットしない
+/// `episode_frames_ptr` - [num_of_instances] 各インスタンスの経過frame数。呼び出し側で保持し、最初は0にしてください。nullならリセットしない
+/// `reset_state_ptr` - リセット時に読み込むSave State。nullならRESET割り込みでリセットします
+/// `dones_ptr` - [num_of_instances] リセットしたインスタンスに1、それ以外に0を書き込みます。nullなら書き込まない
+/// `fb_ptr` - [num_of_instances][fb_stride] 画面の書き出し先。各インスタンスのSetPpuDrawOption/SetPpuObservationOptionに従います。nullなら描画しない
+/// `ram_ptr` - [num_of_instances][EMBEDDED_EMULATOR_WRAM_SIZE] WRAMの書き出し先。nullなら書き出さない
+/// 観測はリセット前の最終frameのものです
+/// APUを持つインスタンス(EmbeddedEmulatorInstance::apu)は、$4015の値とIRQのためにAPUの状態も追います。音は合成しません
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_BatchStep(
+    instances_ptr: *const EmbeddedEmulatorInstance,
+    num_of_instances: usize,
+    buttons_ptr: *const u8,
+    frame_skip: u32,
+    max_episode_frames: u32,
+    episode_frames_ptr: *mut u32,
+    reset_state_ptr: *const u8,
+    reset_state_size: usize,
+    dones_ptr: *mut u8,
+    fb_ptr: *mut u8,
+    fb_stride: usize,
+    ram_ptr: *mut u8,
+) {
+    let frame_skip = if frame_skip == 0 { 1 } else { frame_skip };
+    for i in 0..num_of_instances {
+        let instance = &*instances_ptr.add(i);
+        let cpu_ref = &mut *(instance.cpu as *mut Cpu);
+        let system_ref = &mut *(instance.system as *mut EmulatorSystem);
+        let ppu_ref = &mut *(instance.ppu as *mut Ppu);
+        let mut apu_ref = (instance.apu as *mut Apu).as_mut();
+
+        if !buttons_ptr.is_null() {
+            system_ref.pad1.set_buttons(*buttons_ptr.add(i));
+        }
+        // 観測に使う最後のframeだけ描画する
+        let fb = if fb_ptr.is_null() {
+            core::ptr::null_mut()
+        } else {
+            fb_ptr.add(i * fb_stride)
+        };
+        for frame in 0..frame_skip {
+            let frame_fb = if frame + 1 == frame_skip {
+                fb
+            } else {
+                core::ptr::null_mut()
+            };
+            emulate_engine_frame(
+                &mut Interpreter,
+                apu_ref.as_mut().map(|apu| &mut **apu),
+                &ApuNullSink,
+                cpu_ref,
+                system_ref,
+                ppu_ref,
+                frame_fb,
+            );
+        }
+        if !ram_ptr.is_null() {
+            core::ptr::copy_nonoverlapping(
+                system_ref.wram.as_ptr(),
+                ram_ptr.add(i * EMBEDDED_EMULATOR_WRAM_SIZE),
+                WRAM_SIZE,
+            );
+        }
+
+        let mut is_done = false;
+        if max_episode_frames > 0 && !episode_frames_ptr.is_null() {
+            let episode_frames = &mut *episode_frames_ptr.add(i);
+            *episode_frames = episode_frames.saturating_add(frame_skip);
+            if *episode_frames >= max_episode_frames {
+                is_done = true;
+                *episode_frames = 0;
+                let is_loaded = !reset_state_ptr.is_null()
+                    && load_state(
+                        cpu_ref,
+                        system_ref,
+                        ppu_ref,
+                        apu_ref.as_mut().map(|apu| &mut **apu),
+                        core::slice::from_raw_parts(reset_state_ptr, reset_state_size),
+                    );
+                if !is_loaded {
+                    cpu_ref.reset();
+                    system_ref.reset();
+                    ppu_ref.reset();
+                    if let Some(ref mut apu) = apu_ref {
+                        apu.reset_state(system_ref.apu_cycle);
+                    }
+                    cpu_ref.interrupt(system_ref, Interrupt::RESET);
+                }
+            }
+        }
+        if !dones_ptr.is_null() {
+            *dones_ptr.add(i) = if is_done { 1 } else { 0 };
+        }
+    }
+}
+
+/// LockstepCpuに渡すインスタンス配列
+struct InstanceLanes {
+    instances_ptr: *const EmbeddedEmulatorInstance,
+    num_of_instances: usize,
+    fb_ptr: *mut u8,
+    fb_stride: usize,
+}
+
+impl LockstepLanes<EmulatorStorage> for InstanceLanes {
+    fn num_of_lanes(&self) -> usize {
+        self.num_of_instances
+    }
+    fn lane(&mut self, lane: usize) -> (&mut EmulatorSystem, &mut Ppu, *mut u8) {
+        unsafe {
+            let instance = &*self.instances_ptr.add(lane);
+            let fb = if self.fb_ptr.is_null() {
+                core::ptr::null_mut()
+            } else {
+                self.fb_ptr.add(lane * self.fb_stride)
+            };
+            (
+                &mut *(instance.system as *mut EmulatorSystem),
+                &mut *(instance.ppu as *mut Ppu),
+                fb,
+            )
+        }
+    }
+}
+
+/// 同じROMを動かす複数のインスタンスを、命令単位で足並みをそろえて1frame進めます(実験的)
+/// レジスタをStructure of Arraysにまとめ、同じ命令を実行しているインスタンスをまとめて処理します
+/// 結果はインスタンスごとにEmulateFrameを呼んだ場合と同じです
+/// `raw_lockstep_ref` - InitLockstepで初期化済みの領域
+/// `instances_ptr` - `num_of_instances`個のインスタンス
+/// `num_of_instances` - EMBEDDED_EMULATOR_LOCKSTEP_MAX_LANES以下
+/// `fb_ptr` - [num_of_instances][fb_stride] 画面の書き出し先。nullなら描画しない
+/// ret: `num_of_instances`が多すぎる場合はfalse
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_LockstepEmulateFrame(
+    raw_lockstep_ref: &mut u8,
+    instances_ptr: *const EmbeddedEmulatorInstance,
+    num_of_instances: usize,
+    fb_ptr: *mut u8,
+    fb_stride: usize,
+) -> bool {
+    if num_of_instances > LOCKSTEP_MAX_LANES {
+        return false;
+    }
+    let lockstep_ref = convert_ref::<LockstepCpu>(raw_lockstep_ref);
+    for i in 0..num_of_instances {
+        let instance = &*instances_ptr.add(i);
+        lockstep_ref.load_lane(i, &*(instance.cpu as *const Cpu));
+    }
+    let mut lanes = InstanceLanes {
+        instances_ptr,
+        num_of_instances,
+        fb_ptr,
+        fb_stride,
+    };
+    lockstep_ref.emulate_frame(&mut lanes);
+    for i in 0..num_of_instances {
+        let instance = &*instances_ptr.add(i);
+        *(instance.cpu as *mut Cpu) = lockstep_ref.store_lane(i);
+    }
+    true
+}
+
+/// Lockstep実行の統計を取得します。InitLockstepからの累計です
+/// `vector_lane_steps_ptr` - まとめて実行した命令数(インスタンス換算)
+/// `scalar_lane_steps_ptr` - インスタンスごとに実行した命令数
+/// `dispatches_ptr` - 命令の振り分け回数。インスタンス間で命令がそろっているほど少なくなる
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_GetLockstepStats(
+    raw_lockstep_ref: &mut u8,
+    vector_lane_steps_ptr: *mut u64,
+    scalar_lane_steps_ptr: *mut u64,
+    dispatches_ptr: *mut u64,
+) {
+    let lockstep_ref = convert_ref::<LockstepCpu>(raw_lockstep_ref);
+    *vector_lane_steps_ptr = lockstep_ref.vector_lane_steps;
+    *scalar_lane_steps_ptr = lockstep_ref.scalar_lane_steps;
+    *dispatches_ptr = lockstep_ref.dispatches;
+}
+
+/// JITの実行統計
+#[repr(C)]
+pub struct EmbeddedEmulatorJitStats {
+    /// 翻訳したブロック数
+    pub compiled_blocks: u64,
+    /// 翻訳したコードで実行した命令数
+    pub jit_insts: u64,
+    /// インタプリタで実行した命令数
+    pub interpreted_insts: u64,
+    /// コードバッファがあふれて翻訳済のブロックを捨てた回数
+    pub flushes: u64,
+    /// インタプリタと比較した命令数
+    pub trace_compared: u64,
+    /// インタプリタと結果が一致しなかった命令数
+    pub trace_mismatches: u64,
+    /// 最初に一致しなかった命令のアドレス
+    pub first_mismatch_pc: u16,
+}
+
+/// JITを初期化します。LoadRomの後に呼んでください
+/// PRG-ROM上でよく実行されるブロックをx86-64の機械語に翻訳して実行します
+/// WRAM以外へのアクセスや翻訳しない命令はインタプリタで実行し、結果はEmulateFrameと同じです
+/// `code_buf_ptr` - 翻訳したコードを置くバッファ。読み書き実行可能な領域(mmapでPROT_EXECを指定するなど)を渡してください
+/// 戻り値: jit featureを有効にしていない場合、バッファが小さすぎる場合はfalse
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_InitJit(
+    raw_jit_ref: &mut u8,
+    code_buf_ptr: *mut u8,
+    code_buf_size: usize,
+) -> bool {
+    #[cfg(all(feature = "jit", target_arch = "x86_64"))]
+    {
+        init_struct_ref::<Jit>(raw_jit_ref);
+        let jit_ref = convert_ref::<Jit>(raw_jit_ref);
+        jit_ref.init(code_buf_ptr, code_buf_size)
+    }
+    #[cfg(not(all(feature = "jit", target_arch = "x86_64")))]
+    {
+        let _ = (raw_jit_ref, code_buf_ptr, code_buf_size);
+        false
+    }
+}
+
+/// 有効にすると1命令ずつ翻訳し、実行するたびにインタプリタの結果と比較します
+/// 以降はインタプリタの結果で進めるので、一致しなかった場合もエミュレーションは正しく続きます
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_SetJitTraceCompare(
+    raw_jit_ref: &mut u8,
+    is_enable: bool,
+) {
+    #[cfg(all(feature = "jit", target_arch = "x86_64"))]
+    {
+        let jit_ref = convert_ref::<Jit>(raw_jit_ref);
+        jit_ref.set_trace_compare(is_enable);
+    }
+    #[cfg(not(all(feature = "jit", target_arch = "x86_64")))]
+    {
+        let _ = (raw_jit_ref, is_enable);
+    }
+}
+
+/// JITを使ってCPU/PPUを1frame分エミュレーションします
+/// jit featureを有効にしていない場合はEmulateFrameと同じです
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_JitEmulateFrame(
+    raw_jit_ref: &mut u8,
+    raw_cpu_ref: &mut u8,
+    raw_system_ref: &mut u8,
+    raw_ppu_ref: &mut u8,
+    fb_ptr: *mut u8,
+) {
+    let cpu_ref = convert_ref::<Cpu>(raw_cpu_ref);
+    let system_ref = convert_ref::<EmulatorSystem>(raw_system_ref);
+    let ppu_ref = convert_ref::<Ppu>(raw_ppu_ref);
+    #[cfg(all(feature = "jit", target_arch = "x86_64"))]
+    {
+        let jit_ref = convert_ref::<Jit>(raw_jit_ref);
+        jit_ref.emulate_frame(cpu_ref, system_ref, ppu_ref, fb_ptr);
+    }
+    #[cfg(not(all(feature = "jit", target_arch = "x86_64")))]
+    {
+        let _ = raw_jit_ref;
+        Interpreter.emulate_frame(cpu_ref, system_ref, ppu_ref, fb_ptr);
+    }
+}
+
+/// JITの実行統計を取得します。InitJitからの累計です
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_GetJitStats(
+    raw_jit_ref: &mut u8,
+    stats_ptr: *mut EmbeddedEmulatorJitStats,
+) {
+    #[cfg(all(feature = "jit", target_arch = "x86_64"))]
+    {
+        let stats = convert_ref::<Jit>(raw_jit_ref).stats;
+        *stats_ptr = EmbeddedEmulatorJitStats {
+            compiled_blocks: stats.compiled_blocks,
+            jit_insts: stats.jit_insts,
+            interpreted_insts: stats.interpreted_insts,
+            flushes: stats.flushes,
+            trace_compared: stats.trace_compared,
+            trace_mismatches: stats.trace_mismatches,
+            first_mismatch_pc: stats.first_mismatch_pc,
+        };
+    }
+    #[cfg(not(all(feature = "jit", target_arch = "x86_64")))]
+    {
+        let _ = raw_jit_ref;
+        core::ptr::write_bytes(stats_ptr, 0, 1);
+    }
+}
+
+/// 命令融合の実行統計
+#[repr(C)]
+pub struct EmbeddedEmulatorFusionStats {
+    /// 命令列ごとに融合して実行した回数
+    pub lda_zp_sta_abs: u64,
+    pub dex_bne: u64,
+    pub dey_bne: u64,
+    pub lda_abs_bpl: u64,
+    pub inc_zp_lda_zp: u64,
+    /// 融合せず1命令ずつ実行した数
+    pub single_steps: u64,
+    /// 融合によって省略した命令ディスパッチの数
+    pub eliminated_dispatches: u64,
+}
+
+/// 命令融合を初期化します。LoadRomの後に呼んでください
+/// `LDA zp; STA abs`, `DEX; BNE`などよく使われる2命令の組をPRG-ROM上で検出し、まとめて実行します
+/// 結果はEmulateFrameと同じです
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_InitFusion(raw_fusion_ref: &mut u8) {
+    init_struct_ref::<Fusion>(raw_fusion_ref);
+}
+
+/// 命令融合を使ってCPU/PPUを1frame分エミュレーションします
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_FusionEmulateFrame(
+    raw_fusion_ref: &mut u8,
+    raw_cpu_ref: &mut u8,
+    raw_system_ref: &mut u8,
+    raw_ppu_ref: &mut u8,
+    fb_ptr: *mut u8,
+) {
+    let fusion_ref = convert_ref::<Fusion>(raw_fusion_ref);
+    let cpu_ref = convert_ref::<Cpu>(raw_cpu_ref);
+    let system_ref = convert_ref::<EmulatorSystem>(raw_system_ref);
+    let ppu_ref = convert_ref::<Ppu>(raw_ppu_ref);
+    fusion_ref.emulate_frame(cpu_ref, system_ref, ppu_ref, fb_ptr);
+}
+
+/// 命令融合の実行統計を取得します。InitFusionからの累計です
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_GetFusionStats(
+    raw_fusion_ref: &mut u8,
+    stats_ptr: *mut EmbeddedEmulatorFusionStats,
+) {
+    let stats = convert_ref::<Fusion>(raw_fusion_ref).stats;
+    *stats_ptr = EmbeddedEmulatorFusionStats {
+        lda_zp_sta_abs: stats.fused[0],
+        dex_bne: stats.fused[1],
+        dey_bne: stats.fused[2],
+        lda_abs_bpl: stats.fused[3],
+        inc_zp_lda_zp: stats.fused[4],
+        single_steps: stats.single_steps,
+        eliminated_dispatches: stats.eliminated_dispatches(),
+    };
+}
+
+/// 待ちループ早送りの実行統計
+#[repr(C)]
+pub struct EmbeddedEmulatorIdleSkipStats {
+    /// 1命令ずつ実行した命令数
+    pub executed_insts: u64,
+    /// 省略した待ちループの周回数
+    pub skipped_iterations: u64,
+    /// 省略したcycle数
+    pub skipped_cycles: u64,
+}
+
+/// 待ちループの早送りを初期化します。LoadRom, LoadState, Rewindなどで状態を入れ替えた後に呼んでください
+/// `LDA $2002; BPL wait`やZeroPageのフラグを待つループなど、副作用のない待ちループを検出し、
+/// 次のPPUの処理(lineの更新, VBlank, Sprite 0 hit)までの周回を省略します。結果はEmulateFrameと同じです
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_InitIdleSkip(raw_idle_ref: &mut u8) {
+    init_struct_ref::<IdleSkip>(raw_idle_ref);
+}
+
+/// 待ちループを早送りしながらCPU/PPUを1frame分エミュレーションします
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_IdleSkipEmulateFrame(
+    raw_idle_ref: &mut u8,
+    raw_cpu_ref: &mut u8,
+    raw_system_ref: &mut u8,
+    raw_ppu_ref: &mut u8,
+    fb_ptr: *mut u8,
+) {
+    let idle_ref = convert_ref::<IdleSkip>(raw_idle_ref);
+    let cpu_ref = convert_ref::<Cpu>(raw_cpu_ref);
+    let system_ref = convert_ref::<EmulatorSystem>(raw_system_ref);
+    let ppu_ref = convert_ref::<Ppu>(raw_ppu_ref);
+    idle_ref.emulate_frame(cpu_ref, system_ref, ppu_ref, fb_ptr);
+}
+
+/// 待ちループを早送りしながらCPU/PPU/APUを1frame分エミュレーションし、APUの出力をリングバッファに書き出します
+/// 早送りした周回の分もAPUは合成します。結果はApuEmulateFrameと同じです
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_IdleSkipApuEmulateFrame(
+    raw_idle_ref: &mut u8,
+    raw_apu_ref: &mut u8,
+    raw_ring_ptr: *const u8,
+    raw_cpu_ref: &mut u8,
+    raw_system_ref: &mut u8,
+    raw_ppu_ref: &mut u8,
+    fb_ptr: *mut u8,
+) {
+    let idle_ref = convert_ref::<IdleSkip>(raw_idle_ref);
+    let apu_ref = convert_ref::<Apu>(raw_apu_ref);
+    let ring_ref = &*(raw_ring_ptr as *const SampleRing);
+    let cpu_ref = convert_ref::<Cpu>(raw_cpu_ref);
+    let system_ref = convert_ref::<EmulatorSystem>(raw_system_ref);
+    let ppu_ref = convert_ref::<Ppu>(raw_ppu_ref);
+    idle_ref.emulate_apu_frame(apu_ref, ring_ref, cpu_ref, system_ref, ppu_ref, fb_ptr);
+}
+
+/// 待ちループ早送りの実行統計を取得します。InitIdleSkipからの累計です
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_GetIdleSkipStats(
+    raw_idle_ref: &mut u8,
+    stats_ptr: *mut EmbeddedEmulatorIdleSkipStats,
+) {
+    let stats = convert_ref::<IdleSkip>(raw_idle_ref).stats;
+    *stats_ptr = EmbeddedEmulatorIdleSkipStats {
+        executed_insts: stats.executed_insts,
+        skipped_iterations: stats.skipped_iterations,
+        skipped_cycles: stats.skipped_cycles,
+    };
+}
+
+/// 読み込んだROMがAOTコンパイル結果の生成元と一致するか確認します
+/// aot featureを有効にしていない場合はfalse
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_IsAotCompatible(raw_system_ref: &mut u8) -> bool {
+    #[cfg(feature = "aot")]
+    {
+        let system_ref = convert_ref::<EmulatorSystem>(raw_system_ref);
+        aot_generated::is_compatible(system_ref)
+    }
+    #[cfg(not(feature = "aot"))]
+    {
+        let _ = raw_system_ref;
+        false
+    }
+}
+
+/// AOTコンパイル結果を使ってCPU/PPUを1frame分エミュレーションします
+/// 翻訳していないアドレスはインタプリタで実行します。IsAotCompatibleがtrueのROMでのみ使うこと
+/// aot featureを有効にしていない場合はEmulateFrameと同じです
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_AotEmulateFrame(
+    raw_cpu_ref: &mut u8,
+    raw_system_ref: &mut u8,
+    raw_ppu_ref: &mut u8,
+    fb_ptr: *mut u8,
+) {
+    let cpu_ref = convert_ref::<Cpu>(raw_cpu_ref);
+    let system_ref = convert_ref::<EmulatorSystem>(raw_system_ref);
+    let ppu_ref = convert_ref::<Ppu>(raw_ppu_ref);
+    #[cfg(feature = "aot")]
+    {
+        aot_generated::emulate_frame(cpu_ref, system_ref, ppu_ref, fb_ptr);
+    }
+    #[cfg(not(feature = "aot"))]
+    {
+        Interpreter.emulate_frame(cpu_ref, system_ref, ppu_ref, fb_ptr);
+    }
+}
+
 /// キー入力を反映
 /// `player_num` - Player番号, 0 or 1
 #[no_mangle]
@@ -237,7 +1351,7 @@ pub unsafe extern "C" fn EmbeddedEmulator_UpdateKey(
     player_num: u32,
     key: KeyEvent,
 ) {
-    let system_ref = convert_ref::<System>(raw_system_ref);
+    let system_ref = convert_ref::<EmulatorSystem>(raw_system_ref);
     let p = match player_num {
         0 => &mut (*system_ref).pad1,
         1 => &mut (*system_ref).pad2,
@@ -264,3 +1378,203 @@ pub unsafe extern "C" fn EmbeddedEmulator_UpdateKey(
         KeyEvent::ReleaseRight => p.release_button(PadButton::Right),
     };
 }
+
+/// 実行中のエミュレータの内部状態を別のインスタンスに複製します。木探索やA/B比較でゲームを分岐させる用途向けです
+/// SaveState/LoadStateと同じ結果になりますが、直列化を挟まずに可変な状態だけを直接コピーします
+/// ROM-in-placeのProfileではROMを共有するのでコピーしません。複製先でLoadRomを呼ぶ必要はありません
+/// 描画設定(SetPpuDrawOption/SetPpuObservationOption)は複製先のものを維持します
+/// `src` - 複製元
+/// `dst` - 複製先。InitCpu/InitSystem/InitPpuで初期化済みで、複製元と重ならない領域
+/// APUは複製元と複製先の両方にあれば複製します。複製元にだけなければ、複製先のAPUは電源投入時の状態に戻します
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_Clone(
+    src: *const EmbeddedEmulatorInstance,
+    dst: *const EmbeddedEmulatorInstance,
+) {
+    let src = &*src;
+    let dst = &*dst;
+    clone_state(
+        &mut *(dst.cpu as *mut Cpu),
+        &mut *(dst.system as *mut EmulatorSystem),
+        &mut *(dst.ppu as *mut Ppu),
+        (dst.apu as *mut Apu).as_mut(),
+        &*(src.cpu as *const Cpu),
+        &*(src.system as *const EmulatorSystem),
+        &*(src.ppu as *const Ppu),
+        (src.apu as *const Apu).as_ref(),
+    );
+}
+
+/// 電池バックアップされたRAM(0x6000 - 0x7fff)のサイズを返します
+/// 持っていないカセットの場合は0
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_GetSaveRamSize(raw_system_ref: &mut u8) -> usize {
+    let system_ref = convert_ref::<EmulatorSystem>(raw_system_ref);
+    (*system_ref).cassette.battery_packed_ram_bytes()
+}
+
+/// 前回の呼び出し以降に書き換えられたページをbitmaskで返し、追跡状態をクリアします
+/// bit n が 0x6000 + n * EMBEDDED_EMULATOR_SAVE_RAM_PAGE_SIZE からのページに対応します
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_TakeSaveRamDirtyPages(raw_system_ref: &mut u8) -> u32 {
+    let system_ref = convert_ref::<EmulatorSystem>(raw_system_ref);
+    (*system_ref).cassette.take_battery_packed_ram_dirty_pages()
+}
+
+/// 指定したページを`dst_ptr`にコピーします
+/// `dst_ptr` - EMBEDDED_EMULATOR_SAVE_RAM_PAGE_SIZE bytes以上の領域
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_ReadSaveRamPage(
+    raw_system_ref: &mut u8,
+    page: u32,
+    dst_ptr: *mut u8,
+) -> bool {
+    if page >= EMBEDDED_EMULATOR_SAVE_RAM_NUM_OF_PAGES {
+        return false;
+    }
+    let system_ref = convert_ref::<EmulatorSystem>(raw_system_ref);
+    let src = (*system_ref)
+        .cassette
+        .read_battery_packed_ram_page(page as usize);
+    core::ptr::copy_nonoverlapping(src.as_ptr(), dst_ptr, src.len());
+    true
+}
+
+/// 保存しておいたRAMの内容を書き戻します。LoadRomの後に呼んでください
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_RestoreSaveRam(
+    raw_system_ref: &mut u8,
+    src_ptr: *const u8,
+    size: usize,
+) {
+    let system_ref = convert_ref::<EmulatorSystem>(raw_system_ref);
+    (*system_ref)
+        .cassette
+        .restore_battery_packed_ram(|index: usize| *src_ptr.add(index), size);
+}
+
+/// Save Stateに必要なバイト数を返します。LoadRomの後に呼んでください
+/// CHR-RAMやBattery Packed RAMを持つカセットではその分大きくなります
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_GetSaveStateSize(raw_system_ref: &mut u8) -> usize {
+    let system_ref = convert_ref::<EmulatorSystem>(raw_system_ref);
+    save_state_bytes(&*system_ref)
+}
+
+/// ROMを除いた可変な内部状態を`dst_ptr`に書き出します
+/// `raw_apu_ptr` - エミュレーションに使っているAPU(ApuEmulateFrameやApuLogEmulateFrameに渡すもの)。使っていなければnull
+/// 戻り値: 書き出したバイト数。`dst_size`が足りない場合は0
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_SaveState(
+    raw_cpu_ref: &mut u8,
+    raw_system_ref: &mut u8,
+    raw_ppu_ref: &mut u8,
+    raw_apu_ptr: *const u8,
+    dst_ptr: *mut u8,
+    dst_size: usize,
+) -> usize {
+    let cpu_ref = convert_ref::<Cpu>(raw_cpu_ref);
+    let system_ref = convert_ref::<EmulatorSystem>(raw_system_ref);
+    let ppu_ref = convert_ref::<Ppu>(raw_ppu_ref);
+    let apu_ref = (raw_apu_ptr as *const Apu).as_ref();
+    let dst = core::slice::from_raw_parts_mut(dst_ptr, dst_size);
+    save_state(&*cpu_ref, &*system_ref, &*ppu_ref, apu_ref, dst).unwrap_or(0)
+}
+
+/// SaveStateで書き出した内部状態を復元します
+/// バージョンや読み込んでいるROMが一致しない場合は何も変更せずfalseを返します
+/// `raw_apu_ptr` - SaveStateと同様。APUを渡さずに書き出したSave Stateなら、APUは電源投入時の状態に戻します
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_LoadState(
+    raw_cpu_ref: &mut u8,
+    raw_system_ref: &mut u8,
+    raw_ppu_ref: &mut u8,
+    raw_apu_ptr: *mut u8,
+    src_ptr: *const u8,
+    src_size: usize,
+) -> bool {
+    let cpu_ref = convert_ref::<Cpu>(raw_cpu_ref);
+    let system_ref = convert_ref::<EmulatorSystem>(raw_system_ref);
+    let ppu_ref = convert_ref::<Ppu>(raw_ppu_ref);
+    let apu_ref = (raw_apu_ptr as *mut Apu).as_mut();
+    let src = core::slice::from_raw_parts(src_ptr, src_size);
+    load_state(&mut *cpu_ref, &mut *system_ref, &mut *ppu_ref, apu_ref, src)
+}
+
+/// Rewindを初期化します。LoadRomの後に呼んでください
+/// `buf_ptr` - 履歴を置くバッファ。容量を超えたら古い履歴から捨てます。Rewindを使う間は解放しないでください
+/// `capture_interval` - 何frameごとにsnapshotを取るか
+/// `keyframe_interval` - 何snapshotごとに全体を保存するか。0なら差分のみ
+/// 戻り値: バッファがSave State 2個分に満たない場合はfalse
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_InitRewind(
+    raw_rewind_ref: &mut u8,
+    raw_system_ref: &mut u8,
+    buf_ptr: *mut u8,
+    buf_size: usize,
+    capture_interval: u32,
+    keyframe_interval: u32,
+) -> bool {
+    init_struct_ref::<Rewind>(raw_rewind_ref);
+    let rewind_ref = convert_ref::<Rewind>(raw_rewind_ref);
+    let system_ref = convert_ref::<EmulatorSystem>(raw_system_ref);
+    (*rewind_ref).init(
+        &*system_ref,
+        buf_ptr,
+        buf_size,
+        capture_interval,
+        keyframe_interval,
+    )
+}
+
+/// 1frameエミュレーションするごとに呼んでください。capture_intervalごとに差分を記録します
+/// `raw_apu_ptr` - SaveStateと同様。使っていなければnull
+/// 戻り値: 記録した場合はtrue
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_CaptureRewind(
+    raw_rewind_ref: &mut u8,
+    raw_cpu_ref: &mut u8,
+    raw_system_ref: &mut u8,
+    raw_ppu_ref: &mut u8,
+    raw_apu_ptr: *const u8,
+) -> bool {
+    let rewind_ref = convert_ref::<Rewind>(raw_rewind_ref);
+    let cpu_ref = convert_ref::<Cpu>(raw_cpu_ref);
+    let system_ref = convert_ref::<EmulatorSystem>(raw_system_ref);
+    let ppu_ref = convert_ref::<Ppu>(raw_ppu_ref);
+    let apu_ref = (raw_apu_ptr as *const Apu).as_ref();
+    (*rewind_ref).capture(&*cpu_ref, &*system_ref, &*ppu_ref, apu_ref)
+}
+
+/// 指定したframe数だけ巻き戻します。戻った先より新しい履歴は破棄されます
+/// `raw_apu_ptr` - CaptureRewindに渡したもの。使っていなければnull
+/// 戻り値: 実際に巻き戻したframe数(capture_interval単位)
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_Rewind(
+    raw_rewind_ref: &mut u8,
+    raw_cpu_ref: &mut u8,
+    raw_system_ref: &mut u8,
+    raw_ppu_ref: &mut u8,
+    raw_apu_ptr: *mut u8,
+    frames: u32,
+) -> u32 {
+    let rewind_ref = convert_ref::<Rewind>(raw_rewind_ref);
+    let cpu_ref = convert_ref::<Cpu>(raw_cpu_ref);
+    let system_ref = convert_ref::<EmulatorSystem>(raw_system_ref);
+    let ppu_ref = convert_ref::<Ppu>(raw_ppu_ref);
+    let apu_ref = (raw_apu_ptr as *mut Apu).as_mut();
+    (*rewind_ref).rewind(
+        &mut *cpu_ref,
+        &mut *system_ref,
+        &mut *ppu_ref,
+        apu_ref,
+        frames,
+    )
+}
+
+/// 巻き戻せるframe数を返します
+#[no_mangle]
+pub unsafe extern "C" fn EmbeddedEmulator_GetRewindFrames(raw_rewind_ref: &mut u8) -> u32 {
+    let rewind_ref = convert_ref::<Rewind>(raw_rewind_ref);
+    (*rewind_ref).available_frames()
+}
@@ -1,4 +1,51 @@
+use super::apu_blip::*;
+use super::apu_log::*;
+use super::apu_mixer::*;
+use super::apu_resampler::*;
+use super::apu_ring::*;
+use super::apu_tap::*;
+use super::cassette::CassetteStorage;
+use super::clone_state::*;
 use super::cpu::*;
+use super::save_state::*;
+use super::system::*;
+use super::system_apu_reg::*;
+
+/// 再生時間カウンタのロード値。$4003などの上位5bitで選択する
+const LENGTH_TABLE: [u8; 32] = [
+    10, 254, 20, 2, 40, 4, 80, 6, 160, 8, 60, 10, 14, 12, 26, 14, 12, 16, 24, 18, 48, 20, 96, 22,
+    192, 24, 72, 26, 16, 28, 32, 30,
+];
+/// 矩形波のDuty Cycleごとの波形。MSBから順に出力する
+const PULSE_DUTY_TABLE: [u8; 4] = [0b0100_0000, 0b0110_0000, 0b0111_1000, 0b1001_1111];
+/// 三角波の波形
+const TRIANGLE_TABLE: [u8; 32] = [
+    15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12,
+    13, 14, 15,
+];
+/// ノイズのタイマ周期(CPUサイクル, NTSC)
+const NOISE_PERIOD_TABLE: [u16; 16] = [
+    4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068,
+];
+/// DMCのタイマ周期(CPUサイクル, NTSC)
+const DMC_RATE_TABLE: [u16; 16] = [
+    428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54,
+];
+/// Frame Sequencerの各stepのCPUサイクル(NTSC)。最後の要素が1周期
+const FRAME_SEQ_4STEP_TABLE: [u16; 4] = [7457, 14913, 22371, 29829];
+const FRAME_SEQ_5STEP_TABLE: [u16; 5] = [7457, 14913, 22371, 29829, 37281];
+/// Frame Sequencerの1周期のCPUサイクル
+const FRAME_SEQ_4STEP_PERIOD: u16 = 29830;
+const FRAME_SEQ_5STEP_PERIOD: u16 = 37282;
+
+/// 出力をリングバッファに書き出す間隔(CPUサイクル)。1/240秒ごと
+const APU_FLUSH_CYCLES: u32 = 7457;
+/// 1回の同期で合成する最大のCPUサイクル(1秒)。これより時刻が飛んだら、間を合成せずに時刻を合わせる
+const APU_MAX_CATCH_UP_CYCLES: u32 = CPU_FREQ;
+/// DMCがサンプルを1byte読み込むときにCPUを止めるサイクル数
+pub const DMC_DMA_STALL_CYCLES: u8 = 4;
+/// OAM DMAの転送中にDMCが読み込む場合は、OAM DMAの読み出しと重なる分だけ短くなる
+pub const DMC_DMA_STALL_CYCLES_DURING_OAM_DMA: u8 = 2;
 
 #[derive(Copy, Clone)]
 pub enum PulseDutyCycle {
@@ -151,29 +198,1279 @@ impl Default for DmcSound {
     }
 }
 
+/// 矩形波, ノイズの音量を決めるEnvelope
+#[derive(Copy, Clone, Default)]
+struct Envelope {
+    is_start: bool,
+    divider: u8,
+    decay: u8,
+}
+
+impl Envelope {
+    /// Quarter Frameごとに呼び出します
+    fn clock(&mut self, period: u8, is_loop: bool) {
+        if self.is_start {
+            self.is_start = false;
+            self.decay = 15;
+            self.divider = period;
+        } else if self.divider == 0 {
+            self.divider = period;
+            if self.decay > 0 {
+                self.decay = self.decay - 1;
+            } else if is_loop {
+                self.decay = 15;
+            }
+        } else {
+            self.divider = self.divider - 1;
+        }
+    }
+    fn volume(&self, is_constant_volume: bool, volume: u8) -> u8 {
+        if is_constant_volume {
+            volume
+        } else {
+            self.decay
+        }
+    }
+}
+
+/// 矩形波の内部状態
+#[derive(Copy, Clone, Default)]
+struct PulseChannel {
+    config: PulseSound,
+    /// pulse1はsweepの減算が1の補数になる
+    is_pulse1: bool,
+    /// sweepで変化するタイマ値
+    timer_period: u16,
+    /// 次に波形を進めるまでのCPUサイクル
+    timer_remain: u32,
+    seq: u8,
+    length: u8,
+    envelope: Envelope,
+    sweep_divider: u8,
+    is_sweep_reload: bool,
+}
+
+impl PulseChannel {
+    fn sweep_target(&self) -> u16 {
+        let change = self.timer_period >> self.config.sweep_shift;
+        if self.config.is_sweep_negative {
+            let sub = if self.is_pulse1 { change + 1 } else { change };
+            self.timer_period.saturating_sub(sub)
+        } else {
+            self.timer_period + change
+        }
+    }
+    fn is_muted(&self) -> bool {
+        self.timer_period < 8 || self.sweep_target() > 0x7ff
+    }
+    /// 波形を進める必要があればtrue
+    fn is_active(&self) -> bool {
+        self.length > 0 && !self.is_muted()
+    }
+    fn output(&self) -> u8 {
+        let duty = match self.config.duty_cycle {
+            PulseDutyCycle::Duty12_5 => PULSE_DUTY_TABLE[0],
+            PulseDutyCycle::Duty25_0 => PULSE_DUTY_TABLE[1],
+            PulseDutyCycle::Duty50_0 => PULSE_DUTY_TABLE[2],
+            PulseDutyCycle::Duty75_0 => PULSE_DUTY_TABLE[3],
+        };
+        if self.is_active() && ((duty << self.seq) & 0x80) == 0x80 {
+            self.envelope
+                .volume(self.config.is_constant_volume, self.config.volume)
+        } else {
+            0
+        }
+    }
+    fn period(&self) -> u32 {
+        (u32::from(self.timer_period) + 1) * 2
+    }
+    /// `offset` - 書き込まれたレジスタ(0-3)
+    fn write(&mut self, config: PulseSound, offset: usize, is_enable: bool) {
+        self.config = config;
+        match offset {
+            1 => self.is_sweep_reload = true,
+            2 => self.timer_period = config.timer_value,
+            3 => {
+                self.timer_period = config.timer_value;
+                if is_enable {
+                    self.length = LENGTH_TABLE[usize::from(config.length_counter_load)];
+                }
+                self.seq = 0;
+                self.envelope.is_start = true;
+            }
+            _ => {}
+        }
+    }
+    fn advance(&mut self, cyc: u32) {
+        if self.is_active() {
+            self.timer_remain = self.timer_remain - cyc;
+            if self.timer_remain == 0 {
+                self.timer_remain = self.period();
+                self.seq = (self.seq + 1) & 0x07;
+            }
+        }
+    }
+    fn clock_quarter(&mut self) {
+        self.envelope
+            .clock(self.config.volume, self.config.is_length_counter_halt);
+    }
+    fn clock_half(&mut self) {
+        if self.length > 0 && !self.config.is_length_counter_halt {
+            self.length = self.length - 1;
+        }
+        if self.sweep_divider == 0
+            && self.config.is_sweep_enable
+            && self.config.sweep_shift > 0
+            && !self.is_muted()
+        {
+            self.timer_period = self.sweep_target();
+        }
+        if self.sweep_divider == 0 || self.is_sweep_reload {
+            self.sweep_divider = self.config.sweep_period;
+            self.is_sweep_reload = false;
+        } else {
+            self.sweep_divider = self.sweep_divider - 1;
+        }
+    }
+}
+
+/// 三角波の内部状態
+#[derive(Copy, Clone, Default)]
+struct TriangleChannel {
+    config: TriangleSound,
+    timer_remain: u32,
+    seq: u8,
+    length: u8,
+    linear: u8,
+    is_linear_reload: bool,
+}
+
+impl TriangleChannel {
+    /// 波形を進める必要があればtrue。可聴域を超える周期(timer < 2)は止めておく
+    fn is_active(&self) -> bool {
+        self.length > 0 && self.linear > 0 && self.config.timer_value >= 2
+    }
+    /// 止まっている間も最後の値を出力し続ける
+    fn output(&self) -> u8 {
+        TRIANGLE_TABLE[usize::from(self.seq)]
+    }
+    fn period(&self) -> u32 {
+        u32::from(self.config.timer_value) + 1
+    }
+    fn write(&mut self, config: TriangleSound, offset: usize, is_enable: bool) {
+        self.config = config;
+        if offset == 3 {
+            if is_enable {
+                self.length = LENGTH_TABLE[usize::from(config.length_counter_load)];
+            }
+            self.is_linear_reload = true;
+        }
+    }
+    fn advance(&mut self, cyc: u32) {
+        if self.is_active() {
+            self.timer_remain = self.timer_remain - cyc;
+            if self.timer_remain == 0 {
+                self.timer_remain = self.period();
+                self.seq = (self.seq + 1) & 0x1f;
+            }
+        }
+    }
+    fn clock_quarter(&mut self) {
+        if self.is_linear_reload {
+            self.linear = self.config.counter_load;
+        } else if self.linear > 0 {
+            self.linear = self.linear - 1;
+        }
+        if !self.config.is_length_counter_halt {
+            self.is_linear_reload = false;
+        }
+    }
+    fn clock_half(&mut self) {
+        if self.length > 0 && !self.config.is_length_counter_halt {
+            self.length = self.length - 1;
+        }
+    }
+}
+
+/// ノイズの内部状態
+#[derive(Copy, Clone)]
+struct NoiseChannel {
+    config: NoiseSound,
+    timer_remain: u32,
+    /// 15bitの線形帰還シフトレジスタ
+    shift: u16,
+    length: u8,
+    envelope: Envelope,
+}
+
+impl Default for NoiseChannel {
+    fn default() -> Self {
+        Self {
+            config: NoiseSound::default(),
+            timer_remain: u32::from(NOISE_PERIOD_TABLE[0]),
+            shift: 1,
+            length: 0,
+            envelope: Envelope::default(),
+        }
+    }
+}
+
+impl NoiseChannel {
+    fn is_active(&self) -> bool {
+        self.length > 0
+    }
+    fn output(&self) -> u8 {
+        if self.is_active() && (self.shift & 0x01) == 0 {
+            self.envelope
+                .volume(self.config.is_constant_volume, self.config.volume)
+        } else {
+            0
+        }
+    }
+    fn period(&self) -> u32 {
+        u32::from(NOISE_PERIOD_TABLE[usize::from(self.config.noise_period)])
+    }
+    fn write(&mut self, config: NoiseSound, offset: usize, is_enable: bool) {
+        self.config = config;
+        if offset == 3 {
+            if is_enable {
+                self.length = LENGTH_TABLE[usize::from(config.length_counter_load)];
+            }
+            self.envelope.is_start = true;
+        }
+    }
+    fn advance(&mut self, cyc: u32) {
+        if self.is_active() {
+            self.timer_remain = self.timer_remain - cyc;
+            if self.timer_remain == 0 {
+                self.timer_remain = self.period();
+                let tap = if self.config.is_noise_type_loop { 6 } else { 1 };
+                let feedback = (self.shift ^ (self.shift >> tap)) & 0x01;
+                self.shift = (self.shift >> 1) | (feedback << 14);
+            }
+        }
+    }
+    fn clock_quarter(&mut self) {
+        self.envelope
+            .clock(self.config.volume, self.config.is_length_counter_halt);
+    }
+    fn clock_half(&mut self) {
+        if self.length > 0 && !self.config.is_length_counter_halt {
+            self.length = self.length - 1;
+        }
+    }
+}
+
+/// DMCがサンプルを読み込むメモリ
+pub trait DmcMemory {
+    /// `addr`から1byte読み出します
+    /// ret: Noneなら読み込まない。記録から再生するときは、記録した値を後から反映します
+    fn read_dmc(&mut self, addr: u16) -> Option<u8>;
+}
+
+/// DMCのDMA。読み込み先は0x8000 ~ 0xffffに限られるので、バスを経由せずカセットのPRG-ROMから直接読み出します
+/// CPUを止めるサイクル数を溜めておき、Apu::stepがCPUの時刻に反映します
+impl<S: CassetteStorage> DmcMemory for System<S> {
+    fn read_dmc(&mut self, addr: u16) -> Option<u8> {
+        let stall = if self.is_oam_dma_running {
+            DMC_DMA_STALL_CYCLES_DURING_OAM_DMA
+        } else {
+            DMC_DMA_STALL_CYCLES
+        };
+        self.dmc_stall_cycles = self.dmc_stall_cycles.saturating_add(stall);
+        Some(self.cassette.read_prg_rom(addr))
+    }
+}
+
+/// 記録から再生するときのDMCのメモリ。読み込みは記録したAPU_LOG_DMC_FETCHで反映する
+struct ReplayDmcMemory;
+
+impl DmcMemory for ReplayDmcMemory {
+    fn read_dmc(&mut self, _addr: u16) -> Option<u8> {
+        None
+    }
+}
+
+/// APUの出力先
+pub trait ApuSink {
+    /// 波形を合成するならtrue。falseなら$4015の値に関わる状態(Length Counter, Frame Sequencer, DMC)だけを進めます
+    const IS_SYNTHESIZE: bool;
+    /// 合成したサンプルを書き出します
+    fn push_samples(&self, samples: &[i16]);
+    /// 反映したレジスタへのアクセスと、DMCの読み込み, frameの区切りを時刻順に書き出します
+    fn push_access(&self, access: ApuRegAccess);
+}
+
+impl ApuSink for SampleRing {
+    const IS_SYNTHESIZE: bool = true;
+    fn push_samples(&self, samples: &[i16]) {
+        self.push(samples);
+    }
+    fn push_access(&self, _access: ApuRegAccess) {}
+}
+
+/// 出力を捨てるApuSink。$4015の値とIRQのためにAPUの状態だけを追う場合に使います
+pub struct ApuNullSink;
+
+impl ApuSink for ApuNullSink {
+    const IS_SYNTHESIZE: bool = false;
+    fn push_samples(&self, _samples: &[i16]) {}
+    fn push_access(&self, _access: ApuRegAccess) {}
+}
+
+/// DMCの内部状態
+#[derive(Copy, Clone)]
+struct DmcChannel {
+    config: DmcSound,
+    timer_remain: u32,
+    /// 出力レベル 7bit
+    output_level: u8,
+    /// 出力中のサンプル
+    shift: u8,
+    bits_remain: u8,
+    is_silence: bool,
+    /// 次に出力するサンプル
+    sample_buffer: u8,
+    is_sample_buffer_full: bool,
+    current_addr: u16,
+    bytes_remain: u16,
+    is_irq: bool,
+}
+
+impl Default for DmcChannel {
+    fn default() -> Self {
+        Self {
+            config: DmcSound::default(),
+            timer_remain: u32::from(DMC_RATE_TABLE[0]),
+            output_level: 0,
+            shift: 0,
+            bits_remain: 8,
+            is_silence: true,
+            sample_buffer: 0,
+            is_sample_buffer_full: false,
+            current_addr: 0xc000,
+            bytes_remain: 0,
+            is_irq: false,
+        }
+    }
+}
+
+impl DmcChannel {
+    /// 出力レベルが変化しうる間はtrue。サンプルを使い切って無音になったら止めておく
+    fn is_active(&self) -> bool {
+        !self.is_silence || self.is_sample_buffer_full || self.bytes_remain > 0
+    }
+    fn output(&self) -> u8 {
+        self.output_level
+    }
+    fn period(&self) -> u32 {
+        u32::from(DMC_RATE_TABLE[usize::from(self.config.frequency)])
+    }
+    /// 次の1byteを読み込むまでのCPUサイクル。停止中はNone
+    /// 読み込むたびにCPUを止めるので、同期してCPUの時刻に反映させる。最後の1byteでは$4015の値も変わる
+    fn fetch_remain(&self) -> Option<u32> {
+        if self.bytes_remain == 0 {
+            return None;
+        }
+        // サンプルバッファが空いていればタイマの次の更新で、そうでなければ出力中のサンプルを使い切ったら次の1byteを読み込む
+        if self.is_sample_buffer_full {
+            Some(self.timer_remain + u32::from(self.bits_remain - 1) * self.period())
+        } else {
+            Some(self.timer_remain)
+        }
+    }
+    fn restart(&mut self) {
+        self.current_addr = 0xc000 | (u16::from(self.config.sample_addr) << 6);
+        self.bytes_remain = (u16::from(self.config.sample_length) << 4) + 1;
+    }
+    fn write(&mut self, config: DmcSound, offset: usize) {
+        self.config = config;
+        match offset {
+            0 => {
+                if !config.is_irq_enable {
+                    self.is_irq = false;
+                }
+            }
+            1 => self.output_level = config.load_counter,
+            _ => {}
+        }
+    }
+    /// サンプルバッファが空なら次の1byteを読み込みます
+    /// ret: 読み込んだ値
+    fn fetch<M: DmcMemory>(&mut self, mem: &mut M) -> Option<u8> {
+        if self.is_sample_buffer_full || self.bytes_remain == 0 {
+            return None;
+        }
+        let data = mem.read_dmc(self.current_addr)?;
+        self.load(data);
+        Some(data)
+    }
+    /// 読み込んだ1byteをサンプルバッファに入れて、次のアドレスに進めます
+    fn load(&mut self, data: u8) {
+        if self.bytes_remain == 0 {
+            return;
+        }
+        self.sample_buffer = data;
+        self.is_sample_buffer_full = true;
+        self.current_addr = if self.current_addr == 0xffff {
+            0x8000
+        } else {
+            self.current_addr + 1
+        };
+        self.bytes_remain = self.bytes_remain - 1;
+        if self.bytes_remain == 0 {
+            if self.config.is_loop_enable {
+                self.restart();
+            } else if self.config.is_irq_enable {
+                self.is_irq = true;
+            }
+        }
+    }
+    /// ret: サンプルバッファに読み込んだ値
+    fn advance<M: DmcMemory>(&mut self, mem: &mut M, cyc: u32) -> Option<u8> {
+        if !self.is_active() {
+            return None;
+        }
+        self.timer_remain = self.timer_remain - cyc;
+        if self.timer_remain > 0 {
+            return None;
+        }
+        self.timer_remain = self.period();
+        if !self.is_silence {
+            if (self.shift & 0x01) == 0x01 {
+                if self.output_level <= 125 {
+                    self.output_level = self.output_level + 2;
+                }
+            } else if self.output_level >= 2 {
+                self.output_level = self.output_level - 2;
+            }
+        }
+        self.shift = self.shift >> 1;
+        self.bits_remain = self.bits_remain - 1;
+        if self.bits_remain == 0 {
+            self.bits_remain = 8;
+            if self.is_sample_buffer_full {
+                self.is_silence = false;
+                self.shift = self.sample_buffer;
+                self.is_sample_buffer_full = false;
+            } else {
+                self.is_silence = true;
+            }
+        }
+        self.fetch(mem)
+    }
+}
+
+/// ApuLogRingに書き出す、合成側のAPUとの状態の同期
+#[derive(Copy, Clone, PartialEq)]
+enum ApuResync {
+    /// 同期しない
+    None,
+    /// 電源投入時の状態に戻す
+    Reset,
+    /// Save Stateの読み込みなどで差し替えた状態を送る
+    State,
+}
+
+/// APU
+/// 矩形波x2, 三角波, ノイズ, DMCを合成し、帯域制限したステップ合成でサンプリング周波数に変換してリングバッファに書き出します
+/// 各チャンネルは出力が変化する時刻だけを順に処理するので、CPUサイクルごとの処理はありません
+/// レジスタへのアクセスはSystemが時刻と一緒に記録しておき、APUは$4015の値が変わりうるときだけ同期して、溜まった区間をまとめて合成します
 #[derive(Clone)]
 pub struct Apu {
-    /// Frame Sequencer、CPUサイクルに連動して加算 11bit
+    /// Frame Sequencer、CPUサイクルに連動して加算
     pub frame_seq_counter: u16,
+    /// Frame Sequencerの次のstep
+    frame_seq_step: u8,
+    is_frame_seq_5step: bool,
+    is_frame_irq_inhibit: bool,
+    is_frame_irq: bool,
+
+    pulse: [PulseChannel; 2],
+    triangle: TriangleChannel,
+    noise: NoiseChannel,
+    dmc: DmcChannel,
+
+    /// 記録から反映したレジスタの値
+    regs: [u8; APU_IO_REG_SIZE],
+    /// 合成し終えた時刻。System::apu_cycleと同じ基準で、一周したら0に戻る
+    time: u32,
+    /// blipの現在のフレームの先頭の時刻
+    frame_start: u32,
+    /// 次に同期が必要になるまでのCPUサイクル。timeからの差
+    sync_remain: u32,
+    /// 最後にblipに書き込んだミキサー出力
+    last_output: i32,
+    blip: BlipBuffer,
+    /// blipの出力をホストのサンプリング周波数に変換する
+    resampler: Resampler,
+    /// チャンネルごとの出力の書き出し先。nullなら書き出さない
+    channel_tap: *const ApuChannelTap,
+    /// 次の同期で合成側に送る状態。合成しない場合だけ書き出す
+    resync: ApuResync,
+    /// 記録から再生するときに、APU_LOG_RESYNC_DATAで受け取った状態
+    resync_buf: [u8; APU_SAVE_STATE_BYTES],
+    /// resync_bufに受け取る残りのbyte数。0なら受け取っていない
+    resync_remain: usize,
 }
+
 impl Default for Apu {
     fn default() -> Self {
-        Self {
+        let mut apu = Self {
             frame_seq_counter: 0,
-        }
+            frame_seq_step: 0,
+            is_frame_seq_5step: false,
+            is_frame_irq_inhibit: false,
+            is_frame_irq: false,
+            pulse: [PulseChannel::default(); 2],
+            triangle: TriangleChannel::default(),
+            noise: NoiseChannel::default(),
+            dmc: DmcChannel::default(),
+            regs: [0; APU_IO_REG_SIZE],
+            time: 0,
+            frame_start: 0,
+            // 最初のstepで時刻を合わせる
+            sync_remain: 0,
+            last_output: 0,
+            blip: BlipBuffer::default(),
+            resampler: Resampler::default(),
+            channel_tap: core::ptr::null(),
+            // 合成側も電源投入時の状態から始める
+            resync: ApuResync::Reset,
+            resync_buf: [0; APU_SAVE_STATE_BYTES],
+            resync_remain: 0,
+        };
+        apu.reset_channels();
+        apu
     }
 }
 
+/// 合成に使うサンプリング周波数。CPUクロックを整数で割った、`sample_rate`に最も近い周波数
+pub fn apu_synth_rate(sample_rate: u32) -> u32 {
+    let divider = core::cmp::max(1, (CPU_FREQ + sample_rate / 2) / sample_rate);
+    core::cmp::min(BLIP_MAX_SAMPLE_RATE, CPU_FREQ / divider)
+}
+
 impl Apu {
-    /// FrameSeq
-    /// TODO: 実装
-    #[allow(dead_code)]
-    fn increment_seq(&mut self, cpu_cyc: u8) {
-        self.frame_seq_counter = (self.frame_seq_counter + u16::from(cpu_cyc)) & 0x03ff;
-        // 11bit
-    }
-    /// APUの処理を進めます
-    pub fn step(&mut self, _cpu: &mut Cpu, _cpu_cyc: u8) {
-        // TODO:がんばる
+    /// サンプリング周波数を設定します。内部状態はリセットされます
+    /// 合成はCPUクロックを整数で割った、`sample_rate`に最も近い周波数で行い、Resamplerで`sample_rate`に変換します
+    /// ret: 対応していない周波数(0, BLIP_MAX_SAMPLE_RATEより大きい)ならfalse
+    pub fn init(&mut self, sample_rate: u32) -> bool {
+        *self = Self::default();
+        if sample_rate == 0 || sample_rate > BLIP_MAX_SAMPLE_RATE {
+            return false;
+        }
+        let synth_rate = apu_synth_rate(sample_rate);
+        if !self.blip.set_sample_rate(synth_rate) || !self.resampler.init(synth_rate, sample_rate) {
+            return false;
+        }
+        // 三角波は無音でも0にならないので、最初の出力を時刻0に置いておく
+        // 最初に合成する時刻(同期やアクセスの再生)によって波形が変わらないようにする
+        self.update_output();
+        true
+    }
+
+    /// 出力のサンプリング周波数を`ppm`だけ設定値からずらします。ホストのオーディオ出力との速度差を吸収するのに使います
+    /// `ppm` - 正なら合成したサンプルを速く消費し、出力サンプル数が減ります。±RESAMPLER_MAX_ADJUST_PPMに制限します
+    pub fn set_rate_adjust(&mut self, ppm: i32) {
+        self.resampler.adjust(ppm);
+        if let Some(tap) = self.channel_tap() {
+            tap.set_rate_adjust(ppm);
+        }
+    }
+
+    /// サンプリング周波数変換の積和の実装を選びます
+    /// ret: 実行中のCPUで使えなければfalse
+    pub fn set_resampler_kernel(&mut self, kernel: ResamplerKernel) -> bool {
+        if let Some(tap) = self.channel_tap() {
+            if !tap.set_resampler_kernel(kernel) {
+                return false;
+            }
+        }
+        self.resampler.set_kernel(kernel)
+    }
+
+    /// チャンネルごとの出力を取り付けます。以降の合成で、ミキサーの出力と一緒に各チャンネルの出力も書き出します
+    /// 取り付けた時刻から書き出すので、ミキサーの出力とは取り付けるまでのサンプル数だけずれます。InitApuの直後に取り付けてください
+    /// 取り付けていなければ、合成の処理は増えません
+    /// `tap` - initでこのApuと同じサンプリング周波数を設定したもの。取り外すまで移動や解放をしないでください。nullなら取り外します
+    pub unsafe fn attach_channel_tap(&mut self, tap: *const ApuChannelTap) {
+        self.channel_tap = tap;
+        // 三角波など無音でも0でないチャンネルの出力を、取り付けた時刻に置いておく
+        self.update_output();
+    }
+
+    fn channel_tap(&self) -> Option<&ApuChannelTap> {
+        if self.channel_tap.is_null() {
+            None
+        } else {
+            Some(unsafe { &*self.channel_tap })
+        }
+    }
+
+    /// Frame Sequencerと各チャンネルを電源投入時の状態に戻します
+    /// 合成の設定(サンプリング周波数など)と出力先はそのまま
+    /// `now` - System::apu_cycle。この時刻から合成を再開します
+    pub fn reset_state(&mut self, now: u32) {
+        self.reset_channels();
+        self.restore_time(now);
+        self.resync = ApuResync::Reset;
+    }
+
+    fn reset_channels(&mut self) {
+        self.frame_seq_counter = 0;
+        self.frame_seq_step = 0;
+        self.is_frame_seq_5step = false;
+        self.is_frame_irq_inhibit = false;
+        self.is_frame_irq = false;
+        self.pulse = [PulseChannel::default(); 2];
+        self.pulse[0].is_pulse1 = true;
+        for p in self.pulse.iter_mut() {
+            p.timer_remain = p.period();
+        }
+        self.triangle = TriangleChannel::default();
+        self.triangle.timer_remain = self.triangle.period();
+        self.noise = NoiseChannel::default();
+        self.dmc = DmcChannel::default();
+        self.regs = [0; APU_IO_REG_SIZE];
+    }
+
+    /// Save Stateの読み込みや複製で状態を差し替えた後に、合成し終えた時刻を`time`に移します
+    /// blipのフレームはそのまま続け、出力の変化は次に合成するときに書き込みます。次のstepで必ず同期します
+    fn restore_time(&mut self, time: u32) {
+        self.rebase(time);
+        self.sync_remain = 0;
+    }
+
+    /// $4015を読んだときの値
+    pub fn status(&self) -> u8 {
+        (if self.dmc.is_irq {
+            APU_STATUS_DMC_IRQ
+        } else {
+            0
+        }) | (if self.is_frame_irq {
+            APU_STATUS_FRAME_IRQ
+        } else {
+            0
+        }) | (if self.dmc.bytes_remain > 0 { 0x10 } else { 0 })
+            | (if self.noise.length > 0 { 0x08 } else { 0 })
+            | (if self.triangle.length > 0 { 0x04 } else { 0 })
+            | (if self.pulse[1].length > 0 { 0x02 } else { 0 })
+            | (if self.pulse[0].length > 0 { 0x01 } else { 0 })
+    }
+
+    /// APUの時刻を進めます。Cpu::stepの後に、消費したサイクル数を渡して呼び出してください
+    /// 合成するのは同期が必要なときだけで、それ以外は時刻を進めるだけです
+    /// `out` - SampleRingなら合成したサンプルを、ApuLogRingならレジスタへのアクセスを書き出します
+    /// ret: DMCのDMAでCPUが止まったサイクル数。PPUなどCPU以外の時刻も、この分だけ余計に進めてください
+    #[inline]
+    pub fn step<S: CassetteStorage, O: ApuSink>(
+        &mut self,
+        system: &mut System<S>,
+        out: &O,
+        cpu_cyc: u8,
+    ) -> u8 {
+        system.apu_cycle = system.apu_cycle.wrapping_add(u32::from(cpu_cyc));
+        // Save Stateの読み込みなどで時刻が戻った場合も、差が大きくなるので同期する
+        if system.is_apu_sync_requested
+            || system.apu_cycle.wrapping_sub(self.time) >= self.sync_remain
+        {
+            self.sync(system, out);
+        }
+        // 読み込みは同期したときにまとめて行うが、読み込む時刻で同期するので遅れは1命令以内
+        let stall = system.dmc_stall_cycles;
+        if stall > 0 {
+            system.dmc_stall_cycles = 0;
+            system.apu_cycle = system.apu_cycle.wrapping_add(u32::from(stall));
+        }
+        stall
+    }
+
+    /// 記録されたレジスタへのアクセスを時刻順に反映しながら、System::apu_cycleまで合成します
+    pub fn sync<S: CassetteStorage, O: ApuSink>(&mut self, system: &mut System<S>, out: &O) {
+        let now = system.apu_cycle;
+        let elapsed = now.wrapping_sub(self.time);
+        if (elapsed as i32) < 0 || elapsed > APU_MAX_CATCH_UP_CYCLES {
+            // Save Stateの読み込みやリセットで時刻が飛んだ。飛んだ区間は合成しない
+            self.rebase(now);
+        }
+        if self.resync != ApuResync::None {
+            if !O::IS_SYNTHESIZE {
+                self.push_resync(out);
+            }
+            self.resync = ApuResync::None;
+        }
+        for index in 0..system.apu_log_len {
+            let access = system.apu_log[index];
+            self.run(system, out, access.cycle);
+            out.push_access(access);
+            self.apply_access(system, out, access.offset, access.data);
+        }
+        system.apu_log_len = 0;
+        system.is_apu_sync_requested = false;
+        self.run(system, out, now);
+        system.apu_status = self.status();
+        self.sync_remain = self.next_sync_remain::<O>();
+    }
+
+    /// System::apu_cycleまで合成し、溜まっている出力を書き出します
+    /// ホストがサンプルを必要としたときや、frameの終わりに呼び出してください
+    pub fn flush<S: CassetteStorage, O: ApuSink>(&mut self, system: &mut System<S>, out: &O) {
+        self.sync(system, out);
+        self.end_frame(out);
+    }
+
+    /// 記録されたアクセスを1つ再生して合成します。ApuLogRingに書き出した記録を、別のスレッドやオフラインで合成するのに使います
+    pub fn replay<O: ApuSink>(&mut self, access: ApuRegAccess, out: &O) {
+        let elapsed = access.cycle.wrapping_sub(self.time);
+        if (elapsed as i32) < 0 || elapsed > APU_MAX_CATCH_UP_CYCLES {
+            self.rebase(access.cycle);
+        }
+        let mut mem = ReplayDmcMemory;
+        self.run(&mut mem, out, access.cycle);
+        match access.offset {
+            APU_LOG_DMC_FETCH => self.dmc.load(access.data),
+            APU_LOG_FRAME_END => self.end_frame(out),
+            APU_LOG_RESYNC => self.begin_resync(access),
+            APU_LOG_RESYNC_DATA => self.receive_resync(access.data),
+            _ => self.apply_access(&mut mem, out, access.offset, access.data),
+        }
+    }
+
+    /// 合成側のAPUを今の状態に合わせる記録を書き出します
+    fn push_resync<O: ApuSink>(&self, out: &O) {
+        let mut access = ApuRegAccess {
+            cycle: self.time,
+            offset: APU_LOG_RESYNC,
+            data: APU_LOG_RESYNC_RESET,
+        };
+        if self.resync == ApuResync::Reset {
+            out.push_access(access);
+            return;
+        }
+        let mut buf = [0u8; APU_SAVE_STATE_BYTES];
+        self.save_state(&mut SaveStateWriter::new(&mut buf));
+        access.data = APU_LOG_RESYNC_STATE;
+        out.push_access(access);
+        access.offset = APU_LOG_RESYNC_DATA;
+        for data in buf.iter() {
+            access.data = *data;
+            out.push_access(access);
+        }
+    }
+
+    fn begin_resync(&mut self, access: ApuRegAccess) {
+        if access.data == APU_LOG_RESYNC_STATE {
+            self.resync_remain = APU_SAVE_STATE_BYTES;
+        } else {
+            self.reset_state(access.cycle);
+            self.resync = ApuResync::None;
+            self.resync_remain = 0;
+        }
+    }
+
+    /// 状態を1byte受け取り、揃ったら読み込みます
+    /// エミュレーション側は波形を進めていないので、波形の位相(タイマ, シーケンサ, ノイズのシフトレジスタ)は合成側のものを使い続けます
+    /// 位相以外はエミュレーション側と一致しているので、同じ状態を何度受け取っても出力は変わりません
+    fn receive_resync(&mut self, data: u8) {
+        if self.resync_remain == 0 {
+            // 途中から読み始めた記録の端数
+            return;
+        }
+        self.resync_buf[APU_SAVE_STATE_BYTES - self.resync_remain] = data;
+        self.resync_remain = self.resync_remain - 1;
+        if self.resync_remain > 0 {
+            return;
+        }
+        let pulse = self.pulse;
+        let triangle = self.triangle;
+        let noise = self.noise;
+        let buf = self.resync_buf;
+        self.load_state(&mut SaveStateReader::new(&buf));
+        for (p, prev) in self.pulse.iter_mut().zip(pulse.iter()) {
+            p.timer_remain = prev.timer_remain;
+            p.seq = prev.seq;
+        }
+        self.triangle.timer_remain = triangle.timer_remain;
+        self.triangle.seq = triangle.seq;
+        self.noise.timer_remain = noise.timer_remain;
+        self.noise.shift = noise.shift;
+        self.resync = ApuResync::None;
+    }
+
+    /// blipの現在のフレームを終了して、出力を書き出します
+    /// 合成しない場合は、frameの区切りを書き出します
+    fn end_frame<O: ApuSink>(&mut self, out: &O) {
+        if !O::IS_SYNTHESIZE {
+            out.push_access(ApuRegAccess {
+                cycle: self.time,
+                offset: APU_LOG_FRAME_END,
+                data: 0,
+            });
+            return;
+        }
+        let elapsed = self.time.wrapping_sub(self.frame_start);
+        self.blip.end_frame(elapsed);
+        if let Some(tap) = self.channel_tap() {
+            tap.end_frame(elapsed);
+        }
+        self.frame_start = self.time;
+        let mut samples = [0i16; 256];
+        while self.blip.samples_avail() > 0 {
+            let count = self.blip.read_samples(&mut samples);
+            self.resampler.process(&samples[..count], out);
+        }
+    }
+
+    /// 合成し終えた時刻を`now`に移します
+    fn rebase(&mut self, now: u32) {
+        let frame_elapsed = self.time.wrapping_sub(self.frame_start);
+        self.time = now;
+        self.frame_start = now.wrapping_sub(frame_elapsed);
+    }
+
+    /// 次に同期が必要になるまでのCPUサイクル
+    /// $4015の値はFrame Sequencerのstep(Length Counter, Frame IRQ)とDMCの再生終了でしか変わらず、
+    /// blipのバッファが溢れないように一定間隔でも書き出します
+    /// DMCの読み込みはCPUを止めるので、読み込むたびに同期します
+    fn next_sync_remain<O: ApuSink>(&self) -> u32 {
+        let flush_remain = if O::IS_SYNTHESIZE {
+            APU_FLUSH_CYCLES.saturating_sub(self.time.wrapping_sub(self.frame_start))
+        } else {
+            APU_MAX_CATCH_UP_CYCLES
+        };
+        let remain = core::cmp::min(flush_remain, self.frame_seq_remain());
+        match self.dmc.fetch_remain() {
+            Some(dmc_remain) => core::cmp::min(remain, dmc_remain),
+            None => remain,
+        }
+    }
+
+    /// 記録されたレジスタへのアクセスを1つ反映します
+    fn apply_access<M: DmcMemory, O: ApuSink>(
+        &mut self,
+        mem: &mut M,
+        out: &O,
+        offset: u8,
+        data: u8,
+    ) {
+        if offset == APU_REG_LOG_READ_STATUS {
+            // Frame IRQフラグのクリア
+            self.is_frame_irq = false;
+            return;
+        }
+        let index = usize::from(offset);
+        self.regs[index] = data;
+        match index {
+            0x00..=0x03 => {
+                let config = decode_apu_pulse_regs(&self.regs, 0);
+                let is_enable = self.is_enable(0x01);
+                self.pulse[0].write(config, index - APU_PULSE_1_OFFSET, is_enable);
+            }
+            0x04..=0x07 => {
+                let config = decode_apu_pulse_regs(&self.regs, 1);
+                let is_enable = self.is_enable(0x02);
+                self.pulse[1].write(config, index - APU_PULSE_2_OFFSET, is_enable);
+            }
+            0x08..=0x0b => {
+                let config = decode_apu_tri_regs(&self.regs);
+                let is_enable = self.is_enable(0x04);
+                self.triangle
+                    .write(config, index - APU_TRIANGLE_OFFSET, is_enable);
+            }
+            0x0c..=0x0f => {
+                let config = decode_apu_noise_regs(&self.regs);
+                let is_enable = self.is_enable(0x08);
+                self.noise
+                    .write(config, index - APU_NOISE_OFFSET, is_enable);
+            }
+            0x10..=0x13 => {
+                let config = decode_apu_dmc_regs(&self.regs);
+                self.dmc.write(config, index - APU_DMC_OFFSET);
+            }
+            APU_STATUS_OFFSET => self.write_status(mem, out),
+            APU_FRAMECOUNTER_OFFSET => {
+                self.is_frame_seq_5step = (data & 0x80) == 0x80;
+                self.is_frame_irq_inhibit = (data & 0x40) == 0x40;
+                if self.is_frame_irq_inhibit {
+                    self.is_frame_irq = false;
+                }
+                self.frame_seq_counter = 0;
+                self.frame_seq_step = 0;
+                // 5-step modeは書き込んだ直後にQuarter/Half Frameを1回進める
+                if self.is_frame_seq_5step {
+                    self.clock_quarter_frame();
+                    self.clock_half_frame();
+                }
+            }
+            _ => {}
+        }
+        if O::IS_SYNTHESIZE {
+            self.update_output();
+        }
+    }
+
+    /// $4015 ---DNT21 のチャンネルが有効ならtrue
+    fn is_enable(&self, mask: u8) -> bool {
+        (self.regs[APU_STATUS_OFFSET] & mask) == mask
+    }
+
+    /// $4015 チャンネルの有効/無効
+    fn write_status<M: DmcMemory, O: ApuSink>(&mut self, mem: &mut M, out: &O) {
+        for (index, p) in self.pulse.iter_mut().enumerate() {
+            if (self.regs[APU_STATUS_OFFSET] & (1 << index)) == 0 {
+                p.length = 0;
+            }
+        }
+        if !self.is_enable(0x04) {
+            self.triangle.length = 0;
+        }
+        if !self.is_enable(0x08) {
+            self.noise.length = 0;
+        }
+        self.dmc.is_irq = false;
+        if !self.is_enable(0x10) {
+            self.dmc.bytes_remain = 0;
+        } else if self.dmc.bytes_remain == 0 {
+            let was_active = self.dmc.is_active();
+            self.dmc.restart();
+            if !was_active {
+                self.dmc.timer_remain = self.dmc.period();
+            }
+            if let Some(data) = self.dmc.fetch(mem) {
+                self.push_dmc_fetch(out, data);
+            }
+        }
+    }
+
+    /// DMCの読み込みを書き出します
+    fn push_dmc_fetch<O: ApuSink>(&self, out: &O, data: u8) {
+        out.push_access(ApuRegAccess {
+            cycle: self.time,
+            offset: APU_LOG_DMC_FETCH,
+            data,
+        });
+    }
+
+    /// `end`まで各チャンネルを進めます。出力が変化した時刻ごとにblipに書き込み、一定間隔で書き出します
+    /// 合成しない場合は、矩形波, 三角波, ノイズの波形は進めません
+    fn run<M: DmcMemory, O: ApuSink>(&mut self, mem: &mut M, out: &O, end: u32) {
+        // 既に合成し終えた時刻なら何もしない
+        while (end.wrapping_sub(self.time) as i32) > 0 {
+            // 次にいずれかの状態が変わる時刻まで進める
+            let mut cyc = end.wrapping_sub(self.time);
+            cyc = core::cmp::min(cyc, self.frame_seq_remain());
+            if O::IS_SYNTHESIZE {
+                let frame_elapsed = self.time.wrapping_sub(self.frame_start);
+                cyc = core::cmp::min(cyc, APU_FLUSH_CYCLES.saturating_sub(frame_elapsed));
+                for p in self.pulse.iter() {
+                    if p.is_active() {
+                        cyc = core::cmp::min(cyc, p.timer_remain);
+                    }
+                }
+                if self.triangle.is_active() {
+                    cyc = core::cmp::min(cyc, self.triangle.timer_remain);
+                }
+                if self.noise.is_active() {
+                    cyc = core::cmp::min(cyc, self.noise.timer_remain);
+                }
+            }
+            if self.dmc.is_active() {
+                cyc = core::cmp::min(cyc, self.dmc.timer_remain);
+            }
+
+            if cyc > 0 {
+                if O::IS_SYNTHESIZE {
+                    for p in self.pulse.iter_mut() {
+                        p.advance(cyc);
+                    }
+                    self.triangle.advance(cyc);
+                    self.noise.advance(cyc);
+                }
+                let fetched = self.dmc.advance(mem, cyc);
+                self.increment_seq(cyc);
+                self.time = self.time.wrapping_add(cyc);
+                if let Some(data) = fetched {
+                    self.push_dmc_fetch(out, data);
+                }
+                if O::IS_SYNTHESIZE {
+                    self.update_output();
+                }
+            }
+            if O::IS_SYNTHESIZE && self.time.wrapping_sub(self.frame_start) >= APU_FLUSH_CYCLES {
+                self.end_frame(out);
+            }
+        }
+    }
+
+    /// ミキサーの出力が変わっていればblipに書き込みます
+    /// チャンネルごとの出力を取り付けていれば、各チャンネルを単独で鳴らした出力も書き込みます
+    fn update_output(&mut self) {
+        let time = self.time.wrapping_sub(self.frame_start);
+        let output = self.mix();
+        if output != self.last_output {
+            self.blip.add_delta(time, output - self.last_output);
+            self.last_output = output;
+        }
+        if let Some(tap) = self.channel_tap() {
+            tap.update_output(
+                time,
+                &[
+                    i32::from(mix::<i16>(self.pulse[0].output(), 0, 0, 0, 0)),
+                    i32::from(mix::<i16>(0, self.pulse[1].output(), 0, 0, 0)),
+                    i32::from(mix::<i16>(0, 0, self.triangle.output(), 0, 0)),
+                    i32::from(mix::<i16>(0, 0, 0, self.noise.output(), 0)),
+                    i32::from(mix::<i16>(0, 0, 0, 0, self.dmc.output())),
+                ],
+            );
+        }
+    }
+
+    /// 各チャンネルの出力を混ぜます
+    fn mix(&self) -> i32 {
+        i32::from(mix::<i16>(
+            self.pulse[0].output(),
+            self.pulse[1].output(),
+            self.triangle.output(),
+            self.noise.output(),
+            self.dmc.output(),
+        ))
+    }
+
+    /// Frame Sequencerの次のstepまでのCPUサイクル
+    fn frame_seq_remain(&self) -> u32 {
+        let table: &[u16] = if self.is_frame_seq_5step {
+            &FRAME_SEQ_5STEP_TABLE
+        } else {
+            &FRAME_SEQ_4STEP_TABLE
+        };
+        let next = if usize::from(self.frame_seq_step) < table.len() {
+            table[usize::from(self.frame_seq_step)]
+        } else if self.is_frame_seq_5step {
+            FRAME_SEQ_5STEP_PERIOD
+        } else {
+            FRAME_SEQ_4STEP_PERIOD
+        };
+        u32::from(next - self.frame_seq_counter)
+    }
+
+    /// Frame Sequencerを進めます
+    fn increment_seq(&mut self, cpu_cyc: u32) {
+        let remain = self.frame_seq_remain();
+        self.frame_seq_counter = self.frame_seq_counter + cpu_cyc as u16;
+        if cpu_cyc < remain {
+            return;
+        }
+        let num_of_steps = if self.is_frame_seq_5step { 5 } else { 4 };
+        if self.frame_seq_step == num_of_steps {
+            // 1周したので最初に戻る
+            self.frame_seq_counter = 0;
+            self.frame_seq_step = 0;
+            return;
+        }
+        match (self.is_frame_seq_5step, self.frame_seq_step) {
+            (_, 0) | (_, 2) => self.clock_quarter_frame(),
+            (false, 1) | (true, 1) => {
+                self.clock_quarter_frame();
+                self.clock_half_frame();
+            }
+            (false, 3) => {
+                self.clock_quarter_frame();
+                self.clock_half_frame();
+                if !self.is_frame_irq_inhibit {
+                    self.is_frame_irq = true;
+                }
+            }
+            (true, 4) => {
+                self.clock_quarter_frame();
+                self.clock_half_frame();
+            }
+            _ => {}
+        }
+        self.frame_seq_step = self.frame_seq_step + 1;
+    }
+
+    /// Envelope, 三角波のLinear Counter
+    fn clock_quarter_frame(&mut self) {
+        for p in self.pulse.iter_mut() {
+            p.clock_quarter();
+        }
+        self.triangle.clock_quarter();
+        self.noise.clock_quarter();
+    }
+
+    /// Length Counter, Sweep
+    fn clock_half_frame(&mut self) {
+        for p in self.pulse.iter_mut() {
+            p.clock_half();
+        }
+        self.triangle.clock_half();
+        self.noise.clock_half();
+    }
+}
+
+/// Apu::save_stateが書き出すバイト数。Apuを持たないホストの場合も、同じサイズの領域を確保します
+pub const APU_SAVE_STATE_BYTES: usize = 93;
+
+impl SaveState for Envelope {
+    fn save_state(&self, writer: &mut SaveStateWriter) {
+        writer.write_bool(self.is_start);
+        writer.write_u8(self.divider);
+        writer.write_u8(self.decay);
+    }
+    fn load_state(&mut self, reader: &mut SaveStateReader) {
+        self.is_start = reader.read_bool();
+        self.divider = reader.read_u8();
+        self.decay = reader.read_u8();
+    }
+}
+
+impl SaveState for PulseChannel {
+    /// configはレジスタの値から作り直すので含めない
+    fn save_state(&self, writer: &mut SaveStateWriter) {
+        writer.write_u16(self.timer_period);
+        writer.write_u32(self.timer_remain);
+        writer.write_u8(self.seq);
+        writer.write_u8(self.length);
+        self.envelope.save_state(writer);
+        writer.write_u8(self.sweep_divider);
+        writer.write_bool(self.is_sweep_reload);
+    }
+    fn load_state(&mut self, reader: &mut SaveStateReader) {
+        self.timer_period = reader.read_u16();
+        self.timer_remain = reader.read_u32();
+        self.seq = reader.read_u8();
+        self.length = reader.read_u8();
+        self.envelope.load_state(reader);
+        self.sweep_divider = reader.read_u8();
+        self.is_sweep_reload = reader.read_bool();
+    }
+}
+
+impl SaveState for TriangleChannel {
+    fn save_state(&self, writer: &mut SaveStateWriter) {
+        writer.write_u32(self.timer_remain);
+        writer.write_u8(self.seq);
+        writer.write_u8(self.length);
+        writer.write_u8(self.linear);
+        writer.write_bool(self.is_linear_reload);
+    }
+    fn load_state(&mut self, reader: &mut SaveStateReader) {
+        self.timer_remain = reader.read_u32();
+        self.seq = reader.read_u8();
+        self.length = reader.read_u8();
+        self.linear = reader.read_u8();
+        self.is_linear_reload = reader.read_bool();
+    }
+}
+
+impl SaveState for NoiseChannel {
+    fn save_state(&self, writer: &mut SaveStateWriter) {
+        writer.write_u32(self.timer_remain);
+        writer.write_u16(self.shift);
+        writer.write_u8(self.length);
+        self.envelope.save_state(writer);
+    }
+    fn load_state(&mut self, reader: &mut SaveStateReader) {
+        self.timer_remain = reader.read_u32();
+        self.shift = reader.read_u16();
+        self.length = reader.read_u8();
+        self.envelope.load_state(reader);
+    }
+}
+
+impl SaveState for DmcChannel {
+    fn save_state(&self, writer: &mut SaveStateWriter) {
+        writer.write_u32(self.timer_remain);
+        writer.write_u8(self.output_level);
+        writer.write_u8(self.shift);
+        writer.write_u8(self.bits_remain);
+        writer.write_bool(self.is_silence);
+        writer.write_u8(self.sample_buffer);
+        writer.write_bool(self.is_sample_buffer_full);
+        writer.write_u16(self.current_addr);
+        writer.write_u16(self.bytes_remain);
+        writer.write_bool(self.is_irq);
+    }
+    fn load_state(&mut self, reader: &mut SaveStateReader) {
+        self.timer_remain = reader.read_u32();
+        self.output_level = reader.read_u8();
+        self.shift = reader.read_u8();
+        self.bits_remain = reader.read_u8();
+        self.is_silence = reader.read_bool();
+        self.sample_buffer = reader.read_u8();
+        self.is_sample_buffer_full = reader.read_bool();
+        self.current_addr = reader.read_u16();
+        self.bytes_remain = reader.read_u16();
+        self.is_irq = reader.read_bool();
+    }
+}
+
+impl SaveState for Apu {
+    /// blip, resamplerに溜まっている出力と合成の設定はホスト側のものなので含めない
+    fn save_state(&self, writer: &mut SaveStateWriter) {
+        let start = writer.position();
+        writer.write_u16(self.frame_seq_counter);
+        writer.write_u8(self.frame_seq_step);
+        writer.write_bool(self.is_frame_seq_5step);
+        writer.write_bool(self.is_frame_irq_inhibit);
+        writer.write_bool(self.is_frame_irq);
+
+        for p in self.pulse.iter() {
+            p.save_state(writer);
+        }
+        self.triangle.save_state(writer);
+        self.noise.save_state(writer);
+        self.dmc.save_state(writer);
+
+        writer.write_bytes(&self.regs);
+        writer.write_u32(self.time);
+        debug_assert!(writer.position() - start == APU_SAVE_STATE_BYTES);
+    }
+    fn load_state(&mut self, reader: &mut SaveStateReader) {
+        self.frame_seq_counter = reader.read_u16();
+        self.frame_seq_step = reader.read_u8();
+        self.is_frame_seq_5step = reader.read_bool();
+        self.is_frame_irq_inhibit = reader.read_bool();
+        self.is_frame_irq = reader.read_bool();
+
+        for p in self.pulse.iter_mut() {
+            p.load_state(reader);
+        }
+        self.triangle.load_state(reader);
+        self.noise.load_state(reader);
+        self.dmc.load_state(reader);
+
+        reader.read_bytes(&mut self.regs);
+        // 各チャンネルの設定はレジスタの値から作り直す
+        self.pulse[0].config = decode_apu_pulse_regs(&self.regs, 0);
+        self.pulse[1].config = decode_apu_pulse_regs(&self.regs, 1);
+        self.triangle.config = decode_apu_tri_regs(&self.regs);
+        self.noise.config = decode_apu_noise_regs(&self.regs);
+        self.dmc.config = decode_apu_dmc_regs(&self.regs);
+
+        let time = reader.read_u32();
+        self.restore_time(time);
+        self.resync = ApuResync::State;
+    }
+}
+
+impl CloneState for Apu {
+    /// 合成の設定と出力先は複製先のものを維持します
+    fn clone_state_from(&mut self, src: &Self) {
+        self.frame_seq_counter = src.frame_seq_counter;
+        self.frame_seq_step = src.frame_seq_step;
+        self.is_frame_seq_5step = src.is_frame_seq_5step;
+        self.is_frame_irq_inhibit = src.is_frame_irq_inhibit;
+        self.is_frame_irq = src.is_frame_irq;
+
+        self.pulse = src.pulse;
+        self.triangle = src.triangle;
+        self.noise = src.noise;
+        self.dmc = src.dmc;
+
+        self.regs = src.regs;
+        self.restore_time(src.time);
+        self.resync = ApuResync::State;
     }
 }
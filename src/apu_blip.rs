@@ -0,0 +1,218 @@
+use super::cpu::CPU_FREQ;
+
+/// 帯域制限したステップ関数の位相数(2^BLIP_PHASE_BITS)
+const BLIP_PHASE_BITS: u32 = 5;
+const BLIP_PHASES: usize = 1 << BLIP_PHASE_BITS;
+/// 1つのステップを展開するサンプル数
+pub const BLIP_TAPS: usize = 16;
+/// サンプル位置の固定小数点の小数部bit数
+const BLIP_FRAC_BITS: u32 = 20;
+/// カーネルの係数のbit数。各位相の係数の合計が 1 << BLIP_KERNEL_BITS になっている
+const BLIP_KERNEL_BITS: u32 = 15;
+/// 一度に溜めておけるサンプル数。end_frameの間隔はこれに収まるようにすること
+pub const BLIP_BUFFER_SIZE: usize = 1024;
+/// 対応する最大のサンプリング周波数
+pub const BLIP_MAX_SAMPLE_RATE: u32 = 96000;
+/// 直流成分を取り除くハイパスフィルタの強さ。大きいほどカットオフ周波数が低い
+const BLIP_BASS_SHIFT: u32 = 9;
+
+/// Blackman窓をかけたsinc関数(カットオフ 0.45fs)を積分したステップの差分
+/// `[位相][tap]`。tap 7が遅延0の位置で、各位相の合計は 1 << BLIP_KERNEL_BITS
+const BLIP_KERNEL: [[i16; BLIP_TAPS]; BLIP_PHASES] = [
+    [
+        18, -110, 359, -843, 1561, -2371, 3025, 29490, 3025, -2371, 1561, -843, 359, -110, 18, 0,
+    ],
+    [
+        17, -108, 347, -795, 1421, -2025, 2117, 29452, 3974, -2714, 1693, -887, 369, -111, 18, 0,
+    ],
+    [
+        17, -105, 332, -742, 1276, -1679, 1252, 29332, 4960, -3051, 1818, -925, 376, -110, 17, 0,
+    ],
+    [
+        16, -102, 315, -686, 1128, -1335, 434, 29131, 5981, -3378, 1932, -956, 380, -109, 17, 0,
+    ],
+    [
+        16, -98, 297, -627, 977, -997, -336, 28853, 7031, -3693, 2036, -982, 381, -106, 16, 0,
+    ],
+    [
+        15, -93, 277, -566, 824, -665, -1055, 28499, 8106, -3992, 2127, -999, 378, -103, 15, 0,
+    ],
+    [
+        14, -87, 256, -503, 672, -343, -1721, 28067, 9203, -4273, 2204, -1009, 372, -97, 13, 0,
+    ],
+    [
+        13, -82, 234, -439, 522, -34, -2334, 27565, 10317, -4531, 2266, -1011, 362, -91, 11, 0,
+    ],
+    [
+        12, -76, 211, -375, 374, 262, -2891, 26992, 11444, -4765, 2311, -1004, 348, -83, 8, 0,
+    ],
+    [
+        10, -69, 188, -311, 229, 543, -3394, 26350, 12577, -4970, 2339, -987, 330, -73, 6, 0,
+    ],
+    [
+        9, -63, 165, -248, 90, 807, -3840, 25646, 13712, -5144, 2348, -962, 308, -62, 2, 0,
+    ],
+    [
+        8, -56, 142, -186, -44, 1052, -4231, 24877, 14845, -5283, 2338, -926, 282, -50, -1, 1,
+    ],
+    [
+        7, -50, 119, -126, -171, 1277, -4566, 24057, 15970, -5386, 2307, -881, 251, -36, -5, 1,
+    ],
+    [
+        6, -44, 96, -68, -291, 1482, -4846, 23182, 17081, -5448, 2255, -825, 217, -21, -10, 2,
+    ],
+    [
+        5, -37, 74, -12, -403, 1666, -5072, 22257, 18174, -5467, 2182, -760, 178, -4, -15, 2,
+    ],
+    [
+        4, -31, 53, 41, -506, 1828, -5246, 21289, 19243, -5441, 2086, -685, 136, 14, -20, 3,
+    ],
+    [
+        3, -25, 33, 90, -600, 1968, -5368, 20283, 20283, -5368, 1968, -600, 90, 33, -25, 3,
+    ],
+    [
+        3, -20, 14, 136, -685, 2086, -5441, 19243, 21289, -5246, 1828, -506, 41, 53, -31, 4,
+    ],
+    [
+        2, -15, -4, 178, -760, 2182, -5467, 18174, 22257, -5072, 1666, -403, -12, 74, -37, 5,
+    ],
+    [
+        2, -10, -21, 217, -825, 2255, -5448, 17081, 23182, -4846, 1482, -291, -68, 96, -44, 6,
+    ],
+    [
+        1, -5, -36, 251, -881, 2307, -5386, 15970, 24057, -4566, 1277, -171, -126, 119, -50, 7,
+    ],
+    [
+        1, -1, -50, 282, -926, 2338, -5283, 14845, 24877, -4231, 1052, -44, -186, 142, -56, 8,
+    ],
+    [
+        0, 2, -62, 308, -962, 2348, -5144, 13712, 25646, -3840, 807, 90, -248, 165, -63, 9,
+    ],
+    [
+        0, 6, -73, 330, -987, 2339, -4970, 12577, 26350, -3394, 543, 229, -311, 188, -69, 10,
+    ],
+    [
+        0, 8, -83, 348, -1004, 2311, -4765, 11444, 26992, -2891, 262, 374, -375, 211, -76, 12,
+    ],
+    [
+        0, 11, -91, 362, -1011, 2266, -4531, 10317, 27565, -2334, -34, 522, -439, 234, -82, 13,
+    ],
+    [
+        0, 13, -97, 372, -1009, 2204, -4273, 9203, 28067, -1721, -343, 672, -503, 256, -87, 14,
+    ],
+    [
+        0, 15, -103, 378, -999, 2127, -3992, 8106, 28499, -1055, -665, 824, -566, 277, -93, 15,
+    ],
+    [
+        0, 16, -106, 381, -982, 2036, -3693, 7031, 28853, -336, -997, 977, -627, 297, -98, 16,
+    ],
+    [
+        0, 17, -109, 380, -956, 1932, -3378, 5981, 29131, 434, -1335, 1128, -686, 315, -102, 16,
+    ],
+    [
+        0, 17, -110, 376, -925, 1818, -3051, 4960, 29332, 1252, -1679, 1276, -742, 332, -105, 17,
+    ],
+    [
+        0, 18, -111, 369, -887, 1693, -2714, 3974, 29452, 2117, -2025, 1421, -795, 347, -108, 17,
+    ],
+];
+
+/// 帯域制限したステップ合成(blip buffer)
+/// 振幅の変化(delta)をCPUサイクル単位の時刻で書き込み、end_frameでサンプリング周波数のサンプルに変換します
+/// 変化点ごとにBLIP_TAPS回の積和をするだけで、出力1サンプルあたりは加算とシフトのみです。FPUも使いません
+#[derive(Clone)]
+pub struct BlipBuffer {
+    /// 1CPUサイクルあたりのサンプル数。BLIP_FRAC_BITSの固定小数点
+    factor: u32,
+    /// 現在のフレームの先頭のサンプル位置。BLIP_FRAC_BITSの固定小数点
+    offset: u32,
+    /// 出力の積分器。BLIP_KERNEL_BITS分だけ左にシフトした値を持つ
+    integrator: i32,
+    buf: [i32; BLIP_BUFFER_SIZE + BLIP_TAPS],
+}
+
+impl Default for BlipBuffer {
+    fn default() -> Self {
+        Self {
+            factor: 0,
+            offset: 0,
+            integrator: 0,
+            buf: [0; BLIP_BUFFER_SIZE + BLIP_TAPS],
+        }
+    }
+}
+
+impl BlipBuffer {
+    /// サンプリング周波数を設定して、溜まっているサンプルを破棄します
+    /// ret: 対応していない周波数ならfalse
+    pub fn set_sample_rate(&mut self, sample_rate: u32) -> bool {
+        if sample_rate == 0 || sample_rate > BLIP_MAX_SAMPLE_RATE {
+            return false;
+        }
+        self.factor = ((u64::from(sample_rate) << BLIP_FRAC_BITS) / u64::from(CPU_FREQ)) as u32;
+        self.clear();
+        true
+    }
+
+    /// 溜まっているサンプルを破棄します
+    pub fn clear(&mut self) {
+        self.offset = 0;
+        self.integrator = 0;
+        self.buf = [0; BLIP_BUFFER_SIZE + BLIP_TAPS];
+    }
+
+    /// `time`で振幅が`delta`だけ変化したことを書き込みます
+    /// `time` - 現在のフレームの先頭からのCPUサイクル数
+    #[inline]
+    pub fn add_delta(&mut self, time: u32, delta: i32) {
+        let pos = self.offset + time * self.factor;
+        let index = (pos >> BLIP_FRAC_BITS) as usize;
+        let phase = ((pos >> (BLIP_FRAC_BITS - BLIP_PHASE_BITS)) as usize) & (BLIP_PHASES - 1);
+        debug_assert!(index < BLIP_BUFFER_SIZE);
+        let kernel = &BLIP_KERNEL[phase];
+        let dst = &mut self.buf[index..(index + BLIP_TAPS)];
+        for (d, k) in dst.iter_mut().zip(kernel.iter()) {
+            *d += delta * i32::from(*k);
+        }
+    }
+
+    /// 現在のフレームを`time`で終了し、次のフレームの時刻の基準を`time`に移します
+    /// ret: 読み出せるサンプル数
+    pub fn end_frame(&mut self, time: u32) -> usize {
+        self.offset += time * self.factor;
+        self.samples_avail()
+    }
+
+    /// 読み出せるサンプル数
+    pub fn samples_avail(&self) -> usize {
+        (self.offset >> BLIP_FRAC_BITS) as usize
+    }
+
+    /// サンプルを読み出します
+    /// ret: 読み出したサンプル数
+    pub fn read_samples(&mut self, dst: &mut [i16]) -> usize {
+        let count = core::cmp::min(dst.len(), self.samples_avail());
+        let mut integrator = self.integrator;
+        for (d, delta) in dst.iter_mut().zip(self.buf[..count].iter()) {
+            integrator += *delta;
+            let sample = integrator >> BLIP_KERNEL_BITS;
+            *d = if sample > i32::from(i16::MAX) {
+                i16::MAX
+            } else if sample < i32::from(i16::MIN) {
+                i16::MIN
+            } else {
+                sample as i16
+            };
+            integrator -= integrator >> BLIP_BASS_SHIFT;
+        }
+        self.integrator = integrator;
+        // 読み出した分を詰める。未読み出しのサンプルとステップの裾を残す
+        let remain = self.samples_avail() - count + BLIP_TAPS;
+        self.buf.copy_within(count..(count + remain), 0);
+        for d in self.buf[remain..(count + remain)].iter_mut() {
+            *d = 0;
+        }
+        self.offset -= (count as u32) << BLIP_FRAC_BITS;
+        count
+    }
+}
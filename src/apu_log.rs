@@ -0,0 +1,64 @@
+use super::apu::*;
+use super::apu_ring::*;
+use super::system::*;
+
+/// リングバッファに溜めておけるアクセス数。2の累乗にすること
+/// 記録は状態の同期を除いて1つごとに少なくとも1cycleを使うので(DMCの読み込みもCPUを止める)、
+/// 1frame分(CYCLE_PER_DRAW_FRAME + 最後の命令とDMAのはみ出し + 状態の同期 + frameの区切り)は必ず収まります
+/// 読み出し側がframeごとに読み出していれば、記録は捨てられません
+pub const APU_LOG_RING_SIZE: usize = 32768;
+/// ファイルなどに書き出すときの1アクセスあたりのbyte数
+/// cycle(u32, little endian), offset(u8), data(u8)
+pub const APU_LOG_ENTRY_BYTES: usize = 6;
+/// ApuRegAccess::offsetに入れる、DMCがサンプルを1byte読み込んだことを表す値。dataが読み込んだ値
+pub const APU_LOG_DMC_FETCH: u8 = 0xfe;
+/// ApuRegAccess::offsetに入れる、frameの区切りを表す値。再生側はここで出力を書き出す
+pub const APU_LOG_FRAME_END: u8 = 0xfd;
+/// ApuRegAccess::offsetに入れる、合成側のAPUの状態をエミュレーション側に合わせることを表す値
+/// リセット、Save Stateの読み込み、Rewindの後の最初の同期で書き出す。dataはAPU_LOG_RESYNC_RESETかAPU_LOG_RESYNC_STATE
+pub const APU_LOG_RESYNC: u8 = 0xfc;
+/// ApuRegAccess::offsetに入れる、APU_LOG_RESYNC_STATEに続く状態の1byte。APU_SAVE_STATE_BYTES個続く
+pub const APU_LOG_RESYNC_DATA: u8 = 0xfb;
+/// APU_LOG_RESYNCのdata。電源投入時の状態に戻す(InitApuと同じ。合成の設定はそのまま)
+pub const APU_LOG_RESYNC_RESET: u8 = 0;
+/// APU_LOG_RESYNCのdata。続くAPU_LOG_RESYNC_DATAの状態(Save StateのAPUの部分)を読み込む
+pub const APU_LOG_RESYNC_STATE: u8 = 1;
+
+impl ApuRegAccess {
+    /// ファイルに書き出す形式に変換します
+    pub fn to_bytes(&self) -> [u8; APU_LOG_ENTRY_BYTES] {
+        let cycle = self.cycle.to_le_bytes();
+        [
+            cycle[0],
+            cycle[1],
+            cycle[2],
+            cycle[3],
+            self.offset,
+            self.data,
+        ]
+    }
+
+    /// ファイルに書き出す形式から変換します
+    /// `src` - APU_LOG_ENTRY_BYTES以上
+    pub fn from_bytes(src: &[u8]) -> Self {
+        Self {
+            cycle: u32::from_le_bytes([src[0], src[1], src[2], src[3]]),
+            offset: src[4],
+            data: src[5],
+        }
+    }
+}
+
+/// APUレジスタへのアクセスの記録を、エミュレーションのスレッドから合成するスレッドに渡すリングバッファ
+/// エミュレーション側は$4015の値に関わる状態だけを追い(ApuSink::IS_SYNTHESIZE = false)、アクセスとDMCの読み込みを時刻順に書き込みます
+/// 合成側は読み出した記録をApu::replayに渡して、波形の合成とミキサーを受け持ちます
+/// 記録を1つでも捨てると合成側のAPUの状態がずれるので、書き込み側はdroppedが増えていないか確認してください
+pub type ApuLogRing = SpscRing<ApuRegAccess, APU_LOG_RING_SIZE>;
+
+impl ApuSink for ApuLogRing {
+    const IS_SYNTHESIZE: bool = false;
+    fn push_samples(&self, _samples: &[i16]) {}
+    fn push_access(&self, access: ApuRegAccess) {
+        self.push(&[access]);
+    }
+}
@@ -0,0 +1,138 @@
+/// 矩形波2ch分の出力の段階数(0..=30)
+pub const MIXER_PULSE_TABLE_SIZE: usize = 31;
+/// 三角波, ノイズ, DMCの出力を 3 * triangle + 2 * noise + dmc にまとめた段階数(0..=202)
+pub const MIXER_TND_TABLE_SIZE: usize = 203;
+/// テーブルの値の小数部bit数。16bit出力の1段階が 1 << MIXER_FRAC_BITS
+pub const MIXER_FRAC_BITS: u32 = 16;
+/// 全チャンネルが最大のときの16bit出力
+pub const MIXER_OUTPUT_MAX: i16 = i16::MAX;
+
+/// 非線形ミキサーの式を a * n / (b + 10000 * n) の形にしたときの係数
+/// pulse: 95.52 / (8128 / n + 100), tnd: 163.67 / (24329 / n + 100)
+const MIXER_PULSE_A: u128 = 9552;
+const MIXER_PULSE_B: u128 = 812800;
+const MIXER_TND_A: u128 = 16367;
+const MIXER_TND_B: u128 = 2432900;
+const MIXER_DENOMINATOR_STEP: u128 = 10000;
+
+/// 矩形波の出力(pulse1 + pulse2)ごとの値。MIXER_FRAC_BITSの固定小数点
+pub const MIXER_PULSE_TABLE: [u32; MIXER_PULSE_TABLE_SIZE] =
+    mixer_table(MIXER_PULSE_A, MIXER_PULSE_B);
+/// 3 * triangle + 2 * noise + dmc ごとの値。MIXER_FRAC_BITSの固定小数点
+pub const MIXER_TND_TABLE: [u32; MIXER_TND_TABLE_SIZE] = mixer_table(MIXER_TND_A, MIXER_TND_B);
+
+/// テーブルの1要素を計算します。浮動小数点数を使わずに、コンパイル時に丸めまで済ませます
+/// 全チャンネルが最大のときに、pulseとtndの合計がMIXER_OUTPUT_MAXになるように正規化します
+const fn mixer_entry(n: u128, a: u128, b: u128) -> u32 {
+    // 最大値 pulse(30) + tnd(202) = (pn * td + tn * pd) / (pd * td)
+    let pn = MIXER_PULSE_A * (MIXER_PULSE_TABLE_SIZE as u128 - 1);
+    let pd = MIXER_PULSE_B + MIXER_DENOMINATOR_STEP * (MIXER_PULSE_TABLE_SIZE as u128 - 1);
+    let tn = MIXER_TND_A * (MIXER_TND_TABLE_SIZE as u128 - 1);
+    let td = MIXER_TND_B + MIXER_DENOMINATOR_STEP * (MIXER_TND_TABLE_SIZE as u128 - 1);
+    let scale = (MIXER_OUTPUT_MAX as u128) << MIXER_FRAC_BITS;
+    let num = a * n * pd * td * scale;
+    let den = (b + MIXER_DENOMINATOR_STEP * n) * (pn * td + tn * pd);
+    ((num * 2 + den) / (den * 2)) as u32
+}
+
+const fn mixer_table<const N: usize>(a: u128, b: u128) -> [u32; N] {
+    let mut table = [0u32; N];
+    let mut n = 0;
+    while n < N {
+        table[n] = mixer_entry(n as u128, a, b);
+        n += 1;
+    }
+    table
+}
+
+/// ミキサーの出力形式
+pub trait MixerSample: Copy {
+    /// MIXER_FRAC_BITSの固定小数点の値から変換します
+    fn from_mixer(value: u32) -> Self;
+}
+
+/// 16bit出力。MIXER_OUTPUT_MAXまでの整数に丸めます
+impl MixerSample for i16 {
+    #[inline(always)]
+    fn from_mixer(value: u32) -> Self {
+        ((value + (1 << (MIXER_FRAC_BITS - 1))) >> MIXER_FRAC_BITS) as i16
+    }
+}
+
+/// 32bit出力。16bit出力をMIXER_FRAC_BITSだけ左にシフトした値で、小数部を残します
+/// MIXER_OUTPUT_MAX << MIXER_FRAC_BITS はi32に収まります
+impl MixerSample for i32 {
+    #[inline(always)]
+    fn from_mixer(value: u32) -> Self {
+        value as i32
+    }
+}
+
+/// NESのミキサー(非線形)をテーブル引きと加算だけで計算します。FPUを使いません
+/// `pulse1`, `pulse2`, `noise`: 0..=15, `triangle`: 0..=15, `dmc`: 0..=127
+#[inline(always)]
+pub fn mix<T: MixerSample>(pulse1: u8, pulse2: u8, triangle: u8, noise: u8, dmc: u8) -> T {
+    let pulse = usize::from(pulse1) + usize::from(pulse2);
+    let tnd = 3 * usize::from(triangle) + 2 * usize::from(noise) + usize::from(dmc);
+    T::from_mixer(MIXER_PULSE_TABLE[pulse] + MIXER_TND_TABLE[tnd])
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// 倍精度で計算した非線形ミキサーの式を、全チャンネルが最大のときMIXER_OUTPUT_MAXになるように正規化した値
+    fn reference(pulse: usize, tnd: usize) -> f64 {
+        let pulse_out = |n: f64| {
+            if n == 0.0 {
+                0.0
+            } else {
+                95.52 / (8128.0 / n + 100.0)
+            }
+        };
+        let tnd_out = |n: f64| {
+            if n == 0.0 {
+                0.0
+            } else {
+                163.67 / (24329.0 / n + 100.0)
+            }
+        };
+        let full_scale = pulse_out((MIXER_PULSE_TABLE_SIZE - 1) as f64)
+            + tnd_out((MIXER_TND_TABLE_SIZE - 1) as f64);
+        (pulse_out(pulse as f64) + tnd_out(tnd as f64)) / full_scale * f64::from(MIXER_OUTPUT_MAX)
+    }
+
+    #[test]
+    fn mix_matches_double_precision_reference() {
+        let lsb32 = 1.0 / f64::from(1u32 << MIXER_FRAC_BITS);
+        for pulse1 in 0..16u8 {
+            for pulse2 in 0..16u8 {
+                for triangle in 0..16u8 {
+                    for noise in 0..16u8 {
+                        for dmc in 0..128u8 {
+                            let pulse = usize::from(pulse1) + usize::from(pulse2);
+                            let tnd = 3 * usize::from(triangle)
+                                + 2 * usize::from(noise)
+                                + usize::from(dmc);
+                            let expected = reference(pulse, tnd);
+                            let out16: i16 = mix(pulse1, pulse2, triangle, noise, dmc);
+                            let out32: i32 = mix(pulse1, pulse2, triangle, noise, dmc);
+                            // 16bitは最も近い整数に丸める
+                            assert!((f64::from(out16) - expected).abs() <= 0.5 + 1e-9);
+                            // 32bitはテーブルごとの丸めが1回ずつ
+                            assert!((f64::from(out32) * lsb32 - expected).abs() <= lsb32);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn mix_reaches_output_max() {
+        let silent: i16 = mix(0, 0, 0, 0, 0);
+        let full: i16 = mix(15, 15, 15, 15, 127);
+        assert_eq!(silent, 0);
+        assert_eq!(full, MIXER_OUTPUT_MAX);
+    }
+}
@@ -0,0 +1,456 @@
+use super::apu::ApuSink;
+
+#[cfg(target_arch = "x86_64")]
+use core::arch::x86_64::*;
+
+/// 1つの出力サンプルに使う入力サンプル数
+pub const RESAMPLER_TAPS: usize = 32;
+/// 入力サンプルの間を分割する位相数(2^RESAMPLER_PHASE_BITS)。位相の間は線形補間する
+const RESAMPLER_PHASE_BITS: u32 = 5;
+const RESAMPLER_PHASES: usize = 1 << RESAMPLER_PHASE_BITS;
+/// 位相の間を補間する重みのbit数
+const RESAMPLER_INTERP_BITS: u32 = 15;
+/// カーネルの係数のbit数。各位相の係数の合計が 1 << RESAMPLER_KERNEL_BITS になっている
+/// 係数の絶対値の合計は 1 << (RESAMPLER_KERNEL_BITS + 1) 未満なので、i16の入力との積和はi32に収まる
+const RESAMPLER_KERNEL_BITS: u32 = 15;
+/// 入力の位置の固定小数点の小数部bit数
+const RESAMPLER_FRAC_BITS: u32 = 32;
+/// 一度に受け取る入力サンプル数
+const RESAMPLER_INPUT_SIZE: usize = 256;
+/// 一度に書き出す出力サンプル数
+const RESAMPLER_OUTPUT_SIZE: usize = 256;
+/// 変換比(入力/出力)の上限の分母。カーネルのカットオフ(入力の0.45fs)で折り返しを抑えられる範囲
+const RESAMPLER_MAX_RATIO_DENOMINATOR: u32 = 8;
+/// Resampler::adjustで変えられる変換比の範囲(ppm)
+pub const RESAMPLER_MAX_ADJUST_PPM: i32 = 50000;
+/// 変換比を変えたときに、1出力サンプルごとに目標との差の 1/2^N だけ近づける
+/// 急に変えても位相は連続しているのでクリックにはならないが、ピッチの変化も滑らかにする
+const RESAMPLER_STEP_SMOOTH_SHIFT: u32 = 10;
+
+/// Kaiser窓(beta 8)をかけたsinc関数(カットオフ 0.45fs)
+/// `[位相][tap]`。tap 15が遅延0の位置で、各位相の合計は 1 << RESAMPLER_KERNEL_BITS
+/// 補間用に、最後の位相は最初の位相を1tap遅らせたもの
+const RESAMPLER_KERNEL: [[i16; RESAMPLER_TAPS]; RESAMPLER_PHASES + 1] = [
+    [
+        -7, 17, -31, 42, -39, 0, 99, -283, 569, -959, 1435, -1956, 2464, -2891, 3177, 29494, 3177,
+        -2891, 2464, -1956, 1435, -959, 569, -283, 99, 0, -39, 42, -31, 17, -7, 0,
+    ],
+    [
+        -6, 16, -28, 36, -28, -18, 124, -312, 596, -972, 1414, -1871, 2266, -2485, 2230, 29454,
+        4160, -3288, 2647, -2028, 1445, -938, 536, -250, 73, 18, -50, 48, -33, 18, -7, 1,
+    ],
+    [
+        -6, 15, -25, 30, -17, -35, 147, -338, 618, -977, 1382, -1773, 2056, -2074, 1323, 29337,
+        5178, -3673, 2814, -2085, 1444, -909, 499, -215, 45, 37, -61, 54, -36, 18, -7, 2,
+    ],
+    [
+        -6, 14, -22, 24, -6, -51, 168, -361, 635, -974, 1340, -1663, 1835, -1660, 460, 29143, 6225,
+        -4042, 2963, -2127, 1432, -873, 456, -177, 16, 56, -72, 59, -38, 19, -7, 2,
+    ],
+    [
+        -5, 12, -19, 18, 5, -67, 188, -381, 646, -964, 1288, -1543, 1606, -1247, -357, 28875, 7298,
+        -4393, 3092, -2153, 1407, -828, 409, -137, -13, 75, -83, 64, -40, 20, -7, 2,
+    ],
+    [
+        -5, 11, -16, 12, 15, -82, 205, -397, 652, -946, 1228, -1413, 1370, -838, -1126, 28535,
+        8392, -4722, 3200, -2163, 1371, -776, 357, -95, -44, 94, -93, 69, -41, 20, -7, 1,
+    ],
+    [
+        -5, 10, -13, 6, 24, -95, 221, -409, 653, -922, 1159, -1275, 1129, -436, -1844, 28117, 9504,
+        -5025, 3285, -2155, 1323, -716, 302, -51, -74, 113, -103, 74, -43, 20, -7, 1,
+    ],
+    [
+        -4, 9, -10, 1, 33, -107, 234, -418, 648, -890, 1083, -1131, 885, -43, -2510, 27627, 10629,
+        -5299, 3347, -2130, 1264, -649, 243, -5, -105, 132, -113, 77, -44, 20, -7, 1,
+    ],
+    [
+        -4, 7, -7, -5, 42, -118, 245, -424, 639, -852, 999, -980, 641, 338, -3121, 27072, 11761,
+        -5541, 3383, -2087, 1192, -576, 180, 42, -136, 150, -122, 81, -45, 20, -7, 1,
+    ],
+    [
+        -3, 6, -5, -10, 50, -128, 254, -426, 625, -809, 910, -826, 398, 704, -3678, 26450, 12897,
+        -5749, 3393, -2026, 1110, -496, 114, 89, -167, 167, -130, 84, -45, 20, -6, 1,
+    ],
+    [
+        -3, 5, -2, -15, 57, -137, 261, -424, 606, -760, 815, -669, 158, 1053, -4178, 25766, 14031,
+        -5918, 3377, -1948, 1017, -411, 46, 137, -197, 183, -137, 86, -45, 19, -6, 1,
+    ],
+    [
+        -2, 4, 1, -20, 64, -144, 265, -420, 583, -706, 717, -509, -78, 1383, -4622, 25017, 15159,
+        -6047, 3333, -1852, 914, -320, -23, 185, -226, 198, -143, 88, -45, 18, -5, 1,
+    ],
+    [
+        -2, 2, 3, -24, 70, -150, 267, -412, 555, -648, 614, -350, -307, 1692, -5009, 24220, 16275,
+        -6132, 3261, -1740, 801, -225, -95, 233, -254, 213, -149, 89, -44, 18, -5, 1,
+    ],
+    [
+        -2, 1, 6, -28, 75, -154, 267, -401, 524, -586, 510, -191, -528, 1979, -5339, 23365, 17375,
+        -6172, 3161, -1610, 679, -125, -167, 280, -281, 225, -153, 89, -43, 16, -4, 0,
+    ],
+    [
+        -1, 0, 8, -31, 79, -157, 265, -387, 490, -521, 403, -34, -740, 2242, -5613, 22462, 18454,
+        -6164, 3032, -1465, 549, -23, -239, 326, -306, 237, -157, 89, -42, 15, -3, 0,
+    ],
+    [
+        -1, -1, 10, -35, 83, -159, 261, -370, 453, -453, 296, 119, -940, 2480, -5831, 21515, 19507,
+        -6105, 2876, -1304, 412, 82, -312, 370, -330, 246, -159, 87, -40, 14, -3, 0,
+    ],
+    [
+        -1, -2, 12, -37, 85, -159, 254, -351, 412, -383, 188, 268, -1129, 2691, -5995, 20533,
+        20529, -5995, 2691, -1129, 268, 188, -383, 412, -351, 254, -159, 85, -37, 12, -2, -1,
+    ],
+    [
+        0, -3, 14, -40, 87, -159, 246, -330, 370, -312, 82, 412, -1304, 2876, -6105, 19507, 21515,
+        -5831, 2480, -940, 119, 296, -453, 453, -370, 261, -159, 83, -35, 10, -1, -1,
+    ],
+    [
+        0, -3, 15, -42, 89, -157, 237, -306, 326, -239, -23, 549, -1465, 3032, -6164, 18454, 22462,
+        -5613, 2242, -740, -34, 403, -521, 490, -387, 265, -157, 79, -31, 8, 0, -1,
+    ],
+    [
+        0, -4, 16, -43, 89, -153, 225, -281, 280, -167, -125, 679, -1610, 3161, -6172, 17375,
+        23365, -5339, 1979, -528, -191, 510, -586, 524, -401, 267, -154, 75, -28, 6, 1, -2,
+    ],
+    [
+        1, -5, 18, -44, 89, -149, 213, -254, 233, -95, -225, 801, -1740, 3261, -6132, 16275, 24220,
+        -5009, 1692, -307, -350, 614, -648, 555, -412, 267, -150, 70, -24, 3, 2, -2,
+    ],
+    [
+        1, -5, 18, -45, 88, -143, 198, -226, 185, -23, -320, 914, -1852, 3333, -6047, 15159, 25017,
+        -4622, 1383, -78, -509, 717, -706, 583, -420, 265, -144, 64, -20, 1, 4, -2,
+    ],
+    [
+        1, -6, 19, -45, 86, -137, 183, -197, 137, 46, -411, 1017, -1948, 3377, -5918, 14031, 25766,
+        -4178, 1053, 158, -669, 815, -760, 606, -424, 261, -137, 57, -15, -2, 5, -3,
+    ],
+    [
+        1, -6, 20, -45, 84, -130, 167, -167, 89, 114, -496, 1110, -2026, 3393, -5749, 12897, 26450,
+        -3678, 704, 398, -826, 910, -809, 625, -426, 254, -128, 50, -10, -5, 6, -3,
+    ],
+    [
+        1, -7, 20, -45, 81, -122, 150, -136, 42, 180, -576, 1192, -2087, 3383, -5541, 11761, 27072,
+        -3121, 338, 641, -980, 999, -852, 639, -424, 245, -118, 42, -5, -7, 7, -4,
+    ],
+    [
+        1, -7, 20, -44, 77, -113, 132, -105, -5, 243, -649, 1264, -2130, 3347, -5299, 10629, 27627,
+        -2510, -43, 885, -1131, 1083, -890, 648, -418, 234, -107, 33, 1, -10, 9, -4,
+    ],
+    [
+        1, -7, 20, -43, 74, -103, 113, -74, -51, 302, -716, 1323, -2155, 3285, -5025, 9504, 28117,
+        -1844, -436, 1129, -1275, 1159, -922, 653, -409, 221, -95, 24, 6, -13, 10, -5,
+    ],
+    [
+        1, -7, 20, -41, 69, -93, 94, -44, -95, 357, -776, 1371, -2163, 3200, -4722, 8392, 28535,
+        -1126, -838, 1370, -1413, 1228, -946, 652, -397, 205, -82, 15, 12, -16, 11, -5,
+    ],
+    [
+        2, -7, 20, -40, 64, -83, 75, -13, -137, 409, -828, 1407, -2153, 3092, -4393, 7298, 28875,
+        -357, -1247, 1606, -1543, 1288, -964, 646, -381, 188, -67, 5, 18, -19, 12, -5,
+    ],
+    [
+        2, -7, 19, -38, 59, -72, 56, 16, -177, 456, -873, 1432, -2127, 2963, -4042, 6225, 29143,
+        460, -1660, 1835, -1663, 1340, -974, 635, -361, 168, -51, -6, 24, -22, 14, -6,
+    ],
+    [
+        2, -7, 18, -36, 54, -61, 37, 45, -215, 499, -909, 1444, -2085, 2814, -3673, 5178, 29337,
+        1323, -2074, 2056, -1773, 1382, -977, 618, -338, 147, -35, -17, 30, -25, 15, -6,
+    ],
+    [
+        1, -7, 18, -33, 48, -50, 18, 73, -250, 536, -938, 1445, -2028, 2647, -3288, 4160, 29454,
+        2230, -2485, 2266, -1871, 1414, -972, 596, -312, 124, -18, -28, 36, -28, 16, -6,
+    ],
+    [
+        0, -7, 17, -31, 42, -39, 0, 99, -283, 569, -959, 1435, -1956, 2464, -2891, 3177, 29494,
+        3177, -2891, 2464, -1956, 1435, -959, 569, -283, 99, 0, -39, 42, -31, 17, -7,
+    ],
+];
+
+/// 積和の実装
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
+pub enum ResamplerKernel {
+    /// 固定小数点の整数演算のみ。どのターゲットでも使えます
+    Scalar,
+    /// x86-64のSSE2 (pmaddwd 128bit)
+    Sse2,
+    /// x86-64のAVX2 (vpmaddwd 256bit)。実行時にCPUが対応しているか確認します
+    Avx2,
+}
+
+impl ResamplerKernel {
+    pub fn name(self) -> &'static str {
+        match self {
+            ResamplerKernel::Scalar => "scalar",
+            ResamplerKernel::Sse2 => "SSE2",
+            ResamplerKernel::Avx2 => "AVX2",
+        }
+    }
+
+    /// 実行中のCPUで使えるならtrue
+    pub fn is_available(self) -> bool {
+        match self {
+            ResamplerKernel::Scalar => true,
+            // x86-64はSSE2が必ず使える
+            ResamplerKernel::Sse2 => cfg!(target_arch = "x86_64"),
+            ResamplerKernel::Avx2 => is_avx2_available(),
+        }
+    }
+
+    /// 使える中で最も速い実装を返します
+    pub fn detect() -> Self {
+        if ResamplerKernel::Avx2.is_available() {
+            ResamplerKernel::Avx2
+        } else if ResamplerKernel::Sse2.is_available() {
+            ResamplerKernel::Sse2
+        } else {
+            ResamplerKernel::Scalar
+        }
+    }
+}
+
+/// CPUとOSがAVX2に対応しているか。no_stdなのでis_x86_feature_detected!の代わりにCPUIDを直接読む
+#[cfg(target_arch = "x86_64")]
+fn is_avx2_available() -> bool {
+    unsafe {
+        let leaf1 = __cpuid(1);
+        let is_osxsave = (leaf1.ecx & (1 << 27)) != 0;
+        let is_avx = (leaf1.ecx & (1 << 28)) != 0;
+        if !is_osxsave || !is_avx {
+            return false;
+        }
+        // OSがYMMレジスタを保存するか
+        if (xgetbv0() & 0x06) != 0x06 {
+            return false;
+        }
+        let leaf7 = __cpuid_count(7, 0);
+        (leaf7.ebx & (1 << 5)) != 0
+    }
+}
+
+#[cfg(target_arch = "x86_64")]
+#[target_feature(enable = "xsave")]
+unsafe fn xgetbv0() -> u64 {
+    _xgetbv(0)
+}
+
+#[cfg(not(target_arch = "x86_64"))]
+fn is_avx2_available() -> bool {
+    false
+}
+
+/// 2つの位相の積和を補間して、出力サンプルに丸めます
+#[inline(always)]
+fn interpolate(acc0: i32, acc1: i32, interp: u32) -> i16 {
+    let acc = i64::from(acc0)
+        + ((i64::from(acc1) - i64::from(acc0)) * i64::from(interp) >> RESAMPLER_INTERP_BITS);
+    let sample = (acc + (1 << (RESAMPLER_KERNEL_BITS - 1))) >> RESAMPLER_KERNEL_BITS;
+    if sample > i64::from(i16::MAX) {
+        i16::MAX
+    } else if sample < i64::from(i16::MIN) {
+        i16::MIN
+    } else {
+        sample as i16
+    }
+}
+
+#[inline(always)]
+fn dot_scalar(src: &[i16], kernel: &[i16; RESAMPLER_TAPS]) -> i32 {
+    src[..RESAMPLER_TAPS]
+        .iter()
+        .zip(kernel.iter())
+        .fold(0i32, |acc, (s, k)| acc + i32::from(*s) * i32::from(*k))
+}
+
+/// 8要素ずつpmaddwdで積和します
+/// `src` - RESAMPLER_TAPS要素以上
+#[cfg(target_arch = "x86_64")]
+#[inline(always)]
+unsafe fn dot_sse2(src: *const i16, kernel: &[i16; RESAMPLER_TAPS]) -> i32 {
+    let k = kernel.as_ptr();
+    let mut acc = _mm_setzero_si128();
+    for i in (0..RESAMPLER_TAPS).step_by(8) {
+        let s = _mm_loadu_si128(src.add(i) as *const __m128i);
+        let c = _mm_loadu_si128(k.add(i) as *const __m128i);
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(s, c));
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0b01_00_11_10));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0b10_11_00_01));
+    _mm_cvtsi128_si32(acc)
+}
+
+/// 16要素ずつvpmaddwdで積和します
+/// `src` - RESAMPLER_TAPS要素以上
+#[cfg(target_arch = "x86_64")]
+#[inline]
+#[target_feature(enable = "avx2")]
+unsafe fn dot_avx2(src: *const i16, kernel: &[i16; RESAMPLER_TAPS]) -> i32 {
+    let k = kernel.as_ptr();
+    let mut acc = _mm256_setzero_si256();
+    for i in (0..RESAMPLER_TAPS).step_by(16) {
+        let s = _mm256_loadu_si256(src.add(i) as *const __m256i);
+        let c = _mm256_loadu_si256(k.add(i) as *const __m256i);
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(s, c));
+    }
+    let mut acc128 = _mm_add_epi32(
+        _mm256_castsi256_si128(acc),
+        _mm256_extracti128_si256(acc, 1),
+    );
+    acc128 = _mm_add_epi32(acc128, _mm_shuffle_epi32(acc128, 0b01_00_11_10));
+    acc128 = _mm_add_epi32(acc128, _mm_shuffle_epi32(acc128, 0b10_11_00_01));
+    _mm_cvtsi128_si32(acc128)
+}
+
+/// 多相FIRフィルタによるサンプリング周波数変換
+/// APUが合成したサンプルを、ホストのサンプリング周波数に変換してApuSinkに書き出します
+/// 変換比はadjustで連続的に変えられるので、ホストのオーディオ出力との速度差の吸収に使えます
+/// 積和は整数のみで、実装(ResamplerKernel)によらず結果は一致します
+#[derive(Clone)]
+pub struct Resampler {
+    kernel: ResamplerKernel,
+    /// set_rateで設定した、出力1サンプルあたりに進める入力サンプル数。RESAMPLER_FRAC_BITSの固定小数点
+    base_step: u64,
+    /// adjustで調整した目標のstep
+    target_step: u64,
+    /// 現在のstep。target_stepに少しずつ近づける
+    step: u64,
+    /// 次の出力サンプルの位置。bufの先頭からの入力サンプル数で、RESAMPLER_FRAC_BITSの固定小数点
+    pos: u64,
+    /// 入力サンプル。先頭からlenまでが有効
+    buf: [i16; RESAMPLER_INPUT_SIZE + RESAMPLER_TAPS],
+    len: usize,
+}
+
+impl Default for Resampler {
+    fn default() -> Self {
+        let step = 1 << RESAMPLER_FRAC_BITS;
+        Self {
+            kernel: ResamplerKernel::detect(),
+            base_step: step,
+            target_step: step,
+            step,
+            pos: 0,
+            buf: [0; RESAMPLER_INPUT_SIZE + RESAMPLER_TAPS],
+            // 最初の入力がカーネルの中心に来るように無音で埋めておく
+            len: RESAMPLER_TAPS / 2 - 1,
+        }
+    }
+}
+
+impl Resampler {
+    /// 変換前後のサンプリング周波数を設定して、溜まっている入力を破棄します
+    /// ret: 周波数が0か、入力が出力の 1 + 1/RESAMPLER_MAX_RATIO_DENOMINATOR 倍より大きければfalse
+    pub fn init(&mut self, input_rate: u32, output_rate: u32) -> bool {
+        let kernel = self.kernel;
+        *self = Self::default();
+        self.kernel = kernel;
+        if input_rate == 0
+            || output_rate == 0
+            || input_rate > output_rate + output_rate / RESAMPLER_MAX_RATIO_DENOMINATOR
+        {
+            return false;
+        }
+        self.base_step = (u64::from(input_rate) << RESAMPLER_FRAC_BITS) / u64::from(output_rate);
+        self.target_step = self.base_step;
+        self.step = self.base_step;
+        true
+    }
+
+    /// 積和の実装を選びます
+    /// ret: 実行中のCPUで使えなければfalse
+    pub fn set_kernel(&mut self, kernel: ResamplerKernel) -> bool {
+        if !kernel.is_available() {
+            return false;
+        }
+        self.kernel = kernel;
+        true
+    }
+
+    pub fn kernel(&self) -> ResamplerKernel {
+        self.kernel
+    }
+
+    /// 出力のサンプリング周波数を設定値からずらします。入力を消費する速さが`ppm`だけ速くなります
+    /// 変換比は出力サンプルごとに滑らかに変わります
+    /// `ppm` - ±RESAMPLER_MAX_ADJUST_PPMに制限します
+    pub fn adjust(&mut self, ppm: i32) {
+        let ppm = core::cmp::max(
+            -RESAMPLER_MAX_ADJUST_PPM,
+            core::cmp::min(RESAMPLER_MAX_ADJUST_PPM, ppm),
+        );
+        let scale = (1_000_000 + i64::from(ppm)) as u64;
+        self.target_step = self.base_step * scale / 1_000_000;
+    }
+
+    /// 入力サンプルを変換して`out`に書き出します
+    pub fn process<O: ApuSink>(&mut self, src: &[i16], out: &O) {
+        let mut dst = [0i16; RESAMPLER_OUTPUT_SIZE];
+        let mut src = src;
+        while !src.is_empty() {
+            let count = core::cmp::min(src.len(), self.buf.len() - self.len);
+            self.buf[self.len..(self.len + count)].copy_from_slice(&src[..count]);
+            self.len += count;
+            src = &src[count..];
+            loop {
+                let produced = self.run(&mut dst);
+                if produced == 0 {
+                    break;
+                }
+                out.push_samples(&dst[..produced]);
+            }
+            // 使い終わった入力を詰める。残りはRESAMPLER_TAPS未満なので、次の入力の空きは足りる
+            let consumed = core::cmp::min((self.pos >> RESAMPLER_FRAC_BITS) as usize, self.len);
+            self.buf.copy_within(consumed..self.len, 0);
+            self.len -= consumed;
+            self.pos -= (consumed as u64) << RESAMPLER_FRAC_BITS;
+        }
+    }
+
+    /// 溜まっている入力から、`dst`に収まるだけ出力サンプルを作ります
+    /// ret: 作ったサンプル数
+    fn run(&mut self, dst: &mut [i16]) -> usize {
+        match self.kernel {
+            #[cfg(target_arch = "x86_64")]
+            ResamplerKernel::Sse2 => {
+                self.run_with(dst, |src, kernel| unsafe { dot_sse2(src.as_ptr(), kernel) })
+            }
+            #[cfg(target_arch = "x86_64")]
+            ResamplerKernel::Avx2 => unsafe { self.run_avx2(dst) },
+            _ => self.run_with(dst, dot_scalar),
+        }
+    }
+
+    #[cfg(target_arch = "x86_64")]
+    #[target_feature(enable = "avx2")]
+    unsafe fn run_avx2(&mut self, dst: &mut [i16]) -> usize {
+        self.run_with(dst, |src, kernel| unsafe { dot_avx2(src.as_ptr(), kernel) })
+    }
+
+    #[inline(always)]
+    fn run_with<F: Fn(&[i16], &[i16; RESAMPLER_TAPS]) -> i32>(
+        &mut self,
+        dst: &mut [i16],
+        dot: F,
+    ) -> usize {
+        let mut count = 0;
+        for d in dst.iter_mut() {
+            let index = (self.pos >> RESAMPLER_FRAC_BITS) as usize;
+            if index + RESAMPLER_TAPS > self.len {
+                break;
+            }
+            let frac = self.pos as u32;
+            let phase = (frac >> (RESAMPLER_FRAC_BITS - RESAMPLER_PHASE_BITS)) as usize;
+            let interp = (frac
+                >> (RESAMPLER_FRAC_BITS - RESAMPLER_PHASE_BITS - RESAMPLER_INTERP_BITS))
+                & ((1 << RESAMPLER_INTERP_BITS) - 1);
+            let src = &self.buf[index..(index + RESAMPLER_TAPS)];
+            let acc0 = dot(src, &RESAMPLER_KERNEL[phase]);
+            let acc1 = dot(src, &RESAMPLER_KERNEL[phase + 1]);
+            *d = interpolate(acc0, acc1, interp);
+
+            self.pos += self.step;
+            let diff = self.target_step as i64 - self.step as i64;
+            self.step = (self.step as i64 + (diff >> RESAMPLER_STEP_SMOOTH_SHIFT)) as u64;
+            count += 1;
+        }
+        count
+    }
+}
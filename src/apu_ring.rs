@@ -0,0 +1,95 @@
+use core::cell::UnsafeCell;
+use core::sync::atomic::{AtomicUsize, Ordering};
+
+/// リングバッファに溜めておけるサンプル数。2の累乗にすること
+pub const SAMPLE_RING_SIZE: usize = 4096;
+
+/// APUの出力をホストのオーディオ出力に渡すリングバッファ
+pub type SampleRing = SpscRing<i16, SAMPLE_RING_SIZE>;
+
+/// 書き込み(エミュレーションのスレッド)と読み出し(オーディオコールバックなど)が1つずつであれば、ロックせずに別スレッドから使えるリングバッファ
+/// 読み書きの位置は増え続けるカウンタで、Nで割った余りの位置を使います
+/// `N` - 溜めておける要素数。2の累乗にすること
+pub struct SpscRing<T: Copy + Default, const N: usize> {
+    buf: UnsafeCell<[T; N]>,
+    /// 書き込み側だけが更新する
+    write_pos: AtomicUsize,
+    /// 読み出し側だけが更新する
+    read_pos: AtomicUsize,
+    /// 空きが足りずに捨てた要素数。書き込み側だけが更新する
+    dropped: AtomicUsize,
+}
+
+unsafe impl<T: Copy + Default + Send, const N: usize> Sync for SpscRing<T, N> {}
+
+impl<T: Copy + Default, const N: usize> Default for SpscRing<T, N> {
+    fn default() -> Self {
+        debug_assert!(N.is_power_of_two());
+        Self {
+            buf: UnsafeCell::new([T::default(); N]),
+            write_pos: AtomicUsize::new(0),
+            read_pos: AtomicUsize::new(0),
+            dropped: AtomicUsize::new(0),
+        }
+    }
+}
+
+impl<T: Copy + Default, const N: usize> SpscRing<T, N> {
+    /// 読み出せる要素数
+    pub fn len(&self) -> usize {
+        let write = self.write_pos.load(Ordering::Acquire);
+        let read = self.read_pos.load(Ordering::Acquire);
+        write.wrapping_sub(read)
+    }
+
+    /// 書き込める要素数
+    pub fn free(&self) -> usize {
+        N - self.len()
+    }
+
+    /// 空きが足りずに捨てた要素数の累計
+    pub fn dropped(&self) -> usize {
+        self.dropped.load(Ordering::Relaxed)
+    }
+
+    /// 要素を書き込みます。書き込み側のスレッドから呼んでください
+    /// ret: 書き込んだ要素数。空きが足りない分は捨てます
+    pub fn push(&self, src: &[T]) -> usize {
+        let write = self.write_pos.load(Ordering::Relaxed);
+        let read = self.read_pos.load(Ordering::Acquire);
+        let free = N - write.wrapping_sub(read);
+        let count = core::cmp::min(free, src.len());
+        // 読み出し側は[read, write)にしか触らないので、それ以外への書き込みは競合しない
+        let buf = self.buf.get() as *mut T;
+        for (i, value) in src[..count].iter().enumerate() {
+            unsafe {
+                *buf.add(write.wrapping_add(i) & (N - 1)) = *value;
+            }
+        }
+        self.write_pos
+            .store(write.wrapping_add(count), Ordering::Release);
+        if count < src.len() {
+            let dropped = self.dropped.load(Ordering::Relaxed);
+            self.dropped
+                .store(dropped + (src.len() - count), Ordering::Relaxed);
+        }
+        count
+    }
+
+    /// 要素を読み出します。読み出し側のスレッドから呼んでください
+    /// ret: 読み出した要素数
+    pub fn pop(&self, dst: &mut [T]) -> usize {
+        let read = self.read_pos.load(Ordering::Relaxed);
+        let write = self.write_pos.load(Ordering::Acquire);
+        let count = core::cmp::min(write.wrapping_sub(read), dst.len());
+        let buf = self.buf.get() as *const T;
+        for (i, d) in dst[..count].iter_mut().enumerate() {
+            unsafe {
+                *d = *buf.add(read.wrapping_add(i) & (N - 1));
+            }
+        }
+        self.read_pos
+            .store(read.wrapping_add(count), Ordering::Release);
+        count
+    }
+}
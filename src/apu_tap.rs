@@ -0,0 +1,141 @@
+use super::apu::*;
+use super::apu_blip::*;
+use super::apu_resampler::*;
+use super::apu_ring::*;
+use core::cell::UnsafeCell;
+
+/// チャンネル数
+pub const APU_CHANNEL_NUM: usize = 5;
+
+/// チャンネル
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
+pub enum ApuChannel {
+    Pulse1,
+    Pulse2,
+    Triangle,
+    Noise,
+    Dmc,
+}
+
+impl ApuChannel {
+    pub fn index(self) -> usize {
+        match self {
+            ApuChannel::Pulse1 => 0,
+            ApuChannel::Pulse2 => 1,
+            ApuChannel::Triangle => 2,
+            ApuChannel::Noise => 3,
+            ApuChannel::Dmc => 4,
+        }
+    }
+}
+
+/// 1チャンネル分の合成の状態。合成するスレッドだけが触る
+#[derive(Clone)]
+struct TapSynth {
+    /// 最後にblipに書き込んだ出力
+    last_output: i32,
+    blip: BlipBuffer,
+    resampler: Resampler,
+}
+
+impl Default for TapSynth {
+    fn default() -> Self {
+        Self {
+            last_output: 0,
+            blip: BlipBuffer::default(),
+            resampler: Resampler::default(),
+        }
+    }
+}
+
+/// チャンネルごとの出力
+/// Apu::attach_channel_tapで取り付けると、ミキサーの出力と同じ合成の中で各チャンネルを単独で鳴らした波形も書き出します
+/// 値はそのチャンネルだけを鳴らしたときのミキサーの出力です。ミキサーは非線形なので、合計はミキサーの出力と一致しません
+/// リングバッファは書き込み(合成のスレッド)と読み出しが1つずつであれば、SampleRingと同様にロックせずに別スレッドから読み出せます
+pub struct ApuChannelTap {
+    synth: UnsafeCell<[TapSynth; APU_CHANNEL_NUM]>,
+    rings: [SampleRing; APU_CHANNEL_NUM],
+}
+
+unsafe impl Sync for ApuChannelTap {}
+
+impl Default for ApuChannelTap {
+    fn default() -> Self {
+        Self {
+            synth: UnsafeCell::new([
+                TapSynth::default(),
+                TapSynth::default(),
+                TapSynth::default(),
+                TapSynth::default(),
+                TapSynth::default(),
+            ]),
+            rings: [
+                SampleRing::default(),
+                SampleRing::default(),
+                SampleRing::default(),
+                SampleRing::default(),
+                SampleRing::default(),
+            ],
+        }
+    }
+}
+
+impl ApuChannelTap {
+    /// サンプリング周波数を設定します。取り付けるApuのinitと同じ値にしてください
+    /// ret: 対応していない周波数(0, BLIP_MAX_SAMPLE_RATEより大きい)ならfalse
+    pub fn init(&mut self, sample_rate: u32) -> bool {
+        *self = Self::default();
+        if sample_rate == 0 || sample_rate > BLIP_MAX_SAMPLE_RATE {
+            return false;
+        }
+        let synth_rate = apu_synth_rate(sample_rate);
+        self.synth.get_mut().iter_mut().all(|s| {
+            s.blip.set_sample_rate(synth_rate) && s.resampler.init(synth_rate, sample_rate)
+        })
+    }
+
+    /// チャンネルの出力のリングバッファ
+    pub fn ring(&self, channel: ApuChannel) -> &SampleRing {
+        &self.rings[channel.index()]
+    }
+
+    /// 各チャンネルの出力が変わっていればblipに書き込みます。合成するスレッドから呼んでください
+    /// `time` - 現在のフレームの先頭からのCPUサイクル数
+    #[inline]
+    pub fn update_output(&self, time: u32, outputs: &[i32; APU_CHANNEL_NUM]) {
+        let synth = unsafe { &mut *self.synth.get() };
+        for (s, output) in synth.iter_mut().zip(outputs.iter()) {
+            if *output != s.last_output {
+                s.blip.add_delta(time, *output - s.last_output);
+                s.last_output = *output;
+            }
+        }
+    }
+
+    /// 現在のフレームを`time`で終了して、各チャンネルの出力をリングバッファに書き出します。合成するスレッドから呼んでください
+    pub fn end_frame(&self, time: u32) {
+        let synth = unsafe { &mut *self.synth.get() };
+        let mut samples = [0i16; 256];
+        for (s, ring) in synth.iter_mut().zip(self.rings.iter()) {
+            s.blip.end_frame(time);
+            while s.blip.samples_avail() > 0 {
+                let count = s.blip.read_samples(&mut samples);
+                s.resampler.process(&samples[..count], ring);
+            }
+        }
+    }
+
+    /// Apu::set_rate_adjustと同じずれを各チャンネルに設定します。合成するスレッドから呼んでください
+    pub fn set_rate_adjust(&self, ppm: i32) {
+        let synth = unsafe { &mut *self.synth.get() };
+        for s in synth.iter_mut() {
+            s.resampler.adjust(ppm);
+        }
+    }
+
+    /// Apu::set_resampler_kernelと同じ実装を各チャンネルに設定します。合成するスレッドから呼んでください
+    pub fn set_resampler_kernel(&self, kernel: ResamplerKernel) -> bool {
+        let synth = unsafe { &mut *self.synth.get() };
+        synth.iter_mut().all(|s| s.resampler.set_kernel(kernel))
+    }
+}
@@ -1,13 +1,24 @@
 use super::interface::*;
 
-pub const PRG_ROM_MAX_SIZE: usize = 0x8000;
-pub const CHR_ROM_MAX_SIZE: usize = 0x2000;
-pub const BATTERY_PACKED_RAM_MAX_SIZE: usize = 0x2000;
-
 pub const PRG_ROM_SYSTEM_BASE_ADDR: u16 = 0x8000;
 pub const BATTERY_PACKED_RAM_BASE_ADDR: u16 = 0x6000;
 
+/// CPUから見えるPRG-ROMの窓(0x8000 ~ 0xffff)
+pub const PRG_ROM_WINDOW_SIZE: usize = 0x8000;
+/// PPUから見えるCHR-ROMの窓(0x0000 ~ 0x1fff)、CHR-RAMもこのサイズ
+pub const CHR_ROM_WINDOW_SIZE: usize = 0x2000;
+/// CPUから見えるBattery Packed RAMの窓(0x6000 ~ 0x7fff)
+pub const BATTERY_PACKED_RAM_WINDOW_SIZE: usize = 0x2000;
+
+/// Battery Packed RAMの変更を追跡する単位
+pub const BATTERY_PACKED_RAM_PAGE_SIZE: usize = 0x0100;
+/// 追跡するページ数、u32のbitmaskで管理する
+pub const BATTERY_PACKED_RAM_NUM_OF_PAGES: usize =
+    BATTERY_PACKED_RAM_WINDOW_SIZE / BATTERY_PACKED_RAM_PAGE_SIZE;
+
 pub const INES_TRAINER_DATA_SIZE: usize = 0x0200;
+/// Trainerは0x7000 - 0x71ffに展開される
+pub const INES_TRAINER_BATTERY_PACKED_RAM_OFFSET: usize = 0x1000;
 
 #[derive(Copy, Clone)]
 pub enum Mapper {
@@ -24,10 +35,244 @@ pub enum NameTableMirror {
     SingleScreen,
     FourScreen,
 }
+
+/// PRG-ROM, CHR-ROM, Battery Packed RAMの置き場所
+/// ビルド構成(Storage Profile)ごとに実装を切り替えて、使う分だけ領域を確保させる
+pub trait CassetteStorage: Clone + Default {
+    fn prg_rom(&self) -> &[u8];
+    fn chr_rom(&self) -> &[u8];
+    /// CHR-RAMとして書き換えられない場合はNone
+    fn chr_rom_mut(&mut self) -> Option<&mut [u8]>;
+    fn battery_packed_ram(&self) -> &[u8];
+    fn battery_packed_ram_mut(&mut self) -> &mut [u8];
+    /// iNESファイルのPRG-ROM/CHR-ROMを配置します。容量が足りない場合はfalse
+    /// `read_func` - iNESファイルの読み出し
+    /// `rom_ptr` - iNESファイルがメモリ上にある場合はその先頭、closureでしか読めない場合はnull
+    /// `prg_rom` - (iNESファイル上の先頭, バイト数)
+    /// `chr_rom` - (iNESファイル上の先頭, バイト数)
+    fn map_rom(
+        &mut self,
+        read_func: impl Fn(usize) -> u8,
+        rom_ptr: *const u8,
+        prg_rom: (usize, usize),
+        chr_rom: (usize, usize),
+    ) -> bool;
+    /// ROMの割当を解除して、RAMをクリアします
+    fn clear(&mut self);
+    /// `src`と同じROM、RAMの状態にします。ROMは参照できるものは参照を共有し、コピーが必要なものは使用中の範囲だけコピーします
+    /// `prg_rom_bytes`, `chr_rom_bytes` - `src`に読み込まれているROMのサイズ。CHR-ROMが0ならCHR-RAMとして扱います
+    fn clone_state_from(&mut self, src: &Self, prg_rom_bytes: usize, chr_rom_bytes: usize);
+}
+
+/// カセットの中身をすべて内部の配列に展開するStorage
+/// 配列サイズはProfileごとに型引数で決める
+#[derive(Clone)]
+pub struct ArrayStorage<
+    const PRG_ROM_SIZE: usize,
+    const CHR_ROM_SIZE: usize,
+    const BATTERY_PACKED_RAM_SIZE: usize,
+> {
+    pub prg_rom: [u8; PRG_ROM_SIZE],
+    pub chr_rom: [u8; CHR_ROM_SIZE],
+    pub battery_packed_ram: [u8; BATTERY_PACKED_RAM_SIZE],
+}
+
+/// NROM専用。組み込み向けの最小構成 32KB + 8KB + 8KB
+pub type NromStorage = ArrayStorage<0x8000, 0x2000, 0x2000>;
+/// Mapper対応を見込んだHost向け構成 512KB + 256KB + 8KB
+pub type MapperStorage = ArrayStorage<0x80000, 0x40000, 0x2000>;
+
+impl<
+        const PRG_ROM_SIZE: usize,
+        const CHR_ROM_SIZE: usize,
+        const BATTERY_PACKED_RAM_SIZE: usize,
+    > Default for ArrayStorage<PRG_ROM_SIZE, CHR_ROM_SIZE, BATTERY_PACKED_RAM_SIZE>
+{
+    fn default() -> Self {
+        Self {
+            prg_rom: [0; PRG_ROM_SIZE],
+            chr_rom: [0; CHR_ROM_SIZE],
+            battery_packed_ram: [0; BATTERY_PACKED_RAM_SIZE],
+        }
+    }
+}
+
+impl<
+        const PRG_ROM_SIZE: usize,
+        const CHR_ROM_SIZE: usize,
+        const BATTERY_PACKED_RAM_SIZE: usize,
+    > CassetteStorage for ArrayStorage<PRG_ROM_SIZE, CHR_ROM_SIZE, BATTERY_PACKED_RAM_SIZE>
+{
+    fn prg_rom(&self) -> &[u8] {
+        &self.prg_rom
+    }
+    fn chr_rom(&self) -> &[u8] {
+        &self.chr_rom
+    }
+    /// CHR_RAM対応も込めて書き換え可能にしておく
+    fn chr_rom_mut(&mut self) -> Option<&mut [u8]> {
+        Some(&mut self.chr_rom)
+    }
+    fn battery_packed_ram(&self) -> &[u8] {
+        &self.battery_packed_ram
+    }
+    fn battery_packed_ram_mut(&mut self) -> &mut [u8] {
+        &mut self.battery_packed_ram
+    }
+    fn map_rom(
+        &mut self,
+        read_func: impl Fn(usize) -> u8,
+        _rom_ptr: *const u8,
+        prg_rom: (usize, usize),
+        chr_rom: (usize, usize),
+    ) -> bool {
+        let (prg_rom_baseaddr, prg_rom_bytes) = prg_rom;
+        let (chr_rom_baseaddr, chr_rom_bytes) = chr_rom;
+        if prg_rom_bytes > PRG_ROM_SIZE || chr_rom_bytes > CHR_ROM_SIZE {
+            return false;
+        }
+        // PRG-ROM
+        for index in 0..prg_rom_bytes {
+            let ines_binary_addr = prg_rom_baseaddr + index;
+            self.prg_rom[index] = read_func(ines_binary_addr);
+        }
+        // CHR-ROM
+        for index in 0..chr_rom_bytes {
+            let ines_binary_addr = chr_rom_baseaddr + index;
+            self.chr_rom[index] = read_func(ines_binary_addr);
+        }
+        true
+    }
+    fn clear(&mut self) {
+        self.prg_rom = [0; PRG_ROM_SIZE];
+        self.chr_rom = [0; CHR_ROM_SIZE];
+        self.battery_packed_ram = [0; BATTERY_PACKED_RAM_SIZE];
+    }
+    /// 配列全体ではなく、読み込まれているROMの範囲だけをコピーする
+    fn clone_state_from(&mut self, src: &Self, prg_rom_bytes: usize, chr_rom_bytes: usize) {
+        let chr_bytes = if chr_rom_bytes == 0 {
+            CHR_ROM_WINDOW_SIZE
+        } else {
+            chr_rom_bytes
+        };
+        let prg_bytes = core::cmp::min(prg_rom_bytes, PRG_ROM_SIZE);
+        let chr_bytes = core::cmp::min(chr_bytes, CHR_ROM_SIZE);
+        self.prg_rom[..prg_bytes].copy_from_slice(&src.prg_rom[..prg_bytes]);
+        self.chr_rom[..chr_bytes].copy_from_slice(&src.chr_rom[..chr_bytes]);
+        self.battery_packed_ram
+            .copy_from_slice(&src.battery_packed_ram);
+    }
+}
+
+/// PRG-ROM/CHR-ROMをコピーせず、メモリ上(Flash, SDRAMなど)のiNESファイルをそのまま参照するStorage
+/// 参照先はエミュレーション中ずっと有効である必要がある
+#[derive(Clone)]
+pub struct RomInPlaceStorage {
+    pub prg_rom_ptr: *const u8,
+    pub prg_rom_bytes: usize,
+    pub chr_rom_ptr: *const u8,
+    pub chr_rom_bytes: usize,
+    /// CHR-ROMを持たないカセット向けのCHR-RAM
+    pub chr_ram: [u8; CHR_ROM_WINDOW_SIZE],
+    pub battery_packed_ram: [u8; BATTERY_PACKED_RAM_WINDOW_SIZE],
+}
+
+impl Default for RomInPlaceStorage {
+    fn default() -> Self {
+        Self {
+            prg_rom_ptr: core::ptr::null(),
+            prg_rom_bytes: 0,
+            chr_rom_ptr: core::ptr::null(),
+            chr_rom_bytes: 0,
+            chr_ram: [0; CHR_ROM_WINDOW_SIZE],
+            battery_packed_ram: [0; BATTERY_PACKED_RAM_WINDOW_SIZE],
+        }
+    }
+}
+
+impl CassetteStorage for RomInPlaceStorage {
+    fn prg_rom(&self) -> &[u8] {
+        if self.prg_rom_ptr.is_null() {
+            &[]
+        } else {
+            unsafe { core::slice::from_raw_parts(self.prg_rom_ptr, self.prg_rom_bytes) }
+        }
+    }
+    fn chr_rom(&self) -> &[u8] {
+        if self.chr_rom_ptr.is_null() {
+            &self.chr_ram
+        } else {
+            unsafe { core::slice::from_raw_parts(self.chr_rom_ptr, self.chr_rom_bytes) }
+        }
+    }
+    /// CHR-ROMは参照先を書き換えられないので、CHR-RAMの場合のみ
+    fn chr_rom_mut(&mut self) -> Option<&mut [u8]> {
+        if self.chr_rom_ptr.is_null() {
+            Some(&mut self.chr_ram)
+        } else {
+            None
+        }
+    }
+    fn battery_packed_ram(&self) -> &[u8] {
+        &self.battery_packed_ram
+    }
+    fn battery_packed_ram_mut(&mut self) -> &mut [u8] {
+        &mut self.battery_packed_ram
+    }
+    fn map_rom(
+        &mut self,
+        _read_func: impl Fn(usize) -> u8,
+        rom_ptr: *const u8,
+        prg_rom: (usize, usize),
+        chr_rom: (usize, usize),
+    ) -> bool {
+        // closure経由でしか読めない場合は参照できない
+        if rom_ptr.is_null() {
+            return false;
+        }
+        let (prg_rom_baseaddr, prg_rom_bytes) = prg_rom;
+        let (chr_rom_baseaddr, chr_rom_bytes) = chr_rom;
+        if chr_rom_bytes > CHR_ROM_WINDOW_SIZE {
+            return false;
+        }
+        unsafe {
+            self.prg_rom_ptr = rom_ptr.add(prg_rom_baseaddr);
+            self.chr_rom_ptr = if chr_rom_bytes > 0 {
+                rom_ptr.add(chr_rom_baseaddr)
+            } else {
+                core::ptr::null()
+            };
+        }
+        self.prg_rom_bytes = prg_rom_bytes;
+        self.chr_rom_bytes = chr_rom_bytes;
+        true
+    }
+    fn clear(&mut self) {
+        self.prg_rom_ptr = core::ptr::null();
+        self.prg_rom_bytes = 0;
+        self.chr_rom_ptr = core::ptr::null();
+        self.chr_rom_bytes = 0;
+        self.chr_ram = [0; CHR_ROM_WINDOW_SIZE];
+        self.battery_packed_ram = [0; BATTERY_PACKED_RAM_WINDOW_SIZE];
+    }
+    /// ROMは参照先を共有するのでコピーしない
+    fn clone_state_from(&mut self, src: &Self, _prg_rom_bytes: usize, _chr_rom_bytes: usize) {
+        self.prg_rom_ptr = src.prg_rom_ptr;
+        self.prg_rom_bytes = src.prg_rom_bytes;
+        self.chr_rom_ptr = src.chr_rom_ptr;
+        self.chr_rom_bytes = src.chr_rom_bytes;
+        if src.chr_rom_ptr.is_null() {
+            self.chr_ram.copy_from_slice(&src.chr_ram);
+        }
+        self.battery_packed_ram
+            .copy_from_slice(&src.battery_packed_ram);
+    }
+}
+
 /// Cassete and mapper implement
 /// https://wiki.nesdev.com/w/index.php/List_of_mappers
 #[derive(Clone)]
-pub struct Cassette {
+pub struct Cassette<S: CassetteStorage = NromStorage> {
     // Mapperの種類
     pub mapper: Mapper,
     /// Video領域での0x2000 ~ 0x2effのミラーリング設定
@@ -39,12 +284,13 @@ pub struct Cassette {
     pub prg_rom_bytes: usize,
     pub chr_rom_bytes: usize,
     // datas
-    pub prg_rom: [u8; PRG_ROM_MAX_SIZE], // 32KB
-    pub chr_rom: [u8; CHR_ROM_MAX_SIZE], // 8K
-    pub battery_packed_ram: [u8; BATTERY_PACKED_RAM_MAX_SIZE],
+    pub storage: S,
+
+    /// 前回の同期以降に書き換えられたBattery Packed RAMのページ(bit n = 0x6000 + n * 0x100)
+    pub battery_packed_ram_dirty_pages: u32,
 }
 
-impl Default for Cassette {
+impl<S: CassetteStorage> Default for Cassette<S> {
     fn default() -> Self {
         Self {
             mapper: Mapper::Unknown,
@@ -54,17 +300,28 @@ impl Default for Cassette {
             prg_rom_bytes: 0,
             chr_rom_bytes: 0,
 
-            prg_rom: [0; PRG_ROM_MAX_SIZE],
-            chr_rom: [0; CHR_ROM_MAX_SIZE],
-            battery_packed_ram: [0; BATTERY_PACKED_RAM_MAX_SIZE],
+            storage: S::default(),
+
+            battery_packed_ram_dirty_pages: 0,
         }
     }
 }
 
-impl Cassette {
+impl<S: CassetteStorage> Cassette<S> {
     /// inesファイルから読み出してメモリ上に展開します
     /// 組み込み環境でRAM展開されていなくても利用できるように、多少パフォーマンスを犠牲にしてもclosure経由で読み出します
+    /// ROM-in-placeのStorageでは参照先がわからないので失敗します
     pub fn from_ines_binary(&mut self, read_func: impl Fn(usize) -> u8) -> bool {
+        self.from_ines(read_func, core::ptr::null())
+    }
+
+    /// メモリ上にあるinesファイルを読み込みます
+    /// ROM-in-placeのStorageでは`rom_ptr`を参照し続けるので、エミュレーション中は解放しないこと
+    pub unsafe fn from_ines_ptr(&mut self, rom_ptr: *const u8) -> bool {
+        self.from_ines(|addr: usize| *rom_ptr.add(addr), rom_ptr)
+    }
+
+    fn from_ines(&mut self, read_func: impl Fn(usize) -> u8, rom_ptr: *const u8) -> bool {
         // header : 16byte
         // trainer: 0 or 512byte
         // prg rom: prg_rom_size * 16KB(0x4000)
@@ -120,55 +377,138 @@ impl Cassette {
 
         // 現在はMapper0しか対応しない
         self.mapper = Mapper::Nrom;
-        debug_assert!(prg_rom_bytes <= PRG_ROM_MAX_SIZE);
-        debug_assert!(chr_rom_bytes <= CHR_ROM_MAX_SIZE);
+
+        // PRG-ROM, CHR-ROMの配置はStorageに任せる。Profileの容量が足りなければ失敗
+        if !self.storage.map_rom(
+            &read_func,
+            rom_ptr,
+            (prg_rom_baseaddr, prg_rom_bytes),
+            (chr_rom_baseaddr, chr_rom_bytes),
+        ) {
+            return false;
+        }
 
         // Battery Packed RAMの初期値
         if is_exists_trainer {
             // 0x7000 - 0x71ffに展開する
+            let battery_packed_ram = self.storage.battery_packed_ram_mut();
             for index in 0..INES_TRAINER_DATA_SIZE {
                 let ines_binary_addr = trainer_baseaddr + index;
-                self.prg_rom[index] = read_func(ines_binary_addr);
+                battery_packed_ram[INES_TRAINER_BATTERY_PACKED_RAM_OFFSET + index] =
+                    read_func(ines_binary_addr);
             }
         }
 
-        // PRG-ROM
-        for index in 0..prg_rom_bytes {
-            let ines_binary_addr = prg_rom_baseaddr + index;
-            self.prg_rom[index] = read_func(ines_binary_addr);
-        }
-        // CHR-ROM
-        for index in 0..chr_rom_bytes {
-            let ines_binary_addr = chr_rom_baseaddr + index;
-            self.chr_rom[index] = read_func(ines_binary_addr);
-        }
-
         // rom sizeをセットしとく
         self.prg_rom_bytes = prg_rom_bytes;
         self.chr_rom_bytes = chr_rom_bytes;
+        // Trainerの展開は保存対象ではない
+        self.battery_packed_ram_dirty_pages = 0;
 
         // やったね
         true
     }
+
+    /// NSFのように、PRG-ROMの窓(0x8000 ~ 0xffff)に直接配置するデータを読み込みます。Mapper0として扱います
+    /// 窓に収まらない分は捨て、データのない所は0で埋めます
+    /// 配置をずらしてコピーするので、ROM-in-placeのStorageでは失敗します
+    /// `read_func` - データの先頭からの読み出し
+    /// `offset` - データを置く位置。窓の先頭からのbyte数
+    /// `bytes` - データのbyte数
+    pub fn from_prg_image(
+        &mut self,
+        read_func: impl Fn(usize) -> u8,
+        offset: usize,
+        bytes: usize,
+    ) -> bool {
+        if offset >= PRG_ROM_WINDOW_SIZE {
+            return false;
+        }
+        let image_bytes = core::cmp::min(bytes, PRG_ROM_WINDOW_SIZE - offset);
+        let image_func = |index: usize| {
+            if index >= offset && index < offset + image_bytes {
+                read_func(index - offset)
+            } else {
+                0
+            }
+        };
+        if !self.storage.map_rom(
+            image_func,
+            core::ptr::null(),
+            (0, PRG_ROM_WINDOW_SIZE),
+            (0, 0),
+        ) {
+            return false;
+        }
+        self.mapper = Mapper::Nrom;
+        self.nametable_mirror = NameTableMirror::Horizontal;
+        self.is_exists_battery_backed_ram = false;
+        self.prg_rom_bytes = PRG_ROM_WINDOW_SIZE;
+        self.chr_rom_bytes = 0;
+        self.battery_packed_ram_dirty_pages = 0;
+        true
+    }
+
+    /// PRG-ROMをバスを経由せずに読み出します。DMCのDMAのように、アドレスがPRG-ROMに限られる読み出しに使います
+    /// `addr` - 0x8000 ~ 0xffff
+    #[inline]
+    pub fn read_prg_rom(&self, addr: u16) -> u8 {
+        debug_assert!(addr >= PRG_ROM_SYSTEM_BASE_ADDR);
+
+        let index = usize::from(addr - PRG_ROM_SYSTEM_BASE_ADDR);
+        // ROMが16KB場合のミラーリング
+        if index < self.prg_rom_bytes {
+            arr_read!(self.storage.prg_rom(), index)
+        } else {
+            arr_read!(self.storage.prg_rom(), index - self.prg_rom_bytes)
+        }
+    }
+}
+
+/// Battery Packed RAMの永続化
+/// ホストは変更のあったページだけを一定間隔でファイルやブロックデバイスに書き出す
+impl<S: CassetteStorage> Cassette<S> {
+    /// 電池バックアップされたRAMを持っていれば、そのサイズを返します
+    pub fn battery_packed_ram_bytes(&self) -> usize {
+        if self.is_exists_battery_backed_ram {
+            BATTERY_PACKED_RAM_WINDOW_SIZE
+        } else {
+            0
+        }
+    }
+    /// 変更のあったページを返して、追跡状態をクリアします
+    pub fn take_battery_packed_ram_dirty_pages(&mut self) -> u32 {
+        let dirty_pages = self.battery_packed_ram_dirty_pages;
+        self.battery_packed_ram_dirty_pages = 0;
+        dirty_pages
+    }
+    /// 指定したページを読み出します
+    /// `page` - 0 ~ BATTERY_PACKED_RAM_NUM_OF_PAGES-1
+    pub fn read_battery_packed_ram_page(&self, page: usize) -> &[u8] {
+        debug_assert!(page < BATTERY_PACKED_RAM_NUM_OF_PAGES);
+        let offset = page * BATTERY_PACKED_RAM_PAGE_SIZE;
+        &self.storage.battery_packed_ram()[offset..(offset + BATTERY_PACKED_RAM_PAGE_SIZE)]
+    }
+    /// 保存しておいた内容を書き戻します。書き戻した内容は変更扱いにしません
+    pub fn restore_battery_packed_ram(&mut self, read_func: impl Fn(usize) -> u8, bytes: usize) {
+        let battery_packed_ram = self.storage.battery_packed_ram_mut();
+        let restore_bytes = core::cmp::min(bytes, battery_packed_ram.len());
+        for index in 0..restore_bytes {
+            battery_packed_ram[index] = read_func(index);
+        }
+        self.battery_packed_ram_dirty_pages = 0;
+    }
 }
 
-impl SystemBus for Cassette {
+impl<S: CassetteStorage> SystemBus for Cassette<S> {
     fn read_u8(&mut self, addr: u16, _is_nondestructive: bool) -> u8 {
         if addr < PRG_ROM_SYSTEM_BASE_ADDR {
             debug_assert!(addr >= BATTERY_PACKED_RAM_BASE_ADDR);
 
             let index = usize::from(addr - BATTERY_PACKED_RAM_BASE_ADDR);
-            arr_read!(self.battery_packed_ram, index)
+            arr_read!(self.storage.battery_packed_ram(), index)
         } else {
-            debug_assert!(addr >= PRG_ROM_SYSTEM_BASE_ADDR);
-
-            let index = usize::from(addr - PRG_ROM_SYSTEM_BASE_ADDR);
-            // ROMが16KB場合のミラーリング
-            if index < self.prg_rom_bytes {
-                arr_read!(self.prg_rom, index)
-            } else {
-                arr_read!(self.prg_rom, index - self.prg_rom_bytes)
-            }
+            self.read_prg_rom(addr)
         }
     }
     fn write_u8(&mut self, addr: u16, data: u8, _is_nondestructive: bool) {
@@ -176,43 +516,41 @@ impl SystemBus for Cassette {
             debug_assert!(addr >= BATTERY_PACKED_RAM_BASE_ADDR);
 
             let index = usize::from(addr - BATTERY_PACKED_RAM_BASE_ADDR);
-            arr_write!(self.battery_packed_ram, index, data)
+            arr_write!(self.storage.battery_packed_ram_mut(), index, data);
+            // 永続化のために書き換えたページを覚えておく。バッテリーがなければ作業用RAMなので書き戻さない
+            if self.is_exists_battery_backed_ram {
+                self.battery_packed_ram_dirty_pages |= 1 << (index / BATTERY_PACKED_RAM_PAGE_SIZE);
+            }
         } else {
             debug_assert!(addr >= PRG_ROM_SYSTEM_BASE_ADDR);
-
-            let index = usize::from(addr - PRG_ROM_SYSTEM_BASE_ADDR);
-            // ROMが16KB場合のミラーリング
-            if index < self.prg_rom_bytes {
-                arr_write!(self.prg_rom, index, data);
-            } else {
-                arr_write!(self.prg_rom, index - self.prg_rom_bytes, data);
-            }
+            // PRG-ROMは書き換えない(ROM-in-placeでは参照先がFlashの場合もある)
         }
     }
 }
-impl VideoBus for Cassette {
+impl<S: CassetteStorage> VideoBus for Cassette<S> {
     fn read_video_u8(&mut self, addr: u16) -> u8 {
         let index = usize::from(addr);
-        debug_assert!(index < CHR_ROM_MAX_SIZE);
-        arr_read!(self.chr_rom, index)
+        debug_assert!(index < CHR_ROM_WINDOW_SIZE);
+        arr_read!(self.storage.chr_rom(), index)
     }
     /// CHR_RAM対応も込めて書き換え可能にしておく
     fn write_video_u8(&mut self, addr: u16, data: u8) {
         let index = usize::from(addr);
-        debug_assert!(index < CHR_ROM_MAX_SIZE);
-        arr_write!(self.chr_rom, index, data);
+        debug_assert!(index < CHR_ROM_WINDOW_SIZE);
+        if let Some(chr_rom) = self.storage.chr_rom_mut() {
+            arr_write!(chr_rom, index, data);
+        }
     }
 }
 
-impl EmulateControl for Cassette {
+impl<S: CassetteStorage> EmulateControl for Cassette<S> {
     fn reset(&mut self) {
         self.mapper = Mapper::Unknown;
         self.nametable_mirror = NameTableMirror::Unknown;
         self.is_exists_battery_backed_ram = false;
         self.prg_rom_bytes = 0;
         self.chr_rom_bytes = 0;
-        self.prg_rom = [0; PRG_ROM_MAX_SIZE];
-        self.chr_rom = [0; CHR_ROM_MAX_SIZE];
-        self.battery_packed_ram = [0; BATTERY_PACKED_RAM_MAX_SIZE];
+        self.storage.clear();
+        self.battery_packed_ram_dirty_pages = 0;
     }
 }
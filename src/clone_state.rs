@@ -0,0 +1,112 @@
+use super::apu::*;
+use super::cassette::*;
+use super::cpu::*;
+use super::ppu::*;
+use super::system::*;
+
+/// 別のインスタンスから可変な内部状態だけを複製する機能を提供します
+/// 木探索やA/B比較のために実行中のゲームを分岐させる用途を想定しています
+/// Save Stateを経由するのと同じ結果になりますが、直列化を挟まずに直接コピーします
+/// ホスト側の設定(描画設定など)は複製先のものを維持すること
+pub trait CloneState {
+    fn clone_state_from(&mut self, src: &Self);
+}
+
+impl CloneState for Cpu {
+    fn clone_state_from(&mut self, src: &Self) {
+        self.clone_from(src);
+    }
+}
+
+impl<S: CassetteStorage> CloneState for Cassette<S> {
+    fn clone_state_from(&mut self, src: &Self) {
+        self.mapper = src.mapper;
+        self.nametable_mirror = src.nametable_mirror;
+        self.is_exists_battery_backed_ram = src.is_exists_battery_backed_ram;
+
+        self.prg_rom_bytes = src.prg_rom_bytes;
+        self.chr_rom_bytes = src.chr_rom_bytes;
+        self.storage
+            .clone_state_from(&src.storage, src.prg_rom_bytes, src.chr_rom_bytes);
+
+        self.battery_packed_ram_dirty_pages = src.battery_packed_ram_dirty_pages;
+    }
+}
+
+impl<S: CassetteStorage> CloneState for System<S> {
+    fn clone_state_from(&mut self, src: &Self) {
+        self.wram.copy_from_slice(&src.wram);
+        self.ppu_reg.copy_from_slice(&src.ppu_reg);
+        self.io_reg.copy_from_slice(&src.io_reg);
+
+        self.cassette.clone_state_from(&src.cassette);
+        self.video.clone_from(&src.video);
+        self.pad1.clone_from(&src.pad1);
+        self.pad2.clone_from(&src.pad2);
+
+        self.written_oam_data = src.written_oam_data;
+        self.written_ppu_scroll = src.written_ppu_scroll;
+        self.written_ppu_addr = src.written_ppu_addr;
+        self.written_ppu_data = src.written_ppu_data;
+        self.written_oam_dma = src.written_oam_dma;
+        self.read_oam_data = src.read_oam_data;
+        self.read_ppu_data = src.read_ppu_data;
+        self.is_oam_dma_running = src.is_oam_dma_running;
+
+        self.apu_cycle = src.apu_cycle;
+        self.apu_log[..src.apu_log_len].copy_from_slice(&src.apu_log[..src.apu_log_len]);
+        self.apu_log_len = src.apu_log_len;
+        self.is_apu_sync_requested = src.is_apu_sync_requested;
+        self.apu_status = src.apu_status;
+        self.dmc_stall_cycles = src.dmc_stall_cycles;
+
+        self.ppu_is_second_write = src.ppu_is_second_write;
+        self.ppu_scroll_y_reg = src.ppu_scroll_y_reg;
+        self.ppu_addr_lower_reg = src.ppu_addr_lower_reg;
+    }
+}
+
+impl CloneState for Ppu {
+    fn clone_state_from(&mut self, src: &Self) {
+        self.oam.copy_from_slice(&src.oam);
+        self.sprite_temps = src.sprite_temps;
+
+        self.cumulative_cpu_cyc = src.cumulative_cpu_cyc;
+        self.current_line = src.current_line;
+
+        self.fetch_scroll_x = src.fetch_scroll_x;
+        self.fetch_scroll_y = src.fetch_scroll_y;
+        self.current_scroll_x = src.current_scroll_x;
+        self.current_scroll_y = src.current_scroll_y;
+
+        self.is_dma_running = src.is_dma_running;
+        self.dma_cpu_src_addr = src.dma_cpu_src_addr;
+        self.dma_oam_dst_addr = src.dma_oam_dst_addr;
+
+        // 観測出力の積算途中の値も引き継ぐ(描画設定は複製先のまま)
+        self.observation_acc = src.observation_acc;
+    }
+}
+
+/// `src_*`の内部状態を`dst_*`に複製します
+/// 複製先はROMを読み込んでいなくても構いません。ROM-in-placeのStorageではROMを共有するのでコピーしません
+/// Apuはsave_state/load_stateと同様に扱います。複製元がNoneなら、複製先は電源投入時の状態から再開します
+pub fn clone_state<S: CassetteStorage>(
+    dst_cpu: &mut Cpu,
+    dst_system: &mut System<S>,
+    dst_ppu: &mut Ppu,
+    dst_apu: Option<&mut Apu>,
+    src_cpu: &Cpu,
+    src_system: &System<S>,
+    src_ppu: &Ppu,
+    src_apu: Option<&Apu>,
+) {
+    dst_cpu.clone_state_from(src_cpu);
+    dst_system.clone_state_from(src_system);
+    dst_ppu.clone_state_from(src_ppu);
+    match (dst_apu, src_apu) {
+        (Some(dst_apu), Some(src_apu)) => dst_apu.clone_state_from(src_apu),
+        (Some(dst_apu), None) => dst_apu.reset_state(src_system.apu_cycle),
+        (None, _) => {}
+    }
+}
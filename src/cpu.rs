@@ -1,3 +1,4 @@
+use super::cassette::CassetteStorage;
 use super::interface::*;
 use super::system::System;
 
@@ -68,22 +69,22 @@ impl Cpu {
         self.pc = self.pc + incr;
     }
     /// Stack Push操作を行います
-    pub fn stack_push(&mut self, system: &mut System, data: u8) {
-        // data store
-        system.write_u8(self.sp, data, false);
+    pub fn stack_push<S: CassetteStorage>(&mut self, system: &mut System<S>, data: u8) {
+        // data store. StackはWRAMにしか割り当たらないので直接書く
+        system.write_stack(self.sp, data);
         // decrement
         self.sp = self.sp - 1;
     }
 
     /// Stack Pop操作を行います
-    pub fn stack_pop(&mut self, system: &mut System) -> u8 {
+    pub fn stack_pop<S: CassetteStorage>(&mut self, system: &mut System<S>) -> u8 {
         // increment
         self.sp = self.sp + 1;
         // data fetch
-        system.read_u8(self.sp, false)
+        system.read_stack(self.sp)
     }
     /// 割り込みを処理します
-    pub fn interrupt(&mut self, system: &mut System, irq_type: Interrupt) {
+    pub fn interrupt<S: CassetteStorage>(&mut self, system: &mut System<S>, irq_type: Interrupt) {
         let is_nested_interrupt = self.read_interrupt_flag();
         // RESET, NMI以外は多重割り込みを許容しない
         if is_nested_interrupt && (irq_type == Interrupt::IRQ) || (irq_type == Interrupt::BRK) {
@@ -0,0 +1,103 @@
+use super::apu::*;
+use super::cassette::CassetteStorage;
+use super::cpu::*;
+use super::ppu::*;
+use super::system::System;
+
+/// 1命令、もしくは複数の命令をまとめて実行するCPUの実装
+/// stepだけ実装すれば、PPUのlineとframeの区切りに合わせて1frame進める処理は共通のものを使います
+pub trait CpuEngine {
+    /// 1命令もしくはまとめた命令列を実行します
+    /// `budget` - 消費してよいcycle数。これ以上かかる可能性がある命令列はまとめて実行しない
+    /// ret: cycle数
+    fn step<S: CassetteStorage>(
+        &mut self,
+        cpu: &mut Cpu,
+        system: &mut System<S>,
+        budget: usize,
+    ) -> u8;
+
+    /// 直前のstepでPPUのlineの区切りに達したときに、PPUを進める前に呼ばれます
+    fn end_line(&mut self) {}
+
+    /// CPU/PPUを1frame分エミュレーションします
+    fn emulate_frame<S: CassetteStorage>(
+        &mut self,
+        cpu: &mut Cpu,
+        system: &mut System<S>,
+        ppu: &mut Ppu,
+        fb: *mut u8,
+    ) where
+        Self: Sized,
+    {
+        emulate_engine_frame(self, None, &ApuNullSink, cpu, system, ppu, fb);
+    }
+
+    /// CPU/PPU/APUを1frame分エミュレーションします
+    /// stepがまとめて実行する命令列の途中で$4015を読むと、APUを1命令ずつ進めた場合と結果が変わります
+    fn emulate_apu_frame<S: CassetteStorage, O: ApuSink>(
+        &mut self,
+        apu: &mut Apu,
+        out: &O,
+        cpu: &mut Cpu,
+        system: &mut System<S>,
+        ppu: &mut Ppu,
+        fb: *mut u8,
+    ) where
+        Self: Sized,
+    {
+        emulate_engine_frame(self, Some(apu), out, cpu, system, ppu, fb);
+    }
+}
+
+/// 1命令ずつ実行するインタプリタ。`budget`は使いません
+#[derive(Copy, Clone, Default)]
+pub struct Interpreter;
+
+impl CpuEngine for Interpreter {
+    #[inline(always)]
+    fn step<S: CassetteStorage>(
+        &mut self,
+        cpu: &mut Cpu,
+        system: &mut System<S>,
+        _budget: usize,
+    ) -> u8 {
+        cpu.step(system)
+    }
+}
+
+/// `engine`でCPU/PPUを1frame分(CYCLE_PER_DRAW_FRAME)エミュレーションします
+/// `apu` - Noneの場合はAPUを進めません
+#[inline(always)]
+pub fn emulate_engine_frame<E: CpuEngine, S: CassetteStorage, O: ApuSink>(
+    engine: &mut E,
+    mut apu: Option<&mut Apu>,
+    out: &O,
+    cpu: &mut Cpu,
+    system: &mut System<S>,
+    ppu: &mut Ppu,
+    fb: *mut u8,
+) {
+    let mut total_cyc = 0;
+    while total_cyc < CYCLE_PER_DRAW_FRAME {
+        // PPUのline処理とframeの区切りをまたがない範囲で実行する
+        let budget = core::cmp::min(
+            CPU_CYCLE_PER_LINE - ppu.cumulative_cpu_cyc,
+            CYCLE_PER_DRAW_FRAME - total_cyc,
+        );
+        let cpu_cyc = engine.step(cpu, system, budget);
+        // DMCのDMAでCPUが止まった分も、PPUとframeの時刻は進む
+        let stall_cyc = match apu {
+            Some(ref mut apu) => apu.step(system, out, cpu_cyc),
+            None => 0,
+        };
+        let cyc = usize::from(cpu_cyc) + usize::from(stall_cyc);
+        total_cyc = total_cyc + cyc;
+        if cyc >= CPU_CYCLE_PER_LINE - ppu.cumulative_cpu_cyc {
+            engine.end_line();
+        }
+        if let Some(irq) = ppu.step(cyc, system, fb) {
+            cpu.interrupt(system, irq);
+        }
+    }
+}
@@ -0,0 +1,287 @@
+use super::cassette::{CassetteStorage, PRG_ROM_SYSTEM_BASE_ADDR};
+use super::cpu::*;
+use super::cpu_engine::*;
+use super::interface::*;
+use super::system::System;
+
+use core::fmt;
+
+/// 検出結果を保持するテーブルのエントリ数
+const FUSION_NUM_OF_ENTRIES: usize = 0x10000 - PRG_ROM_SYSTEM_BASE_ADDR as usize;
+
+/// 検出結果のテーブルの値。FUSION_ENTRY_KIND_BASE以上は FusionKind::ALL のindex + FUSION_ENTRY_KIND_BASE
+const FUSION_ENTRY_UNCHECKED: u8 = 0;
+const FUSION_ENTRY_NONE: u8 = 1;
+const FUSION_ENTRY_KIND_BASE: u8 = 2;
+
+/// 融合する命令列の種類数
+pub const FUSION_NUM_OF_KINDS: usize = 5;
+
+/// 1つのハンドラで実行する命令列。ゲームのトレースで頻出するものを選んでいます
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
+pub enum FusionKind {
+    /// LDA zp; STA abs
+    LdaZpStaAbs,
+    /// DEX; BNE
+    DexBne,
+    /// DEY; BNE
+    DeyBne,
+    /// LDA abs; BPL。`LDA $2002; BPL`でVBlankを待つループなど
+    LdaAbsBpl,
+    /// INC zp; LDA zp
+    IncZpLdaZp,
+}
+
+impl FusionKind {
+    pub const ALL: [FusionKind; FUSION_NUM_OF_KINDS] = [
+        FusionKind::LdaZpStaAbs,
+        FusionKind::DexBne,
+        FusionKind::DeyBne,
+        FusionKind::LdaAbsBpl,
+        FusionKind::IncZpLdaZp,
+    ];
+
+    pub fn name(self) -> &'static str {
+        match self {
+            FusionKind::LdaZpStaAbs => "LDA zp; STA abs",
+            FusionKind::DexBne => "DEX; BNE",
+            FusionKind::DeyBne => "DEY; BNE",
+            FusionKind::LdaAbsBpl => "LDA abs; BPL",
+            FusionKind::IncZpLdaZp => "INC zp; LDA zp",
+        }
+    }
+
+    /// 融合している命令数
+    pub fn num_of_insts(self) -> u64 {
+        2
+    }
+
+    /// 分岐やページ跨ぎを含めた最大cycle数
+    fn max_cyc(self) -> u8 {
+        match self {
+            FusionKind::LdaZpStaAbs => 3 + 4,
+            FusionKind::DexBne | FusionKind::DeyBne => 2 + 4,
+            FusionKind::LdaAbsBpl => 4 + 4,
+            FusionKind::IncZpLdaZp => 5 + 3,
+        }
+    }
+
+    /// `addr`から始まる命令列を判定します
+    fn detect<S: CassetteStorage>(system: &mut System<S>, addr: u16) -> Option<FusionKind> {
+        // 最長の LDA abs; BPL (5byte) が収まらない末尾は対象外
+        if addr > 0xfffb {
+            return None;
+        }
+        let mut code = [0u8; 5];
+        for (i, data) in code.iter_mut().enumerate() {
+            *data = system.read_u8(addr + i as u16, true);
+        }
+        match code {
+            [0xa5, _, 0x8d, _, _] => Some(FusionKind::LdaZpStaAbs),
+            [0xca, 0xd0, _, _, _] => Some(FusionKind::DexBne),
+            [0x88, 0xd0, _, _, _] => Some(FusionKind::DeyBne),
+            [0xad, _, _, 0x10, _] => Some(FusionKind::LdaAbsBpl),
+            [0xe6, _, 0xa5, _, _] => Some(FusionKind::IncZpLdaZp),
+            _ => None,
+        }
+    }
+}
+
+/// 実行統計
+#[derive(Copy, Clone, Default)]
+pub struct FusionStats {
+    /// FusionKind::ALLの順に、融合して実行した回数
+    pub fused: [u64; FUSION_NUM_OF_KINDS],
+    /// 融合せずCpu::stepで実行した命令数
+    pub single_steps: u64,
+}
+
+impl FusionStats {
+    /// 融合によって省略した命令ディスパッチの数
+    pub fn eliminated_dispatches(&self) -> u64 {
+        FusionKind::ALL
+            .iter()
+            .zip(self.fused.iter())
+            .map(|(kind, count)| count * (kind.num_of_insts() - 1))
+            .sum()
+    }
+
+    /// 実行した命令数
+    pub fn total_insts(&self) -> u64 {
+        self.single_steps + self.eliminated_dispatches() + self.fused.iter().sum::<u64>()
+    }
+
+    /// 命令列ごとの実行回数と、省略したディスパッチ数を書き出します
+    pub fn dump(&self, w: &mut impl fmt::Write) -> fmt::Result {
+        let total = core::cmp::max(1, self.total_insts());
+        for (kind, count) in FusionKind::ALL.iter().zip(self.fused.iter()) {
+            writeln!(
+                w,
+                "{:<16} {:>12} ({:.2} % of instructions)",
+                kind.name(),
+                count,
+                100.0 * (count * kind.num_of_insts()) as f64 / total as f64
+            )?;
+        }
+        writeln!(
+            w,
+            "dispatch {:>12} -> {} ({:.2} % eliminated)",
+            total,
+            total - self.eliminated_dispatches(),
+            100.0 * self.eliminated_dispatches() as f64 / total as f64
+        )
+    }
+}
+
+/// よく使われる2命令の組をPRG-ROM上で検出し、1回のディスパッチでまとめて実行します
+/// 検出結果はアドレスごとに保持するので、PRG-ROMを入れ替えた場合はresetしてください
+/// PPU/APUレジスタへのアクセスは1組につき高々1回で、組はPPUの1lineをまたがないときだけ実行するので、結果はCpu::stepと一致します
+#[derive(Clone)]
+pub struct Fusion {
+    /// PRG-ROMのアドレスごとの検出結果
+    kinds: [u8; FUSION_NUM_OF_ENTRIES],
+    pub stats: FusionStats,
+}
+
+impl Default for Fusion {
+    fn default() -> Self {
+        Self {
+            kinds: [FUSION_ENTRY_UNCHECKED; FUSION_NUM_OF_ENTRIES],
+            stats: FusionStats::default(),
+        }
+    }
+}
+
+/// N,Zフラグを更新します
+#[inline(always)]
+fn update_nz(cpu: &mut Cpu, result: u8) {
+    cpu.write_zero_flag(result == 0);
+    cpu.write_negative_flag((result & 0x80) == 0x80);
+}
+
+/// `addr`から2byte読み出します
+#[inline(always)]
+fn read_u16<S: CassetteStorage>(system: &mut System<S>, addr: u16) -> u16 {
+    u16::from(system.read_u8(addr, false)) | (u16::from(system.read_u8(addr + 1, false)) << 8)
+}
+
+/// `addr`にある分岐命令を実行します
+/// ret: cycle数。Cpu::stepと同じく、分岐しない場合も分岐先のページ跨ぎを加算します
+#[inline(always)]
+fn branch<S: CassetteStorage>(
+    cpu: &mut Cpu,
+    system: &mut System<S>,
+    addr: u16,
+    is_taken: bool,
+) -> u8 {
+    let offset = system.read_u8(addr + 1, false);
+    let next = addr + 2;
+    let dst = (i32::from(offset as i8) + i32::from(next)) as u16;
+    let additional_cyc = if (dst & 0xff00) != (next & 0xff00) {
+        1
+    } else {
+        0
+    };
+    if is_taken {
+        cpu.pc = dst;
+        1 + 1 + additional_cyc + 1
+    } else {
+        cpu.pc = next;
+        1 + 1 + additional_cyc
+    }
+}
+
+impl Fusion {
+    /// 検出結果と統計を破棄します
+    pub fn reset(&mut self) {
+        self.kinds = [FUSION_ENTRY_UNCHECKED; FUSION_NUM_OF_ENTRIES];
+        self.stats = FusionStats::default();
+    }
+
+    /// 命令列を実行します。各命令の読み書きの順序とcycle数はCpu::stepと同じです
+    /// ret: cycle数
+    fn execute<S: CassetteStorage>(kind: FusionKind, cpu: &mut Cpu, system: &mut System<S>) -> u8 {
+        let pc = cpu.pc;
+        match kind {
+            FusionKind::LdaZpStaAbs => {
+                let src_addr = system.read_u8(pc + 1, false);
+                let dst_addr = read_u16(system, pc + 3);
+                let data = system.read_zero_page(src_addr);
+                update_nz(cpu, data);
+                cpu.a = data;
+                system.write_u8(dst_addr, data, false);
+                cpu.pc = pc + 5;
+                3 + 4
+            }
+            FusionKind::DexBne => {
+                let result = cpu.x.wrapping_sub(1);
+                update_nz(cpu, result);
+                cpu.x = result;
+                2 + branch(cpu, system, pc + 1, result != 0)
+            }
+            FusionKind::DeyBne => {
+                let result = cpu.y.wrapping_sub(1);
+                update_nz(cpu, result);
+                cpu.y = result;
+                2 + branch(cpu, system, pc + 1, result != 0)
+            }
+            FusionKind::LdaAbsBpl => {
+                let addr = read_u16(system, pc + 1);
+                let data = system.read_u8(addr, false);
+                update_nz(cpu, data);
+                cpu.a = data;
+                4 + branch(cpu, system, pc + 3, (data & 0x80) == 0)
+            }
+            FusionKind::IncZpLdaZp => {
+                let inc_addr = system.read_u8(pc + 1, false);
+                let lda_addr = system.read_u8(pc + 3, false);
+                let result = system.read_zero_page(inc_addr).wrapping_add(1);
+                update_nz(cpu, result);
+                system.write_zero_page(inc_addr, result);
+                let data = system.read_zero_page(lda_addr);
+                update_nz(cpu, data);
+                cpu.a = data;
+                cpu.pc = pc + 4;
+                5 + 3
+            }
+        }
+    }
+}
+
+impl CpuEngine for Fusion {
+    /// 融合した命令列もしくは1命令を実行します
+    /// `budget` - 消費してよいcycle数。これ以上かかる可能性がある命令列は融合しない
+    /// ret: cycle数
+    fn step<S: CassetteStorage>(
+        &mut self,
+        cpu: &mut Cpu,
+        system: &mut System<S>,
+        budget: usize,
+    ) -> u8 {
+        // PRG-ROMより前(WRAMなど)のコードは書き換わる可能性があるので融合しない
+        if cpu.pc >= PRG_ROM_SYSTEM_BASE_ADDR {
+            let index = usize::from(cpu.pc - PRG_ROM_SYSTEM_BASE_ADDR);
+            let mut entry = self.kinds[index];
+            if entry == FUSION_ENTRY_UNCHECKED {
+                entry = match FusionKind::detect(system, cpu.pc) {
+                    Some(kind) => {
+                        let kind_index = FusionKind::ALL.iter().position(|k| *k == kind).unwrap();
+                        FUSION_ENTRY_KIND_BASE + kind_index as u8
+                    }
+                    None => FUSION_ENTRY_NONE,
+                };
+                self.kinds[index] = entry;
+            }
+            if entry >= FUSION_ENTRY_KIND_BASE {
+                let kind_index = usize::from(entry - FUSION_ENTRY_KIND_BASE);
+                let kind = FusionKind::ALL[kind_index];
+                if usize::from(kind.max_cyc()) < budget {
+                    self.stats.fused[kind_index] += 1;
+                    return Fusion::execute(kind, cpu, system);
+                }
+            }
+        }
+        self.stats.single_steps += 1;
+        cpu.step(system)
+    }
+}
@@ -0,0 +1,255 @@
+use super::cassette::{CassetteStorage, PRG_ROM_SYSTEM_BASE_ADDR};
+use super::cpu::*;
+use super::cpu_engine::*;
+use super::interface::*;
+use super::system::*;
+
+/// 検出結果をキャッシュするエントリ数。待ちループは少数なのでアドレスで直接マップする
+const IDLE_CACHE_ENTRIES: usize = 64;
+/// 待ちループとみなす本体の最大byte数
+const IDLE_MAX_LOOP_BYTES: u16 = 16;
+
+/// 待ちループの検出結果
+#[derive(Copy, Clone, Default)]
+struct IdleLoopEntry {
+    /// 判定したアドレス。0は未判定
+    head: u16,
+    /// ループ本体のbyte数。0ならループの先頭ではない
+    len: u16,
+}
+
+/// 実行統計
+#[derive(Copy, Clone, Default)]
+pub struct IdleStats {
+    /// Cpu::stepで実行した命令数
+    pub executed_insts: u64,
+    /// 省略した待ちループの周回数
+    pub skipped_iterations: u64,
+    /// 省略したcycle数
+    pub skipped_cycles: u64,
+}
+
+/// ループ本体に含めてよい命令の種類
+enum IdleInst {
+    /// レジスタとフラグだけを変更する命令
+    Register,
+    /// メモリを読み出してレジスタとフラグを変更する命令。`u16`は命令長
+    Read(AddressingMode, u16),
+    Branch,
+    JmpAbsolute,
+}
+
+/// ループ本体で使うAddressingMode
+#[derive(Copy, Clone, PartialEq)]
+enum AddressingMode {
+    Immediate,
+    ZeroPage,
+    ZeroPageIndexed,
+    Absolute,
+}
+
+impl IdleInst {
+    /// 書き込み、スタック操作、読み出しで状態が変わるI/Oを含まない命令だけを返します
+    fn from(opcode: u8) -> Option<IdleInst> {
+        match opcode {
+            // TAX, TAY, TXA, TYA, INX, INY, DEX, DEY, CLC, SEC, CLV, NOP
+            0xaa | 0xa8 | 0x8a | 0x98 | 0xe8 | 0xc8 | 0xca | 0x88 | 0x18 | 0x38 | 0xb8 | 0xea => {
+                Some(IdleInst::Register)
+            }
+            // LDA, LDX, LDY, CMP, CPX, CPY, AND, ORA, EOR, ADC, SBC
+            0xa9 | 0xa2 | 0xa0 | 0xc9 | 0xe0 | 0xc0 | 0x29 | 0x09 | 0x49 | 0x69 | 0xe9 => {
+                Some(IdleInst::Read(AddressingMode::Immediate, 2))
+            }
+            0xa5 | 0xa6 | 0xa4 | 0xc5 | 0xe4 | 0xc4 | 0x25 | 0x05 | 0x45 | 0x65 | 0xe5 | 0x24 => {
+                Some(IdleInst::Read(AddressingMode::ZeroPage, 2))
+            }
+            0xb5 | 0xb6 | 0xb4 | 0xd5 | 0x35 | 0x15 | 0x55 | 0x75 | 0xf5 => {
+                Some(IdleInst::Read(AddressingMode::ZeroPageIndexed, 2))
+            }
+            0xad | 0xae | 0xac | 0xcd | 0xec | 0xcc | 0x2d | 0x0d | 0x4d | 0x6d | 0xed | 0x2c => {
+                Some(IdleInst::Read(AddressingMode::Absolute, 3))
+            }
+            // BPL, BMI, BVC, BVS, BCC, BCS, BNE, BEQ
+            0x10 | 0x30 | 0x50 | 0x70 | 0x90 | 0xb0 | 0xd0 | 0xf0 => Some(IdleInst::Branch),
+            0x4c => Some(IdleInst::JmpAbsolute),
+            _ => None,
+        }
+    }
+}
+
+/// 何度読んでも同じ値が返り、状態も変わらないアドレスか
+/// WRAM, PPU_STATUS($2002, ミラー含む), カセット上のRAM/ROM
+fn is_idempotent_read_addr(addr: u16) -> bool {
+    addr < PPU_REG_BASE_ADDR
+        || (addr < APU_IO_REG_BASE_ADDR && (addr & 0x0007) == 0x0002)
+        || addr >= 0x6000
+}
+
+/// `LDA $2002; BPL wait`やZeroPageのフラグを待つループなど、副作用のない待ちループを検出して早送りします
+/// 待ちループの先頭に戻ってきたときにレジスタが前回と同じで、その間にPPUのlineを跨いでいなければ、
+/// 次のPPUの処理(lineの更新, VBlank, Sprite 0 hit)までの周回は同じ結果になるので、まとめてcycleだけ進めます
+/// ループ本体は書き込みを含まず、読み出しの副作用($2002のVBlankフラグのクリアなど)は繰り返しても変わらないものに限ります
+/// 結果はCpu::stepで1命令ずつ実行した場合と一致します
+/// 待ちループは$4015を読まないものに限るので、emulate_apu_frameでも早送りした周回の分をAPUで合成し、APUを1命令ずつ進めた場合と一致します
+#[derive(Clone)]
+pub struct IdleSkip {
+    cache: [IdleLoopEntry; IDLE_CACHE_ENTRIES],
+    /// 監視中のループの先頭と終端。先頭が0なら監視していない
+    watch_head: u16,
+    watch_end: u16,
+    /// 先頭に到達したときのレジスタ
+    watch_a: u8,
+    watch_x: u8,
+    watch_y: u8,
+    watch_p: u8,
+    watch_sp: u16,
+    /// 先頭に到達したときのline_serial
+    watch_line_serial: u32,
+    /// 先頭に到達してから経過したcycle数
+    watch_cyc: usize,
+    /// ループに入ってから先頭に到達した回数
+    watch_arrivals: u32,
+    /// PPUのlineを跨いだ回数。読み出す値が変わりうるタイミングの区切りに使う
+    line_serial: u32,
+    pub stats: IdleStats,
+}
+
+impl Default for IdleSkip {
+    fn default() -> Self {
+        Self {
+            cache: [IdleLoopEntry::default(); IDLE_CACHE_ENTRIES],
+            watch_head: 0,
+            watch_end: 0,
+            watch_a: 0,
+            watch_x: 0,
+            watch_y: 0,
+            watch_p: 0,
+            watch_sp: 0,
+            watch_line_serial: 0,
+            watch_cyc: 0,
+            watch_arrivals: 0,
+            line_serial: 0,
+            stats: IdleStats::default(),
+        }
+    }
+}
+
+impl IdleSkip {
+    /// 検出結果と統計を破棄します。ROMを入れ替えたときに呼んでください
+    pub fn reset(&mut self) {
+        *self = Self::default();
+    }
+
+    /// `head`から始まる待ちループの本体のbyte数を返します。待ちループでなければ0
+    fn loop_len<S: CassetteStorage>(&mut self, system: &mut System<S>, head: u16) -> u16 {
+        let index = usize::from(head) % IDLE_CACHE_ENTRIES;
+        let entry = self.cache[index];
+        if entry.head == head {
+            return entry.len;
+        }
+        let len = IdleSkip::analyze(system, head);
+        self.cache[index] = IdleLoopEntry { head, len };
+        len
+    }
+
+    /// `head`から命令を辿り、`head`に戻る分岐までが副作用のない命令だけであれば本体のbyte数を返します
+    fn analyze<S: CassetteStorage>(system: &mut System<S>, head: u16) -> u16 {
+        let mut addr = head;
+        while addr - head < IDLE_MAX_LOOP_BYTES && addr <= 0xfffc {
+            let opcode = system.read_u8(addr, true);
+            let operand_lower = system.read_u8(addr + 1, true);
+            let operand =
+                u16::from(operand_lower) | (u16::from(system.read_u8(addr + 2, true)) << 8);
+            match IdleInst::from(opcode) {
+                Some(IdleInst::Register) => addr = addr + 1,
+                Some(IdleInst::Read(mode, len)) => {
+                    if mode == AddressingMode::Absolute && !is_idempotent_read_addr(operand) {
+                        return 0;
+                    }
+                    addr = addr + len;
+                }
+                Some(IdleInst::Branch) => {
+                    let next = addr + 2;
+                    let dst = (i32::from(operand_lower as i8) + i32::from(next)) as u16;
+                    if dst == head {
+                        return next - head;
+                    }
+                    // ループの外への分岐は抜けるときだけ通る
+                    addr = next;
+                }
+                Some(IdleInst::JmpAbsolute) => {
+                    return if operand == head { addr + 3 - head } else { 0 };
+                }
+                None => return 0,
+            }
+        }
+        0
+    }
+}
+
+impl CpuEngine for IdleSkip {
+    /// 1命令実行するか、待ちループを早送りします
+    /// `budget` - 消費してよいcycle数。早送りはこれ未満に収めます
+    /// ret: cycle数
+    fn step<S: CassetteStorage>(
+        &mut self,
+        cpu: &mut Cpu,
+        system: &mut System<S>,
+        budget: usize,
+    ) -> u8 {
+        let pc = cpu.pc;
+        if self.watch_head != 0 && (pc < self.watch_head || pc >= self.watch_end) {
+            // ループを抜けたか割り込みが入った
+            self.watch_head = 0;
+        }
+        // PRG-ROMより前(WRAMなど)のコードは書き換わる可能性があるので対象にしない
+        if pc >= PRG_ROM_SYSTEM_BASE_ADDR {
+            let len = self.loop_len(system, pc);
+            if len > 0 {
+                // 最初の周回は直前のコードが残した状態(VBlankフラグなど)を読むので、2周目以降を比べる
+                if self.watch_head == pc
+                    && self.watch_arrivals >= 2
+                    && self.watch_line_serial == self.line_serial
+                    && self.watch_a == cpu.a
+                    && self.watch_x == cpu.x
+                    && self.watch_y == cpu.y
+                    && self.watch_p == cpu.p
+                    && self.watch_sp == cpu.sp
+                    && self.watch_cyc > 0
+                    && self.watch_cyc < budget
+                {
+                    // 前回の周回で状態が変わっていないので、budgetに収まるだけ周回を省略する
+                    let iterations = (budget - 1) / self.watch_cyc;
+                    let cyc = iterations * self.watch_cyc;
+                    self.stats.skipped_iterations += iterations as u64;
+                    self.stats.skipped_cycles += cyc as u64;
+                    // 次の周回は実際に実行して、もう一度確かめる
+                    self.watch_cyc = 0;
+                    return cyc as u8;
+                }
+                self.watch_arrivals = if self.watch_head == pc {
+                    self.watch_arrivals.saturating_add(1)
+                } else {
+                    1
+                };
+                self.watch_head = pc;
+                self.watch_end = pc + len;
+                self.watch_a = cpu.a;
+                self.watch_x = cpu.x;
+                self.watch_y = cpu.y;
+                self.watch_p = cpu.p;
+                self.watch_sp = cpu.sp;
+                self.watch_line_serial = self.line_serial;
+                self.watch_cyc = 0;
+            }
+        }
+        let cyc = cpu.step(system);
+        self.stats.executed_insts += 1;
+        self.watch_cyc += usize::from(cyc);
+        cyc
+    }
+
+    fn end_line(&mut self) {
+        self.line_serial = self.line_serial.wrapping_add(1);
+    }
+}
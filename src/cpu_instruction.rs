@@ -1,3 +1,4 @@
+use super::cassette::CassetteStorage;
 use super::cpu::*;
 use super::interface::SystemBus;
 use super::system::System;
@@ -422,14 +423,14 @@ impl Instruction {
 impl Cpu {
     /// PCから1byteフェッチします
     /// フェッチした後、PCを一つ進めます
-    fn fetch_u8(&mut self, system: &mut System) -> u8 {
+    fn fetch_u8<S: CassetteStorage>(&mut self, system: &mut System<S>) -> u8 {
         let data = system.read_u8(self.pc, false);
         self.pc = self.pc + 1;
         data
     }
     /// PCから2byteフェッチします
     /// フェッチした後、PCを一つ進めます
-    fn fetch_u16(&mut self, system: &mut System) -> u16 {
+    fn fetch_u16<S: CassetteStorage>(&mut self, system: &mut System<S>) -> u16 {
         let lower = self.fetch_u8(system);
         let upper = self.fetch_u8(system);
         let data = u16::from(lower) | (u16::from(upper) << 8);
@@ -437,7 +438,11 @@ impl Cpu {
     }
     /// operandをフェッチします。AddressingモードによってはPCも進みます
     /// 実装するときは命令直後のオペランドを読み取るときはCpu::fetch, それ以外はSystem::read
-    fn fetch_operand(&mut self, system: &mut System, mode: AddressingMode) -> Operand {
+    fn fetch_operand<S: CassetteStorage>(
+        &mut self,
+        system: &mut System<S>,
+        mode: AddressingMode,
+    ) -> Operand {
         match mode {
             AddressingMode::Implied => Operand(0, 0),
             AddressingMode::Accumulator => Operand(0, 1),
@@ -504,9 +509,9 @@ impl Cpu {
                 let src_addr = self.fetch_u8(system);
                 let dst_addr = src_addr.wrapping_add(self.x);
 
-                let data_lower = u16::from(system.read_u8(u16::from(dst_addr), false));
-                let data_upper =
-                    u16::from(system.read_u8(u16::from(dst_addr.wrapping_add(1)), false));
+                // ポインタはZeroPageにあるのでWRAMから直接読む
+                let data_lower = u16::from(system.read_zero_page(dst_addr));
+                let data_upper = u16::from(system.read_zero_page(dst_addr.wrapping_add(1)));
 
                 let data = data_lower | (data_upper << 8);
                 Operand(data, 5)
@@ -514,9 +519,9 @@ impl Cpu {
             AddressingMode::IndirectY => {
                 let src_addr = self.fetch_u8(system);
 
-                let data_lower = u16::from(system.read_u8(u16::from(src_addr), false));
-                let data_upper =
-                    u16::from(system.read_u8(u16::from(src_addr.wrapping_add(1)), false));
+                // ポインタはZeroPageにあるのでWRAMから直接読む
+                let data_lower = u16::from(system.read_zero_page(src_addr));
+                let data_upper = u16::from(system.read_zero_page(src_addr.wrapping_add(1)));
 
                 let base_data = data_lower | (data_upper << 8);
                 let data = base_data.wrapping_add(u16::from(self.y));
@@ -530,9 +535,45 @@ impl Cpu {
             }
         }
     }
+    /// operandのアドレスから読み出します
+    /// ZeroPageはWRAMにしか割り当たらないので、System Busを経由せずに読み出します
+    #[inline(always)]
+    fn load<S: CassetteStorage>(
+        system: &mut System<S>,
+        mode: AddressingMode,
+        addr: u16,
+        is_nondestructive: bool,
+    ) -> u8 {
+        match mode {
+            AddressingMode::ZeroPage | AddressingMode::ZeroPageX | AddressingMode::ZeroPageY => {
+                system.read_zero_page(addr as u8)
+            }
+            _ => system.read_u8(addr, is_nondestructive),
+        }
+    }
+    /// operandのアドレスに書き込みます
+    /// ZeroPageはWRAMにしか割り当たらないので、System Busを経由せずに書き込みます
+    #[inline(always)]
+    fn store<S: CassetteStorage>(
+        system: &mut System<S>,
+        mode: AddressingMode,
+        addr: u16,
+        data: u8,
+    ) {
+        match mode {
+            AddressingMode::ZeroPage | AddressingMode::ZeroPageX | AddressingMode::ZeroPageY => {
+                system.write_zero_page(addr as u8, data)
+            }
+            _ => system.write_u8(addr, data, false),
+        }
+    }
     /// addressだけでなくデータまで一発で引きたい場合
     /// ret: (Operand(引いだ即値もしくはアドレス, clock数), データ)
-    fn fetch_args(&mut self, system: &mut System, mode: AddressingMode) -> (Operand, u8) {
+    fn fetch_args<S: CassetteStorage>(
+        &mut self,
+        system: &mut System<S>,
+        mode: AddressingMode,
+    ) -> (Operand, u8) {
         match mode {
             // 使わないはず
             AddressingMode::Implied => (self.fetch_operand(system, mode), 0),
@@ -547,7 +588,7 @@ impl Cpu {
             // 他は帰ってきたアドレスからデータを引きなおす。使わない場合もある
             _ => {
                 let Operand(addr, cyc) = self.fetch_operand(system, mode);
-                let data = system.read_u8(addr, false);
+                let data = Cpu::load(system, mode, addr, false);
                 (Operand(addr, cyc), data)
             }
         }
@@ -556,7 +597,7 @@ impl Cpu {
     /// 命令を実行します
     /// ret: cycle数
     /// http://obelisk.me.uk/6502/reference.html
-    pub fn step(&mut self, system: &mut System) -> u8 {
+    pub fn step<S: CassetteStorage>(&mut self, system: &mut System<S>) -> u8 {
         // 命令がおいてあるところのaddress
         let inst_pc = self.pc;
         let inst_code = self.fetch_u8(system);
@@ -664,7 +705,7 @@ impl Cpu {
                     1 + cyc
                 } else {
                     // 計算結果を元いたアドレスに書き戻す
-                    system.write_u8(addr, result, false);
+                    Cpu::store(system, mode, addr, result);
                     3 + cyc
                 }
             }
@@ -686,7 +727,7 @@ impl Cpu {
                     1 + cyc
                 } else {
                     // 計算結果を元いたアドレスに書き戻す
-                    system.write_u8(addr, result, false);
+                    Cpu::store(system, mode, addr, result);
                     3 + cyc
                 }
             }
@@ -709,7 +750,7 @@ impl Cpu {
                     1 + cyc
                 } else {
                     // 計算結果を元いたアドレスに書き戻す
-                    system.write_u8(addr, result, false);
+                    Cpu::store(system, mode, addr, result);
                     3 + cyc
                 }
             }
@@ -732,7 +773,7 @@ impl Cpu {
                     1 + cyc
                 } else {
                     // 計算結果を元いたアドレスに書き戻す
-                    system.write_u8(addr, result, false);
+                    Cpu::store(system, mode, addr, result);
                     3 + cyc
                 }
             }
@@ -748,7 +789,7 @@ impl Cpu {
 
                 self.write_zero_flag(is_zero);
                 self.write_negative_flag(is_negative);
-                system.write_u8(addr, result, false);
+                Cpu::store(system, mode, addr, result);
                 3 + cyc
             }
             Opcode::INX => {
@@ -783,7 +824,7 @@ impl Cpu {
 
                 self.write_zero_flag(is_zero);
                 self.write_negative_flag(is_negative);
-                system.write_u8(addr, result, false);
+                Cpu::store(system, mode, addr, result);
                 3 + cyc
             }
             Opcode::DEX => {
@@ -848,19 +889,19 @@ impl Cpu {
             Opcode::STA => {
                 let Operand(addr, cyc) = self.fetch_operand(system, mode);
 
-                system.write_u8(addr, self.a, false);
+                Cpu::store(system, mode, addr, self.a);
                 1 + cyc
             }
             Opcode::STX => {
                 let Operand(addr, cyc) = self.fetch_operand(system, mode);
 
-                system.write_u8(addr, self.x, false);
+                Cpu::store(system, mode, addr, self.x);
                 1 + cyc
             }
             Opcode::STY => {
                 let Operand(addr, cyc) = self.fetch_operand(system, mode);
 
-                system.write_u8(addr, self.y, false);
+                Cpu::store(system, mode, addr, self.y);
                 1 + cyc
             }
 
@@ -1149,7 +1190,7 @@ impl Cpu {
                 // ZeroPage or Absolute
                 // 非破壊読み出しが必要, fetch_args使わずに自分で読むか...
                 let Operand(addr, cyc) = self.fetch_operand(system, mode);
-                let arg = system.read_u8(addr, true); // 非破壊読み出し
+                let arg = Cpu::load(system, mode, addr, true); // 非破壊読み出し
 
                 let is_negative = (arg & 0x80) == 0x80;
                 let is_overflow = (arg & 0x40) == 0x40;
@@ -1260,7 +1301,7 @@ impl Cpu {
 
                 let result = self.a & self.x;
 
-                system.write_u8(addr, result, false);
+                Cpu::store(system, mode, addr, result);
                 1 + cyc
             }
             Opcode::DCP => {
@@ -1269,7 +1310,7 @@ impl Cpu {
 
                 // DEC
                 let dec_result = arg.wrapping_sub(1);
-                system.write_u8(addr, dec_result, false);
+                Cpu::store(system, mode, addr, dec_result);
 
                 // CMP
                 let result = self.a.wrapping_sub(dec_result);
@@ -1289,7 +1330,7 @@ impl Cpu {
 
                 // INC
                 let inc_result = arg.wrapping_add(1);
-                system.write_u8(addr, inc_result, false);
+                Cpu::store(system, mode, addr, inc_result);
 
                 // SBC
                 let (data1, is_carry1) = self.a.overflowing_sub(inc_result);
@@ -1320,7 +1361,7 @@ impl Cpu {
                 let is_carry = (arg & 0x80) == 0x80;
                 self.write_carry_flag(is_carry);
 
-                system.write_u8(addr, result_rol, false);
+                Cpu::store(system, mode, addr, result_rol);
 
                 // AND
                 let result_and = self.a & result_rol;
@@ -1346,7 +1387,7 @@ impl Cpu {
                 let is_carry_ror = (arg & 0x01) == 0x01;
                 self.write_carry_flag(is_carry_ror);
 
-                system.write_u8(addr, result_ror, false);
+                Cpu::store(system, mode, addr, result_ror);
 
                 // ADC
                 let tmp = u16::from(self.a)
@@ -1378,7 +1419,7 @@ impl Cpu {
                 let is_carry = (arg & 0x80) == 0x80; // shift前データでわかるよね
                 self.write_carry_flag(is_carry);
 
-                system.write_u8(addr, result_asl, false);
+                Cpu::store(system, mode, addr, result_asl);
 
                 // ORA
                 let result_ora = self.a | result_asl;
@@ -1402,7 +1443,7 @@ impl Cpu {
                 let is_carry = (arg & 0x01) == 0x01;
                 self.write_carry_flag(is_carry);
 
-                system.write_u8(addr, result_lsr, false);
+                Cpu::store(system, mode, addr, result_lsr);
 
                 // EOR
                 let result_eor = self.a ^ result_lsr;
@@ -0,0 +1,640 @@
+use super::cassette::{CassetteStorage, PRG_ROM_SYSTEM_BASE_ADDR};
+use super::cpu::*;
+use super::cpu_engine::*;
+use super::interface::*;
+use super::system::*;
+
+/// ブロックを管理するテーブルのエントリ数
+const JIT_NUM_OF_ENTRIES: usize = 0x10000 - PRG_ROM_SYSTEM_BASE_ADDR as usize;
+/// この回数実行されたアドレスを翻訳します
+pub const JIT_HOT_THRESHOLD: u8 = 16;
+/// 1ブロックに含める命令数の上限
+const JIT_MAX_BLOCK_INSTRUCTIONS: usize = 32;
+/// 1ブロックが消費するcycle数の上限。PPUの1line(CPU_CYCLE_PER_LINE)に収まる程度にする
+const JIT_MAX_BLOCK_CYCLES: u8 = 48;
+/// 1ブロックの機械語の最大サイズ。命令あたり最大58byte(ADC/SBC) + 終端
+const JIT_MAX_BLOCK_CODE_BYTES: usize = JIT_MAX_BLOCK_INSTRUCTIONS * 64 + 64;
+
+/// ブロックの状態
+const JIT_BLOCK_NONE: u32 = 0;
+const JIT_BLOCK_UNCOMPILABLE: u32 = u32::max_value();
+
+/// 翻訳したコードとやり取りするレジスタ
+/// 翻訳したコードは rdi にこの構造体、rsi にWRAMの先頭を受け取り、消費したcycle数を eax で返します
+#[repr(C)]
+#[derive(Copy, Clone, Default)]
+struct JitRegs {
+    a: u8,
+    x: u8,
+    y: u8,
+    p: u8,
+    pc: u16,
+}
+const JIT_REG_A: u8 = 0;
+const JIT_REG_X: u8 = 1;
+const JIT_REG_Y: u8 = 2;
+const JIT_REG_P: u8 = 3;
+const JIT_REG_PC: u8 = 4;
+
+type JitBlockFunc = extern "sysv64" fn(*mut JitRegs, *mut u8) -> u32;
+
+/// 翻訳済のブロック
+#[derive(Copy, Clone)]
+struct JitBlock {
+    /// コードバッファ上の位置+1。JIT_BLOCK_NONE, JIT_BLOCK_UNCOMPILABLEは特殊な値
+    entry: u32,
+    /// 分岐先によらない最大cycle数
+    max_cyc: u8,
+    /// 含まれる命令数
+    num_of_insts: u8,
+}
+
+impl Default for JitBlock {
+    fn default() -> Self {
+        Self {
+            entry: JIT_BLOCK_NONE,
+            max_cyc: 0,
+            num_of_insts: 0,
+        }
+    }
+}
+
+/// 翻訳できる命令
+#[derive(Copy, Clone, PartialEq)]
+enum JitOp {
+    /// レジスタへのロード
+    Load(u8),
+    /// レジスタのストア
+    Store(u8),
+    And,
+    Ora,
+    Eor,
+    Adc,
+    Sbc,
+    /// レジスタとの比較
+    Compare(u8),
+    Inc,
+    Dec,
+    /// レジスタのインクリメント/デクリメント
+    IncrementReg(u8, bool),
+    /// レジスタ間の転送
+    Transfer(u8, u8),
+    /// フラグのセット/クリア
+    WriteFlag(u8, bool),
+    Nop,
+    /// フラグがセット/クリアされていたら分岐
+    Branch(u8, bool),
+    Jmp,
+}
+
+#[derive(Copy, Clone, PartialEq)]
+enum JitMode {
+    Implied,
+    Immediate,
+    ZeroPage,
+    Absolute,
+}
+
+/// 翻訳できる命令を判定します。PPU/APUレジスタへのアクセスなどはここでは判定しません
+fn decode(opcode: u8) -> Option<(JitOp, JitMode)> {
+    let decoded = match opcode {
+        0xa9 => (JitOp::Load(JIT_REG_A), JitMode::Immediate),
+        0xa5 => (JitOp::Load(JIT_REG_A), JitMode::ZeroPage),
+        0xad => (JitOp::Load(JIT_REG_A), JitMode::Absolute),
+        0xa2 => (JitOp::Load(JIT_REG_X), JitMode::Immediate),
+        0xa6 => (JitOp::Load(JIT_REG_X), JitMode::ZeroPage),
+        0xae => (JitOp::Load(JIT_REG_X), JitMode::Absolute),
+        0xa0 => (JitOp::Load(JIT_REG_Y), JitMode::Immediate),
+        0xa4 => (JitOp::Load(JIT_REG_Y), JitMode::ZeroPage),
+        0xac => (JitOp::Load(JIT_REG_Y), JitMode::Absolute),
+        0x85 => (JitOp::Store(JIT_REG_A), JitMode::ZeroPage),
+        0x8d => (JitOp::Store(JIT_REG_A), JitMode::Absolute),
+        0x86 => (JitOp::Store(JIT_REG_X), JitMode::ZeroPage),
+        0x8e => (JitOp::Store(JIT_REG_X), JitMode::Absolute),
+        0x84 => (JitOp::Store(JIT_REG_Y), JitMode::ZeroPage),
+        0x8c => (JitOp::Store(JIT_REG_Y), JitMode::Absolute),
+        0x29 => (JitOp::And, JitMode::Immediate),
+        0x25 => (JitOp::And, JitMode::ZeroPage),
+        0x2d => (JitOp::And, JitMode::Absolute),
+        0x09 => (JitOp::Ora, JitMode::Immediate),
+        0x05 => (JitOp::Ora, JitMode::ZeroPage),
+        0x0d => (JitOp::Ora, JitMode::Absolute),
+        0x49 => (JitOp::Eor, JitMode::Immediate),
+        0x45 => (JitOp::Eor, JitMode::ZeroPage),
+        0x4d => (JitOp::Eor, JitMode::Absolute),
+        0x69 => (JitOp::Adc, JitMode::Immediate),
+        0x65 => (JitOp::Adc, JitMode::ZeroPage),
+        0x6d => (JitOp::Adc, JitMode::Absolute),
+        0xe9 => (JitOp::Sbc, JitMode::Immediate),
+        0xe5 => (JitOp::Sbc, JitMode::ZeroPage),
+        0xed => (JitOp::Sbc, JitMode::Absolute),
+        0xc9 => (JitOp::Compare(JIT_REG_A), JitMode::Immediate),
+        0xc5 => (JitOp::Compare(JIT_REG_A), JitMode::ZeroPage),
+        0xcd => (JitOp::Compare(JIT_REG_A), JitMode::Absolute),
+        0xe0 => (JitOp::Compare(JIT_REG_X), JitMode::Immediate),
+        0xe4 => (JitOp::Compare(JIT_REG_X), JitMode::ZeroPage),
+        0xec => (JitOp::Compare(JIT_REG_X), JitMode::Absolute),
+        0xc0 => (JitOp::Compare(JIT_REG_Y), JitMode::Immediate),
+        0xc4 => (JitOp::Compare(JIT_REG_Y), JitMode::ZeroPage),
+        0xcc => (JitOp::Compare(JIT_REG_Y), JitMode::Absolute),
+        0xe6 => (JitOp::Inc, JitMode::ZeroPage),
+        0xee => (JitOp::Inc, JitMode::Absolute),
+        0xc6 => (JitOp::Dec, JitMode::ZeroPage),
+        0xce => (JitOp::Dec, JitMode::Absolute),
+        0xe8 => (JitOp::IncrementReg(JIT_REG_X, true), JitMode::Implied),
+        0xc8 => (JitOp::IncrementReg(JIT_REG_Y, true), JitMode::Implied),
+        0xca => (JitOp::IncrementReg(JIT_REG_X, false), JitMode::Implied),
+        0x88 => (JitOp::IncrementReg(JIT_REG_Y, false), JitMode::Implied),
+        0xaa => (JitOp::Transfer(JIT_REG_A, JIT_REG_X), JitMode::Implied),
+        0xa8 => (JitOp::Transfer(JIT_REG_A, JIT_REG_Y), JitMode::Implied),
+        0x8a => (JitOp::Transfer(JIT_REG_X, JIT_REG_A), JitMode::Implied),
+        0x98 => (JitOp::Transfer(JIT_REG_Y, JIT_REG_A), JitMode::Implied),
+        0x18 => (JitOp::WriteFlag(0x01, false), JitMode::Implied),
+        0x38 => (JitOp::WriteFlag(0x01, true), JitMode::Implied),
+        0x58 => (JitOp::WriteFlag(0x04, false), JitMode::Implied),
+        0x78 => (JitOp::WriteFlag(0x04, true), JitMode::Implied),
+        0xb8 => (JitOp::WriteFlag(0x40, false), JitMode::Implied),
+        0xd8 => (JitOp::WriteFlag(0x08, false), JitMode::Implied),
+        0xf8 => (JitOp::WriteFlag(0x08, true), JitMode::Implied),
+        0xea => (JitOp::Nop, JitMode::Implied),
+        0x10 => (JitOp::Branch(0x80, false), JitMode::Immediate),
+        0x30 => (JitOp::Branch(0x80, true), JitMode::Immediate),
+        0x50 => (JitOp::Branch(0x40, false), JitMode::Immediate),
+        0x70 => (JitOp::Branch(0x40, true), JitMode::Immediate),
+        0x90 => (JitOp::Branch(0x01, false), JitMode::Immediate),
+        0xb0 => (JitOp::Branch(0x01, true), JitMode::Immediate),
+        0xd0 => (JitOp::Branch(0x02, false), JitMode::Immediate),
+        0xf0 => (JitOp::Branch(0x02, true), JitMode::Immediate),
+        0x4c => (JitOp::Jmp, JitMode::Absolute),
+        _ => return None,
+    };
+    Some(decoded)
+}
+
+/// x86-64の機械語を書き出します
+/// レジスタの使い方: rdi=JitRegs, rsi=WRAM, al=演算結果, dl=オペランド, cl/ch=フラグ計算
+struct Emitter<'a> {
+    buf: &'a mut [u8],
+    pos: usize,
+}
+
+impl<'a> Emitter<'a> {
+    fn emit(&mut self, bytes: &[u8]) {
+        self.buf[self.pos..self.pos + bytes.len()].copy_from_slice(bytes);
+        self.pos += bytes.len();
+    }
+    /// mov al, [rdi+reg]
+    fn load_reg(&mut self, reg: u8) {
+        self.emit(&[0x8a, 0x47, reg]);
+    }
+    /// mov [rdi+reg], al
+    fn store_reg(&mut self, reg: u8) {
+        self.emit(&[0x88, 0x47, reg]);
+    }
+    /// mov al, [rsi+index]
+    fn load_wram(&mut self, index: u16) {
+        let d = u32::from(index).to_le_bytes();
+        self.emit(&[0x8a, 0x86, d[0], d[1], d[2], d[3]]);
+    }
+    /// mov [rsi+index], al
+    fn store_wram(&mut self, index: u16) {
+        let d = u32::from(index).to_le_bytes();
+        self.emit(&[0x88, 0x86, d[0], d[1], d[2], d[3]]);
+    }
+    /// オペランドをdlに読み込みます
+    fn load_operand(&mut self, mode: JitMode, operand: u16) {
+        if mode == JitMode::Immediate {
+            // mov dl, imm8
+            self.emit(&[0xb2, operand as u8]);
+        } else {
+            // mov dl, [rsi+index]
+            let d = u32::from(operand).to_le_bytes();
+            self.emit(&[0x8a, 0x96, d[0], d[1], d[2], d[3]]);
+        }
+    }
+    /// alの値でN, Zフラグを更新します
+    fn update_nz(&mut self) {
+        self.emit(&[
+            0x80, 0x67, JIT_REG_P, 0x7d, // and byte [rdi+P], ~(N|Z)
+            0x84, 0xc0, // test al, al
+            0x75, 0x04, // jnz +4
+            0x80, 0x4f, JIT_REG_P, 0x02, // or byte [rdi+P], Z
+            0x88, 0xc1, // mov cl, al
+            0x80, 0xe1, 0x80, // and cl, N
+            0x08, 0x4f, JIT_REG_P, // or [rdi+P], cl
+        ]);
+    }
+    /// clの値(0 or 1)でCフラグを更新します
+    fn update_carry(&mut self) {
+        self.emit(&[
+            0x80, 0x67, JIT_REG_P, 0xfe, // and byte [rdi+P], ~C
+            0x08, 0x4f, JIT_REG_P, // or [rdi+P], cl
+        ]);
+    }
+    /// pcを設定し、cycle数を返して抜けます
+    fn exit(&mut self, pc: u16, cyc: u8) {
+        let p = pc.to_le_bytes();
+        self.emit(&[0x66, 0xc7, 0x47, JIT_REG_PC, p[0], p[1]]); // mov word [rdi+PC], pc
+        self.emit(&[0xb8, cyc, 0x00, 0x00, 0x00]); // mov eax, cyc
+        self.emit(&[0xc3]); // ret
+    }
+}
+
+/// 実行統計
+#[derive(Copy, Clone, Default)]
+pub struct JitStats {
+    /// 翻訳したブロック数
+    pub compiled_blocks: u64,
+    /// 翻訳したコードで実行した命令数
+    pub jit_insts: u64,
+    /// インタプリタで実行した命令数
+    pub interpreted_insts: u64,
+    /// コードバッファがあふれて捨てた回数
+    pub flushes: u64,
+    /// インタプリタと比較した命令数
+    pub trace_compared: u64,
+    /// インタプリタと結果が一致しなかった命令数
+    pub trace_mismatches: u64,
+    /// 最初に一致しなかった命令のアドレス
+    pub first_mismatch_pc: u16,
+}
+
+/// PRG-ROM上でよく実行されるブロックをx86-64の機械語に翻訳して実行します
+/// WRAM以外へのアクセス(PPU/APUレジスタなど)を含む命令や、スタック操作などの翻訳しない命令の直前でブロックを終了し、
+/// その命令はインタプリタ(Cpu::step)で実行します
+/// 割り込みとPPUの処理はブロックの境界で行います。ブロックはPPUの1lineをまたがないときだけ実行するので、結果はインタプリタと一致します
+pub struct Jit {
+    /// 翻訳したコードを置くバッファ。読み書き実行可能な領域を渡してください
+    code_ptr: *mut u8,
+    code_size: usize,
+    code_pos: usize,
+    /// 0x8000 - 0xffffの各アドレスから始まるブロック
+    blocks: [JitBlock; JIT_NUM_OF_ENTRIES],
+    /// 0x8000 - 0xffffの各アドレスの実行回数
+    hits: [u8; JIT_NUM_OF_ENTRIES],
+    /// 有効にすると1命令ずつ翻訳し、インタプリタの結果と比較します
+    is_trace_compare: bool,
+    trace_wram: [u8; WRAM_SIZE],
+    trace_jit_wram: [u8; WRAM_SIZE],
+
+    pub stats: JitStats,
+}
+
+impl Default for Jit {
+    fn default() -> Self {
+        Self {
+            code_ptr: core::ptr::null_mut(),
+            code_size: 0,
+            code_pos: 0,
+            blocks: [JitBlock::default(); JIT_NUM_OF_ENTRIES],
+            hits: [0; JIT_NUM_OF_ENTRIES],
+            is_trace_compare: false,
+            trace_wram: [0; WRAM_SIZE],
+            trace_jit_wram: [0; WRAM_SIZE],
+
+            stats: JitStats::default(),
+        }
+    }
+}
+
+impl Jit {
+    /// コードバッファを設定し、翻訳済のブロックを破棄します。ROMを読み込み直したときも呼んでください
+    /// `code_ptr` - 読み書き実行可能な領域
+    /// ret: バッファが1ブロック分に満たない場合はfalse
+    pub fn init(&mut self, code_ptr: *mut u8, code_size: usize) -> bool {
+        if code_ptr.is_null() || code_size < JIT_MAX_BLOCK_CODE_BYTES {
+            return false;
+        }
+        self.code_ptr = code_ptr;
+        self.code_size = code_size;
+        self.stats = JitStats::default();
+        self.flush();
+        true
+    }
+
+    /// インタプリタとの比較を切り替えます。翻訳済のブロックは破棄します
+    pub fn set_trace_compare(&mut self, is_enable: bool) {
+        self.is_trace_compare = is_enable;
+        self.flush();
+    }
+
+    /// 翻訳済のブロックを破棄します
+    fn flush(&mut self) {
+        self.code_pos = 0;
+        for block in self.blocks.iter_mut() {
+            *block = JitBlock::default();
+        }
+        for hit in self.hits.iter_mut() {
+            *hit = 0;
+        }
+    }
+
+    /// 翻訳済のブロックを実行します
+    fn run<S: CassetteStorage>(
+        &mut self,
+        block: JitBlock,
+        cpu: &mut Cpu,
+        system: &mut System<S>,
+    ) -> u8 {
+        let mut regs = JitRegs {
+            a: cpu.a,
+            x: cpu.x,
+            y: cpu.y,
+            p: cpu.p,
+            pc: cpu.pc,
+        };
+        let cyc = unsafe {
+            let func = core::mem::transmute::<*mut u8, JitBlockFunc>(
+                self.code_ptr.add((block.entry - 1) as usize),
+            );
+            func(&mut regs, system.wram.as_mut_ptr())
+        };
+        cpu.a = regs.a;
+        cpu.x = regs.x;
+        cpu.y = regs.y;
+        cpu.p = regs.p;
+        cpu.pc = regs.pc;
+        cyc as u8
+    }
+
+    /// `pc`から始まるブロックを翻訳します
+    fn compile<S: CassetteStorage>(&mut self, system: &mut System<S>, pc: u16) -> JitBlock {
+        if self.code_size - self.code_pos < JIT_MAX_BLOCK_CODE_BYTES {
+            self.stats.flushes += 1;
+            self.flush();
+        }
+        let code_pos = self.code_pos;
+        let buf = unsafe {
+            core::slice::from_raw_parts_mut(self.code_ptr.add(code_pos), JIT_MAX_BLOCK_CODE_BYTES)
+        };
+        let mut e = Emitter { buf, pos: 0 };
+        let max_insts = if self.is_trace_compare {
+            1
+        } else {
+            JIT_MAX_BLOCK_INSTRUCTIONS
+        };
+
+        let mut inst_pc = pc;
+        let mut cyc: u8 = 0;
+        let mut num_of_insts = 0;
+        let mut max_cyc: Option<u8> = None;
+        while num_of_insts < max_insts {
+            let (op, mode) = match decode(system.read_u8(inst_pc, true)) {
+                Some(decoded) => decoded,
+                None => break,
+            };
+            let inst_bytes: u16 = match mode {
+                JitMode::Implied => 1,
+                JitMode::Immediate | JitMode::ZeroPage => 2,
+                JitMode::Absolute => 3,
+            };
+            // PRG-ROMの末尾をまたぐ命令は翻訳しない
+            if u32::from(inst_pc) + u32::from(inst_bytes) > 0x10000 {
+                break;
+            }
+            let next_pc = inst_pc.wrapping_add(inst_bytes);
+            let operand = match mode {
+                JitMode::Implied => 0,
+                JitMode::Immediate | JitMode::ZeroPage => {
+                    u16::from(system.read_u8(inst_pc + 1, true))
+                }
+                JitMode::Absolute => {
+                    u16::from(system.read_u8(inst_pc + 1, true))
+                        | (u16::from(system.read_u8(inst_pc + 2, true)) << 8)
+                }
+            };
+            // WRAM以外(PPU/APUレジスタ, カセット)へのアクセスはインタプリタに任せる
+            let is_memory = mode == JitMode::ZeroPage || mode == JitMode::Absolute;
+            if is_memory && op != JitOp::Jmp && operand >= PPU_REG_BASE_ADDR {
+                break;
+            }
+            let wram_index = operand % (WRAM_SIZE as u16);
+            let inst_cyc: u8 = match mode {
+                JitMode::Implied => 2,
+                JitMode::Immediate => 2,
+                JitMode::ZeroPage => 3,
+                JitMode::Absolute => 4,
+            };
+            // 最大cycle数を超えるなら手前で終わる(分岐は最大4cycle)
+            if cyc + 4 + 2 > JIT_MAX_BLOCK_CYCLES {
+                break;
+            }
+
+            match op {
+                JitOp::Load(reg) => {
+                    e.load_operand(mode, wram_index_or_imm(mode, operand, wram_index));
+                    e.emit(&[0x88, 0xd0]); // mov al, dl
+                    e.store_reg(reg);
+                    e.update_nz();
+                }
+                JitOp::Store(reg) => {
+                    e.load_reg(reg);
+                    e.store_wram(wram_index);
+                }
+                JitOp::And | JitOp::Ora | JitOp::Eor => {
+                    e.load_operand(mode, wram_index_or_imm(mode, operand, wram_index));
+                    e.load_reg(JIT_REG_A);
+                    let code = match op {
+                        JitOp::And => 0x20,
+                        JitOp::Ora => 0x08,
+                        _ => 0x30,
+                    };
+                    e.emit(&[code, 0xd0]); // op al, dl
+                    e.store_reg(JIT_REG_A);
+                    e.update_nz();
+                }
+                JitOp::Adc | JitOp::Sbc => {
+                    e.load_operand(mode, wram_index_or_imm(mode, operand, wram_index));
+                    e.load_reg(JIT_REG_A);
+                    e.emit(&[0x8a, 0x4f, JIT_REG_P]); // mov cl, [rdi+P]
+                    e.emit(&[0xd0, 0xe9]); // shr cl, 1 (CF = C)
+                    if op == JitOp::Adc {
+                        e.emit(&[0x10, 0xd0]); // adc al, dl
+                        e.emit(&[0x0f, 0x92, 0xc1]); // setc cl
+                    } else {
+                        e.emit(&[0xf5]); // cmc (borrow = !C)
+                        e.emit(&[0x18, 0xd0]); // sbb al, dl
+                        e.emit(&[0x0f, 0x93, 0xc1]); // setnc cl
+                    }
+                    e.emit(&[0x0f, 0x90, 0xc5]); // seto ch
+                    e.store_reg(JIT_REG_A);
+                    e.emit(&[0x80, 0x67, JIT_REG_P, 0xbe]); // and byte [rdi+P], ~(V|C)
+                    e.emit(&[0x08, 0x4f, JIT_REG_P]); // or [rdi+P], cl
+                    e.emit(&[0xc0, 0xe5, 0x06]); // shl ch, 6
+                    e.emit(&[0x08, 0x6f, JIT_REG_P]); // or [rdi+P], ch
+                    e.update_nz();
+                }
+                JitOp::Compare(reg) => {
+                    e.load_operand(mode, wram_index_or_imm(mode, operand, wram_index));
+                    e.load_reg(reg);
+                    e.emit(&[0x28, 0xd0]); // sub al, dl
+                    e.emit(&[0x0f, 0x93, 0xc1]); // setnc cl
+                    e.update_carry();
+                    e.update_nz();
+                }
+                JitOp::Inc | JitOp::Dec => {
+                    e.load_wram(wram_index);
+                    if op == JitOp::Inc {
+                        e.emit(&[0xfe, 0xc0]); // inc al
+                    } else {
+                        e.emit(&[0xfe, 0xc8]); // dec al
+                    }
+                    e.store_wram(wram_index);
+                    e.update_nz();
+                }
+                JitOp::IncrementReg(reg, is_increment) => {
+                    e.load_reg(reg);
+                    if is_increment {
+                        e.emit(&[0xfe, 0xc0]); // inc al
+                    } else {
+                        e.emit(&[0xfe, 0xc8]); // dec al
+                    }
+                    e.store_reg(reg);
+                    e.update_nz();
+                }
+                JitOp::Transfer(src, dst) => {
+                    e.load_reg(src);
+                    e.store_reg(dst);
+                    e.update_nz();
+                }
+                JitOp::WriteFlag(flag, is_set) => {
+                    if is_set {
+                        e.emit(&[0x80, 0x4f, JIT_REG_P, flag]); // or byte [rdi+P], flag
+                    } else {
+                        e.emit(&[0x80, 0x67, JIT_REG_P, !flag]); // and byte [rdi+P], ~flag
+                    }
+                }
+                JitOp::Nop => {}
+                JitOp::Branch(flag, is_taken_if_set) => {
+                    // Cpu::stepと同じく、分岐しない場合もページをまたぐ分のcycleを加算する
+                    let dst_pc = next_pc.wrapping_add((operand as u8 as i8) as u16);
+                    let page_cyc = if (dst_pc & 0xff00) != (next_pc & 0xff00) {
+                        1
+                    } else {
+                        0
+                    };
+                    e.emit(&[0xf6, 0x47, JIT_REG_P, flag]); // test byte [rdi+P], flag
+                                                            // 分岐しない側のexitは12byte
+                    e.emit(&[if is_taken_if_set { 0x75 } else { 0x74 }, 12]);
+                    e.exit(next_pc, cyc + 2 + page_cyc);
+                    e.exit(dst_pc, cyc + 3 + page_cyc);
+                    num_of_insts += 1;
+                    max_cyc = Some(cyc + 3 + page_cyc);
+                    break;
+                }
+                JitOp::Jmp => {
+                    e.exit(operand, cyc + 3);
+                    num_of_insts += 1;
+                    max_cyc = Some(cyc + 3);
+                    break;
+                }
+            }
+            cyc += match op {
+                JitOp::Inc | JitOp::Dec => inst_cyc + 2,
+                _ => inst_cyc,
+            };
+            num_of_insts += 1;
+            inst_pc = next_pc;
+        }
+        if num_of_insts == 0 {
+            return JitBlock {
+                entry: JIT_BLOCK_UNCOMPILABLE,
+                max_cyc: 0,
+                num_of_insts: 0,
+            };
+        }
+        // 分岐/ジャンプで終わらなかったら次の命令から再開する
+        let max_cyc = match max_cyc {
+            Some(max_cyc) => max_cyc,
+            None => {
+                e.exit(inst_pc, cyc);
+                cyc
+            }
+        };
+        self.code_pos += e.pos;
+        self.stats.compiled_blocks += 1;
+        JitBlock {
+            entry: (code_pos + 1) as u32,
+            max_cyc,
+            num_of_insts: num_of_insts as u8,
+        }
+    }
+}
+
+impl CpuEngine for Jit {
+    /// 1ブロックもしくは1命令実行します
+    /// `budget` - ブロックが消費してよいcycle数。これ以上かかる可能性があるブロックは実行しない
+    /// ret: cycle数
+    fn step<S: CassetteStorage>(
+        &mut self,
+        cpu: &mut Cpu,
+        system: &mut System<S>,
+        budget: usize,
+    ) -> u8 {
+        // PRG-ROMより前(WRAMなど)のコードは書き換わる可能性があるので翻訳しない
+        if self.code_ptr.is_null() || cpu.pc < PRG_ROM_SYSTEM_BASE_ADDR {
+            self.stats.interpreted_insts += 1;
+            return cpu.step(system);
+        }
+        let index = usize::from(cpu.pc - PRG_ROM_SYSTEM_BASE_ADDR);
+        let mut block = self.blocks[index];
+        if block.entry == JIT_BLOCK_NONE {
+            self.hits[index] = self.hits[index].saturating_add(1);
+            if self.hits[index] >= JIT_HOT_THRESHOLD {
+                block = self.compile(system, cpu.pc);
+                self.blocks[index] = block;
+            }
+        }
+        if block.entry == JIT_BLOCK_NONE
+            || block.entry == JIT_BLOCK_UNCOMPILABLE
+            || usize::from(block.max_cyc) >= budget
+        {
+            self.stats.interpreted_insts += 1;
+            return cpu.step(system);
+        }
+
+        if !self.is_trace_compare {
+            self.stats.jit_insts += u64::from(block.num_of_insts);
+            return self.run(block, cpu, system);
+        }
+
+        // 同じ命令をインタプリタでも実行して比較する。以降はインタプリタの結果で進める
+        let src_cpu = cpu.clone();
+        self.trace_wram.copy_from_slice(&system.wram);
+        let jit_cyc = self.run(block, cpu, system);
+        let jit_cpu = cpu.clone();
+        self.trace_jit_wram.copy_from_slice(&system.wram);
+
+        let src_pc = src_cpu.pc;
+        *cpu = src_cpu;
+        system.wram.copy_from_slice(&self.trace_wram);
+        let cyc = cpu.step(system);
+
+        self.stats.trace_compared += 1;
+        self.stats.interpreted_insts += 1;
+        let is_match = cyc == jit_cyc
+            && cpu.a == jit_cpu.a
+            && cpu.x == jit_cpu.x
+            && cpu.y == jit_cpu.y
+            && cpu.p == jit_cpu.p
+            && cpu.pc == jit_cpu.pc
+            && cpu.sp == jit_cpu.sp
+            && system.wram[..] == self.trace_jit_wram[..];
+        if !is_match {
+            if self.stats.trace_mismatches == 0 {
+                self.stats.first_mismatch_pc = src_pc;
+            }
+            self.stats.trace_mismatches += 1;
+        }
+        cyc
+    }
+}
+
+/// 即値はそのまま、メモリはWRAMのindexを返します
+fn wram_index_or_imm(mode: JitMode, operand: u16, wram_index: u16) -> u16 {
+    if mode == JitMode::Immediate {
+        operand
+    } else {
+        wram_index
+    }
+}
@@ -0,0 +1,1002 @@
+use super::cassette::CassetteStorage;
+use super::cpu::*;
+use super::interface::*;
+use super::ppu::*;
+use super::system::System;
+
+/// 同時に実行できるインスタンス数の上限。u8レジスタ16laneがSSE2の128bitレジスタ1本に収まる
+pub const LOCKSTEP_MAX_LANES: usize = 16;
+
+/// laneごとの値
+type Lanes<T> = [T; LOCKSTEP_MAX_LANES];
+
+/// LockstepCpuでまとめて動かすインスタンスの集まり
+pub trait LockstepLanes<S: CassetteStorage> {
+    /// lane数。LOCKSTEP_MAX_LANES以下
+    fn num_of_lanes(&self) -> usize;
+    /// laneのSystem, Ppuと画面の書き出し先を返します。書き出し先がnullなら描画しない
+    fn lane(&mut self, lane: usize) -> (&mut System<S>, &mut Ppu, *mut u8);
+}
+
+/// 同じROMを動かす複数インスタンスのCPUを、命令単位で足並みをそろえて実行する実験的なエンジン
+/// レジスタはStructure of Arraysで保持し、同じopcodeを実行するlaneをまとめてSIMDレジスタ上でマスク付きで処理します
+/// PCなどu16のレジスタは8laneずつ処理し、動いているlaneが下位8laneだけなら上位は処理しません
+/// 対応していない命令やメモリアクセスを伴う複雑な命令は、laneごとにCpu::stepへfallbackします
+/// 結果はlaneごとにCpu::stepを回した場合と一致します
+#[derive(Clone)]
+pub struct LockstepCpu {
+    pub a: Lanes<u8>,
+    pub x: Lanes<u8>,
+    pub y: Lanes<u8>,
+    pub p: Lanes<u8>,
+    pub sp: Lanes<u16>,
+    pub pc: Lanes<u16>,
+
+    /// まとめて実行した命令数(lane換算)
+    pub vector_lane_steps: u64,
+    /// Cpu::stepにfallbackした命令数(lane換算)
+    pub scalar_lane_steps: u64,
+    /// opcodeごとに振り分けた回数。lane間でopcodeがそろっていれば命令数と同じになる
+    pub dispatches: u64,
+}
+
+impl Default for LockstepCpu {
+    fn default() -> Self {
+        Self {
+            a: [0; LOCKSTEP_MAX_LANES],
+            x: [0; LOCKSTEP_MAX_LANES],
+            y: [0; LOCKSTEP_MAX_LANES],
+            p: [0; LOCKSTEP_MAX_LANES],
+            sp: [0; LOCKSTEP_MAX_LANES],
+            pc: [0; LOCKSTEP_MAX_LANES],
+
+            vector_lane_steps: 0,
+            scalar_lane_steps: 0,
+            dispatches: 0,
+        }
+    }
+}
+
+/// Processor Status Flag
+const FLAG_NEGATIVE: u8 = 0x80;
+const FLAG_OVERFLOW: u8 = 0x40;
+const FLAG_DECIMAL: u8 = 0x08;
+const FLAG_INTERRUPT: u8 = 0x04;
+const FLAG_ZERO: u8 = 0x02;
+const FLAG_CARRY: u8 = 0x01;
+
+/// u16のレジスタを分けて処理する単位のlane数。上位のlaneが動いていなければ下位だけを処理します
+const LOCKSTEP_HALF_LANES: usize = LOCKSTEP_MAX_LANES / 2;
+
+/// laneをまとめて1つのSIMDレジスタで扱う型
+/// x86_64ではSSE2の__m128i(u8 x 16lane, u16 x 8lane)を使い、マスク付きの更新はand/andnot/orのblendで行います
+/// それ以外のアーキテクチャではlaneごとのループで同じ演算を行います
+#[cfg(target_arch = "x86_64")]
+mod lane_vec {
+    use super::{Lanes, LOCKSTEP_HALF_LANES};
+    use core::arch::x86_64::*;
+
+    /// u8 x 16lane
+    #[derive(Copy, Clone)]
+    pub struct U8x16(__m128i);
+    /// u16 x 8lane。16laneを下位(lane 0-7)と上位(lane 8-15)に分けて扱う
+    #[derive(Copy, Clone)]
+    pub struct U16x8(__m128i);
+
+    // SSE2はx86_64で必ず使えるので、実行時の判定はしない
+    impl U8x16 {
+        #[inline(always)]
+        pub fn load(src: &Lanes<u8>) -> Self {
+            Self(unsafe { _mm_loadu_si128(src.as_ptr() as *const __m128i) })
+        }
+        #[inline(always)]
+        pub fn store(self, dst: &mut Lanes<u8>) {
+            unsafe { _mm_storeu_si128(dst.as_mut_ptr() as *mut __m128i, self.0) }
+        }
+        #[inline(always)]
+        pub fn splat(data: u8) -> Self {
+            Self(unsafe { _mm_set1_epi8(data as i8) })
+        }
+        /// `group`のbitが立っているlaneを0xff、それ以外を0にしたマスク
+        #[inline(always)]
+        pub fn mask(group: u32) -> Self {
+            unsafe {
+                // laneごとに自分のbitだけを残して比較する
+                let bits = _mm_set1_epi64x(0x8040_2010_0804_0201u64 as i64);
+                let lower = u64::from(group & 0xff).wrapping_mul(0x0101_0101_0101_0101);
+                let upper = u64::from((group >> 8) & 0xff).wrapping_mul(0x0101_0101_0101_0101);
+                let spread = _mm_set_epi64x(upper as i64, lower as i64);
+                Self(_mm_cmpeq_epi8(_mm_and_si128(spread, bits), bits))
+            }
+        }
+        #[inline(always)]
+        pub fn add(self, other: Self) -> Self {
+            Self(unsafe { _mm_add_epi8(self.0, other.0) })
+        }
+        #[inline(always)]
+        pub fn sub(self, other: Self) -> Self {
+            Self(unsafe { _mm_sub_epi8(self.0, other.0) })
+        }
+        #[inline(always)]
+        pub fn and(self, other: Self) -> Self {
+            Self(unsafe { _mm_and_si128(self.0, other.0) })
+        }
+        /// self & !other
+        #[inline(always)]
+        pub fn and_not(self, other: Self) -> Self {
+            Self(unsafe { _mm_andnot_si128(other.0, self.0) })
+        }
+        #[inline(always)]
+        pub fn or(self, other: Self) -> Self {
+            Self(unsafe { _mm_or_si128(self.0, other.0) })
+        }
+        #[inline(always)]
+        pub fn xor(self, other: Self) -> Self {
+            Self(unsafe { _mm_xor_si128(self.0, other.0) })
+        }
+        /// 等しいlaneを0xffにしたマスク
+        #[inline(always)]
+        pub fn eq(self, other: Self) -> Self {
+            Self(unsafe { _mm_cmpeq_epi8(self.0, other.0) })
+        }
+        /// 符号なしでself >= otherのlaneを0xffにしたマスク
+        #[inline(always)]
+        pub fn ge(self, other: Self) -> Self {
+            Self(unsafe { _mm_cmpeq_epi8(_mm_max_epu8(self.0, other.0), self.0) })
+        }
+        /// `mask`が0xffのlaneはself、0のlaneは`other`
+        #[inline(always)]
+        pub fn select(self, mask: Self, other: Self) -> Self {
+            Self(unsafe {
+                _mm_or_si128(
+                    _mm_and_si128(mask.0, self.0),
+                    _mm_andnot_si128(mask.0, other.0),
+                )
+            })
+        }
+        /// `half`のlaneをu16に符号拡張します
+        #[inline(always)]
+        pub fn widen_i8(self, half: usize) -> U16x8 {
+            unsafe {
+                let spread = if half == 0 {
+                    _mm_unpacklo_epi8(self.0, self.0)
+                } else {
+                    _mm_unpackhi_epi8(self.0, self.0)
+                };
+                U16x8(_mm_srai_epi16(spread, 8))
+            }
+        }
+        /// `half`のlaneをu16にゼロ拡張します
+        #[inline(always)]
+        pub fn widen_u8(self, half: usize) -> U16x8 {
+            unsafe {
+                let zero = _mm_setzero_si128();
+                U16x8(if half == 0 {
+                    _mm_unpacklo_epi8(self.0, zero)
+                } else {
+                    _mm_unpackhi_epi8(self.0, zero)
+                })
+            }
+        }
+        /// 0xffのマスクを`half`のu16のマスク(0xffff)に広げます
+        #[inline(always)]
+        pub fn widen_mask(self, half: usize) -> U16x8 {
+            unsafe {
+                U16x8(if half == 0 {
+                    _mm_unpacklo_epi8(self.0, self.0)
+                } else {
+                    _mm_unpackhi_epi8(self.0, self.0)
+                })
+            }
+        }
+        /// 下位と上位の8laneを、符号付きで飽和させてu8にまとめます。-128..=127の値とマスクだけに使う
+        #[inline(always)]
+        pub fn narrow(lower: U16x8, upper: U16x8) -> Self {
+            Self(unsafe { _mm_packs_epi16(lower.0, upper.0) })
+        }
+    }
+
+    impl U16x8 {
+        #[inline(always)]
+        pub fn load(src: &Lanes<u16>, half: usize) -> Self {
+            let src = &src[(half * LOCKSTEP_HALF_LANES)..((half + 1) * LOCKSTEP_HALF_LANES)];
+            Self(unsafe { _mm_loadu_si128(src.as_ptr() as *const __m128i) })
+        }
+        #[inline(always)]
+        pub fn store(self, dst: &mut Lanes<u16>, half: usize) {
+            let dst = &mut dst[(half * LOCKSTEP_HALF_LANES)..((half + 1) * LOCKSTEP_HALF_LANES)];
+            unsafe { _mm_storeu_si128(dst.as_mut_ptr() as *mut __m128i, self.0) }
+        }
+        #[inline(always)]
+        pub fn splat(data: u16) -> Self {
+            Self(unsafe { _mm_set1_epi16(data as i16) })
+        }
+        #[inline(always)]
+        pub fn add(self, other: Self) -> Self {
+            Self(unsafe { _mm_add_epi16(self.0, other.0) })
+        }
+        #[inline(always)]
+        pub fn sub(self, other: Self) -> Self {
+            Self(unsafe { _mm_sub_epi16(self.0, other.0) })
+        }
+        #[inline(always)]
+        pub fn and(self, other: Self) -> Self {
+            Self(unsafe { _mm_and_si128(self.0, other.0) })
+        }
+        #[inline(always)]
+        pub fn xor(self, other: Self) -> Self {
+            Self(unsafe { _mm_xor_si128(self.0, other.0) })
+        }
+        /// 等しいlaneを0xffffにしたマスク
+        #[inline(always)]
+        pub fn eq(self, other: Self) -> Self {
+            Self(unsafe { _mm_cmpeq_epi16(self.0, other.0) })
+        }
+        /// `mask`が0xffffのlaneはself、0のlaneは`other`
+        #[inline(always)]
+        pub fn select(self, mask: Self, other: Self) -> Self {
+            Self(unsafe {
+                _mm_or_si128(
+                    _mm_and_si128(mask.0, self.0),
+                    _mm_andnot_si128(mask.0, other.0),
+                )
+            })
+        }
+    }
+}
+
+/// x86_64以外では、lane_vecと同じ演算をlaneごとのループで行います
+#[cfg(not(target_arch = "x86_64"))]
+mod lane_vec {
+    use super::{Lanes, LOCKSTEP_HALF_LANES, LOCKSTEP_MAX_LANES};
+
+    #[derive(Copy, Clone)]
+    pub struct U8x16(Lanes<u8>);
+    #[derive(Copy, Clone)]
+    pub struct U16x8([u16; LOCKSTEP_HALF_LANES]);
+
+    #[inline(always)]
+    fn map_u8(f: impl Fn(usize) -> u8) -> U8x16 {
+        let mut dst = [0u8; LOCKSTEP_MAX_LANES];
+        for lane in 0..LOCKSTEP_MAX_LANES {
+            dst[lane] = f(lane);
+        }
+        U8x16(dst)
+    }
+
+    #[inline(always)]
+    fn map_u16(f: impl Fn(usize) -> u16) -> U16x8 {
+        let mut dst = [0u16; LOCKSTEP_HALF_LANES];
+        for lane in 0..LOCKSTEP_HALF_LANES {
+            dst[lane] = f(lane);
+        }
+        U16x8(dst)
+    }
+
+    impl U8x16 {
+        #[inline(always)]
+        pub fn load(src: &Lanes<u8>) -> Self {
+            Self(*src)
+        }
+        #[inline(always)]
+        pub fn store(self, dst: &mut Lanes<u8>) {
+            *dst = self.0;
+        }
+        #[inline(always)]
+        pub fn splat(data: u8) -> Self {
+            Self([data; LOCKSTEP_MAX_LANES])
+        }
+        #[inline(always)]
+        pub fn mask(group: u32) -> Self {
+            map_u8(|lane| if (group >> lane) & 1 == 1 { 0xff } else { 0 })
+        }
+        #[inline(always)]
+        pub fn add(self, other: Self) -> Self {
+            map_u8(|lane| self.0[lane].wrapping_add(other.0[lane]))
+        }
+        #[inline(always)]
+        pub fn sub(self, other: Self) -> Self {
+            map_u8(|lane| self.0[lane].wrapping_sub(other.0[lane]))
+        }
+        #[inline(always)]
+        pub fn and(self, other: Self) -> Self {
+            map_u8(|lane| self.0[lane] & other.0[lane])
+        }
+        #[inline(always)]
+        pub fn and_not(self, other: Self) -> Self {
+            map_u8(|lane| self.0[lane] & !other.0[lane])
+        }
+        #[inline(always)]
+        pub fn or(self, other: Self) -> Self {
+            map_u8(|lane| self.0[lane] | other.0[lane])
+        }
+        #[inline(always)]
+        pub fn xor(self, other: Self) -> Self {
+            map_u8(|lane| self.0[lane] ^ other.0[lane])
+        }
+        #[inline(always)]
+        pub fn eq(self, other: Self) -> Self {
+            map_u8(|lane| {
+                if self.0[lane] == other.0[lane] {
+                    0xff
+                } else {
+                    0
+                }
+            })
+        }
+        #[inline(always)]
+        pub fn ge(self, other: Self) -> Self {
+            map_u8(|lane| {
+                if self.0[lane] >= other.0[lane] {
+                    0xff
+                } else {
+                    0
+                }
+            })
+        }
+        #[inline(always)]
+        pub fn select(self, mask: Self, other: Self) -> Self {
+            map_u8(|lane| (mask.0[lane] & self.0[lane]) | (!mask.0[lane] & other.0[lane]))
+        }
+        #[inline(always)]
+        pub fn widen_i8(self, half: usize) -> U16x8 {
+            map_u16(|lane| (self.0[half * LOCKSTEP_HALF_LANES + lane] as i8) as u16)
+        }
+        #[inline(always)]
+        pub fn widen_u8(self, half: usize) -> U16x8 {
+            map_u16(|lane| u16::from(self.0[half * LOCKSTEP_HALF_LANES + lane]))
+        }
+        #[inline(always)]
+        pub fn widen_mask(self, half: usize) -> U16x8 {
+            self.widen_i8(half)
+        }
+        #[inline(always)]
+        pub fn narrow(lower: U16x8, upper: U16x8) -> Self {
+            map_u8(|lane| {
+                let src = if lane < LOCKSTEP_HALF_LANES {
+                    lower.0[lane]
+                } else {
+                    upper.0[lane - LOCKSTEP_HALF_LANES]
+                };
+                core::cmp::max(-128, core::cmp::min(127, src as i16)) as u8
+            })
+        }
+    }
+
+    impl U16x8 {
+        #[inline(always)]
+        pub fn load(src: &Lanes<u16>, half: usize) -> Self {
+            map_u16(|lane| src[half * LOCKSTEP_HALF_LANES + lane])
+        }
+        #[inline(always)]
+        pub fn store(self, dst: &mut Lanes<u16>, half: usize) {
+            dst[(half * LOCKSTEP_HALF_LANES)..((half + 1) * LOCKSTEP_HALF_LANES)]
+                .copy_from_slice(&self.0);
+        }
+        #[inline(always)]
+        pub fn splat(data: u16) -> Self {
+            Self([data; LOCKSTEP_HALF_LANES])
+        }
+        #[inline(always)]
+        pub fn add(self, other: Self) -> Self {
+            map_u16(|lane| self.0[lane].wrapping_add(other.0[lane]))
+        }
+        #[inline(always)]
+        pub fn sub(self, other: Self) -> Self {
+            map_u16(|lane| self.0[lane].wrapping_sub(other.0[lane]))
+        }
+        #[inline(always)]
+        pub fn and(self, other: Self) -> Self {
+            map_u16(|lane| self.0[lane] & other.0[lane])
+        }
+        #[inline(always)]
+        pub fn xor(self, other: Self) -> Self {
+            map_u16(|lane| self.0[lane] ^ other.0[lane])
+        }
+        #[inline(always)]
+        pub fn eq(self, other: Self) -> Self {
+            map_u16(|lane| {
+                if self.0[lane] == other.0[lane] {
+                    0xffff
+                } else {
+                    0
+                }
+            })
+        }
+        #[inline(always)]
+        pub fn select(self, mask: Self, other: Self) -> Self {
+            map_u16(|lane| (mask.0[lane] & self.0[lane]) | (!mask.0[lane] & other.0[lane]))
+        }
+    }
+}
+
+use lane_vec::*;
+
+/// `group`のlaneを含むu16の処理単位(0: lane 0-7, 1: lane 8-15)か
+#[inline(always)]
+fn is_active_half(group: u32, half: usize) -> bool {
+    (group >> (half * LOCKSTEP_HALF_LANES)) & 0xff != 0
+}
+
+/// マスクされたlaneだけ値を更新します
+#[inline(always)]
+fn select_u8(dst: &mut Lanes<u8>, src: U8x16, mask: U8x16) {
+    src.select(mask, U8x16::load(dst)).store(dst);
+}
+
+/// マスクされたlaneだけ値を更新します。`group`のlaneを含まない8laneは処理しません
+#[inline(always)]
+fn select_u16(dst: &mut Lanes<u16>, src: &Lanes<u16>, group: u32, mask: U8x16) {
+    for half in 0..2 {
+        if is_active_half(group, half) {
+            let prev = U16x8::load(dst, half);
+            U16x8::load(src, half)
+                .select(mask.widen_mask(half), prev)
+                .store(dst, half);
+        }
+    }
+}
+
+/// N, Zフラグを結果から更新します
+#[inline(always)]
+fn update_nz(p: &mut Lanes<u8>, result: U8x16, mask: U8x16) {
+    let prev = U8x16::load(p);
+    let n = result.and(U8x16::splat(FLAG_NEGATIVE));
+    let z = result.eq(U8x16::splat(0)).and(U8x16::splat(FLAG_ZERO));
+    let updated = prev
+        .and_not(U8x16::splat(FLAG_NEGATIVE | FLAG_ZERO))
+        .or(n)
+        .or(z);
+    updated.select(mask, prev).store(p);
+}
+
+/// `flag`を`is_set`(0xffのlaneでセット)に合わせて更新します
+#[inline(always)]
+fn update_flag(p: &mut Lanes<u8>, flag: u8, is_set: U8x16, mask: U8x16) {
+    let prev = U8x16::load(p);
+    let flag = U8x16::splat(flag);
+    let updated = prev.and_not(flag).or(is_set.and(flag));
+    updated.select(mask, prev).store(p);
+}
+
+/// フラグをセット/クリアします
+#[inline(always)]
+fn write_flag(p: &mut Lanes<u8>, flag: u8, is_active: bool, mask: U8x16) {
+    let is_set = U8x16::splat(if is_active { 0xff } else { 0 });
+    update_flag(p, flag, is_set, mask);
+}
+
+/// cycle数を設定します
+#[inline(always)]
+fn write_cyc(cycs: &mut Lanes<u8>, cyc: u8, mask: U8x16) {
+    select_u8(cycs, U8x16::splat(cyc), mask);
+}
+
+/// PCを進めます
+#[inline(always)]
+fn increment_pc(pc: &mut Lanes<u16>, incr: u16, group: u32, mask: U8x16) {
+    for half in 0..2 {
+        if is_active_half(group, half) {
+            let prev = U16x8::load(pc, half);
+            prev.add(U16x8::splat(incr))
+                .select(mask.widen_mask(half), prev)
+                .store(pc, half);
+        }
+    }
+}
+
+impl LockstepCpu {
+    /// laneのレジスタをCpuから取り込みます
+    pub fn load_lane(&mut self, lane: usize, cpu: &Cpu) {
+        self.a[lane] = cpu.a;
+        self.x[lane] = cpu.x;
+        self.y[lane] = cpu.y;
+        self.pc[lane] = cpu.pc;
+        self.sp[lane] = cpu.sp;
+        self.p[lane] = cpu.p;
+    }
+    /// laneのレジスタをCpuとして取り出します
+    pub fn store_lane(&self, lane: usize) -> Cpu {
+        Cpu {
+            a: self.a[lane],
+            x: self.x[lane],
+            y: self.y[lane],
+            pc: self.pc[lane],
+            sp: self.sp[lane],
+            p: self.p[lane],
+        }
+    }
+
+    /// 全laneを1frame分(CYCLE_PER_DRAW_FRAME)進めます
+    /// laneごとにCpu::step/Ppu::step/Cpu::interruptを回すのと同じ結果になります
+    pub fn emulate_frame<S: CassetteStorage, L: LockstepLanes<S>>(&mut self, lanes: &mut L) {
+        let num_of_lanes = lanes.num_of_lanes();
+        debug_assert!(num_of_lanes <= LOCKSTEP_MAX_LANES);
+
+        let mut total_cycs = [0usize; LOCKSTEP_MAX_LANES];
+        let mut opcodes = [0u8; LOCKSTEP_MAX_LANES];
+        let mut cycs = [0u8; LOCKSTEP_MAX_LANES];
+        let mut active: u32 = (1u32 << num_of_lanes) - 1;
+
+        while active != 0 {
+            // opcodeを先読みする。実行時にもう一度fetchするので非破壊で読む
+            let mut pending = active;
+            while pending != 0 {
+                let lane = pending.trailing_zeros() as usize;
+                pending &= pending - 1;
+                opcodes[lane] = lanes.lane(lane).0.read_u8(self.pc[lane], true);
+            }
+            // 同じopcodeのlaneをまとめて実行する
+            let mut pending = active;
+            while pending != 0 {
+                let opcode = opcodes[pending.trailing_zeros() as usize];
+                let mut group = 0u32;
+                let mut rest = pending;
+                while rest != 0 {
+                    let lane = rest.trailing_zeros() as usize;
+                    rest &= rest - 1;
+                    if opcodes[lane] == opcode {
+                        group |= 1 << lane;
+                    }
+                }
+                pending &= !group;
+                self.dispatches += 1;
+                self.execute(opcode, group, lanes, &mut cycs);
+            }
+            // PPUはlaneごとに進める
+            let mut pending = active;
+            while pending != 0 {
+                let lane = pending.trailing_zeros() as usize;
+                pending &= pending - 1;
+                let cyc = usize::from(cycs[lane]);
+                total_cycs[lane] += cyc;
+                let (system, ppu, fb_ptr) = lanes.lane(lane);
+                if let Some(irq) = ppu.step(cyc, system, fb_ptr) {
+                    let mut cpu = self.store_lane(lane);
+                    cpu.interrupt(system, irq);
+                    self.load_lane(lane, &cpu);
+                }
+                if total_cycs[lane] >= CYCLE_PER_DRAW_FRAME {
+                    active &= !(1 << lane);
+                }
+            }
+        }
+    }
+
+    /// `group`のlaneで`opcode`を1命令実行し、cycle数を`cycs`に書き込みます
+    fn execute<S: CassetteStorage, L: LockstepLanes<S>>(
+        &mut self,
+        opcode: u8,
+        group: u32,
+        lanes: &mut L,
+        cycs: &mut Lanes<u8>,
+    ) {
+        let num_of_lanes = group.count_ones() as u64;
+        let mask = U8x16::mask(group);
+        let is_vectorized = match opcode {
+            /* *************** implied ***************  */
+            0xe8 | 0xc8 | 0xca | 0x88 | 0xaa | 0xa8 | 0x8a | 0x98 | 0x18 | 0x38 | 0x58 | 0x78
+            | 0xb8 | 0xd8 | 0xf8 | 0xea => {
+                self.execute_implied(opcode, mask);
+                increment_pc(&mut self.pc, 1, group, mask);
+                write_cyc(cycs, 2, mask);
+                true
+            }
+            /* *************** immediate ***************  */
+            0xa9 | 0xa2 | 0xa0 | 0x29 | 0x09 | 0x49 | 0xc9 | 0xe0 | 0xc0 | 0x69 | 0xe9 => {
+                let args = self.fetch_args_u8(group, lanes);
+                self.execute_immediate(opcode, U8x16::load(&args), mask);
+                increment_pc(&mut self.pc, 2, group, mask);
+                write_cyc(cycs, 2, mask);
+                true
+            }
+            /* *************** branch ***************  */
+            0x10 | 0x30 | 0x50 | 0x70 | 0x90 | 0xb0 | 0xd0 | 0xf0 => {
+                let args = self.fetch_args_u8(group, lanes);
+                self.execute_branch(opcode, U8x16::load(&args), group, mask, cycs);
+                true
+            }
+            /* *************** load/store zeropage, absolute ***************  */
+            0xa5 | 0xa6 | 0xa4 | 0x85 | 0x86 | 0x84 => {
+                let args = U8x16::load(&self.fetch_args_u8(group, lanes));
+                let mut addrs = [0u16; LOCKSTEP_MAX_LANES];
+                for half in 0..2 {
+                    if is_active_half(group, half) {
+                        args.widen_u8(half).store(&mut addrs, half);
+                    }
+                }
+                self.execute_load_store(opcode, group, &addrs, mask, lanes);
+                increment_pc(&mut self.pc, 2, group, mask);
+                write_cyc(cycs, 3, mask);
+                true
+            }
+            0xad | 0xae | 0xac | 0x8d | 0x8e | 0x8c => {
+                let addrs = self.fetch_args_u16(group, lanes);
+                self.execute_load_store(opcode, group, &addrs, mask, lanes);
+                increment_pc(&mut self.pc, 3, group, mask);
+                write_cyc(cycs, 4, mask);
+                true
+            }
+            /* *************** jump ***************  */
+            0x4c => {
+                let addrs = self.fetch_args_u16(group, lanes);
+                select_u16(&mut self.pc, &addrs, group, mask);
+                write_cyc(cycs, 3, mask);
+                true
+            }
+            _ => false,
+        };
+
+        if is_vectorized {
+            self.vector_lane_steps += num_of_lanes;
+            return;
+        }
+        // 対応していない命令はlaneごとに実行する
+        self.scalar_lane_steps += num_of_lanes;
+        let mut rest = group;
+        while rest != 0 {
+            let lane = rest.trailing_zeros() as usize;
+            rest &= rest - 1;
+            let mut cpu = self.store_lane(lane);
+            cycs[lane] = cpu.step(lanes.lane(lane).0);
+            self.load_lane(lane, &cpu);
+        }
+    }
+
+    /// opcode直後の1byteをlaneごとに読み出します
+    fn fetch_args_u8<S: CassetteStorage, L: LockstepLanes<S>>(
+        &self,
+        group: u32,
+        lanes: &mut L,
+    ) -> Lanes<u8> {
+        let mut args = [0u8; LOCKSTEP_MAX_LANES];
+        let mut rest = group;
+        while rest != 0 {
+            let lane = rest.trailing_zeros() as usize;
+            rest &= rest - 1;
+            args[lane] = lanes
+                .lane(lane)
+                .0
+                .read_u8(self.pc[lane].wrapping_add(1), false);
+        }
+        args
+    }
+
+    /// opcode直後の2byteをlaneごとに読み出します
+    fn fetch_args_u16<S: CassetteStorage, L: LockstepLanes<S>>(
+        &self,
+        group: u32,
+        lanes: &mut L,
+    ) -> Lanes<u16> {
+        let mut args = [0u16; LOCKSTEP_MAX_LANES];
+        let mut rest = group;
+        while rest != 0 {
+            let lane = rest.trailing_zeros() as usize;
+            rest &= rest - 1;
+            let lower = lanes
+                .lane(lane)
+                .0
+                .read_u8(self.pc[lane].wrapping_add(1), false);
+            let upper = lanes
+                .lane(lane)
+                .0
+                .read_u8(self.pc[lane].wrapping_add(2), false);
+            args[lane] = u16::from(lower) | (u16::from(upper) << 8);
+        }
+        args
+    }
+
+    fn execute_implied(&mut self, opcode: u8, mask: U8x16) {
+        match opcode {
+            // INX, INY, DEX, DEY
+            0xe8 | 0xc8 | 0xca | 0x88 => {
+                let diff = U8x16::splat(if opcode == 0xe8 || opcode == 0xc8 {
+                    1
+                } else {
+                    0xff
+                });
+                let dst = if opcode == 0xe8 || opcode == 0xca {
+                    &mut self.x
+                } else {
+                    &mut self.y
+                };
+                let result = U8x16::load(dst).add(diff);
+                select_u8(dst, result, mask);
+                update_nz(&mut self.p, result, mask);
+            }
+            // TAX, TAY
+            0xaa | 0xa8 => {
+                let result = U8x16::load(&self.a);
+                let dst = if opcode == 0xaa {
+                    &mut self.x
+                } else {
+                    &mut self.y
+                };
+                select_u8(dst, result, mask);
+                update_nz(&mut self.p, result, mask);
+            }
+            // TXA, TYA
+            0x8a | 0x98 => {
+                let result = U8x16::load(if opcode == 0x8a { &self.x } else { &self.y });
+                select_u8(&mut self.a, result, mask);
+                update_nz(&mut self.p, result, mask);
+            }
+            0x18 => write_flag(&mut self.p, FLAG_CARRY, false, mask),
+            0x38 => write_flag(&mut self.p, FLAG_CARRY, true, mask),
+            0x58 => write_flag(&mut self.p, FLAG_INTERRUPT, false, mask),
+            0x78 => write_flag(&mut self.p, FLAG_INTERRUPT, true, mask),
+            0xb8 => write_flag(&mut self.p, FLAG_OVERFLOW, false, mask),
+            0xd8 => write_flag(&mut self.p, FLAG_DECIMAL, false, mask),
+            0xf8 => write_flag(&mut self.p, FLAG_DECIMAL, true, mask),
+            // NOP
+            _ => {}
+        }
+    }
+
+    fn execute_immediate(&mut self, opcode: u8, args: U8x16, mask: U8x16) {
+        match opcode {
+            // LDA, LDX, LDY
+            0xa9 | 0xa2 | 0xa0 => {
+                let dst = match opcode {
+                    0xa9 => &mut self.a,
+                    0xa2 => &mut self.x,
+                    _ => &mut self.y,
+                };
+                select_u8(dst, args, mask);
+                update_nz(&mut self.p, args, mask);
+            }
+            // AND, ORA, EOR
+            0x29 | 0x09 | 0x49 => {
+                let a = U8x16::load(&self.a);
+                let result = match opcode {
+                    0x29 => a.and(args),
+                    0x09 => a.or(args),
+                    _ => a.xor(args),
+                };
+                select_u8(&mut self.a, result, mask);
+                update_nz(&mut self.p, result, mask);
+            }
+            // CMP, CPX, CPY
+            0xc9 | 0xe0 | 0xc0 => {
+                let src = U8x16::load(match opcode {
+                    0xc9 => &self.a,
+                    0xe0 => &self.x,
+                    _ => &self.y,
+                });
+                update_flag(&mut self.p, FLAG_CARRY, src.ge(args), mask);
+                update_nz(&mut self.p, src.sub(args), mask);
+            }
+            // ADC, SBC(SBCは引数を反転したADCと等しい)
+            _ => {
+                let a = U8x16::load(&self.a);
+                let arg = if opcode == 0xe9 {
+                    args.xor(U8x16::splat(0xff))
+                } else {
+                    args
+                };
+                let carry_in = U8x16::load(&self.p).and(U8x16::splat(FLAG_CARRY));
+                // 9bit目はa + argの桁あふれか、a + argが0xffでcarryを足して0になった場合
+                let sum = a.add(arg);
+                let result = sum.add(carry_in);
+                let is_carry = sum
+                    .ge(a)
+                    .xor(U8x16::splat(0xff))
+                    .or(result.eq(U8x16::splat(0)).and(carry_in.eq(U8x16::splat(1))));
+                let is_overflow = a
+                    .xor(result)
+                    .and(arg.xor(result))
+                    .and(U8x16::splat(0x80))
+                    .eq(U8x16::splat(0x80));
+                update_flag(&mut self.p, FLAG_OVERFLOW, is_overflow, mask);
+                update_flag(&mut self.p, FLAG_CARRY, is_carry, mask);
+                select_u8(&mut self.a, result, mask);
+                update_nz(&mut self.p, result, mask);
+            }
+        }
+    }
+
+    /// Cpu::stepと同じく、分岐しない場合もページをまたぐ分のcycleを加算します
+    fn execute_branch(
+        &mut self,
+        opcode: u8,
+        args: U8x16,
+        group: u32,
+        mask: U8x16,
+        cycs: &mut Lanes<u8>,
+    ) {
+        // bit7-6でフラグ、bit5で条件を選ぶ
+        let flag = U8x16::splat(match opcode >> 6 {
+            0 => FLAG_NEGATIVE,
+            1 => FLAG_OVERFLOW,
+            2 => FLAG_CARRY,
+            _ => FLAG_ZERO,
+        });
+        let is_set = U8x16::load(&self.p).and(flag).eq(flag);
+        let is_taken = if (opcode & 0x20) == 0x20 {
+            is_set
+        } else {
+            is_set.xor(U8x16::splat(0xff))
+        };
+        let mut halves_cyc = [U16x8::splat(0); 2];
+        for half in 0..2 {
+            if !is_active_half(group, half) {
+                continue;
+            }
+            let pc = U16x8::load(&self.pc, half);
+            let next_pc = pc.add(U16x8::splat(2));
+            let dst_pc = next_pc.add(args.widen_i8(half));
+            let is_same_page = dst_pc
+                .xor(next_pc)
+                .and(U16x8::splat(0xff00))
+                .eq(U16x8::splat(0));
+            let is_taken = is_taken.widen_mask(half);
+            dst_pc
+                .select(is_taken, next_pc)
+                .select(mask.widen_mask(half), pc)
+                .store(&mut self.pc, half);
+            // マスクは-1なので、3から同じページなら1引き、分岐するなら1足す
+            halves_cyc[half] = U16x8::splat(3).add(is_same_page).sub(is_taken);
+        }
+        select_u8(cycs, U8x16::narrow(halves_cyc[0], halves_cyc[1]), mask);
+    }
+
+    /// LDA/LDX/LDY/STA/STX/STYのZeroPage, Absolute
+    /// メモリアクセスはlaneごとに行い、フラグ更新はまとめて行う
+    fn execute_load_store<S: CassetteStorage, L: LockstepLanes<S>>(
+        &mut self,
+        opcode: u8,
+        group: u32,
+        addrs: &Lanes<u16>,
+        mask: U8x16,
+        lanes: &mut L,
+    ) {
+        // bit1-0でレジスタ(0: Y, 1: A, 2: X)、bit5で方向を選ぶ
+        let is_load = (opcode & 0x20) == 0x20;
+        let mut rest = group;
+        if is_load {
+            let mut data = [0u8; LOCKSTEP_MAX_LANES];
+            while rest != 0 {
+                let lane = rest.trailing_zeros() as usize;
+                rest &= rest - 1;
+                data[lane] = lanes.lane(lane).0.read_u8(addrs[lane], false);
+            }
+            let data = U8x16::load(&data);
+            let dst = match opcode & 0x03 {
+                0 => &mut self.y,
+                1 => &mut self.a,
+                _ => &mut self.x,
+            };
+            select_u8(dst, data, mask);
+            update_nz(&mut self.p, data, mask);
+        } else {
+            let src = match opcode & 0x03 {
+                0 => &self.y,
+                1 => &self.a,
+                _ => &self.x,
+            };
+            while rest != 0 {
+                let lane = rest.trailing_zeros() as usize;
+                rest &= rest - 1;
+                lanes.lane(lane).0.write_u8(addrs[lane], src[lane], false);
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::cassette::NromStorage;
+
+    struct TestLanes {
+        systems: Vec<Box<System<NromStorage>>>,
+        ppus: Vec<Ppu>,
+    }
+
+    impl LockstepLanes<NromStorage> for TestLanes {
+        fn num_of_lanes(&self) -> usize {
+            self.systems.len()
+        }
+        fn lane(&mut self, lane: usize) -> (&mut System<NromStorage>, &mut Ppu, *mut u8) {
+            (
+                &mut self.systems[lane],
+                &mut self.ppus[lane],
+                core::ptr::null_mut(),
+            )
+        }
+    }
+
+    /// まとめて実行する命令
+    const VECTOR_OPCODES: [u8; 48] = [
+        0xe8, 0xc8, 0xca, 0x88, 0xaa, 0xa8, 0x8a, 0x98, 0x18, 0x38, 0x58, 0x78, 0xb8, 0xd8, 0xf8,
+        0xea, 0xa9, 0xa2, 0xa0, 0x29, 0x09, 0x49, 0xc9, 0xe0, 0xc0, 0x69, 0xe9, 0x10, 0x30, 0x50,
+        0x70, 0x90, 0xb0, 0xd0, 0xf0, 0xa5, 0xa6, 0xa4, 0x85, 0x86, 0x84, 0xad, 0xae, 0xac, 0x8d,
+        0x8e, 0x8c, 0x4c,
+    ];
+
+    #[test]
+    fn execute_matches_cpu_step() {
+        let mut rng = 0x1234_5678u32;
+        let mut next = move || {
+            rng ^= rng << 13;
+            rng ^= rng >> 17;
+            rng ^= rng << 5;
+            rng
+        };
+        let mut lanes = TestLanes {
+            systems: (0..LOCKSTEP_MAX_LANES)
+                .map(|_| Box::new(System::default()))
+                .collect(),
+            ppus: vec![Ppu::default(); LOCKSTEP_MAX_LANES],
+        };
+        let mut references: Vec<Box<System<NromStorage>>> = (0..LOCKSTEP_MAX_LANES)
+            .map(|_| Box::new(System::default()))
+            .collect();
+        for &opcode in VECTOR_OPCODES.iter() {
+            for trial in 0..64 {
+                // 下位8laneだけ、上位8laneだけ、ばらばらのlaneを含める
+                let group = match trial % 4 {
+                    0 => 0xffff,
+                    1 => 0x00ff & next(),
+                    2 => 0xff00 & next(),
+                    _ => 0xffff & next(),
+                };
+                let mut lockstep = LockstepCpu::default();
+                let mut cpus: Vec<Cpu> = (0..LOCKSTEP_MAX_LANES).map(|_| Cpu::default()).collect();
+                for lane in 0..LOCKSTEP_MAX_LANES {
+                    let system = &mut lanes.systems[lane];
+                    for data in system.wram.iter_mut() {
+                        *data = next() as u8;
+                    }
+                    // 命令は$0100-$06ffに置き、Absoluteの読み書きもWRAMに収める
+                    let pc = 0x0100 + (next() % 0x0600) as u16;
+                    system.wram[usize::from(pc)] = opcode;
+                    system.wram[usize::from(pc) + 2] &= 0x07;
+                    references[lane].wram = system.wram;
+                    let random = next();
+                    let cpu = &mut cpus[lane];
+                    cpu.a = random as u8;
+                    cpu.x = (random >> 8) as u8;
+                    cpu.y = (random >> 16) as u8;
+                    cpu.p = (random >> 24) as u8;
+                    cpu.sp = 0x01fd;
+                    cpu.pc = pc;
+                    lockstep.load_lane(lane, cpu);
+                }
+                let mut cycs = [0xffu8; LOCKSTEP_MAX_LANES];
+                lockstep.execute(opcode, group, &mut lanes, &mut cycs);
+                assert_eq!(lockstep.scalar_lane_steps, 0);
+                for lane in 0..LOCKSTEP_MAX_LANES {
+                    let actual = lockstep.store_lane(lane);
+                    let mut expected = cpus[lane].clone();
+                    if (group >> lane) & 1 == 1 {
+                        let cyc = expected.step(&mut references[lane]);
+                        assert_eq!(cycs[lane], cyc, "opcode {:02x} lane {}", opcode, lane);
+                    } else {
+                        assert_eq!(cycs[lane], 0xff, "opcode {:02x} lane {}", opcode, lane);
+                    }
+                    assert_eq!(
+                        (actual.a, actual.x, actual.y, actual.p, actual.sp, actual.pc),
+                        (
+                            expected.a,
+                            expected.x,
+                            expected.y,
+                            expected.p,
+                            expected.sp,
+                            expected.pc
+                        ),
+                        "opcode {:02x} lane {}",
+                        opcode,
+                        lane
+                    );
+                    assert!(
+                        lanes.systems[lane].wram[..] == references[lane].wram[..],
+                        "opcode {:02x} lane {}",
+                        opcode,
+                        lane
+                    );
+                }
+            }
+        }
+    }
+}
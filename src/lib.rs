@@ -1,17 +1,33 @@
 #![crate_type = "lib"]
 #![crate_name = "rust_nes_emulator"]
-#![cfg_attr(not(feature = "std"), no_std)]
+#![cfg_attr(not(any(test, feature = "std")), no_std)]
 #[macro_use]
 pub mod interface;
 
 pub mod apu;
+pub mod apu_blip;
+pub mod apu_log;
+pub mod apu_mixer;
+pub mod apu_resampler;
+pub mod apu_ring;
+pub mod apu_tap;
 pub mod cassette;
+pub mod clone_state;
 pub mod cpu;
+pub mod cpu_engine;
+pub mod cpu_fusion;
+pub mod cpu_idle;
 pub mod cpu_instruction;
+#[cfg(all(feature = "jit", target_arch = "x86_64"))]
+pub mod cpu_jit;
+pub mod cpu_lockstep;
 pub mod cpu_register;
+pub mod nsf;
 pub mod pad;
 pub mod ppu;
 pub mod prelude;
+pub mod rewind;
+pub mod save_state;
 pub mod system;
 pub mod system_apu_reg;
 pub mod system_ppu_reg;
@@ -0,0 +1,191 @@
+use super::apu::*;
+use super::cassette::*;
+use super::cpu::*;
+use super::interface::*;
+use super::system::*;
+
+/// NSFファイルのヘッダのbyte数。データはこの直後から始まる
+pub const NSF_HEADER_BYTES: usize = 0x80;
+/// INIT/PLAYから戻る先。RTSで戻ってきたところで止めて、この番地の命令は実行しない
+/// 何も割り当たっていない領域を使う
+pub const NSF_RETURN_ADDR: u16 = 0x4100;
+/// INITに与えるcycle数の上限。戻ってこないINITで止まらないようにする
+pub const NSF_INIT_MAX_CYCLES: u32 = CPU_FREQ;
+/// ヘッダのPLAYの呼び出し間隔(us)が0の場合に使う値。NTSCの60Hz
+const NSF_DEFAULT_PLAY_SPEED_US: u32 = 16639;
+
+/// 1回の呼び出しでCPUを止めておく間に進めるcycle数。Apu::stepに渡せる上限
+const NSF_IDLE_STEP_CYCLES: u32 = 0xff;
+
+/// NSF(NES Sound Format)の再生
+/// ROMのデータをPRG-ROMの窓に配置し、曲ごとにINITを1回、以降はPLAYを一定間隔で呼び出します
+/// PPUは動かさず、PLAYが戻ってから次の呼び出しまではAPUだけを進めます
+/// Mapper0相当のため、Bank切り替えを使うNSFには対応しません
+#[derive(Clone)]
+pub struct Nsf {
+    /// 曲数
+    pub total_songs: u8,
+    /// 最初に再生する曲。1始まり
+    pub starting_song: u8,
+    pub load_addr: u16,
+    pub init_addr: u16,
+    pub play_addr: u16,
+    /// PLAYの呼び出し間隔(CPU cycle)
+    pub play_period: u32,
+}
+
+impl Default for Nsf {
+    fn default() -> Self {
+        Self {
+            total_songs: 0,
+            starting_song: 0,
+            load_addr: 0,
+            init_addr: 0,
+            play_addr: 0,
+            play_period: 0,
+        }
+    }
+}
+
+impl Nsf {
+    /// NSFファイルを読み込み、データをカセットに配置します
+    /// ret: NSFでない、Bank切り替えを使う、配置先がPRG-ROMの窓の外の場合はfalse
+    /// `read_func` - NSFファイルの読み出し
+    /// `bytes` - NSFファイルのbyte数
+    pub fn load<S: CassetteStorage>(
+        &mut self,
+        system: &mut System<S>,
+        read_func: impl Fn(usize) -> u8,
+        bytes: usize,
+    ) -> bool {
+        if bytes <= NSF_HEADER_BYTES {
+            return false;
+        }
+        // "NESM" 0x1a
+        if read_func(0) != 0x4e
+            || read_func(1) != 0x45
+            || read_func(2) != 0x53
+            || read_func(3) != 0x4d
+            || read_func(4) != 0x1a
+        {
+            return false;
+        }
+        let read_u16 =
+            |addr: usize| u16::from(read_func(addr)) | (u16::from(read_func(addr + 1)) << 8);
+        let total_songs = read_func(0x06);
+        let starting_song = read_func(0x07);
+        let load_addr = read_u16(0x08);
+        let init_addr = read_u16(0x0a);
+        let play_addr = read_u16(0x0c);
+        let play_speed_us = u32::from(read_u16(0x6e));
+        // 0x70 ~ 0x77: Bank切り替えの初期値。すべて0なら切り替えなし
+        let is_bank_switched = (0x70..0x78).any(|addr| read_func(addr) != 0);
+        if total_songs == 0 || is_bank_switched || load_addr < PRG_ROM_SYSTEM_BASE_ADDR {
+            return false;
+        }
+        let offset = usize::from(load_addr - PRG_ROM_SYSTEM_BASE_ADDR);
+        if !system.cassette.from_prg_image(
+            |index: usize| read_func(NSF_HEADER_BYTES + index),
+            offset,
+            bytes - NSF_HEADER_BYTES,
+        ) {
+            return false;
+        }
+
+        let play_speed_us = if play_speed_us == 0 {
+            NSF_DEFAULT_PLAY_SPEED_US
+        } else {
+            play_speed_us
+        };
+        self.total_songs = total_songs;
+        self.starting_song = core::cmp::max(1, core::cmp::min(starting_song, total_songs));
+        self.load_addr = load_addr;
+        self.init_addr = init_addr;
+        self.play_addr = play_addr;
+        self.play_period =
+            ((u64::from(play_speed_us) * u64::from(CPU_FREQ) + 500_000) / 1_000_000) as u32;
+        true
+    }
+
+    /// 曲の再生を始めます。RAMとAPUのレジスタを初期化して、INITを呼び出します
+    /// ret: 曲番号が範囲外ならfalse
+    /// `song` - 1始まり
+    pub fn init_song<S: CassetteStorage, O: ApuSink>(
+        &self,
+        apu: &mut Apu,
+        out: &O,
+        cpu: &mut Cpu,
+        system: &mut System<S>,
+        song: u8,
+    ) -> bool {
+        if song == 0 || song > self.total_songs {
+            return false;
+        }
+        // 0x0000 ~ 0x07ff, 0x6000 ~ 0x7fffをクリアする
+        let apu_cycle = system.apu_cycle;
+        system.reset();
+        system.apu_cycle = apu_cycle;
+        for data in system.cassette.storage.battery_packed_ram_mut().iter_mut() {
+            *data = 0;
+        }
+        cpu.reset();
+        // 0x4000 ~ 0x4013に0, 0x4015に0x0f, 0x4017に0x40
+        for addr in 0x4000..0x4014 {
+            system.write_u8(addr, 0x00, false);
+        }
+        system.write_u8(0x4015, 0x0f, false);
+        system.write_u8(0x4017, 0x40, false);
+        // A: 曲番号(0始まり), X: 0(NTSC)
+        cpu.a = song - 1;
+        cpu.x = 0;
+        self.call(apu, out, cpu, system, self.init_addr, NSF_INIT_MAX_CYCLES);
+        apu.flush(system, out);
+        true
+    }
+
+    /// PLAYを呼び出し、次の呼び出しまでAPUを進めます
+    /// PLAYが呼び出し間隔を超えて戻ってこない場合は、そこで打ち切ります
+    pub fn emulate_frame<S: CassetteStorage, O: ApuSink>(
+        &self,
+        apu: &mut Apu,
+        out: &O,
+        cpu: &mut Cpu,
+        system: &mut System<S>,
+    ) {
+        let mut total_cyc = self.call(apu, out, cpu, system, self.play_addr, self.play_period);
+        // CPUは止めたまま、APUだけ次の呼び出しまで進める
+        while total_cyc < self.play_period {
+            let cyc = core::cmp::min(NSF_IDLE_STEP_CYCLES, self.play_period - total_cyc) as u8;
+            let stall_cyc = apu.step(system, out, cyc);
+            total_cyc = total_cyc + u32::from(cyc) + u32::from(stall_cyc);
+        }
+        apu.flush(system, out);
+    }
+
+    /// `addr`のサブルーチンを、RTSで戻ってくるか`max_cyc`に達するまで実行します
+    /// ret: 経過したcycle数
+    fn call<S: CassetteStorage, O: ApuSink>(
+        &self,
+        apu: &mut Apu,
+        out: &O,
+        cpu: &mut Cpu,
+        system: &mut System<S>,
+        addr: u16,
+        max_cyc: u32,
+    ) -> u32 {
+        // 打ち切った呼び出しが残したStackは捨てる
+        cpu.sp = 0x01fd;
+        let return_addr = NSF_RETURN_ADDR - 1;
+        cpu.stack_push(system, (return_addr >> 8) as u8);
+        cpu.stack_push(system, (return_addr & 0xff) as u8);
+        cpu.pc = addr;
+        let mut total_cyc = 0;
+        while cpu.pc != NSF_RETURN_ADDR && total_cyc < max_cyc {
+            let cpu_cyc = cpu.step(system);
+            // DMCのDMAでCPUが止まった分も時刻は進む
+            let stall_cyc = apu.step(system, out, cpu_cyc);
+            total_cyc = total_cyc + u32::from(cpu_cyc) + u32::from(stall_cyc);
+        }
+        total_cyc
+    }
+}
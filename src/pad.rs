@@ -88,4 +88,9 @@ impl Pad {
             PadButton::Right => self.button_reg = self.button_reg & (!0x80u8),
         }
     }
+    /// 全ボタンの状態をまとめて設定します。bit0から A, B, Select, Start, Up, Down, Left, Right
+    /// 学習用途などでframeごとに入力を差し替える場合に使います
+    pub fn set_buttons(&mut self, buttons: u8) {
+        self.button_reg = buttons;
+    }
 }
@@ -1,3 +1,4 @@
+use super::cassette::CassetteStorage;
 use super::cpu::*;
 use super::interface::*;
 use super::system::*;
@@ -66,6 +67,10 @@ impl Color {
     pub fn is_black(&self) -> bool {
         self.0 == 0x0 && self.1 == 0x0 && self.2 == 0x0
     }
+    /// 輝度に変換します(BT.601の係数を256倍した整数演算)
+    pub fn luma(&self) -> u8 {
+        ((u16::from(self.0) * 77 + u16::from(self.1) * 150 + u16::from(self.2) * 29) >> 8) as u8
+    }
 }
 
 /// sprite.tile_idのu8から変換する
@@ -203,6 +208,47 @@ pub struct DrawOption {
     pub pixel_format: PixelFormat,
 }
 
+/// 観測出力の縮小方法
+#[derive(Copy, Clone)]
+pub enum ObservationSampling {
+    /// 出力pixelの左上に相当するdotを使う
+    Nearest,
+    /// 出力pixelに含まれるdotを平均する
+    Area,
+}
+
+/// 学習用途向けの観測出力設定
+/// 有効な場合はDrawOptionの代わりに、縮小したL8(1pixel 1byte)の画像をFrame Bufferに書き出します
+#[derive(Copy, Clone)]
+pub struct ObservationOption {
+    /// 出力幅(1~256)。0なら観測出力は無効
+    pub width: u32,
+    /// 出力高さ(1~240)。0なら観測出力は無効
+    pub height: u32,
+    /// 縮小方法
+    pub sampling: ObservationSampling,
+    /// trueなら直前のframeとのmax-poolを出力します
+    /// Frame Bufferの後半width*heightに直前のframeを保持するので、width*height*2 byte必要です
+    pub is_max_pool: bool,
+}
+
+impl Default for ObservationOption {
+    fn default() -> Self {
+        Self {
+            width: 0,
+            height: 0,
+            sampling: ObservationSampling::Nearest,
+            is_max_pool: false,
+        }
+    }
+}
+
+impl ObservationOption {
+    pub fn is_enable(&self) -> bool {
+        self.width > 0 && self.height > 0
+    }
+}
+
 impl Default for DrawOption {
     fn default() -> Self {
         Self {
@@ -245,6 +291,10 @@ pub struct Ppu {
 
     /// PPUの描画設定(step時に渡したかったが、毎回渡すのも無駄なので)
     pub draw_option: DrawOption,
+    /// 観測出力の設定。有効ならdraw_optionより優先します
+    pub observation_option: ObservationOption,
+    /// 観測出力をArea samplingする際の、出力1行分の輝度の積算値
+    pub observation_acc: [u32; VISIBLE_SCREEN_WIDTH],
 }
 
 impl Default for Ppu {
@@ -266,6 +316,8 @@ impl Default for Ppu {
             dma_oam_dst_addr: 0,
 
             draw_option: DrawOption::default(),
+            observation_option: ObservationOption::default(),
+            observation_acc: [0; VISIBLE_SCREEN_WIDTH],
         }
     }
 }
@@ -292,7 +344,7 @@ impl EmulateControl for Ppu {
 impl Ppu {
     /// DMA転送を(2回に分けて)行います
     /// `is_pre_transfer` - 受領直後の転送ならtrue, ppu 1stepあとならfalse
-    fn run_dma(&mut self, system: &mut System, is_pre_transfer: bool) {
+    fn run_dma<S: CassetteStorage>(&mut self, system: &mut System<S>, is_pre_transfer: bool) {
         debug_assert!(
             (!self.is_dma_running && is_pre_transfer) || (self.is_dma_running && !is_pre_transfer)
         );
@@ -324,6 +376,7 @@ impl Ppu {
 
         // ステータス更新
         self.is_dma_running = is_pre_transfer;
+        system.is_oam_dma_running = is_pre_transfer;
     }
 
     /// 1行書きます
@@ -332,7 +385,7 @@ impl Ppu {
     /// `tile_global` - スクロールオフセット換算した、4面含めた上でのタイル位置
     /// `tile_local`  - `tile_global`を1Namespace上のタイルでの位置に変換したもの
     /// scrollなしなら上記はすべて一致するはず
-    fn draw_line(&mut self, system: &mut System, fb: *mut u8) {
+    fn draw_line<S: CassetteStorage>(&mut self, system: &mut System<S>, fb: *mut u8) {
         // ループ内で何度も呼び出すとパフォーマンスが下がる
         let nametable_base_addr = system.read_ppu_name_table_base_addr();
         let pattern_table_addr = system.read_ppu_bg_pattern_table_addr();
@@ -360,6 +413,10 @@ impl Ppu {
             PixelFormat::ARGB8888 => (1, 2, 3, 0),
         };
 
+        // 観測出力の場合は1行分の輝度をためてから縮小して書き出す
+        let is_observation = self.observation_option.is_enable();
+        let mut line_luma = [0u8; VISIBLE_SCREEN_WIDTH];
+
         // 描画座標系でループさせる
         let pixel_y = usize::from(self.current_line);
         for pixel_x in 0..VISIBLE_SCREEN_WIDTH {
@@ -446,6 +503,11 @@ impl Ppu {
                 }
             }
 
+            if is_observation {
+                line_luma[pixel_x] = draw_color.luma();
+                continue;
+            }
+
             // 毎回計算する必要のないものを事前計算
             let draw_base_y =
                 self.draw_option.offset_y + (pixel_y as i32) * (self.draw_option.scale as i32);
@@ -499,15 +561,117 @@ impl Ppu {
                 }
             }
         }
+
+        if is_observation {
+            self.write_observation_line(fb, pixel_y, &line_luma);
+        }
+    }
+
+    /// 観測出力の設定を更新します
+    /// `width`, `height` - 出力サイズ。縮小のみ対応で、0を指定すると観測出力を無効にします
+    /// retval - サイズが範囲外の場合は何も変更せずfalse
+    pub fn set_observation_option(
+        &mut self,
+        width: u32,
+        height: u32,
+        sampling: ObservationSampling,
+        is_max_pool: bool,
+    ) -> bool {
+        if (width as usize) > VISIBLE_SCREEN_WIDTH || (height as usize) > VISIBLE_SCREEN_HEIGHT {
+            return false;
+        }
+        self.observation_option = ObservationOption {
+            width,
+            height,
+            sampling,
+            is_max_pool,
+        };
+        true
+    }
+
+    /// 描画した1行分の輝度を縮小して、観測出力としてFrame Bufferに書き出します
+    /// 出力pixel(obs_x, obs_y)は画面上の[obs_x * 256 / width, (obs_x + 1) * 256 / width) x [obs_y * 240 / height, (obs_y + 1) * 240 / height)に相当します
+    /// `pixel_y` - 描画した行
+    /// `line_luma` - 描画した行の輝度
+    fn write_observation_line(
+        &mut self,
+        fb: *mut u8,
+        pixel_y: usize,
+        line_luma: &[u8; VISIBLE_SCREEN_WIDTH],
+    ) {
+        let width = self.observation_option.width as usize;
+        let height = self.observation_option.height as usize;
+        // pixel_yを含む出力行と、その出力行に相当する範囲
+        let obs_y = ((pixel_y + 1) * height - 1) / VISIBLE_SCREEN_HEIGHT;
+        let begin_y = obs_y * VISIBLE_SCREEN_HEIGHT / height;
+        let end_y = (obs_y + 1) * VISIBLE_SCREEN_HEIGHT / height;
+
+        match self.observation_option.sampling {
+            ObservationSampling::Nearest => {
+                // 出力行の先頭に相当する行だけを使う
+                if pixel_y != begin_y {
+                    return;
+                }
+                for obs_x in 0..width {
+                    let src_x = obs_x * VISIBLE_SCREEN_WIDTH / width;
+                    self.write_observation_pixel(fb, obs_x, obs_y, line_luma[src_x]);
+                }
+            }
+            ObservationSampling::Area => {
+                // 出力行の範囲にある行を積算して、最後の行で平均を書き出す
+                if pixel_y == begin_y {
+                    for acc in self.observation_acc[..width].iter_mut() {
+                        *acc = 0;
+                    }
+                }
+                for obs_x in 0..width {
+                    let begin_x = obs_x * VISIBLE_SCREEN_WIDTH / width;
+                    let end_x = (obs_x + 1) * VISIBLE_SCREEN_WIDTH / width;
+                    let sum: u32 = line_luma[begin_x..end_x]
+                        .iter()
+                        .map(|luma| u32::from(*luma))
+                        .sum();
+                    self.observation_acc[obs_x] += sum;
+                }
+                if pixel_y + 1 != end_y {
+                    return;
+                }
+                for obs_x in 0..width {
+                    let begin_x = obs_x * VISIBLE_SCREEN_WIDTH / width;
+                    let end_x = (obs_x + 1) * VISIBLE_SCREEN_WIDTH / width;
+                    let area = ((end_x - begin_x) * (end_y - begin_y)) as u32;
+                    let luma = (self.observation_acc[obs_x] + area / 2) / area;
+                    self.write_observation_pixel(fb, obs_x, obs_y, luma as u8);
+                }
+            }
+        }
+    }
+
+    /// 観測出力の1pixelを書き出します。max-poolが有効なら直前のframeと比較します
+    fn write_observation_pixel(&self, fb: *mut u8, obs_x: usize, obs_y: usize, luma: u8) {
+        let width = self.observation_option.width as usize;
+        let height = self.observation_option.height as usize;
+        let index = obs_y * width + obs_x;
+        unsafe {
+            if self.observation_option.is_max_pool {
+                // 後半には直前のframeの値が入っている
+                let prev_ptr = fb.add(width * height + index);
+                let prev = *prev_ptr;
+                *prev_ptr = luma;
+                *fb.add(index) = if prev > luma { prev } else { luma };
+            } else {
+                *fb.add(index) = luma;
+            }
+        }
     }
 
     /// 指定されたpixelにあるスプライトを描画します
     /// `pixel_x` - 描画対象の表示するリーンにおけるx座標
     /// `pixel_y` - 描画対象の表示するリーンにおけるy座標
     /// retval - (bgよりも後ろに描画するデータ, bgより前に描画するデータ)
-    fn get_sprite_draw_data(
+    fn get_sprite_draw_data<S: CassetteStorage>(
         &mut self,
-        system: &mut System,
+        system: &mut System<S>,
         pixel_x: usize,
         pixel_y: usize,
     ) -> (Option<u8>, Option<u8>) {
@@ -614,7 +778,7 @@ impl Ppu {
 
     /// OAMを探索して次の描画で使うスプライトをレジスタにフェッチします
     /// 8個を超えるとOverflowフラグを立てる
-    fn fetch_sprite(&mut self, system: &mut System) {
+    fn fetch_sprite<S: CassetteStorage>(&mut self, system: &mut System<S>) {
         // sprite描画無効化
         if !system.read_ppu_is_write_sprite() {
             return;
@@ -661,7 +825,11 @@ impl Ppu {
 
     /// 1行ごとに色々更新する処理です
     /// 341cyc溜まったときに呼び出されることを期待
-    fn update_line(&mut self, system: &mut System, fb: *mut u8) -> Option<Interrupt> {
+    fn update_line<S: CassetteStorage>(
+        &mut self,
+        system: &mut System<S>,
+        fb: *mut u8,
+    ) -> Option<Interrupt> {
         // scroll更新
         self.current_scroll_x = self.fetch_scroll_x;
         self.current_scroll_y = self.fetch_scroll_y;
@@ -682,12 +850,14 @@ impl Ppu {
         system.write_ppu_is_sprite_overflow(false);
 
         // 行の更新
-        match LineStatus::from(self.current_line) {
+        let nmi = match LineStatus::from(self.current_line) {
             LineStatus::Visible => {
                 // sprite探索
                 self.fetch_sprite(system);
-                // 1行描く
-                self.draw_line(system, fb);
+                // 1行描く(Run-aheadなど画面を使わない場合は省略)
+                if !fb.is_null() {
+                    self.draw_line(system, fb);
+                }
                 // 行カウンタを更新して終わり
                 self.current_line = (self.current_line + 1) % RENDER_SCREEN_HEIGHT;
 
@@ -716,6 +886,13 @@ impl Ppu {
 
                 None
             }
+        };
+        // IRQ線はAPUの同期(Frame Sequencerのstep, DMCの読み込み)と$4015のアクセスでしか変わらないので、命令ごとではなくline処理で見る
+        // CPUが割り込みを禁止している間は保留になり、禁止が解けた後のline処理で受け付けられる
+        if nmi.is_none() && system.is_irq_asserted() {
+            Some(Interrupt::IRQ)
+        } else {
+            nmi
         }
     }
 
@@ -725,7 +902,13 @@ impl Ppu {
     /// `system` - レジスタ読み書きする
     /// `video_system` - レジスタ読み書きする
     /// `videoout_func` - pixelごとのデータが決まるごとに呼ぶ(NESは出力ダブルバッファとかない)
-    pub fn step(&mut self, cpu_cyc: usize, system: &mut System, fb: *mut u8) -> Option<Interrupt> {
+    /// `fb` - nullを渡すと描画だけを省略します。描画以外の状態は変わりません
+    pub fn step<S: CassetteStorage>(
+        &mut self,
+        cpu_cyc: usize,
+        system: &mut System<S>,
+        fb: *mut u8,
+    ) -> Option<Interrupt> {
         // PPU_SCROLL書き込み
         let (_, scroll_x, scroll_y) = system.read_ppu_scroll();
         self.fetch_scroll_x = scroll_x;
@@ -1,7 +1,23 @@
 pub use super::apu::*;
+pub use super::apu_blip::*;
+pub use super::apu_log::*;
+pub use super::apu_mixer::*;
+pub use super::apu_resampler::*;
+pub use super::apu_ring::*;
+pub use super::apu_tap::*;
 pub use super::cassette::*;
+pub use super::clone_state::*;
 pub use super::cpu::*;
+pub use super::cpu_engine::*;
+pub use super::cpu_fusion::*;
+pub use super::cpu_idle::*;
+#[cfg(all(feature = "jit", target_arch = "x86_64"))]
+pub use super::cpu_jit::*;
+pub use super::cpu_lockstep::*;
 pub use super::interface::*;
+pub use super::nsf::*;
 pub use super::pad::*;
 pub use super::ppu::*;
+pub use super::rewind::*;
+pub use super::save_state::*;
 pub use super::system::*;
@@ -0,0 +1,527 @@
+use super::apu::*;
+use super::cassette::CassetteStorage;
+use super::cpu::*;
+use super::ppu::*;
+use super::save_state::*;
+use super::system::*;
+
+/// total bytes(4) + older entry offset(4) + delta bytes(4)
+pub const REWIND_ENTRY_HEADER_SIZE: usize = 12;
+/// RLEで連続する0をこの長さ以上見つけたらリテラルを打ち切る(tokenの大きさと同じ)
+pub const REWIND_RLE_MIN_ZERO_RUN: usize = 4;
+/// 1tokenで表せる最大長
+const REWIND_RLE_MAX_RUN: usize = 0xffff;
+/// 変化のない区間を読み飛ばす単位
+const REWIND_RLE_CHUNK_SIZE: usize = 32;
+
+/// `src`と`base`のXORをRLEで符号化します。`base`がNoneの場合は`src`そのものを符号化します
+/// token: skip(u16) + copy(u16) + XORしたデータ(copy bytes)、末尾の0は省略する
+/// `writer`に空のバッファを渡せば符号化後のサイズだけ計算できます
+pub fn encode_xor_rle(writer: &mut SaveStateWriter, src: &[u8], base: Option<&[u8]>) {
+    let xor = |index: usize| -> u8 {
+        match base {
+            Some(b) => arr_read!(src, index) ^ arr_read!(b, index),
+            None => arr_read!(src, index),
+        }
+    };
+    let len = src.len();
+    let mut index = 0;
+    while index < len {
+        // 変化のない区間
+        let skip_start = index;
+        // 変化がない場合がほとんどなので、まとめて比較して読み飛ばす
+        while (index + REWIND_RLE_CHUNK_SIZE) <= len
+            && (index - skip_start + REWIND_RLE_CHUNK_SIZE) <= REWIND_RLE_MAX_RUN
+        {
+            let chunk = &src[index..(index + REWIND_RLE_CHUNK_SIZE)];
+            let is_same = match base {
+                Some(b) => chunk == &b[index..(index + REWIND_RLE_CHUNK_SIZE)],
+                None => chunk.iter().all(|&data| data == 0),
+            };
+            if !is_same {
+                break;
+            }
+            index = index + REWIND_RLE_CHUNK_SIZE;
+        }
+        while index < len && (index - skip_start) < REWIND_RLE_MAX_RUN && xor(index) == 0 {
+            index = index + 1;
+        }
+        if index == len {
+            break;
+        }
+        let skip = index - skip_start;
+        // 変化のある区間、短い0は取り込んでしまったほうが小さい
+        let copy_start = index;
+        let mut copy_end = index;
+        while index < len && (index - copy_start) < REWIND_RLE_MAX_RUN {
+            if xor(index) != 0 {
+                copy_end = index + 1;
+            } else if (index - copy_end) + 1 >= REWIND_RLE_MIN_ZERO_RUN {
+                break;
+            }
+            index = index + 1;
+        }
+        writer.write_u16(skip as u16);
+        writer.write_u16((copy_end - copy_start) as u16);
+        for i in copy_start..copy_end {
+            writer.write_u8(xor(i));
+        }
+        index = copy_end;
+    }
+}
+
+/// encode_xor_rleで符号化したデータを`dst`にXORします
+/// 差分を2回適用すると元に戻るので、前後どちらの方向にも使えます
+pub fn decode_xor_rle(dst: &mut [u8], encoded: &[u8]) {
+    let mut reader = SaveStateReader::new(encoded);
+    let mut index = 0;
+    while reader.position() < encoded.len() {
+        index = index + usize::from(reader.read_u16());
+        let copy = usize::from(reader.read_u16());
+        for _ in 0..copy {
+            dst[index] = dst[index] ^ reader.read_u8();
+            index = index + 1;
+        }
+    }
+}
+
+/// Save Stateの差分を固定サイズのリングバッファに貯めて巻き戻せるようにします
+/// 領域はホストが用意したバッファを使います
+/// - [0, state_bytes): 最新のsnapshot / 作業用 (交互に使う)
+/// - [state_bytes, 2 * state_bytes): 同上
+/// - [2 * state_bytes, ): entryのリングバッファ
+///
+/// entryはひとつ前のsnapshotとのXOR差分を持ち、keyframe_intervalごとにsnapshot全体も持ちます
+/// 容量が足りなくなったら古いentryから捨てます
+#[derive(Clone)]
+pub struct Rewind {
+    /// ホストが用意したバッファ
+    pub buf_ptr: *mut u8,
+    pub buf_bytes: usize,
+    /// Save State 1個分のサイズ
+    pub state_bytes: usize,
+    /// 最新のsnapshotが入っているスロット(0 or 1)
+    pub current_slot: usize,
+    /// 最新のsnapshotがあればtrue
+    pub is_exists_current: bool,
+
+    /// リングバッファの容量
+    pub ring_bytes: usize,
+    /// 最も古いentryの位置
+    pub head: usize,
+    /// 次にentryを書く位置
+    pub tail: usize,
+    /// 折り返した場合の、折り返す前の有効データの終端
+    pub wrap_end: usize,
+    pub is_wrapped: bool,
+    /// 最新のentryの位置
+    pub newest: usize,
+    pub num_of_entries: usize,
+
+    /// 何frameごとにsnapshotを取るか
+    pub capture_interval: u32,
+    /// 何entryごとにkeyframeを入れるか。0ならkeyframeを入れない
+    pub keyframe_interval: u32,
+    /// 前回のsnapshotから経過したframe数
+    pub frame_counter: u32,
+    /// 前回のkeyframeから追加したentry数
+    pub entries_since_keyframe: u32,
+}
+
+impl Default for Rewind {
+    fn default() -> Self {
+        Self {
+            buf_ptr: core::ptr::null_mut(),
+            buf_bytes: 0,
+            state_bytes: 0,
+            current_slot: 0,
+            is_exists_current: false,
+
+            ring_bytes: 0,
+            head: 0,
+            tail: 0,
+            wrap_end: 0,
+            is_wrapped: false,
+            newest: 0,
+            num_of_entries: 0,
+
+            capture_interval: 1,
+            keyframe_interval: 0,
+            frame_counter: 0,
+            entries_since_keyframe: 0,
+        }
+    }
+}
+
+impl Rewind {
+    /// ホストのバッファを割り当てます。LoadRomの後に呼ぶこと
+    /// バッファがSave State 2個分に満たない場合はfalse
+    /// `buf_ptr` - Rewindを使う間は解放しないこと
+    /// `capture_interval` - 何frameごとにsnapshotを取るか(1以上)
+    /// `keyframe_interval` - 何entryごとにkeyframeを入れるか。0ならkeyframeを入れない
+    pub unsafe fn init<S: CassetteStorage>(
+        &mut self,
+        system: &System<S>,
+        buf_ptr: *mut u8,
+        buf_bytes: usize,
+        capture_interval: u32,
+        keyframe_interval: u32,
+    ) -> bool {
+        let state_bytes = save_state_bytes(system);
+        if buf_ptr.is_null() || buf_bytes < (2 * state_bytes + REWIND_ENTRY_HEADER_SIZE) {
+            return false;
+        }
+        self.buf_ptr = buf_ptr;
+        self.buf_bytes = buf_bytes;
+        self.state_bytes = state_bytes;
+        self.ring_bytes = buf_bytes - 2 * state_bytes;
+        self.capture_interval = core::cmp::max(capture_interval, 1);
+        self.keyframe_interval = keyframe_interval;
+        self.clear();
+        true
+    }
+
+    /// 履歴をすべて破棄します
+    pub fn clear(&mut self) {
+        self.current_slot = 0;
+        self.is_exists_current = false;
+        self.head = 0;
+        self.tail = 0;
+        self.wrap_end = 0;
+        self.is_wrapped = false;
+        self.newest = 0;
+        self.num_of_entries = 0;
+        self.frame_counter = 0;
+        self.entries_since_keyframe = 0;
+    }
+
+    /// 巻き戻せるframe数
+    pub fn available_frames(&self) -> u32 {
+        (self.num_of_entries as u32) * self.capture_interval
+    }
+
+    /// ホストのバッファの一部を切り出します
+    fn region<'a>(&self, offset: usize, bytes: usize) -> &'a mut [u8] {
+        debug_assert!(offset + bytes <= self.buf_bytes);
+        unsafe { core::slice::from_raw_parts_mut(self.buf_ptr.add(offset), bytes) }
+    }
+    fn state_slot<'a>(&self, slot: usize) -> &'a mut [u8] {
+        self.region(slot * self.state_bytes, self.state_bytes)
+    }
+    fn ring<'a>(&self) -> &'a mut [u8] {
+        self.region(2 * self.state_bytes, self.ring_bytes)
+    }
+
+    /// entryのheaderを読みます
+    /// 戻り値: (total bytes, older entry offset, delta bytes)
+    fn read_entry_header(ring: &[u8], offset: usize) -> (usize, usize, usize) {
+        let mut reader = SaveStateReader::new(&ring[offset..(offset + REWIND_ENTRY_HEADER_SIZE)]);
+        let total_bytes = reader.read_u32() as usize;
+        let older_offset = reader.read_u32() as usize;
+        let delta_bytes = reader.read_u32() as usize;
+        (total_bytes, older_offset, delta_bytes)
+    }
+
+    /// 最も古いentryを捨てます
+    fn evict_oldest(&mut self) {
+        debug_assert!(self.num_of_entries > 0);
+        let (total_bytes, _, _) = Self::read_entry_header(self.ring(), self.head);
+        self.head = self.head + total_bytes;
+        self.num_of_entries = self.num_of_entries - 1;
+        if self.num_of_entries == 0 {
+            self.head = 0;
+            self.tail = 0;
+            self.is_wrapped = false;
+        } else if self.is_wrapped && self.head == self.wrap_end {
+            self.head = 0;
+            self.is_wrapped = false;
+        }
+    }
+
+    /// 古いentryを捨てて`bytes`を連続して書ける位置を確保します
+    /// 戻り値: 書き込み位置。リングバッファより大きい場合はNone
+    fn allocate_entry(&mut self, bytes: usize) -> Option<usize> {
+        if bytes >= self.ring_bytes {
+            return None;
+        }
+        loop {
+            if self.num_of_entries == 0 {
+                self.head = 0;
+                self.tail = 0;
+                self.is_wrapped = false;
+            }
+            if !self.is_wrapped {
+                // [head, tail)が使用中
+                if self.tail + bytes <= self.ring_bytes {
+                    break;
+                }
+                // 末尾に入らないので先頭に折り返す。tailがheadに追いつかないようにする
+                if bytes < self.head {
+                    self.wrap_end = self.tail;
+                    self.tail = 0;
+                    self.is_wrapped = true;
+                    break;
+                }
+            } else {
+                // [head, wrap_end) + [0, tail)が使用中
+                if self.tail + bytes < self.head {
+                    break;
+                }
+            }
+            self.evict_oldest();
+        }
+        Some(self.tail)
+    }
+
+    /// 1frameごとに呼び出してください。capture_intervalごとにsnapshotを取ります
+    /// `apu` - $4015やIRQの状態を追っているApu。使っていなければNone
+    /// 戻り値: snapshotを取ったらtrue
+    pub fn capture<S: CassetteStorage>(
+        &mut self,
+        cpu: &Cpu,
+        system: &System<S>,
+        ppu: &Ppu,
+        apu: Option<&Apu>,
+    ) -> bool {
+        if self.buf_ptr.is_null() {
+            return false;
+        }
+        self.frame_counter = self.frame_counter + 1;
+        if self.is_exists_current && self.frame_counter < self.capture_interval {
+            return false;
+        }
+        self.frame_counter = 0;
+
+        // 作業用スロットに現在の状態を書き出す
+        let next_slot = self.current_slot ^ 1;
+        let next_state = self.state_slot(next_slot);
+        if save_state(cpu, system, ppu, apu, next_state).is_none() {
+            return false;
+        }
+        if !self.is_exists_current {
+            // 差分をとる相手がいないので、snapshotだけ更新する
+            self.current_slot = next_slot;
+            self.is_exists_current = true;
+            return true;
+        }
+        let current_state = self.state_slot(self.current_slot);
+
+        // 符号化後のサイズを先に計算して、領域を確保する
+        let is_keyframe = self.keyframe_interval > 0
+            && (self.entries_since_keyframe + 1) >= self.keyframe_interval;
+        let mut writer = SaveStateWriter::new(&mut []);
+        encode_xor_rle(&mut writer, next_state, Some(current_state));
+        let delta_bytes = writer.position();
+        if is_keyframe {
+            encode_xor_rle(&mut writer, next_state, None);
+        }
+        let total_bytes = REWIND_ENTRY_HEADER_SIZE + writer.position();
+        let older_offset = self.newest;
+        let offset = match self.allocate_entry(total_bytes) {
+            Some(offset) => offset,
+            None => return false,
+        };
+
+        // entryを書き込む
+        let ring = self.ring();
+        let mut writer = SaveStateWriter::new(&mut ring[offset..(offset + total_bytes)]);
+        writer.write_u32(total_bytes as u32);
+        writer.write_u32(older_offset as u32);
+        writer.write_u32(delta_bytes as u32);
+        encode_xor_rle(&mut writer, next_state, Some(current_state));
+        if is_keyframe {
+            encode_xor_rle(&mut writer, next_state, None);
+        }
+        debug_assert!(writer.position() == total_bytes);
+
+        self.tail = offset + total_bytes;
+        self.newest = offset;
+        self.num_of_entries = self.num_of_entries + 1;
+        self.entries_since_keyframe = if is_keyframe {
+            0
+        } else {
+            self.entries_since_keyframe + 1
+        };
+        self.current_slot = next_slot;
+        true
+    }
+
+    /// 指定したframe数だけ巻き戻して、内部状態を復元します
+    /// snapshotはcapture_interval単位なので、`frames`以上で最も近いsnapshotに戻ります。戻った先より新しい履歴は破棄します
+    /// 戻り値: 実際に巻き戻したframe数。履歴がない場合は0
+    pub fn rewind<S: CassetteStorage>(
+        &mut self,
+        cpu: &mut Cpu,
+        system: &mut System<S>,
+        ppu: &mut Ppu,
+        apu: Option<&mut Apu>,
+        frames: u32,
+    ) -> u32 {
+        if !self.is_exists_current {
+            return 0;
+        }
+        let steps = core::cmp::min(
+            ((frames + self.capture_interval - 1) / self.capture_interval) as usize,
+            self.num_of_entries,
+        );
+        let ring = self.ring();
+        let current_state = self.state_slot(self.current_slot);
+
+        // 戻り先に最も近いkeyframeを探す。見つかればそこから差分を適用する
+        let mut start_offset = self.newest;
+        let mut start_steps = steps;
+        let mut offset = self.newest;
+        for step in 0..steps {
+            let (total_bytes, older_offset, delta_bytes) = Self::read_entry_header(ring, offset);
+            if total_bytes > REWIND_ENTRY_HEADER_SIZE + delta_bytes {
+                start_offset = offset;
+                start_steps = steps - step;
+            }
+            offset = older_offset;
+        }
+        if start_steps < steps {
+            let (total_bytes, _, delta_bytes) = Self::read_entry_header(ring, start_offset);
+            let keyframe_begin = start_offset + REWIND_ENTRY_HEADER_SIZE + delta_bytes;
+            let keyframe_end = start_offset + total_bytes;
+            for data in current_state.iter_mut() {
+                *data = 0;
+            }
+            decode_xor_rle(current_state, &ring[keyframe_begin..keyframe_end]);
+        }
+
+        // 差分を新しい順に適用する
+        let mut offset = start_offset;
+        for _ in 0..start_steps {
+            let (_, older_offset, delta_bytes) = Self::read_entry_header(ring, offset);
+            let delta_begin = offset + REWIND_ENTRY_HEADER_SIZE;
+            decode_xor_rle(
+                current_state,
+                &ring[delta_begin..(delta_begin + delta_bytes)],
+            );
+            offset = older_offset;
+        }
+
+        // 戻った先より新しいentryを捨てる
+        self.num_of_entries = self.num_of_entries - steps;
+        if self.num_of_entries == 0 {
+            self.head = 0;
+            self.tail = 0;
+            self.is_wrapped = false;
+        } else {
+            let (total_bytes, _, _) = Self::read_entry_header(ring, offset);
+            self.newest = offset;
+            self.tail = offset + total_bytes;
+            if self.is_wrapped && self.tail > self.head {
+                self.is_wrapped = false;
+            }
+        }
+        self.frame_counter = 0;
+        self.entries_since_keyframe = 0;
+
+        let is_loaded = load_state(cpu, system, ppu, apu, current_state);
+        debug_assert!(is_loaded);
+        (steps as u32) * self.capture_interval
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::cassette::NromStorage;
+    use crate::cpu_engine::*;
+    use crate::interface::*;
+
+    const ROM: &[u8] = include_bytes!("../roms/other/hello.nes");
+
+    /// 疎な変化と、RLEの1tokenに収まらない長さの変化のない区間を含むデータ
+    fn pattern(len: usize, seed: u32) -> Vec<u8> {
+        let mut x = seed;
+        (0..len)
+            .map(|i| {
+                x = x.wrapping_mul(1_103_515_245).wrapping_add(12345);
+                if (i / 0x1_0000) % 2 == 1 || (x >> 16) % 7 != 0 {
+                    0
+                } else {
+                    (x >> 24) as u8
+                }
+            })
+            .collect()
+    }
+
+    fn encode(src: &[u8], base: Option<&[u8]>) -> Vec<u8> {
+        let mut writer = SaveStateWriter::new(&mut []);
+        encode_xor_rle(&mut writer, src, base);
+        let mut encoded = vec![0u8; writer.position()];
+        let mut writer = SaveStateWriter::new(&mut encoded);
+        encode_xor_rle(&mut writer, src, base);
+        assert!(!writer.is_overflow());
+        encoded
+    }
+
+    #[test]
+    fn xor_rle_round_trip() {
+        let len = 0x2_4000 + 3;
+        let base = pattern(len, 1);
+        let src = pattern(len, 2);
+
+        // 差分
+        let delta = encode(&src, Some(&base));
+        let mut dst = base.clone();
+        decode_xor_rle(&mut dst, &delta);
+        assert_eq!(dst, src);
+        // 同じ差分をもう一度適用すると戻る
+        decode_xor_rle(&mut dst, &delta);
+        assert_eq!(dst, base);
+
+        // keyframe
+        let keyframe = encode(&src, None);
+        let mut dst = vec![0u8; len];
+        decode_xor_rle(&mut dst, &keyframe);
+        assert_eq!(dst, src);
+
+        // 変化がなければ、1tokenに収まらない区間を読み飛ばすtokenだけ
+        let same = encode(&src, Some(&src));
+        assert!(same.len() <= 4 * (len / REWIND_RLE_MAX_RUN));
+        decode_xor_rle(&mut dst, &same);
+        assert_eq!(dst, src);
+    }
+
+    #[test]
+    fn rewind_restores_captured_state() {
+        let mut cpu = Cpu::default();
+        let mut system: Box<System<NromStorage>> = Box::new(System::default());
+        let mut ppu = Ppu::default();
+        assert!(system.cassette.from_ines_binary(|i| ROM[i]));
+        cpu.reset();
+        system.reset();
+        ppu.reset();
+        cpu.interrupt(&mut system, Interrupt::RESET);
+
+        let state_bytes = save_state_bytes(&*system);
+        let mut buf = vec![0u8; 64 * 1024];
+        let mut rewind = Rewind::default();
+        assert!(unsafe { rewind.init(&*system, buf.as_mut_ptr(), buf.len(), 1, 8) });
+
+        let mut history = Vec::new();
+        for _ in 0..60 {
+            Interpreter.emulate_frame(&mut cpu, &mut system, &mut ppu, core::ptr::null_mut());
+            assert!(rewind.capture(&cpu, &system, &ppu, None));
+            let mut state = vec![0u8; state_bytes];
+            assert!(save_state(&cpu, &system, &ppu, None, &mut state).is_some());
+            history.push(state);
+        }
+
+        for &frames in [1u32, 5, 20].iter() {
+            assert_eq!(
+                rewind.rewind(&mut cpu, &mut system, &mut ppu, None, frames),
+                frames
+            );
+            for _ in 0..frames {
+                history.pop();
+            }
+            let mut state = vec![0u8; state_bytes];
+            assert!(save_state(&cpu, &system, &ppu, None, &mut state).is_some());
+            assert!(state == *history.last().unwrap());
+        }
+    }
+}
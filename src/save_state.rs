@@ -0,0 +1,530 @@
+use super::apu::*;
+use super::cassette::*;
+use super::cpu::*;
+use super::pad::*;
+use super::ppu::*;
+use super::system::*;
+use super::video_system::*;
+
+/// Save Stateの先頭に置く識別子
+pub const SAVE_STATE_MAGIC: [u8; 4] = *b"RNES";
+/// レイアウトを変更したら上げること。異なるバージョンは読み込まない
+pub const SAVE_STATE_VERSION: u8 = 5;
+/// magic(4) + version(1) + flags(1) + reserved(2) + total size(4) + prg rom bytes(4) + chr rom bytes(4)
+pub const SAVE_STATE_HEADER_SIZE: usize = 20;
+
+/// CHR-RAMの内容を含む
+pub const SAVE_STATE_FLAG_CHR_RAM: u8 = 0x01;
+/// Battery Packed RAMの内容を含む
+pub const SAVE_STATE_FLAG_BATTERY_PACKED_RAM: u8 = 0x02;
+
+/// Save Stateを書き出します
+/// バッファが足りない場合も書き込み位置だけは進めるので、空のバッファを渡せば必要なサイズを計算できます
+pub struct SaveStateWriter<'a> {
+    buf: &'a mut [u8],
+    pos: usize,
+}
+
+impl<'a> SaveStateWriter<'a> {
+    pub fn new(buf: &'a mut [u8]) -> Self {
+        Self { buf, pos: 0 }
+    }
+    /// 書き込んだ(書き込もうとした)バイト数
+    pub fn position(&self) -> usize {
+        self.pos
+    }
+    /// バッファが足りずに書き込めなかったデータがあればtrue
+    pub fn is_overflow(&self) -> bool {
+        self.pos > self.buf.len()
+    }
+    pub fn write_u8(&mut self, data: u8) {
+        if self.pos < self.buf.len() {
+            arr_write!(self.buf, self.pos, data);
+        }
+        self.pos = self.pos + 1;
+    }
+    pub fn write_bool(&mut self, data: bool) {
+        self.write_u8(if data { 1 } else { 0 });
+    }
+    pub fn write_u16(&mut self, data: u16) {
+        self.write_u8((data & 0xff) as u8);
+        self.write_u8((data >> 8) as u8);
+    }
+    pub fn write_u32(&mut self, data: u32) {
+        self.write_u16((data & 0xffff) as u16);
+        self.write_u16((data >> 16) as u16);
+    }
+    pub fn write_bytes(&mut self, data: &[u8]) {
+        let end = self.pos + data.len();
+        if end <= self.buf.len() {
+            self.buf[self.pos..end].copy_from_slice(data);
+        }
+        self.pos = end;
+    }
+}
+
+/// Save Stateを読み出します
+/// 範囲外の読み出しは0を返すので、読み出し後にis_overflowを確認すること
+pub struct SaveStateReader<'a> {
+    buf: &'a [u8],
+    pos: usize,
+}
+
+impl<'a> SaveStateReader<'a> {
+    pub fn new(buf: &'a [u8]) -> Self {
+        Self { buf, pos: 0 }
+    }
+    pub fn position(&self) -> usize {
+        self.pos
+    }
+    pub fn is_overflow(&self) -> bool {
+        self.pos > self.buf.len()
+    }
+    pub fn read_u8(&mut self) -> u8 {
+        let data = if self.pos < self.buf.len() {
+            arr_read!(self.buf, self.pos)
+        } else {
+            0
+        };
+        self.pos = self.pos + 1;
+        data
+    }
+    pub fn read_bool(&mut self) -> bool {
+        self.read_u8() != 0
+    }
+    pub fn read_u16(&mut self) -> u16 {
+        let lower = u16::from(self.read_u8());
+        let upper = u16::from(self.read_u8());
+        (upper << 8) | lower
+    }
+    pub fn read_u32(&mut self) -> u32 {
+        let lower = u32::from(self.read_u16());
+        let upper = u32::from(self.read_u16());
+        (upper << 16) | lower
+    }
+    pub fn read_bytes(&mut self, data: &mut [u8]) {
+        let end = self.pos + data.len();
+        if end <= self.buf.len() {
+            data.copy_from_slice(&self.buf[self.pos..end]);
+        }
+        self.pos = end;
+    }
+}
+
+/// 可変な内部状態だけを直列化する機能を提供します
+/// ROMやホスト側の設定(描画設定など)は含めないこと
+pub trait SaveState {
+    fn save_state(&self, writer: &mut SaveStateWriter);
+    fn load_state(&mut self, reader: &mut SaveStateReader);
+}
+
+impl SaveState for Cpu {
+    fn save_state(&self, writer: &mut SaveStateWriter) {
+        writer.write_u8(self.a);
+        writer.write_u8(self.x);
+        writer.write_u8(self.y);
+        writer.write_u16(self.pc);
+        // 上位8bitは0x1固定
+        writer.write_u8((self.sp & 0xff) as u8);
+        writer.write_u8(self.p);
+    }
+    fn load_state(&mut self, reader: &mut SaveStateReader) {
+        self.a = reader.read_u8();
+        self.x = reader.read_u8();
+        self.y = reader.read_u8();
+        self.pc = reader.read_u16();
+        self.sp = 0x0100 | u16::from(reader.read_u8());
+        self.p = reader.read_u8();
+    }
+}
+
+impl SaveState for Pad {
+    fn save_state(&self, writer: &mut SaveStateWriter) {
+        writer.write_u8(self.button_reg);
+        writer.write_u8(self.read_shift_index);
+        writer.write_bool(self.strobe_enable);
+    }
+    fn load_state(&mut self, reader: &mut SaveStateReader) {
+        self.button_reg = reader.read_u8();
+        self.read_shift_index = reader.read_u8();
+        self.strobe_enable = reader.read_bool();
+    }
+}
+
+impl SaveState for VideoSystem {
+    fn save_state(&self, writer: &mut SaveStateWriter) {
+        for nametable in self.nametables.iter() {
+            writer.write_bytes(nametable);
+        }
+        writer.write_bytes(&self.palette);
+    }
+    fn load_state(&mut self, reader: &mut SaveStateReader) {
+        for nametable in self.nametables.iter_mut() {
+            reader.read_bytes(nametable);
+        }
+        reader.read_bytes(&mut self.palette);
+    }
+}
+
+impl<S: CassetteStorage> SaveState for Cassette<S> {
+    /// ROMは含めず、CHR-RAMとBattery Packed RAMだけを対象にします
+    /// 含めるかどうかはヘッダのflagsで判断するので、ここでは確認しない
+    fn save_state(&self, writer: &mut SaveStateWriter) {
+        // TODO: Mapperのレジスタもここに追加する
+        if self.chr_rom_bytes == 0 {
+            writer.write_bytes(&self.storage.chr_rom()[..CHR_ROM_WINDOW_SIZE]);
+        }
+        if self.is_exists_battery_backed_ram {
+            writer.write_bytes(self.storage.battery_packed_ram());
+        }
+    }
+    fn load_state(&mut self, reader: &mut SaveStateReader) {
+        if self.chr_rom_bytes == 0 {
+            if let Some(chr_ram) = self.storage.chr_rom_mut() {
+                reader.read_bytes(&mut chr_ram[..CHR_ROM_WINDOW_SIZE]);
+            }
+        }
+        if self.is_exists_battery_backed_ram {
+            // 内容が変わったページだけ書き出してもらう(Run-aheadなどで毎frame読み込まれても書き出しが増えないように)
+            let mut page_buf = [0u8; BATTERY_PACKED_RAM_PAGE_SIZE];
+            for page in 0..BATTERY_PACKED_RAM_NUM_OF_PAGES {
+                reader.read_bytes(&mut page_buf);
+                let offset = page * BATTERY_PACKED_RAM_PAGE_SIZE;
+                let dst = &mut self.storage.battery_packed_ram_mut()
+                    [offset..(offset + BATTERY_PACKED_RAM_PAGE_SIZE)];
+                if dst[..] != page_buf[..] {
+                    dst.copy_from_slice(&page_buf);
+                    self.battery_packed_ram_dirty_pages |= 1 << page;
+                }
+            }
+        }
+    }
+}
+
+impl<S: CassetteStorage> SaveState for System<S> {
+    fn save_state(&self, writer: &mut SaveStateWriter) {
+        writer.write_bytes(&self.wram);
+        writer.write_bytes(&self.ppu_reg);
+        writer.write_bytes(&self.io_reg);
+
+        self.cassette.save_state(writer);
+        self.video.save_state(writer);
+        self.pad1.save_state(writer);
+        self.pad2.save_state(writer);
+
+        writer.write_bool(self.written_oam_data);
+        writer.write_bool(self.written_ppu_scroll);
+        writer.write_bool(self.written_ppu_addr);
+        writer.write_bool(self.written_ppu_data);
+        writer.write_bool(self.written_oam_dma);
+        writer.write_bool(self.read_oam_data);
+        writer.write_bool(self.read_ppu_data);
+
+        // サイズを固定するため、ログは未使用の分も書き出す
+        writer.write_u32(self.apu_cycle);
+        for access in self.apu_log.iter() {
+            writer.write_u32(access.cycle);
+            writer.write_u8(access.offset);
+            writer.write_u8(access.data);
+        }
+        writer.write_u8(self.apu_log_len as u8);
+        writer.write_bool(self.is_apu_sync_requested);
+        writer.write_u8(self.apu_status);
+        writer.write_u8(self.dmc_stall_cycles);
+
+        writer.write_bool(self.ppu_is_second_write);
+        writer.write_u8(self.ppu_scroll_y_reg);
+        writer.write_u8(self.ppu_addr_lower_reg);
+    }
+    fn load_state(&mut self, reader: &mut SaveStateReader) {
+        reader.read_bytes(&mut self.wram);
+        reader.read_bytes(&mut self.ppu_reg);
+        reader.read_bytes(&mut self.io_reg);
+
+        self.cassette.load_state(reader);
+        self.video.load_state(reader);
+        self.pad1.load_state(reader);
+        self.pad2.load_state(reader);
+
+        self.written_oam_data = reader.read_bool();
+        self.written_ppu_scroll = reader.read_bool();
+        self.written_ppu_addr = reader.read_bool();
+        self.written_ppu_data = reader.read_bool();
+        self.written_oam_dma = reader.read_bool();
+        self.read_oam_data = reader.read_bool();
+        self.read_ppu_data = reader.read_bool();
+
+        self.apu_cycle = reader.read_u32();
+        for access in self.apu_log.iter_mut() {
+            access.cycle = reader.read_u32();
+            access.offset = reader.read_u8();
+            access.data = reader.read_u8();
+        }
+        self.apu_log_len = core::cmp::min(usize::from(reader.read_u8()), APU_REG_LOG_SIZE);
+        self.is_apu_sync_requested = reader.read_bool();
+        self.apu_status = reader.read_u8();
+        self.dmc_stall_cycles = reader.read_u8();
+
+        self.ppu_is_second_write = reader.read_bool();
+        self.ppu_scroll_y_reg = reader.read_u8();
+        self.ppu_addr_lower_reg = reader.read_u8();
+    }
+}
+
+impl SaveState for Ppu {
+    /// sprite_tempsは描画する行ごとにOAMから作り直すので含めない
+    /// draw_optionはホスト側の設定なので含めない
+    fn save_state(&self, writer: &mut SaveStateWriter) {
+        writer.write_bytes(&self.oam);
+        writer.write_u16(self.cumulative_cpu_cyc as u16);
+        writer.write_u16(self.current_line);
+
+        writer.write_u8(self.fetch_scroll_x);
+        writer.write_u8(self.fetch_scroll_y);
+        writer.write_u8(self.current_scroll_x);
+        writer.write_u8(self.current_scroll_y);
+
+        writer.write_bool(self.is_dma_running);
+        writer.write_u16(self.dma_cpu_src_addr);
+        writer.write_u8(self.dma_oam_dst_addr);
+    }
+    fn load_state(&mut self, reader: &mut SaveStateReader) {
+        reader.read_bytes(&mut self.oam);
+        self.cumulative_cpu_cyc = usize::from(reader.read_u16());
+        self.current_line = reader.read_u16();
+
+        self.fetch_scroll_x = reader.read_u8();
+        self.fetch_scroll_y = reader.read_u8();
+        self.current_scroll_x = reader.read_u8();
+        self.current_scroll_y = reader.read_u8();
+
+        self.is_dma_running = reader.read_bool();
+        self.dma_cpu_src_addr = reader.read_u16();
+        self.dma_oam_dst_addr = reader.read_u8();
+    }
+}
+
+/// 読み込んでいるカセットの構成から、Save Stateに含める領域を決めます
+fn save_state_flags<S: CassetteStorage>(system: &System<S>) -> u8 {
+    let mut flags = 0;
+    if system.cassette.chr_rom_bytes == 0 {
+        flags = flags | SAVE_STATE_FLAG_CHR_RAM;
+    }
+    if system.cassette.is_exists_battery_backed_ram {
+        flags = flags | SAVE_STATE_FLAG_BATTERY_PACKED_RAM;
+    }
+    flags
+}
+
+/// Save Stateに必要なバイト数を返します。カセットの構成(CHR-RAM, Battery Packed RAM)で変わります
+pub fn save_state_bytes<S: CassetteStorage>(system: &System<S>) -> usize {
+    let mut writer = SaveStateWriter::new(&mut []);
+    Cpu::default().save_state(&mut writer);
+    system.save_state(&mut writer);
+    Ppu::default().save_state(&mut writer);
+    save_apu_state(None, &mut writer);
+    SAVE_STATE_HEADER_SIZE + writer.position()
+}
+
+/// Apuの状態を書き出します。Apuを持たないホストでもサイズが変わらないよう、有無を書いてから同じサイズの領域を埋めます
+fn save_apu_state(apu: Option<&Apu>, writer: &mut SaveStateWriter) {
+    writer.write_bool(apu.is_some());
+    match apu {
+        Some(apu) => apu.save_state(writer),
+        None => writer.write_bytes(&[0u8; APU_SAVE_STATE_BYTES]),
+    }
+}
+
+/// Apuの状態を読み込みます。Apuを持たないホストが書き出したものなら、電源投入時の状態から`now`に再開します
+fn load_apu_state(apu: Option<&mut Apu>, now: u32, reader: &mut SaveStateReader) {
+    let is_exists = reader.read_bool();
+    match apu {
+        Some(apu) if is_exists => apu.load_state(reader),
+        Some(apu) => {
+            reader.read_bytes(&mut [0u8; APU_SAVE_STATE_BYTES]);
+            apu.reset_state(now);
+        }
+        None => reader.read_bytes(&mut [0u8; APU_SAVE_STATE_BYTES]),
+    }
+}
+
+/// 可変な内部状態を`buf`に書き出します
+/// `apu` - $4015やIRQの状態を追っているApu。使っていなければNone
+/// 戻り値: 書き出したバイト数。バッファが足りない場合はNone
+pub fn save_state<S: CassetteStorage>(
+    cpu: &Cpu,
+    system: &System<S>,
+    ppu: &Ppu,
+    apu: Option<&Apu>,
+    buf: &mut [u8],
+) -> Option<usize> {
+    if buf.len() < SAVE_STATE_HEADER_SIZE {
+        return None;
+    }
+    let (header, body) = buf.split_at_mut(SAVE_STATE_HEADER_SIZE);
+    // body
+    let mut writer = SaveStateWriter::new(body);
+    cpu.save_state(&mut writer);
+    system.save_state(&mut writer);
+    ppu.save_state(&mut writer);
+    save_apu_state(apu, &mut writer);
+    if writer.is_overflow() {
+        return None;
+    }
+    let total_bytes = SAVE_STATE_HEADER_SIZE + writer.position();
+    // header
+    let mut writer = SaveStateWriter::new(header);
+    writer.write_bytes(&SAVE_STATE_MAGIC);
+    writer.write_u8(SAVE_STATE_VERSION);
+    writer.write_u8(save_state_flags(system));
+    writer.write_u16(0); // reserved
+    writer.write_u32(total_bytes as u32);
+    writer.write_u32(system.cassette.prg_rom_bytes as u32);
+    writer.write_u32(system.cassette.chr_rom_bytes as u32);
+    debug_assert!(writer.position() == SAVE_STATE_HEADER_SIZE);
+
+    Some(total_bytes)
+}
+
+/// `buf`から内部状態を復元します
+/// バージョンや読み込んでいるROMの構成が一致しない場合は何も変更せずにfalseを返します
+/// `apu` - save_stateと同様。Noneなら書き出したApuの状態は読み飛ばします
+pub fn load_state<S: CassetteStorage>(
+    cpu: &mut Cpu,
+    system: &mut System<S>,
+    ppu: &mut Ppu,
+    apu: Option<&mut Apu>,
+    buf: &[u8],
+) -> bool {
+    // 途中で失敗して中途半端な状態にならないよう、先にヘッダとサイズをすべて確認する
+    let mut reader = SaveStateReader::new(buf);
+    let mut magic = [0u8; 4];
+    reader.read_bytes(&mut magic);
+    let version = reader.read_u8();
+    let flags = reader.read_u8();
+    let _reserved = reader.read_u16();
+    let total_bytes = reader.read_u32() as usize;
+    let prg_rom_bytes = reader.read_u32() as usize;
+    let chr_rom_bytes = reader.read_u32() as usize;
+    if reader.is_overflow()
+        || magic != SAVE_STATE_MAGIC
+        || version != SAVE_STATE_VERSION
+        || flags != save_state_flags(system)
+        || prg_rom_bytes != system.cassette.prg_rom_bytes
+        || chr_rom_bytes != system.cassette.chr_rom_bytes
+        || total_bytes != save_state_bytes(system)
+        || total_bytes > buf.len()
+    {
+        return false;
+    }
+    // body
+    cpu.load_state(&mut reader);
+    system.load_state(&mut reader);
+    ppu.load_state(&mut reader);
+    load_apu_state(apu, system.apu_cycle, &mut reader);
+    debug_assert!(reader.position() == total_bytes);
+    // Systemが持つ写しはPPUの状態から戻す
+    system.is_oam_dma_running = ppu.is_dma_running;
+
+    true
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::cpu_engine::*;
+    use crate::interface::*;
+
+    const ROM: &[u8] = include_bytes!("../roms/other/hello.nes");
+
+    struct Instance {
+        cpu: Cpu,
+        system: Box<System<NromStorage>>,
+        ppu: Ppu,
+        apu: Box<Apu>,
+    }
+
+    impl Instance {
+        fn new() -> Self {
+            let mut instance = Self {
+                cpu: Cpu::default(),
+                system: Box::new(System::default()),
+                ppu: Ppu::default(),
+                apu: Box::new(Apu::default()),
+            };
+            assert!(instance.system.cassette.from_ines_binary(|i| ROM[i]));
+            instance.cpu.reset();
+            instance.system.reset();
+            instance.ppu.reset();
+            instance
+                .cpu
+                .interrupt(&mut instance.system, Interrupt::RESET);
+            instance
+        }
+        fn emulate(&mut self, frames: usize) {
+            for _ in 0..frames {
+                Interpreter.emulate_apu_frame(
+                    &mut self.apu,
+                    &ApuNullSink,
+                    &mut self.cpu,
+                    &mut self.system,
+                    &mut self.ppu,
+                    core::ptr::null_mut(),
+                );
+            }
+        }
+        fn save(&self) -> Vec<u8> {
+            let mut buf = vec![0u8; save_state_bytes(&*self.system)];
+            let size = save_state(
+                &self.cpu,
+                &self.system,
+                &self.ppu,
+                Some(&self.apu),
+                &mut buf,
+            );
+            assert_eq!(size, Some(buf.len()));
+            buf
+        }
+        fn load(&mut self, buf: &[u8]) -> bool {
+            load_state(
+                &mut self.cpu,
+                &mut self.system,
+                &mut self.ppu,
+                Some(&mut self.apu),
+                buf,
+            )
+        }
+    }
+
+    #[test]
+    fn save_load_save_is_identical() {
+        let mut src = Instance::new();
+        src.emulate(120);
+        let saved = src.save();
+
+        let mut dst = Instance::new();
+        assert!(dst.load(&saved));
+        assert_eq!(dst.save(), saved);
+
+        // 読み込んだ後も同じように進む
+        src.emulate(60);
+        dst.emulate(60);
+        assert_eq!(dst.save(), src.save());
+    }
+
+    #[test]
+    fn load_rejects_broken_state() {
+        let mut src = Instance::new();
+        src.emulate(10);
+        let saved = src.save();
+
+        let mut version = saved.clone();
+        version[SAVE_STATE_MAGIC.len()] = SAVE_STATE_VERSION.wrapping_add(1);
+        let mut dst = Instance::new();
+        let before = dst.save();
+        assert!(!dst.load(&version));
+        assert!(!dst.load(&saved[..(saved.len() - 1)]));
+        // 失敗しても状態は変えない
+        assert_eq!(dst.save(), before);
+    }
+}
@@ -1,6 +1,7 @@
 use super::cassette::*;
 use super::interface::*;
 use super::pad::*;
+use super::system_apu_reg::*;
 use super::video_system::*;
 
 pub const WRAM_SIZE: usize = 0x0800;
@@ -15,9 +16,33 @@ pub const PPU_REG_BASE_ADDR: u16 = 0x2000;
 pub const APU_IO_REG_BASE_ADDR: u16 = 0x4000;
 pub const CASSETTE_BASE_ADDR: u16 = 0x4020;
 
+/// APUが同期するまでに溜めておけるレジスタへのアクセス数
+pub const APU_REG_LOG_SIZE: usize = 32;
+/// ApuRegAccess::offsetに入れる、$4015 APU_STATUSの読み出しを表す値
+pub const APU_REG_LOG_READ_STATUS: u8 = 0xff;
+
+/// APUレジスタへのアクセスの記録
+#[derive(Copy, Clone, Default)]
+pub struct ApuRegAccess {
+    /// アクセスした命令の先頭の時刻。System::apu_cycle
+    pub cycle: u32,
+    /// $4000からのoffset。APU_REG_LOG_READ_STATUSなら$4015の読み出し
+    pub offset: u8,
+    /// 書き込んだ値
+    pub data: u8,
+}
+
+/// NROM専用の組み込み向け構成
+pub type NromSystem = System<NromStorage>;
+/// Mapper対応を見込んだHost向け構成
+pub type MapperSystem = System<MapperStorage>;
+/// ROMをコピーせずに参照する構成
+pub type RomInPlaceSystem = System<RomInPlaceStorage>;
+
 /// Memory Access Dispatcher
+/// `S` - カセットのStorage Profile。Profileごとに具象型を用意している
 #[derive(Clone)]
-pub struct System {
+pub struct System<S: CassetteStorage = NromStorage> {
     /// 0x0000 - 0x07ff: WRAM
     /// 0x0800 - 0x1f7ff: WRAM  Mirror x3
     pub wram: [u8; WRAM_SIZE],
@@ -33,7 +58,7 @@ pub struct System {
     ///  0x6000 - 0x7FFF: Extended RAM
     ///  0x8000 - 0xbfff: PRG-ROM switchable
     ///  0xc000 - 0xffff: PRG-ROM fixed to the last bank or switchable
-    pub cassette: Cassette,
+    pub cassette: Cassette<S>,
 
     /// PPUが描画に使うメモリ空間
     pub video: VideoSystem,
@@ -51,6 +76,21 @@ pub struct System {
     pub written_oam_dma: bool,    // OAM_DMAが書かれた
     pub read_oam_data: bool,      // OAM_DATAが読まれた
     pub read_ppu_data: bool,      // PPU_DATAが読まれた
+    /// OAM DMAの転送中。Ppu::is_dma_runningの写しで、DMCのDMAが止めるサイクル数に影響する
+    pub is_oam_dma_running: bool,
+
+    /* APUへの要求トリガ */
+    /// APUの時刻(CPUサイクル)。APUを動かすときだけ進め、一周したら0に戻る
+    pub apu_cycle: u32,
+    /// APUが同期するまでのレジスタへのアクセス。APUは同期したときに時刻順に反映する
+    pub apu_log: [ApuRegAccess; APU_REG_LOG_SIZE],
+    pub apu_log_len: usize,
+    /// $4015の値が変わりうるアクセスがあったか、ログが溢れそう。APUは次の命令の後で同期する
+    pub is_apu_sync_requested: bool,
+    /// $4015を読んだときの値。APUが同期したときに更新する
+    pub apu_status: u8,
+    /// DMCのDMAでCPUが止まるサイクル数のうち、まだCPUの時刻に反映していない分。Apu::stepが取り出す
+    pub dmc_stall_cycles: u8,
 
     /* 2回海ができるPPU register対応 */
     /// $2005, $2006は状態を共有する、$2002を読み出すと、どっちを書くかはリセットされる
@@ -59,7 +99,7 @@ pub struct System {
     pub ppu_addr_lower_reg: u8, // $2006
 }
 
-impl Default for System {
+impl<S: CassetteStorage> Default for System<S> {
     fn default() -> Self {
         Self {
             wram: [0; WRAM_SIZE],
@@ -78,6 +118,14 @@ impl Default for System {
             written_oam_dma: false,
             read_oam_data: false,
             read_ppu_data: false,
+            is_oam_dma_running: false,
+
+            apu_cycle: 0,
+            apu_log: [ApuRegAccess::default(); APU_REG_LOG_SIZE],
+            apu_log_len: 0,
+            is_apu_sync_requested: false,
+            apu_status: 0,
+            dmc_stall_cycles: 0,
 
             ppu_is_second_write: false,
             ppu_scroll_y_reg: 0,
@@ -86,7 +134,7 @@ impl Default for System {
     }
 }
 
-impl EmulateControl for System {
+impl<S: CassetteStorage> EmulateControl for System<S> {
     fn reset(&mut self) {
         self.video.reset();
         self.pad1.reset();
@@ -103,6 +151,12 @@ impl EmulateControl for System {
         self.written_oam_dma = false;
         self.read_oam_data = false;
         self.read_ppu_data = false;
+        self.is_oam_dma_running = false;
+
+        self.apu_log_len = 0;
+        self.is_apu_sync_requested = false;
+        self.apu_status = 0;
+        self.dmc_stall_cycles = 0;
 
         self.ppu_is_second_write = false;
         self.ppu_scroll_y_reg = 0;
@@ -110,7 +164,7 @@ impl EmulateControl for System {
     }
 }
 
-impl SystemBus for System {
+impl<S: CassetteStorage> SystemBus for System<S> {
     fn read_u8(&mut self, addr: u16, is_nondestructive: bool) -> u8 {
         if addr < PPU_REG_BASE_ADDR {
             // mirror support
@@ -152,11 +206,19 @@ impl SystemBus for System {
             let index = usize::from(addr - APU_IO_REG_BASE_ADDR);
             if !is_nondestructive {
                 match index {
-                    // TODO: APU
+                    // APU_STATUS 読み出すとFrame IRQフラグがクリアされる
+                    0x15 => {
+                        let data = self.apu_status;
+                        self.apu_status = data & !APU_STATUS_FRAME_IRQ;
+                        self.log_apu_access(APU_REG_LOG_READ_STATUS, 0);
+                        data
+                    }
                     0x16 => self.pad1.read_out(), // pad1
                     0x17 => self.pad2.read_out(), // pad2
                     _ => arr_read!(self.io_reg, index),
                 }
+            } else if index == 0x15 {
+                self.apu_status
             } else {
                 arr_read!(self.io_reg, index)
             }
@@ -229,11 +291,15 @@ impl SystemBus for System {
             let index = usize::from(addr - APU_IO_REG_BASE_ADDR);
             if !is_nondestructive {
                 match index {
-                    // TODO: APU
-                    0x14 => self.written_oam_dma = true, // OAM DMA
+                    0x14 => self.written_oam_dma = true,                   // OAM DMA
                     0x16 => self.pad1.write_strobe((data & 0x01) == 0x01), // pad1
-                    0x17 => self.pad2.write_strobe((data & 0x01) == 0x01), // pad2
-                    _ => {}
+                    // $4017はpad2とFrame Counterを兼ねる
+                    0x17 => {
+                        self.pad2.write_strobe((data & 0x01) == 0x01);
+                        self.log_apu_access(index as u8, data);
+                    }
+                    // APUに書いてもらう
+                    _ => self.log_apu_access(index as u8, data),
                 }
             }
             arr_write!(self.io_reg, index, data);
@@ -242,3 +308,58 @@ impl SystemBus for System {
         }
     }
 }
+
+/// CPUが頻繁にアクセスするWRAM上の領域への近道
+/// ZeroPage($00xx)とStack($01xx)はWRAMにしか割り当たらないので、SystemBusのアドレス判定とミラーの計算を省略します
+impl<S: CassetteStorage> System<S> {
+    /// ZeroPageから読み出します
+    #[inline(always)]
+    pub fn read_zero_page(&self, addr: u8) -> u8 {
+        arr_read!(self.wram, usize::from(addr))
+    }
+    /// ZeroPageに書き込みます
+    #[inline(always)]
+    pub fn write_zero_page(&mut self, addr: u8, data: u8) {
+        arr_write!(self.wram, usize::from(addr), data);
+    }
+    /// Stackから読み出します
+    /// `sp` - Cpu::spの値。$0000-$1fffの範囲内
+    #[inline(always)]
+    pub fn read_stack(&self, sp: u16) -> u8 {
+        debug_assert!(sp < PPU_REG_BASE_ADDR);
+        arr_read!(self.wram, usize::from(sp) & (WRAM_SIZE - 1))
+    }
+    /// Stackに書き込みます
+    /// `sp` - Cpu::spの値。$0000-$1fffの範囲内
+    #[inline(always)]
+    pub fn write_stack(&mut self, sp: u16, data: u8) {
+        debug_assert!(sp < PPU_REG_BASE_ADDR);
+        arr_write!(self.wram, usize::from(sp) & (WRAM_SIZE - 1), data);
+    }
+}
+
+/// APUへのアクセスの記録
+impl<S: CassetteStorage> System<S> {
+    /// APUレジスタへのアクセスを時刻と一緒に記録します
+    /// $4015の値(Length Counter, IRQフラグ)が変わりうるアクセスは、APUに同期を要求します
+    fn log_apu_access(&mut self, offset: u8, data: u8) {
+        if self.apu_log_len < APU_REG_LOG_SIZE {
+            self.apu_log[self.apu_log_len] = ApuRegAccess {
+                cycle: self.apu_cycle,
+                offset,
+                data,
+            };
+            self.apu_log_len = self.apu_log_len + 1;
+        }
+        // RMW命令は1命令で2回書き込むので、余裕を持って同期させる
+        if self.apu_log_len + 2 >= APU_REG_LOG_SIZE {
+            self.is_apu_sync_requested = true;
+        }
+        match offset {
+            0x03 | 0x07 | 0x0b | 0x0f | 0x10 | 0x15 | 0x17 | APU_REG_LOG_READ_STATUS => {
+                self.is_apu_sync_requested = true
+            }
+            _ => {}
+        }
+    }
+}
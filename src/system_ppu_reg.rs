@@ -1,3 +1,4 @@
+use super::cassette::*;
 use super::system::*;
 
 pub const PPU_CTRL_OFFSET: usize = 0x00;
@@ -13,7 +14,7 @@ pub const APU_IO_OAM_DMA_OFFSET: usize = 0x14;
 /// PPU Register Implement
 /// 0x2000 - 0x2007
 /// PPU本体の実装向けです。CPUから本レジスタを本関数を通して読むことはありません(STA, STX, STYなどで読むのが普通)
-impl System {
+impl<S: CassetteStorage> System<S> {
     /*************************** 0x2000: PPUCTRL ***************************/
     /// VBLANK発生時にNMI割り込みを出す
     /// oneshotではなく0x2002のVLANKフラグがある限り
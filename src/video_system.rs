@@ -99,7 +99,7 @@ impl VideoSystem {
         };
         (table_index, offset)
     }
-    pub fn read_u8(&self, cassette: &mut Cassette, addr: u16) -> u8 {
+    pub fn read_u8<S: CassetteStorage>(&self, cassette: &mut Cassette<S>, addr: u16) -> u8 {
         debug_assert!(addr < VIDEO_ADDRESS_SIZE);
 
         if addr < NAME_TABLE_BASE_ADDR {
@@ -125,7 +125,12 @@ impl VideoSystem {
             }
         }
     }
-    pub fn write_u8(&mut self, cassette: &mut Cassette, addr: u16, data: u8) {
+    pub fn write_u8<S: CassetteStorage>(
+        &mut self,
+        cassette: &mut Cassette<S>,
+        addr: u16,
+        data: u8,
+    ) {
         debug_assert!(addr < VIDEO_ADDRESS_SIZE);
 
         if addr < NAME_TABLE_BASE_ADDR {
@@ -25,6 +25,10 @@ MBED_ALIGN(32) uint8_t emuWorkBuffer[EMU_WORK_SIZE];
 #define SDRAM_SIZE                    (SDRAM_DEVICE_SIZE)       // ~0xc100_0000(16MByte)
 #define DISPLAY_WIDTH                 (OTM8009A_800X480_WIDTH)  // 800
 #define DISPLAY_HEIGHT                (OTM8009A_800X480_HEIGHT) // 480
+#define SD_BLOCK_SIZE                 (512)
+#define SAVE_RAM_SD_BLOCK_ADDR        (128)                     // next to the 64KByte ROM area
+#define SAVE_RAM_FLUSH_INTERVAL       (60)                      // frames
+#define SAVE_RAM_SD_MAGIC             (0x5641534e)              // "NSAV"
 
 void initSystem(void) {
     // Enabled I/D Cache, Prefetch Buffer
@@ -79,6 +83,84 @@ bool readRomFromSd(uint8_t* buffer) {
     return true;
 }
 
+// FNV-1a hash of the iNES image, used to tell which game the save RAM on SD belongs to
+uint32_t hashRom(const uint8_t* romBuf) {
+    const uint32_t maxRomBytes = 64 * 1024; // readRomFromSd reads 64KByte
+    const uint32_t romBytes = 16 + romBuf[4] * 0x4000 + romBuf[5] * 0x2000;
+    const uint32_t hashBytes = (romBytes < maxRomBytes) ? romBytes : maxRomBytes;
+    uint32_t hash = 0x811c9dc5;
+    for (uint32_t i = 0; i < hashBytes; i++) {
+        hash = (hash ^ romBuf[i]) * 0x01000193;
+    }
+    return hash;
+}
+
+// Save RAM layout on SD:
+// - [SAVE_RAM_SD_BLOCK_ADDR + 0]: header block (magic, ROM hash, save RAM size)
+// - [SAVE_RAM_SD_BLOCK_ADDR + 1 - ]: save RAM image, 2 pages per block
+// A header for another ROM is treated as the first boot and overwritten
+bool restoreSaveRamFromSd(uint8_t* systemBuf, uint32_t romHash, uint8_t* buffer) {
+    const uint32_t saveRamSize = EmbeddedEmulator_GetSaveRamSize(systemBuf);
+    const uint32_t numOfBlocks = saveRamSize / SD_BLOCK_SIZE;
+    const uint32_t timeout = 1000;
+    if (saveRamSize == 0) {
+        return true;
+    }
+
+    // header check
+    if (MSD_OK != BSP_SD_ReadBlocks(reinterpret_cast<uint32_t*>(buffer), SAVE_RAM_SD_BLOCK_ADDR, 1, timeout)) {
+        return false;
+    }
+    const uint32_t* header = reinterpret_cast<const uint32_t*>(buffer);
+    if ((header[0] == SAVE_RAM_SD_MAGIC) && (header[1] == romHash) && (header[2] == saveRamSize)) {
+        if (MSD_OK != BSP_SD_ReadBlocks(reinterpret_cast<uint32_t*>(buffer), SAVE_RAM_SD_BLOCK_ADDR + 1, numOfBlocks, timeout)) {
+            return false;
+        }
+        EmbeddedEmulator_RestoreSaveRam(systemBuf, buffer, saveRamSize);
+        return true;
+    }
+
+    // first boot: write the whole image once, then only the dirty pages are written back
+    for (uint32_t i = 0; i < saveRamSize / EMBEDDED_EMULATOR_SAVE_RAM_PAGE_SIZE; i++) {
+        EmbeddedEmulator_ReadSaveRamPage(systemBuf, i, &buffer[i * EMBEDDED_EMULATOR_SAVE_RAM_PAGE_SIZE]);
+    }
+    EmbeddedEmulator_TakeSaveRamDirtyPages(systemBuf);
+    if (MSD_OK != BSP_SD_WriteBlocks(reinterpret_cast<uint32_t*>(buffer), SAVE_RAM_SD_BLOCK_ADDR + 1, numOfBlocks, timeout)) {
+        return false;
+    }
+    memset(buffer, 0, SD_BLOCK_SIZE);
+    reinterpret_cast<uint32_t*>(buffer)[0] = SAVE_RAM_SD_MAGIC;
+    reinterpret_cast<uint32_t*>(buffer)[1] = romHash;
+    reinterpret_cast<uint32_t*>(buffer)[2] = saveRamSize;
+    return (MSD_OK == BSP_SD_WriteBlocks(reinterpret_cast<uint32_t*>(buffer), SAVE_RAM_SD_BLOCK_ADDR, 1, timeout));
+}
+
+bool flushSaveRamToSd(uint8_t* systemBuf, uint8_t* buffer) {
+    const uint32_t saveRamSize = EmbeddedEmulator_GetSaveRamSize(systemBuf);
+    const uint32_t pagesPerBlock = SD_BLOCK_SIZE / EMBEDDED_EMULATOR_SAVE_RAM_PAGE_SIZE;
+    const uint32_t numOfBlocks = saveRamSize / SD_BLOCK_SIZE;
+    const uint32_t blockMask = (1u << pagesPerBlock) - 1;
+    const uint32_t timeout = 1000;
+    if (saveRamSize == 0) {
+        return true;
+    }
+    const uint32_t dirtyPages = EmbeddedEmulator_TakeSaveRamDirtyPages(systemBuf);
+
+    // write back only the blocks that contain dirty pages
+    for (uint32_t block = 0; block < numOfBlocks; block++) {
+        if ((dirtyPages & (blockMask << (block * pagesPerBlock))) == 0) {
+            continue;
+        }
+        for (uint32_t i = 0; i < pagesPerBlock; i++) {
+            EmbeddedEmulator_ReadSaveRamPage(systemBuf, block * pagesPerBlock + i, &buffer[i * EMBEDDED_EMULATOR_SAVE_RAM_PAGE_SIZE]);
+        }
+        if (MSD_OK != BSP_SD_WriteBlocks(reinterpret_cast<uint32_t*>(buffer), SAVE_RAM_SD_BLOCK_ADDR + 1 + block, 1, timeout)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 int main(void) {
     // Allocate SDRAM Buffer
     // Frame Buffer:
@@ -93,6 +175,9 @@ int main(void) {
     uint8_t* generalBufferPtr  = frameBuffer1Ptr + frameBufferSize;
     const uint32_t generalBufferSize = (SDRAM_SIZE - reinterpret_cast<uint32_t>(generalBufferPtr));
     uint8_t* romBuf = generalBufferPtr;
+    uint8_t* saveRamBuf = romBuf + (64 * 1024);
+    uint8_t* rewindHistoryBuf = saveRamBuf + (64 * 1024);
+    const uint32_t rewindHistorySize = 4 * 1024 * 1024;
 
     // work data
     char msg[128];
@@ -154,6 +239,9 @@ int main(void) {
     uint8_t* cpuBuf    = &emuWorkBuffer[0];
     uint8_t* systemBuf = &emuWorkBuffer[cpuDataSize];
     uint8_t* ppuBuf    = &emuWorkBuffer[cpuDataSize + systemDataSize];
+    const uint32_t rewindDataSize = EmbeddedEmulator_GetRewindDataSize();
+    uint8_t* rewindBuf = &emuWorkBuffer[cpuDataSize + systemDataSize + ppuDataSize];
+    uint8_t* idleBuf   = &emuWorkBuffer[cpuDataSize + systemDataSize + ppuDataSize + rewindDataSize];
 
     // Init emulator
     const uint32_t scale = 2;
@@ -171,6 +259,8 @@ int main(void) {
 
     // Load ROM
     BSP_LCD_DisplayStringAt(0, (messageLine++ * PRINT_MESSAGE_HEIGHT), (uint8_t *)"[INFO ] Load ROM", LEFT_MODE);
+    // With the ROM-in-place storage profile (default for this board), the cassette keeps referring to romBuf on SDRAM.
+    // Only the mutable part of the cassette is placed on DTCM, so romBuf must not be reused while emulating.
 
     const bool isLoad = EmbeddedEmulator_LoadRom(systemBuf, romBuf);
     if (!isLoad) {
@@ -178,17 +268,34 @@ int main(void) {
         while(1);
     }
 
+    // Restore battery-backed RAM
+    BSP_LCD_DisplayStringAt(0, (messageLine++ * PRINT_MESSAGE_HEIGHT), (uint8_t *)"[INFO ] Restore Save RAM from SD", LEFT_MODE);
+    if (!restoreSaveRamFromSd(systemBuf, hashRom(romBuf), saveRamBuf)) {
+        BSP_LCD_DisplayStringAt(0, (messageLine++ * PRINT_MESSAGE_HEIGHT), (uint8_t *)"[WARN ] FAILED", LEFT_MODE);
+    }
+
     // Reset
     BSP_LCD_DisplayStringAt(0, (messageLine++ * PRINT_MESSAGE_HEIGHT), (uint8_t *)"[INFO ] Reset Emulator", LEFT_MODE);
     EmbeddedEmulator_Reset(cpuBuf, systemBuf, ppuBuf);
 
+    // Rewind (history is placed on SDRAM, touch the screen to rewind)
+    BSP_LCD_DisplayStringAt(0, (messageLine++ * PRINT_MESSAGE_HEIGHT), (uint8_t *)"[INFO ] Init Rewind", LEFT_MODE);
+    if (!EmbeddedEmulator_InitRewind(rewindBuf, systemBuf, rewindHistoryBuf, rewindHistorySize, 1, 60)) {
+        BSP_LCD_DisplayStringAt(0, (messageLine++ * PRINT_MESSAGE_HEIGHT), (uint8_t *)"[WARN ] FAILED", LEFT_MODE);
+    }
+    // Idle-loop skip (VBlank/flag polling loops are fast-forwarded to the next PPU line)
+    EmbeddedEmulator_InitIdleSkip(idleBuf);
+    TS_StateTypeDef tsState;
+    Timer captureTimer;
+    captureTimer.start();
+    int captureUs = 0;
+
     // Start Emulation
     BSP_LCD_DisplayStringAt(0, (messageLine++ * PRINT_MESSAGE_HEIGHT), (uint8_t *)"[INFO ] Start Emulation", LEFT_MODE);
     wait_ms(1000);
     BSP_LCD_Clear(LCD_COLOR_BLACK);
-    const uint32_t cyclePerFrame = EmbeddedEmulator_GetCpuCyclePerFrame();
     for(uint32_t i = 0; ; i++) {
-        sprintf(msg, "%d", i);
+        sprintf(msg, "%d capture:%dus", i, captureUs);
         BSP_LCD_DisplayStringAt(0, 0, (uint8_t *)msg, LEFT_MODE);
         // TODO: Input
         // for (const auto& [key, value]: keyMaps) {
@@ -204,17 +311,25 @@ int main(void) {
         //     EmbeddedEmulator_Reset(cpuBuf, systemBuf, ppuBuf);
         // }
 
+        // Rewind 2 frames and emulate 1 frame to redraw the screen
+        BSP_TS_GetState(&tsState);
+        if (tsState.touchDetected > 0) {
+            EmbeddedEmulator_Rewind(rewindBuf, cpuBuf, systemBuf, ppuBuf, nullptr, 2);
+            // The watched loop was observed before rewinding
+            EmbeddedEmulator_InitIdleSkip(idleBuf);
+        }
+
         // Emulate cpu/ppu
-        for(uint32_t cycleSum = 0; cycleSum < cyclePerFrame; ) {
-            // emulate cpu
-            const uint32_t cyc = EmbeddedEmulator_EmulateCpu(cpuBuf, systemBuf);
-            cycleSum += cyc;
-            // emulate ppu
-            const CpuInterrupt irq = EmbeddedEmulator_EmulatePpu(ppuBuf, systemBuf, frameBuffer0Ptr, cyc);
-            // Interrupt from ppu
-            if (irq != CpuInterrupt::NONE) {
-                EmbeddedEmulator_InterruptCpu(cpuBuf, systemBuf, irq);
-            }
+        EmbeddedEmulator_IdleSkipEmulateFrame(idleBuf, cpuBuf, systemBuf, ppuBuf, frameBuffer0Ptr);
+
+        // Record history for rewind
+        captureTimer.reset();
+        EmbeddedEmulator_CaptureRewind(rewindBuf, cpuBuf, systemBuf, ppuBuf, nullptr);
+        captureUs = captureTimer.read_us();
+
+        // Write back battery-backed RAM
+        if ((i % SAVE_RAM_FLUSH_INTERVAL) == 0) {
+            flushSaveRamToSd(systemBuf, saveRamBuf);
         }
     }
 }
\ No newline at end of file
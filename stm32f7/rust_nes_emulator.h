@@ -3,16 +3,59 @@
 #include <cstdlib>
 #include <new>
 
+static const uintptr_t EMBEDDED_EMULATOR_APU_CHANNEL_NUM = 5;
+
+static const uintptr_t EMBEDDED_EMULATOR_APU_LOG_ENTRY_BYTES = 6;
+
+static const uintptr_t EMBEDDED_EMULATOR_APU_LOG_RING_SIZE = 32768;
+
+static const int32_t EMBEDDED_EMULATOR_APU_MAX_RATE_ADJUST_PPM = 50000;
+
+static const uint32_t EMBEDDED_EMULATOR_APU_MAX_SAMPLE_RATE = 96000;
+
+static const uint32_t EMBEDDED_EMULATOR_APU_MIXER_FRAC_BITS = 16;
+
+static const int16_t EMBEDDED_EMULATOR_APU_MIXER_OUTPUT_MAX = 32767;
+
+static const uintptr_t EMBEDDED_EMULATOR_LOCKSTEP_MAX_LANES = 16;
+
 static const uintptr_t EMBEDDED_EMULATOR_NUM_OF_COLOR = 4;
 
 static const uint32_t EMBEDDED_EMULATOR_PLAYER_0 = 0;
 
 static const uint32_t EMBEDDED_EMULATOR_PLAYER_1 = 1;
 
+static const uintptr_t EMBEDDED_EMULATOR_SAMPLE_RING_SIZE = 4096;
+
+static const uint32_t EMBEDDED_EMULATOR_SAVE_RAM_NUM_OF_PAGES = 32;
+
+static const uintptr_t EMBEDDED_EMULATOR_SAVE_RAM_PAGE_SIZE = 256;
+
+static const uint8_t EMBEDDED_EMULATOR_SAVE_STATE_VERSION = 5;
+
 static const uintptr_t EMBEDDED_EMULATOR_VISIBLE_SCREEN_HEIGHT = 240;
 
 static const uintptr_t EMBEDDED_EMULATOR_VISIBLE_SCREEN_WIDTH = 256;
 
+static const uintptr_t EMBEDDED_EMULATOR_WRAM_SIZE = 2048;
+
+enum class ApuResamplerKernel : uint8_t {
+  /// 固定小数点の整数演算のみ
+  Scalar,
+  /// x86-64のSSE2
+  Sse2,
+  /// x86-64のAVX2
+  Avx2,
+};
+
+enum class ApuTapChannel : uint8_t {
+  Pulse1,
+  Pulse2,
+  Triangle,
+  Noise,
+  Dmc,
+};
+
 enum class CpuInterrupt : uint8_t {
   NMI,
   RESET,
@@ -46,11 +89,181 @@ enum class KeyEvent : uint8_t {
   ReleaseRight,
 };
 
+enum class ObservationSamplingMode : uint8_t {
+  /// 出力pixelの左上に相当するdotを使う
+  Nearest,
+  /// 出力pixelに含まれるdotを平均する
+  Area,
+};
+
+enum class StorageProfile : uint8_t {
+  /// NROM専用 PRG-ROM/CHR-ROMをSystem内に展開する
+  Nrom,
+  /// Mapper対応を見込んだ大容量構成
+  Mapper,
+  /// ROMをコピーせずLoadRomに渡したバッファを参照する
+  RomInPlace,
+};
+
+/// 命令融合の実行統計
+struct EmbeddedEmulatorFusionStats {
+  /// 命令列ごとに融合して実行した回数
+  uint64_t lda_zp_sta_abs;
+  uint64_t dex_bne;
+  uint64_t dey_bne;
+  uint64_t lda_abs_bpl;
+  uint64_t inc_zp_lda_zp;
+  /// 融合せず1命令ずつ実行した数
+  uint64_t single_steps;
+  /// 融合によって省略した命令ディスパッチの数
+  uint64_t eliminated_dispatches;
+};
+
+/// 待ちループ早送りの実行統計
+struct EmbeddedEmulatorIdleSkipStats {
+  /// 1命令ずつ実行した命令数
+  uint64_t executed_insts;
+  /// 省略した待ちループの周回数
+  uint64_t skipped_iterations;
+  /// 省略したcycle数
+  uint64_t skipped_cycles;
+};
+
+/// BatchStepに渡すエミュレータ1台分の領域
+/// 各領域はInitCpu/InitSystem/InitPpuで初期化済みのものを指定してください
+struct EmbeddedEmulatorInstance {
+  uint8_t *cpu;
+  uint8_t *system;
+  uint8_t *ppu;
+  /// $4015の値とIRQのために状態を追うAPU。InitApuで初期化済みのもの。nullならAPUを使わない
+  uint8_t *apu;
+};
+
+/// JITの実行統計
+struct EmbeddedEmulatorJitStats {
+  /// 翻訳したブロック数
+  uint64_t compiled_blocks;
+  /// 翻訳したコードで実行した命令数
+  uint64_t jit_insts;
+  /// インタプリタで実行した命令数
+  uint64_t interpreted_insts;
+  /// コードバッファがあふれて翻訳済のブロックを捨てた回数
+  uint64_t flushes;
+  /// インタプリタと比較した命令数
+  uint64_t trace_compared;
+  /// インタプリタと結果が一致しなかった命令数
+  uint64_t trace_mismatches;
+  /// 最初に一致しなかった命令のアドレス
+  uint16_t first_mismatch_pc;
+};
+
 extern "C" {
 
+/// AOTコンパイル結果を使ってCPU/PPUを1frame分エミュレーションします
+/// 翻訳していないアドレスはインタプリタで実行します。IsAotCompatibleがtrueのROMでのみ使うこと
+/// aot featureを有効にしていない場合はEmulateFrameと同じです
+void EmbeddedEmulator_AotEmulateFrame(uint8_t *raw_cpu_ref,
+                                      uint8_t *raw_system_ref,
+                                      uint8_t *raw_ppu_ref,
+                                      uint8_t *fb_ptr);
+
+/// CPU/PPU/APUを1frame分エミュレーションします
+/// 1命令ごとにEmulateCpu/EmulatePpu/EmulateApu/InterruptCpuを呼ぶのと同じ動作です
+/// Run-aheadなど後で巻き戻すframeは、音が重複しないようにApuLogEmulateFrameで捨てるためのリングバッファに記録し、
+/// APUごとSaveState/LoadStateで戻してください
+void EmbeddedEmulator_ApuEmulateFrame(uint8_t *raw_apu_ref,
+                                      const uint8_t *raw_ring_ptr,
+                                      uint8_t *raw_cpu_ref,
+                                      uint8_t *raw_system_ref,
+                                      uint8_t *raw_ppu_ref,
+                                      uint8_t *fb_ptr);
+
+/// CPU/PPUを1frame分エミュレーションし、APUレジスタへのアクセスを時刻と一緒にリングバッファに記録します
+/// APUは$4015の値に関わる状態だけを追い、波形は合成しません。合成は別スレッドでRenderApuLogに任せてください
+/// リングバッファは1frame分の記録が必ず収まる大きさなので、frameごとにReadApuLogで読み出していれば記録は捨てられません
+/// InitApu, LoadState, Rewindで状態を差し替えた後の最初のframeでは、合成側のAPUを同じ状態に合わせる記録も書き出します
+/// `raw_apu_ref` - 状態を追うためのAPU。RenderApuLogに渡すものとは別に用意してください
+/// ret: リングバッファの空きが足りずに記録を捨てた場合はfalse。捨てた分だけ合成側のAPUの状態がずれます
+bool EmbeddedEmulator_ApuLogEmulateFrame(uint8_t *raw_apu_ref,
+                                         const uint8_t *raw_log_ptr,
+                                         uint8_t *raw_cpu_ref,
+                                         uint8_t *raw_system_ref,
+                                         uint8_t *raw_ppu_ref,
+                                         uint8_t *fb_ptr);
+
+/// APUにチャンネルごとの出力を取り付けます。以降は出力をリングバッファに書き出すすべての関数で、
+/// ミキサーの出力と同じ合成の中で各チャンネルを単独で鳴らした出力も書き出します。取り付けなければ合成の処理は増えません
+/// InitApuの直後に取り付けてください。取り付けるまでに合成した分だけ、ミキサーの出力とサンプルの位置がずれます
+/// `raw_tap_ptr` - InitApuChannelTapで初期化したもの。取り外すまで解放しないでください。nullなら取り外します
+void EmbeddedEmulator_AttachApuChannelTap(uint8_t *raw_apu_ref, const uint8_t *raw_tap_ptr);
+
+/// 複数のエミュレータをまとめて進めます。強化学習などで多数の環境を並べて動かす用途向けです
+/// 各インスタンスに`buttons`を入力して`frame_skip`frame進め、最後のframeの観測を書き出します
+/// 領域の確保やコピーは観測の書き出し以外行いません
+/// 重ならない範囲のインスタンス配列であれば、複数スレッドから同時に呼び出せます
+/// `instances_ptr` - `num_of_instances`個のインスタンス
+/// `buttons_ptr` - [num_of_instances] 1Pの入力。bit0から A, B, Select, Start, Up, Down, Left, Right。nullなら入力を変更しない
+/// `frame_skip` - 1回の呼び出しで進めるframe数。0は1とみなします
+/// `max_episode_frames` - このframe数に達したインスタンスをリセットします。0ならリセットしない
+/// `episode_frames_ptr` - [num_of_instances] 各インスタンスの経過frame数。呼び出し側で保持し、最初は0にしてください。nullならリセットしない
+/// `reset_state_ptr` - リセット時に読み込むSave State。nullならRESET割り込みでリセットします
+/// `dones_ptr` - [num_of_instances] リセットしたインスタンスに1、それ以外に0を書き込みます。nullなら書き込まない
+/// `fb_ptr` - [num_of_instances][fb_stride] 画面の書き出し先。各インスタンスのSetPpuDrawOption/SetPpuObservationOptionに従います。nullなら描画しない
+/// `ram_ptr` - [num_of_instances][EMBEDDED_EMULATOR_WRAM_SIZE] WRAMの書き出し先。nullなら書き出さない
+/// 観測はリセット前の最終frameのものです
+/// APUを持つインスタンス(EmbeddedEmulatorInstance::apu)は、$4015の値とIRQのためにAPUの状態も追います。音は合成しません
+void EmbeddedEmulator_BatchStep(const EmbeddedEmulatorInstance *instances_ptr,
+                                uintptr_t num_of_instances,
+                                const uint8_t *buttons_ptr,
+                                uint32_t frame_skip,
+                                uint32_t max_episode_frames,
+                                uint32_t *episode_frames_ptr,
+                                const uint8_t *reset_state_ptr,
+                                uintptr_t reset_state_size,
+                                uint8_t *dones_ptr,
+                                uint8_t *fb_ptr,
+                                uintptr_t fb_stride,
+                                uint8_t *ram_ptr);
+
+/// 1frameエミュレーションするごとに呼んでください。capture_intervalごとに差分を記録します
+/// `raw_apu_ptr` - SaveStateと同様。使っていなければnull
+/// 戻り値: 記録した場合はtrue
+bool EmbeddedEmulator_CaptureRewind(uint8_t *raw_rewind_ref,
+                                    uint8_t *raw_cpu_ref,
+                                    uint8_t *raw_system_ref,
+                                    uint8_t *raw_ppu_ref,
+                                    const uint8_t *raw_apu_ptr);
+
+/// 実行中のエミュレータの内部状態を別のインスタンスに複製します。木探索やA/B比較でゲームを分岐させる用途向けです
+/// SaveState/LoadStateと同じ結果になりますが、直列化を挟まずに可変な状態だけを直接コピーします
+/// ROM-in-placeのProfileではROMを共有するのでコピーしません。複製先でLoadRomを呼ぶ必要はありません
+/// 描画設定(SetPpuDrawOption/SetPpuObservationOption)は複製先のものを維持します
+/// `src` - 複製元
+/// `dst` - 複製先。InitCpu/InitSystem/InitPpuで初期化済みで、複製元と重ならない領域
+/// APUは複製元と複製先の両方にあれば複製します。複製元にだけなければ、複製先のAPUは電源投入時の状態に戻します
+void EmbeddedEmulator_Clone(const EmbeddedEmulatorInstance *src,
+                            const EmbeddedEmulatorInstance *dst);
+
+/// APUの時刻を進めます。EmulateCpuの後に、その命令のCPU Cycle数を渡して呼び出してください
+/// 合成は記録したレジスタへのアクセスを反映する必要があるときにまとめて行い、出力は一定間隔でリングバッファに書き出されます
+/// 戻り値: DMCのDMAでCPUが止まったサイクル数。EmulatePpuには命令のCPU Cycle数にこの分を加えて渡してください
+uint8_t EmbeddedEmulator_EmulateApu(uint8_t *raw_apu_ref,
+                                    uint8_t *raw_system_ref,
+                                    const uint8_t *raw_ring_ptr,
+                                    uint8_t cpu_cycle);
+
 /// CPUを1stepエミュレーションします
 uint8_t EmbeddedEmulator_EmulateCpu(uint8_t *raw_cpu_ref, uint8_t *raw_system_ref);
 
+/// CPU/PPUを1frame分(EmbeddedEmulator_GetCpuCyclePerFrame)エミュレーションします
+/// 1命令ごとにEmulateCpu/EmulatePpu/InterruptCpuを呼ぶのと同じ動作です
+/// APUは進めないので、Frame IRQ/DMC IRQは発生せず$4015の値も変わりません
+/// `fb_ptr` - nullを渡すと描画を省略します。Run-aheadなど画面を使わないframeで使ってください
+void EmbeddedEmulator_EmulateFrame(uint8_t *raw_cpu_ref,
+                                   uint8_t *raw_system_ref,
+                                   uint8_t *raw_ppu_ref,
+                                   uint8_t *fb_ptr);
+
 /// PPUをエミュレーションします。cpu cycを基準にlineごとに進めます
 /// `cpu_cyc`: cpuでエミュレーション経過済で、PPU側に未反映のCPU Cycle数合計
 CpuInterrupt EmbeddedEmulator_EmulatePpu(uint8_t *raw_ppu_ref,
@@ -58,6 +271,38 @@ CpuInterrupt EmbeddedEmulator_EmulatePpu(uint8_t *raw_ppu_ref,
                                          uint8_t *fb_ptr,
                                          uintptr_t cpu_cycle);
 
+/// APUを現在の時刻まで合成して、溜まっている出力をリングバッファに書き出します
+/// 通常は一定間隔で書き出されるので、サンプルを読み出す直前や一時停止の前などに呼んでください
+void EmbeddedEmulator_FlushApu(uint8_t *raw_apu_ref,
+                               uint8_t *raw_system_ref,
+                               const uint8_t *raw_ring_ptr);
+
+/// 命令融合を使ってCPU/PPUを1frame分エミュレーションします
+void EmbeddedEmulator_FusionEmulateFrame(uint8_t *raw_fusion_ref,
+                                         uint8_t *raw_cpu_ref,
+                                         uint8_t *raw_system_ref,
+                                         uint8_t *raw_ppu_ref,
+                                         uint8_t *fb_ptr);
+
+/// チャンネルのリングバッファから読み出せるサンプル数を返します
+uintptr_t EmbeddedEmulator_GetApuChannelSampleLength(const uint8_t *raw_tap_ptr,
+                                                     ApuTapChannel channel);
+
+/// APUのチャンネルごとの出力に必要なサイズを返します
+uintptr_t EmbeddedEmulator_GetApuChannelTapDataSize();
+
+/// APUのデータ構造に必要なサイズを返します
+uintptr_t EmbeddedEmulator_GetApuDataSize();
+
+/// APUレジスタへのアクセスのリングバッファの空きが足りずに捨てたアクセス数の累計を返します
+uintptr_t EmbeddedEmulator_GetApuLogDropped(const uint8_t *raw_log_ptr);
+
+/// APUレジスタへのアクセスの記録を受け渡すリングバッファに必要なサイズを返します
+uintptr_t EmbeddedEmulator_GetApuLogRingDataSize();
+
+/// サンプリング周波数変換に必要なサイズを返します
+uintptr_t EmbeddedEmulator_GetApuResamplerDataSize();
+
 /// 画面全体を描画するのに必要なCPU Cylceを返します
 uintptr_t EmbeddedEmulator_GetCpuCyclePerFrame();
 
@@ -67,18 +312,173 @@ uintptr_t EmbeddedEmulator_GetCpuCyclePerLine();
 /// Cpuのデータ構造に必要なサイズを返します
 uintptr_t EmbeddedEmulator_GetCpuDataSize();
 
+/// CPUのクロック周波数を返します
+uint32_t EmbeddedEmulator_GetCpuFreq();
+
+/// 命令融合の管理データ構造に必要なサイズを返します
+uintptr_t EmbeddedEmulator_GetFusionDataSize();
+
+/// 命令融合の実行統計を取得します。InitFusionからの累計です
+void EmbeddedEmulator_GetFusionStats(uint8_t *raw_fusion_ref,
+                                     EmbeddedEmulatorFusionStats *stats_ptr);
+
+/// 待ちループ早送りの管理データ構造に必要なサイズを返します
+uintptr_t EmbeddedEmulator_GetIdleSkipDataSize();
+
+/// 待ちループ早送りの実行統計を取得します。InitIdleSkipからの累計です
+void EmbeddedEmulator_GetIdleSkipStats(uint8_t *raw_idle_ref,
+                                       EmbeddedEmulatorIdleSkipStats *stats_ptr);
+
+/// JITの管理データ構造に必要なサイズを返します
+/// 翻訳したコードはInitJitに渡すバッファに置かれます。jit featureを有効にしていない場合は0
+uintptr_t EmbeddedEmulator_GetJitDataSize();
+
+/// JITの実行統計を取得します。InitJitからの累計です
+void EmbeddedEmulator_GetJitStats(uint8_t *raw_jit_ref, EmbeddedEmulatorJitStats *stats_ptr);
+
+/// Lockstep実行の管理データ構造に必要なサイズを返します
+uintptr_t EmbeddedEmulator_GetLockstepDataSize();
+
+/// Lockstep実行の統計を取得します。InitLockstepからの累計です
+/// `vector_lane_steps_ptr` - まとめて実行した命令数(インスタンス換算)
+/// `scalar_lane_steps_ptr` - インスタンスごとに実行した命令数
+/// `dispatches_ptr` - 命令の振り分け回数。インスタンス間で命令がそろっているほど少なくなる
+void EmbeddedEmulator_GetLockstepStats(uint8_t *raw_lockstep_ref,
+                                       uint64_t *vector_lane_steps_ptr,
+                                       uint64_t *scalar_lane_steps_ptr,
+                                       uint64_t *dispatches_ptr);
+
+/// NSFの再生に必要なサイズを返します
+uintptr_t EmbeddedEmulator_GetNsfDataSize();
+
+/// LoadNsfで読み込んだNSFの最初に再生する曲を返します。1始まり
+uint8_t EmbeddedEmulator_GetNsfStartingSong(uint8_t *raw_nsf_ref);
+
+/// LoadNsfで読み込んだNSFの曲数を返します
+uint8_t EmbeddedEmulator_GetNsfTotalSongs(uint8_t *raw_nsf_ref);
+
 /// Ppuのデータ構造に必要なサイズを返します
 uintptr_t EmbeddedEmulator_GetPpuDataSize();
 
+/// Rewindの管理データ構造に必要なサイズを返します
+/// 履歴自体はInitRewindに渡すバッファに置かれます
+uintptr_t EmbeddedEmulator_GetRewindDataSize();
+
+/// 巻き戻せるframe数を返します
+uint32_t EmbeddedEmulator_GetRewindFrames(uint8_t *raw_rewind_ref);
+
+/// APUの出力を受け渡すリングバッファに必要なサイズを返します
+uintptr_t EmbeddedEmulator_GetSampleRingDataSize();
+
+/// リングバッファの空きが足りずに捨てたサンプル数の累計を返します
+uintptr_t EmbeddedEmulator_GetSampleRingDropped(const uint8_t *raw_ring_ptr);
+
+/// リングバッファから読み出せるサンプル数を返します
+uintptr_t EmbeddedEmulator_GetSampleRingLength(const uint8_t *raw_ring_ptr);
+
+/// 電池バックアップされたRAM(0x6000 - 0x7fff)のサイズを返します
+/// 持っていないカセットの場合は0
+uintptr_t EmbeddedEmulator_GetSaveRamSize(uint8_t *raw_system_ref);
+
+/// Save Stateに必要なバイト数を返します。LoadRomの後に呼んでください
+/// CHR-RAMやBattery Packed RAMを持つカセットではその分大きくなります
+uintptr_t EmbeddedEmulator_GetSaveStateSize(uint8_t *raw_system_ref);
+
+/// ビルド時に選択したStorage Profileを返します
+StorageProfile EmbeddedEmulator_GetStorageProfile();
+
 /// SubSystemのデータ構造に必要なサイズを返します
+/// Storage Profileによってサイズが変わります
 uintptr_t EmbeddedEmulator_GetSystemDataSize();
 
+/// 待ちループを早送りしながらCPU/PPU/APUを1frame分エミュレーションし、APUの出力をリングバッファに書き出します
+/// 早送りした周回の分もAPUは合成します。結果はApuEmulateFrameと同じです
+void EmbeddedEmulator_IdleSkipApuEmulateFrame(uint8_t *raw_idle_ref,
+                                              uint8_t *raw_apu_ref,
+                                              const uint8_t *raw_ring_ptr,
+                                              uint8_t *raw_cpu_ref,
+                                              uint8_t *raw_system_ref,
+                                              uint8_t *raw_ppu_ref,
+                                              uint8_t *fb_ptr);
+
+/// 待ちループを早送りしながらCPU/PPUを1frame分エミュレーションします
+void EmbeddedEmulator_IdleSkipEmulateFrame(uint8_t *raw_idle_ref,
+                                           uint8_t *raw_cpu_ref,
+                                           uint8_t *raw_system_ref,
+                                           uint8_t *raw_ppu_ref,
+                                           uint8_t *fb_ptr);
+
+/// APUを初期化します
+/// `sample_rate` - 出力のサンプリング周波数。 1 ~ EMBEDDED_EMULATOR_APU_MAX_SAMPLE_RATE
+/// ret: 対応していないサンプリング周波数ならfalse
+bool EmbeddedEmulator_InitApu(uint8_t *raw_ref, uint32_t sample_rate);
+
+/// APUのチャンネルごとの出力を初期化します。チャンネルごとに16bit signed monoのリングバッファを持ちます
+/// `sample_rate` - 取り付けるAPUのInitApuと同じ値
+/// ret: 対応していないサンプリング周波数ならfalse
+bool EmbeddedEmulator_InitApuChannelTap(uint8_t *raw_ref, uint32_t sample_rate);
+
+/// APUレジスタへのアクセスの記録を受け渡すリングバッファを初期化します
+void EmbeddedEmulator_InitApuLogRing(uint8_t *raw_ref);
+
+/// サンプリング周波数変換を初期化します。APUは内部に持っているので、それ以外のサンプルを変換する場合に使います
+/// `input_rate`, `output_rate` - 変換前後のサンプリング周波数。入力は出力の1.125倍以下
+/// ret: 対応していない組み合わせならfalse
+bool EmbeddedEmulator_InitApuResampler(uint8_t *raw_ref, uint32_t input_rate, uint32_t output_rate);
+
 /// Cpuの構造体を初期化します
 void EmbeddedEmulator_InitCpu(uint8_t *raw_ref);
 
+/// 命令融合を初期化します。LoadRomの後に呼んでください
+/// `LDA zp; STA abs`, `DEX; BNE`などよく使われる2命令の組をPRG-ROM上で検出し、まとめて実行します
+/// 結果はEmulateFrameと同じです
+void EmbeddedEmulator_InitFusion(uint8_t *raw_fusion_ref);
+
+/// 待ちループの早送りを初期化します。LoadRom, LoadState, Rewindなどで状態を入れ替えた後に呼んでください
+/// `LDA $2002; BPL wait`やZeroPageのフラグを待つループなど、副作用のない待ちループを検出し、
+/// 次のPPUの処理(lineの更新, VBlank, Sprite 0 hit)までの周回を省略します。結果はEmulateFrameと同じです
+void EmbeddedEmulator_InitIdleSkip(uint8_t *raw_idle_ref);
+
+/// JITを初期化します。LoadRomの後に呼んでください
+/// PRG-ROM上でよく実行されるブロックをx86-64の機械語に翻訳して実行します
+/// WRAM以外へのアクセスや翻訳しない命令はインタプリタで実行し、結果はEmulateFrameと同じです
+/// `code_buf_ptr` - 翻訳したコードを置くバッファ。読み書き実行可能な領域(mmapでPROT_EXECを指定するなど)を渡してください
+/// 戻り値: jit featureを有効にしていない場合、バッファが小さすぎる場合はfalse
+bool EmbeddedEmulator_InitJit(uint8_t *raw_jit_ref, uint8_t *code_buf_ptr, uintptr_t code_buf_size);
+
+/// Lockstep実行の管理データ構造を初期化します
+void EmbeddedEmulator_InitLockstep(uint8_t *raw_ref);
+
+/// NSFの曲の再生を始めます。RAMとAPUのレジスタを初期化して、曲のINITを呼び出します
+/// PPUは使わないので不要です
+/// `song` - 1 ~ GetNsfTotalSongs
+/// ret: 曲番号が範囲外ならfalse
+bool EmbeddedEmulator_InitNsfSong(uint8_t *raw_nsf_ref,
+                                  uint8_t *raw_apu_ref,
+                                  const uint8_t *raw_ring_ptr,
+                                  uint8_t *raw_cpu_ref,
+                                  uint8_t *raw_system_ref,
+                                  uint8_t song);
+
 /// Ppuの構造体を初期化します
 void EmbeddedEmulator_InitPpu(uint8_t *raw_ref);
 
+/// Rewindを初期化します。LoadRomの後に呼んでください
+/// `buf_ptr` - 履歴を置くバッファ。容量を超えたら古い履歴から捨てます。Rewindを使う間は解放しないでください
+/// `capture_interval` - 何frameごとにsnapshotを取るか
+/// `keyframe_interval` - 何snapshotごとに全体を保存するか。0なら差分のみ
+/// 戻り値: バッファがSave State 2個分に満たない場合はfalse
+bool EmbeddedEmulator_InitRewind(uint8_t *raw_rewind_ref,
+                                 uint8_t *raw_system_ref,
+                                 uint8_t *buf_ptr,
+                                 uintptr_t buf_size,
+                                 uint32_t capture_interval,
+                                 uint32_t keyframe_interval);
+
+/// APUの出力を受け渡すリングバッファを初期化します
+/// 16bit signed monoのサンプルが入ります
+void EmbeddedEmulator_InitSampleRing(uint8_t *raw_ref);
+
 /// Systemの構造体を初期化します
 void EmbeddedEmulator_InitSystem(uint8_t *raw_ref);
 
@@ -87,15 +487,170 @@ void EmbeddedEmulator_InterruptCpu(uint8_t *raw_cpu_ref,
                                    uint8_t *raw_system_ref,
                                    CpuInterrupt interrupt);
 
+/// 読み込んだROMがAOTコンパイル結果の生成元と一致するか確認します
+/// aot featureを有効にしていない場合はfalse
+bool EmbeddedEmulator_IsAotCompatible(uint8_t *raw_system_ref);
+
+/// JITを使ってCPU/PPUを1frame分エミュレーションします
+/// jit featureを有効にしていない場合はEmulateFrameと同じです
+void EmbeddedEmulator_JitEmulateFrame(uint8_t *raw_jit_ref,
+                                      uint8_t *raw_cpu_ref,
+                                      uint8_t *raw_system_ref,
+                                      uint8_t *raw_ppu_ref,
+                                      uint8_t *fb_ptr);
+
+/// NSFファイルを読み込みます。データはカセットのPRG-ROMに配置します
+/// Bank切り替えを使うNSFと、ROM-in-placeのProfileには対応しません
+/// 成功した場合はtrueが返ります。続けてInitNsfSongで曲を選んでください
+/// `nsf_ptr` - [len] NSFファイル
+bool EmbeddedEmulator_LoadNsf(uint8_t *raw_nsf_ref,
+                              uint8_t *raw_system_ref,
+                              const uint8_t *nsf_ptr,
+                              uintptr_t len);
+
 /// ROMを読み込みます
 /// 成功した場合はtrueが返ります。実行中のエミュレートは中止して、Resetをかけてください
-bool EmbeddedEmulator_LoadRom(uint8_t *raw_system_ref,
-                              const uint8_t *rom_ref);
+/// ROM-in-placeのProfileでは`rom_ref`を参照し続けるので、エミュレーション中は解放しないでください
+bool EmbeddedEmulator_LoadRom(uint8_t *raw_system_ref, const uint8_t *rom_ref);
+
+/// SaveStateで書き出した内部状態を復元します
+/// バージョンや読み込んでいるROMが一致しない場合は何も変更せずfalseを返します
+/// `raw_apu_ptr` - SaveStateと同様。APUを渡さずに書き出したSave Stateなら、APUは電源投入時の状態に戻します
+bool EmbeddedEmulator_LoadState(uint8_t *raw_cpu_ref,
+                                uint8_t *raw_system_ref,
+                                uint8_t *raw_ppu_ref,
+                                uint8_t *raw_apu_ptr,
+                                const uint8_t *src_ptr,
+                                uintptr_t src_size);
+
+/// 同じROMを動かす複数のインスタンスを、命令単位で足並みをそろえて1frame進めます(実験的)
+/// レジスタをStructure of Arraysにまとめ、同じ命令を実行しているインスタンスをまとめて処理します
+/// 結果はインスタンスごとにEmulateFrameを呼んだ場合と同じです
+/// `raw_lockstep_ref` - InitLockstepで初期化済みの領域
+/// `instances_ptr` - `num_of_instances`個のインスタンス
+/// `num_of_instances` - EMBEDDED_EMULATOR_LOCKSTEP_MAX_LANES以下
+/// `fb_ptr` - [num_of_instances][fb_stride] 画面の書き出し先。nullなら描画しない
+/// ret: `num_of_instances`が多すぎる場合はfalse
+bool EmbeddedEmulator_LockstepEmulateFrame(uint8_t *raw_lockstep_ref,
+                                           const EmbeddedEmulatorInstance *instances_ptr,
+                                           uintptr_t num_of_instances,
+                                           uint8_t *fb_ptr,
+                                           uintptr_t fb_stride);
+
+/// 各チャンネルの出力を非線形ミキサーで混ぜた値を返します。全チャンネルが最大のときEMBEDDED_EMULATOR_APU_MIXER_OUTPUT_MAX
+/// 固定小数点のテーブル引きで計算します。APUが合成に使っている値と同じです
+/// `pulse1`, `pulse2`, `triangle`, `noise` - 0 ~ 15。上位bitは無視します
+/// `dmc` - 0 ~ 127。上位bitは無視します
+int16_t EmbeddedEmulator_MixApuOutput16(uint8_t pulse1,
+                                        uint8_t pulse2,
+                                        uint8_t triangle,
+                                        uint8_t noise,
+                                        uint8_t dmc);
+
+/// MixApuOutput16の32bit版です。16bitの出力をEMBEDDED_EMULATOR_APU_MIXER_FRAC_BITSだけ左にシフトした値で、丸める前の小数部を含みます
+int32_t EmbeddedEmulator_MixApuOutput32(uint8_t pulse1,
+                                        uint8_t pulse2,
+                                        uint8_t triangle,
+                                        uint8_t noise,
+                                        uint8_t dmc);
+
+/// NSFの曲のPLAYを1回呼び出し、次の呼び出しまでAPUを進めて、出力をリングバッファに書き出します
+/// 画面は描画しません。1回あたりの長さはNSFが指定した呼び出し間隔(通常は1/60秒)です
+void EmbeddedEmulator_NsfEmulateFrame(uint8_t *raw_nsf_ref,
+                                      uint8_t *raw_apu_ref,
+                                      const uint8_t *raw_ring_ptr,
+                                      uint8_t *raw_cpu_ref,
+                                      uint8_t *raw_system_ref);
+
+/// チャンネルのリングバッファからサンプルを読み出します
+/// ReadSamplesと同様に、エミュレーションと別のスレッドから呼び出せます。読み出し側はチャンネルごとに1スレッドにしてください
+/// `dst_ptr` - [len] 16bit signed mono
+/// ret: 読み出したサンプル数
+uintptr_t EmbeddedEmulator_ReadApuChannelSamples(const uint8_t *raw_tap_ptr,
+                                                 ApuTapChannel channel,
+                                                 int16_t *dst_ptr,
+                                                 uintptr_t len);
+
+/// リングバッファからAPUレジスタへのアクセスの記録を読み出します
+/// エミュレーションと別のスレッドから呼び出せます。読み出し側は1スレッドにしてください
+/// 1アクセスはEMBEDDED_EMULATOR_APU_LOG_ENTRY_BYTES byteで、そのままファイルに書き出してオフラインの合成に使えます
+/// `dst_ptr` - [len]
+/// ret: 読み出したbyte数。EMBEDDED_EMULATOR_APU_LOG_ENTRY_BYTESの倍数
+uintptr_t EmbeddedEmulator_ReadApuLog(const uint8_t *raw_log_ptr, uint8_t *dst_ptr, uintptr_t len);
+
+/// リングバッファからサンプルを読み出します
+/// エミュレーションと別のスレッド(オーディオコールバックなど)から呼び出せます。読み出し側は1スレッドにしてください
+/// `dst_ptr` - [len] 16bit signed mono
+/// ret: 読み出したサンプル数
+uintptr_t EmbeddedEmulator_ReadSamples(const uint8_t *raw_ring_ptr,
+                                       int16_t *dst_ptr,
+                                       uintptr_t len);
+
+/// 指定したページを`dst_ptr`にコピーします
+/// `dst_ptr` - EMBEDDED_EMULATOR_SAVE_RAM_PAGE_SIZE bytes以上の領域
+bool EmbeddedEmulator_ReadSaveRamPage(uint8_t *raw_system_ref, uint32_t page, uint8_t *dst_ptr);
+
+/// ReadApuLogで読み出した記録から波形を合成して、サンプルのリングバッファに書き出します
+/// ファイルに書き出した記録をオフラインで合成する場合にも使えます
+/// エミュレーション側のリセットやSave Stateの読み込みも記録から反映するので、合成側のAPUを作り直す必要はありません
+/// `raw_apu_ref` - 合成に使うAPU。ApuLogEmulateFrameに渡すものとは別に用意してください
+/// `src_ptr` - [len] 端数のbyteは無視します
+/// ret: 合成したframe数
+uintptr_t EmbeddedEmulator_RenderApuLog(uint8_t *raw_apu_ref,
+                                        const uint8_t *src_ptr,
+                                        uintptr_t len,
+                                        const uint8_t *raw_ring_ptr);
+
+/// サンプルのサンプリング周波数を変換して、サンプルのリングバッファに書き出します
+/// `src_ptr` - [len] 16bit signed monoのサンプル
+/// `raw_ring_ptr` - InitSampleRingで初期化したリングバッファ
+void EmbeddedEmulator_ResampleApu(uint8_t *raw_resampler_ref,
+                                  const int16_t *src_ptr,
+                                  uintptr_t len,
+                                  const uint8_t *raw_ring_ptr);
 
 /// エミュレータをリセットします
 /// 各種変数の初期化後、RESET割り込みが行われます
 void EmbeddedEmulator_Reset(uint8_t *raw_cpu_ref, uint8_t *raw_system_ref, uint8_t *raw_ppu_ref);
 
+/// 保存しておいたRAMの内容を書き戻します。LoadRomの後に呼んでください
+void EmbeddedEmulator_RestoreSaveRam(uint8_t *raw_system_ref,
+                                     const uint8_t *src_ptr,
+                                     uintptr_t size);
+
+/// 指定したframe数だけ巻き戻します。戻った先より新しい履歴は破棄されます
+/// `raw_apu_ptr` - CaptureRewindに渡したもの。使っていなければnull
+/// 戻り値: 実際に巻き戻したframe数(capture_interval単位)
+uint32_t EmbeddedEmulator_Rewind(uint8_t *raw_rewind_ref,
+                                 uint8_t *raw_cpu_ref,
+                                 uint8_t *raw_system_ref,
+                                 uint8_t *raw_ppu_ref,
+                                 uint8_t *raw_apu_ptr,
+                                 uint32_t frames);
+
+/// ROMを除いた可変な内部状態を`dst_ptr`に書き出します
+/// `raw_apu_ptr` - エミュレーションに使っているAPU(ApuEmulateFrameやApuLogEmulateFrameに渡すもの)。使っていなければnull
+/// 戻り値: 書き出したバイト数。`dst_size`が足りない場合は0
+uintptr_t EmbeddedEmulator_SaveState(uint8_t *raw_cpu_ref,
+                                     uint8_t *raw_system_ref,
+                                     uint8_t *raw_ppu_ref,
+                                     const uint8_t *raw_apu_ptr,
+                                     uint8_t *dst_ptr,
+                                     uintptr_t dst_size);
+
+/// APUの出力のサンプリング周波数を設定値からずらします。エミュレーションの速さとオーディオ出力の時計のずれを吸収するのに使います
+/// 正の値ほど1frameあたりのサンプル数が減ります。変換比は出力サンプルごとに滑らかに変わります
+/// `ppm` - ±EMBEDDED_EMULATOR_APU_MAX_RATE_ADJUST_PPMに制限します
+void EmbeddedEmulator_SetApuRateAdjust(uint8_t *raw_apu_ref, int32_t ppm);
+
+/// サンプリング周波数変換の積和の実装を選びます。初期化時には使える中で最も速いものが選ばれています
+/// ret: 実行中のCPUで使えなければ何もせずfalse
+bool EmbeddedEmulator_SetApuResamplerKernel(uint8_t *raw_resampler_ref, ApuResamplerKernel kernel);
+
+/// 有効にすると1命令ずつ翻訳し、実行するたびにインタプリタの結果と比較します
+/// 以降はインタプリタの結果で進めるので、一致しなかった場合もエミュレーションは正しく続きます
+void EmbeddedEmulator_SetJitTraceCompare(uint8_t *raw_jit_ref, bool is_enable);
+
 /// Ppuの描画設定を更新します
 void EmbeddedEmulator_SetPpuDrawOption(uint8_t *raw_ppu_ref,
                                        uint32_t fb_width,
@@ -105,6 +660,21 @@ void EmbeddedEmulator_SetPpuDrawOption(uint8_t *raw_ppu_ref,
                                        uint32_t scale,
                                        DrawPioxelFormat draw_pixel_format);
 
+/// Ppuの観測出力設定を更新します
+/// 有効な間はSetPpuDrawOptionの代わりに、縮小したL8(1pixel 1byte, width*height byte)の画像をFrame Bufferに書き出します
+/// `width`, `height` - 出力サイズ。256x240以下のみ対応です。0を指定すると観測出力を無効にします
+/// `is_max_pool` - 直前のframeとのmax-poolを出力します。Frame Bufferの後半に直前のframeを保持するので、width*height*2 byte必要です
+/// 戻り値: サイズが範囲外の場合は何も変更せずfalse
+bool EmbeddedEmulator_SetPpuObservationOption(uint8_t *raw_ppu_ref,
+                                              uint32_t width,
+                                              uint32_t height,
+                                              ObservationSamplingMode sampling,
+                                              bool is_max_pool);
+
+/// 前回の呼び出し以降に書き換えられたページをbitmaskで返し、追跡状態をクリアします
+/// bit n が 0x6000 + n * EMBEDDED_EMULATOR_SAVE_RAM_PAGE_SIZE からのページに対応します
+uint32_t EmbeddedEmulator_TakeSaveRamDirtyPages(uint8_t *raw_system_ref);
+
 /// キー入力を反映
 /// `player_num` - Player番号, 0 or 1
 void EmbeddedEmulator_UpdateKey(uint8_t *raw_system_ref, uint32_t player_num, KeyEvent key);